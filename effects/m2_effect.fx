@@ -18,6 +18,8 @@ cbuffer Material
 cbuffer Object
 {
     matrix    world;
+    float3    pos_scale = float3(1,1,1);
+    float3    pos_bias = float3(0,0,0);
 };
 
 Texture2D diffuse_texture;
@@ -38,6 +40,14 @@ struct VS_INPUT
     float2 Tex : TEXCOORD;
 };
 
+// CompactVertex: unorm16 position relative to the mesh bounds, octahedral normal, half float uv
+struct VS_INPUT_COMPACT
+{
+    float4 Pos : POSITION;
+    float2 Normal : NORMAL;
+    float2 Tex : TEXCOORD;
+};
+
 struct PS_INPUT
 {
     float4 Pos : SV_POSITION;
@@ -66,6 +76,24 @@ PS_INPUT VS(VS_INPUT input, uniform bool use_texture)
     return output;
 }
 
+float3 oct_decode(float2 e)
+{
+    float3 n = float3(e.xy, 1 - abs(e.x) - abs(e.y));
+    if (n.z < 0) {
+        n.xy = (1 - abs(n.yx)) * (n.xy >= 0 ? 1 : -1);
+    }
+    return normalize(n);
+}
+
+PS_INPUT VS_compact(VS_INPUT_COMPACT input, uniform bool use_texture)
+{
+    VS_INPUT expanded;
+    expanded.Pos = float4(input.Pos.xyz * pos_scale + pos_bias, 1);
+    expanded.Normal = oct_decode(input.Normal);
+    expanded.Tex = input.Tex;
+    return VS(expanded, use_texture);
+}
+
 float4 PS(PS_INPUT input, uniform bool use_texture) : SV_Target
 {
 	return diffuse_texture.Sample(samLinear, float2(input.Tex.x, 1-input.Tex.y));
@@ -112,3 +140,152 @@ technique10 render_no_texture
         SetPixelShader( CompileShader( ps_4_0, PS(false) ) );
     }
 }
+
+technique10 render_compact
+{
+    pass P0
+    {
+		SetDepthStencilState( EnableDepth, 0 );
+
+        SetVertexShader( CompileShader( vs_4_0, VS_compact(true) ) );
+        SetGeometryShader( NULL );
+        SetPixelShader( CompileShader( ps_4_0, PS(true) ) );
+    }
+}
+
+// Particles and ribbons. The vertices are written in world space every frame
+struct VS_INPUT_PARTICLE
+{
+    float4 Pos : POSITION;
+    float4 Color : COLOR;
+    float2 Tex : TEXCOORD;
+};
+
+struct PS_INPUT_PARTICLE
+{
+    float4 Pos : SV_POSITION;
+    float4 Color : COLOR;
+    float2 Tex : TEXCOORD0;
+};
+
+PS_INPUT_PARTICLE VS_particle(VS_INPUT_PARTICLE input)
+{
+    PS_INPUT_PARTICLE output = (PS_INPUT_PARTICLE)0;
+    output.Pos = mul(mul(input.Pos, view), projection);
+    output.Color = input.Color;
+    output.Tex = input.Tex;
+    return output;
+}
+
+float4 PS_particle(PS_INPUT_PARTICLE input) : SV_Target
+{
+    return input.Color * diffuse_texture.Sample(samLinear, input.Tex);
+}
+
+BlendState AlphaBlend
+{
+    BlendEnable[0] = TRUE;
+    SrcBlend = SRC_ALPHA;
+    DestBlend = INV_SRC_ALPHA;
+    BlendOp = ADD;
+    SrcBlendAlpha = ONE;
+    DestBlendAlpha = INV_SRC_ALPHA;
+    BlendOpAlpha = ADD;
+    RenderTargetWriteMask[0] = 0x0F;
+};
+
+BlendState AdditiveBlend
+{
+    BlendEnable[0] = TRUE;
+    SrcBlend = SRC_ALPHA;
+    DestBlend = ONE;
+    BlendOp = ADD;
+    SrcBlendAlpha = ZERO;
+    DestBlendAlpha = ONE;
+    BlendOpAlpha = ADD;
+    RenderTargetWriteMask[0] = 0x0F;
+};
+
+// the modulate modes multiply the destination by the particle color, or by twice the color
+BlendState ModulateBlend
+{
+    BlendEnable[0] = TRUE;
+    SrcBlend = DEST_COLOR;
+    DestBlend = ZERO;
+    BlendOp = ADD;
+    SrcBlendAlpha = ZERO;
+    DestBlendAlpha = ONE;
+    BlendOpAlpha = ADD;
+    RenderTargetWriteMask[0] = 0x0F;
+};
+
+BlendState Modulate2xBlend
+{
+    BlendEnable[0] = TRUE;
+    SrcBlend = DEST_COLOR;
+    DestBlend = SRC_COLOR;
+    BlendOp = ADD;
+    SrcBlendAlpha = ZERO;
+    DestBlendAlpha = ONE;
+    BlendOpAlpha = ADD;
+    RenderTargetWriteMask[0] = 0x0F;
+};
+
+DepthStencilState DepthTestNoWrite
+{
+    DepthEnable = TRUE;
+    DepthWriteMask = ZERO;
+    DepthFunc = LESS_EQUAL;
+};
+
+technique10 render_particles
+{
+    pass P0
+    {
+		SetDepthStencilState( DepthTestNoWrite, 0 );
+		SetBlendState( AlphaBlend, float4( 0.0f, 0.0f, 0.0f, 0.0f ), 0xFFFFFFFF );
+
+        SetVertexShader( CompileShader( vs_4_0, VS_particle() ) );
+        SetGeometryShader( NULL );
+        SetPixelShader( CompileShader( ps_4_0, PS_particle() ) );
+    }
+}
+
+technique10 render_particles_additive
+{
+    pass P0
+    {
+		SetDepthStencilState( DepthTestNoWrite, 0 );
+		SetBlendState( AdditiveBlend, float4( 0.0f, 0.0f, 0.0f, 0.0f ), 0xFFFFFFFF );
+
+        SetVertexShader( CompileShader( vs_4_0, VS_particle() ) );
+        SetGeometryShader( NULL );
+        SetPixelShader( CompileShader( ps_4_0, PS_particle() ) );
+    }
+}
+
+technique10 render_particles_modulate
+{
+    pass P0
+    {
+		SetDepthStencilState( DepthTestNoWrite, 0 );
+		SetBlendState( ModulateBlend, float4( 0.0f, 0.0f, 0.0f, 0.0f ), 0xFFFFFFFF );
+
+        SetVertexShader( CompileShader( vs_4_0, VS_particle() ) );
+        SetGeometryShader( NULL );
+        SetPixelShader( CompileShader( ps_4_0, PS_particle() ) );
+    }
+}
+
+technique10 render_particles_modulate2x
+{
+    pass P0
+    {
+		SetDepthStencilState( DepthTestNoWrite, 0 );
+		SetBlendState( Modulate2xBlend, float4( 0.0f, 0.0f, 0.0f, 0.0f ), 0xFFFFFFFF );
+
+        SetVertexShader( CompileShader( vs_4_0, VS_particle() ) );
+        SetGeometryShader( NULL );
+        SetPixelShader( CompileShader( ps_4_0, PS_particle() ) );
+    }
+}
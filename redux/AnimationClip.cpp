@@ -0,0 +1,175 @@
+#include "stdafx.h"
+#include <boost/weak_ptr.hpp>
+#include "AnimationClip.hpp"
+#include "Utils.hpp"
+#include "AnimationNode.hpp"
+#include "TransformHierarchy.hpp"
+#include "ThreadPool.hpp"
+
+namespace
+{
+  // instances per task
+  const uint32_t kCrowdGrainSize = 16;
+
+  typedef std::map<std::string, boost::weak_ptr<AnimationClip> > SharedClips;
+  SharedClips g_shared_clips;
+}
+
+AnimationClip::AnimationClip(const std::vector<AnimationNodeHandle>& parents, const std::vector<CompressedTrack>& tracks, const uint32_t duration)
+  : parents_(parents)
+  , tracks_(tracks)
+  , duration_(duration)
+{
+  SUPER_ASSERT(parents_.size() == tracks_.size());
+}
+
+void AnimationClip::sample(const uint32_t node, const uint32_t time_in_ms, const float weight, uint32_t& cursor,
+  D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale) const
+{
+  const CompressedTrack& track = tracks_[node];
+  if (track.num_keys() == 0) {
+    pos = kVec3Zero;
+    rot = kQuatId;
+    scale = kVec3One;
+    return;
+  }
+
+  sample_track(track, time_in_ms, cursor, pos, rot, scale);
+  if (weight < 1) {
+    AnimationKey rest, cur(time_in_ms, pos, rot, scale);
+    track.key(0, rest);
+    interpolate_keys(rest, cur, std::max<float>(0, weight), pos, rot, scale);
+  }
+}
+
+AnimationCrowd::AnimationCrowd(const AnimationClipSPtr& clip)
+  : clip_(clip)
+{
+}
+
+uint32_t AnimationCrowd::add_instance(const AnimationInstance& instance)
+{
+  instances_.push_back(instance);
+  instances_.back().cursors.assign(clip_->num_nodes(), 0);
+  palettes_.resize(instances_.size() * clip_->num_nodes(), kMtxId);
+  const uint32_t num_tasks = (instances_.size() + kCrowdGrainSize - 1) / kCrowdGrainSize;
+  scratch_pos_.resize(num_tasks * clip_->num_nodes());
+  scratch_rot_.resize(num_tasks * clip_->num_nodes());
+  scratch_scale_.resize(num_tasks * clip_->num_nodes());
+  return instances_.size() - 1;
+}
+
+void AnimationCrowd::update_range(const float delta_ms, const uint32_t begin, const uint32_t end)
+{
+  const uint32_t num_nodes = clip_->num_nodes();
+  const float duration = (float)clip_->duration();
+  if (num_nodes == 0 || begin == end) {
+    return;
+  }
+
+  // the local transforms only live for the duration of one instance. parallel_for starts every task
+  // on a multiple of the grain size, so each task gets its own slot
+  const uint32_t scratch_ofs = begin / kCrowdGrainSize * num_nodes;
+  D3DXVECTOR3* pos = &scratch_pos_[scratch_ofs];
+  D3DXQUATERNION* rot = &scratch_rot_[scratch_ofs];
+  D3DXVECTOR3* scale = &scratch_scale_[scratch_ofs];
+
+  for (uint32_t i = begin; i < end; ++i) {
+    AnimationInstance& instance = instances_[i];
+    instance.time_in_ms += delta_ms * instance.speed;
+    if (instance.loop && duration > 0) {
+      instance.time_in_ms = fmodf(instance.time_in_ms, duration);
+      if (instance.time_in_ms < 0) {
+        instance.time_in_ms += duration;
+      }
+    } else {
+      instance.time_in_ms = std::min<float>(duration, std::max<float>(0, instance.time_in_ms));
+    }
+
+    const uint32_t time_in_ms = (uint32_t)instance.time_in_ms;
+    for (uint32_t j = 0; j < num_nodes; ++j) {
+      clip_->sample(j, time_in_ms, instance.weight, instance.cursors[j], pos[j], rot[j], scale[j]);
+    }
+    compose_world_transforms(&palettes_[i * num_nodes], pos, rot, scale, clip_->parents(), 0, num_nodes);
+  }
+}
+
+void AnimationCrowd::update(const float delta_ms, ThreadPool* pool)
+{
+  if (pool == NULL) {
+    update_range(delta_ms, 0, instances_.size());
+  } else {
+    pool->parallel_for(instances_.size(), kCrowdGrainSize, boost::bind(&AnimationCrowd::update_range, this, delta_ms, _1, _2));
+  }
+}
+
+CrowdBenchmark benchmark_crowd(const uint32_t num_instances, const uint32_t iterations, ThreadPool* pool)
+{
+  // a 2 second clip on a 32 node chain, with the instances spread over it at different speeds
+  const uint32_t kNumNodes = 32;
+  AnimationKeys keys;
+  for (uint32_t i = 0; i <= 60; ++i) {
+    const float t = i / 30.0f;
+    D3DXQUATERNION rot;
+    D3DXQuaternionRotationYawPitchRoll(&rot, t, 0.5f * t, 0);
+    keys.push_back(AnimationKey(i * 33, D3DXVECTOR3(sinf(t), cosf(t), t), rot, kVec3One));
+  }
+
+  std::vector<AnimationNodeHandle> parents(kNumNodes);
+  std::vector<CompressedTrack> tracks(kNumNodes);
+  for (uint32_t i = 0; i < kNumNodes; ++i) {
+    parents[i] = i == 0 ? kInvalidAnimationNode : i - 1;
+    AnimationCompressionStats stats;
+    compress_track(tracks[i], stats, keys, AnimationCompressionSettings());
+  }
+
+  AnimationCrowd crowd(AnimationClipSPtr(new AnimationClip(parents, tracks, keys.back().time_in_ms)));
+  srand(1);
+  for (uint32_t i = 0; i < num_instances; ++i) {
+    AnimationInstance instance;
+    instance.time_in_ms = (float)(rand() % 2000);
+    instance.speed = 0.5f + rand() / (float)RAND_MAX;
+    crowd.add_instance(instance);
+  }
+
+  CrowdBenchmark result;
+  LARGE_INTEGER start, end;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    crowd.update(16, NULL);
+  }
+  QueryPerformanceCounter(&end);
+  result.serial_ms = elapsed_ms(start, end) / iterations;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    crowd.update(16, pool);
+  }
+  QueryPerformanceCounter(&end);
+  result.parallel_ms = elapsed_ms(start, end) / iterations;
+  result.instances_per_ms = result.parallel_ms > 0 ? num_instances / result.parallel_ms : 0;
+
+  LOG_INFO_LN("crowd: %d instances of %d nodes. serial: %.3f ms, %d threads: %.3f ms",
+    num_instances, kNumNodes, result.serial_ms, pool ? pool->num_threads() + 1 : 1, result.parallel_ms);
+  return result;
+}
+
+AnimationClipSPtr find_shared_clip(const std::string& name)
+{
+  SharedClips::iterator it = g_shared_clips.find(name);
+  return it != g_shared_clips.end() ? it->second.lock() : AnimationClipSPtr();
+}
+
+void add_shared_clip(const std::string& name, const AnimationClipSPtr& clip)
+{
+  // drop the clips that have been freed while we're here
+  for (SharedClips::iterator it = g_shared_clips.begin(); it != g_shared_clips.end(); ) {
+    if (it->second.expired()) {
+      it = g_shared_clips.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  g_shared_clips[name] = clip;
+}
@@ -0,0 +1,97 @@
+#ifndef ANIMATION_CLIP_HPP
+#define ANIMATION_CLIP_HPP
+
+#include "AnimationCompression.hpp"
+#include "ReduxTypes.hpp"
+
+class ThreadPool;
+
+/**
+ * Read-only animation data for a hierarchy, shared by every instance that plays it. The nodes are
+ * sorted so the parents come first, like in the AnimationManager the clip is created from.
+ */
+class AnimationClip
+{
+public:
+  AnimationClip(const std::vector<AnimationNodeHandle>& parents, const std::vector<CompressedTrack>& tracks, const uint32_t duration);
+
+  uint32_t num_nodes() const { return parents_.size(); }
+  uint32_t duration() const { return duration_; }
+  const CompressedTrack& track(const uint32_t node) const { return tracks_[node]; }
+
+  // Samples node at time_in_ms. weight blends between the node's first key (0) and the sampled pose (1).
+  void sample(const uint32_t node, const uint32_t time_in_ms, const float weight, uint32_t& cursor,
+    D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale) const;
+
+  const AnimationNodeHandle* parents() const { return parents_.empty() ? NULL : &parents_[0]; }
+  // true if the clip was made for a hierarchy with these parents
+  bool has_parents(const std::vector<AnimationNodeHandle>& parents) const { return parents_ == parents; }
+
+private:
+  std::vector<AnimationNodeHandle> parents_;
+  std::vector<CompressedTrack> tracks_;
+  uint32_t duration_;
+};
+
+// per instance playback state
+struct AnimationInstance
+{
+  AnimationInstance() : time_in_ms(0), speed(1), weight(1), loop(true) {}
+  float time_in_ms;
+  float speed;
+  float weight;
+  bool loop;
+  // last key used per node, so forward playback doesn't have to search
+  std::vector<uint32_t> cursors;
+};
+
+/**
+ * A crowd of instances playing the same clip, each at its own time and speed. The world matrices of
+ * every instance end up in one array, num_nodes per instance, so they can be streamed straight to the
+ * skinning or instancing buffers.
+ */
+class AnimationCrowd
+{
+public:
+  AnimationCrowd(const AnimationClipSPtr& clip);
+
+  uint32_t add_instance(const AnimationInstance& instance);
+  uint32_t num_instances() const { return instances_.size(); }
+  AnimationInstance& instance(const uint32_t idx) { return instances_[idx]; }
+
+  // Advances every instance by delta_ms, and recomputes the palettes. The instances are spread over pool
+  // if it isn't NULL.
+  void update(const float delta_ms, ThreadPool* pool);
+
+  const D3DXMATRIX* palette(const uint32_t idx) const { return &palettes_[idx * clip_->num_nodes()]; }
+
+private:
+  void update_range(const float delta_ms, const uint32_t begin, const uint32_t end);
+
+  AnimationClipSPtr clip_;
+  std::vector<AnimationInstance> instances_;
+  std::vector<D3DXMATRIX> palettes_;
+  // the local transforms, num_nodes for each task, so the tasks don't allocate
+  std::vector<D3DXVECTOR3> scratch_pos_;
+  std::vector<D3DXQUATERNION> scratch_rot_;
+  std::vector<D3DXVECTOR3> scratch_scale_;
+};
+
+// Clips are shared by name, so everything that loads the same scene plays the same clip. The name should
+// identify the data the clip was made from, not just the scene. A clip is freed along with its last
+// user. Only used from the main thread.
+AnimationClipSPtr find_shared_clip(const std::string& name);
+void add_shared_clip(const std::string& name, const AnimationClipSPtr& clip);
+
+struct CrowdBenchmark
+{
+  CrowdBenchmark() : serial_ms(0), parallel_ms(0), instances_per_ms(0) {}
+  double serial_ms;
+  double parallel_ms;
+  double instances_per_ms;
+};
+
+// Plays num_instances instances of a synthetic 32 node clip. Doesn't need a device, so it can run headless.
+CrowdBenchmark benchmark_crowd(const uint32_t num_instances, const uint32_t iterations, ThreadPool* pool);
+
+#endif // #ifndef ANIMATION_CLIP_HPP
@@ -0,0 +1,423 @@
+#include "stdafx.h"
+#include "AnimationCompression.hpp"
+#include "AnimationNode.hpp"
+
+namespace
+{
+  const float kRadToDeg = 180.0f / (float)D3DX_PI;
+
+  // the three smallest components of a unit quaternion are within +-1/sqrt(2)
+  const float kSmallestThreeRange = 0.70710678f;
+  const uint32_t kSmallestThreeMax = (1 << 15) - 1;
+
+  // how far find_key steps from its hint before giving up and searching
+  const uint32_t kMaxCursorSteps = 4;
+
+  inline uint16_t to_unorm16(const float v)
+  {
+    const float c = std::min<float>(1, std::max<float>(0, v));
+    return (uint16_t)floorf(c * 65535.0f + 0.5f);
+  }
+
+  inline float dist(const D3DXVECTOR3& a, const D3DXVECTOR3& b)
+  {
+    const D3DXVECTOR3 d(a - b);
+    return D3DXVec3Length(&d);
+  }
+
+  // Angle between the rotations, in degrees. q and -q are the same rotation. acos loses too much
+  // precision near 1 for the small angles we care about, so this goes via the chord length instead.
+  inline float angle_deg(const D3DXQUATERNION& a, const D3DXQUATERNION& b)
+  {
+    const D3DXQUATERNION d(D3DXQuaternionDot(&a, &b) < 0 ? a + b : a - b);
+    const float chord = std::min<float>(2, sqrtf(D3DXQuaternionDot(&d, &d)));
+    return 4 * asinf(chord * 0.5f) * kRadToDeg;
+  }
+
+  uint32_t gcd(uint32_t a, uint32_t b)
+  {
+    while (b != 0) {
+      const uint32_t t = a % b;
+      a = b;
+      b = t;
+    }
+    return a;
+  }
+
+  bool is_within_tolerance(const AnimationKey& key, const D3DXVECTOR3& pos, const D3DXQUATERNION& rot, const D3DXVECTOR3& scale,
+    const AnimationCompressionSettings& settings)
+  {
+    return dist(key.pos, pos) <= settings.max_pos_error && angle_deg(key.rot, rot) <= settings.max_rot_error_deg &&
+      dist(key.scale, scale) <= settings.max_scale_error;
+  }
+
+  // true if every key between first and last can be reconstructed by interpolating the two
+  bool can_skip_keys(const AnimationKeys& keys, const uint32_t first, const uint32_t last, const AnimationCompressionSettings& settings)
+  {
+    const AnimationKey& a = keys[first];
+    const AnimationKey& b = keys[last];
+    const float span = (float)(b.time_in_ms - a.time_in_ms);
+    for (uint32_t i = first + 1; i < last; ++i) {
+      D3DXVECTOR3 pos, scale;
+      D3DXQUATERNION rot;
+      interpolate_keys(a, b, span > 0 ? (keys[i].time_in_ms - a.time_in_ms) / span : 0, pos, rot, scale);
+      if (!is_within_tolerance(keys[i], pos, rot, scale, settings)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void calc_bounds(QuantizationBounds& bounds, const std::vector<D3DXVECTOR3>& values)
+  {
+    D3DXVECTOR3 min_v(values[0]), max_v(values[0]);
+    for (size_t i = 1; i < values.size(); ++i) {
+      D3DXVec3Minimize(&min_v, &min_v, &values[i]);
+      D3DXVec3Maximize(&max_v, &max_v, &values[i]);
+    }
+    bounds.bias = min_v;
+    bounds.scale = max_v - min_v;
+  }
+
+  // A constant channel is stored as a single value
+  void quantize_channel(std::vector<uint16_t>& out, QuantizationBounds& bounds, const std::vector<D3DXVECTOR3>& values, const float tolerance)
+  {
+    bool constant = true;
+    for (size_t i = 1; i < values.size() && constant; ++i) {
+      constant = dist(values[0], values[i]) <= tolerance;
+    }
+
+    calc_bounds(bounds, constant ? std::vector<D3DXVECTOR3>(1, values[0]) : values);
+    const size_t count = constant ? 1 : values.size();
+    out.resize(3 * count);
+    for (size_t i = 0; i < count; ++i) {
+      const D3DXVECTOR3& v = values[i];
+      out[i*3+0] = to_unorm16(bounds.scale.x > 0 ? (v.x - bounds.bias.x) / bounds.scale.x : 0);
+      out[i*3+1] = to_unorm16(bounds.scale.y > 0 ? (v.y - bounds.bias.y) / bounds.scale.y : 0);
+      out[i*3+2] = to_unorm16(bounds.scale.z > 0 ? (v.z - bounds.bias.z) / bounds.scale.z : 0);
+    }
+  }
+
+  inline D3DXVECTOR3 dequantize(const uint16_t* v, const QuantizationBounds& bounds)
+  {
+    return D3DXVECTOR3(
+      v[0] / 65535.0f * bounds.scale.x + bounds.bias.x,
+      v[1] / 65535.0f * bounds.scale.y + bounds.bias.y,
+      v[2] / 65535.0f * bounds.scale.z + bounds.bias.z);
+  }
+
+  // Interpolates the exported keys at time_in_ms, which has to increase between calls with the same cursor
+  void sample_keys(AnimationKey& out, const AnimationKeys& keys, const float time_in_ms, uint32_t& cursor)
+  {
+    while (cursor + 1 < keys.size() && keys[cursor + 1].time_in_ms <= time_in_ms) {
+      ++cursor;
+    }
+    const AnimationKey& a = keys[cursor];
+    out.time_in_ms = (uint32_t)time_in_ms;
+    if (cursor + 1 == keys.size() || time_in_ms <= a.time_in_ms) {
+      out.pos = a.pos;
+      out.rot = a.rot;
+      out.scale = a.scale;
+      return;
+    }
+    const AnimationKey& b = keys[cursor + 1];
+    interpolate_keys(a, b, (time_in_ms - a.time_in_ms) / (b.time_in_ms - a.time_in_ms), out.pos, out.rot, out.scale);
+  }
+
+  // quantizes the values of the keys. The times are up to the caller
+  void quantize_keys(CompressedTrack& out, const AnimationKeys& keys, const AnimationCompressionSettings& tolerance)
+  {
+    std::vector<D3DXVECTOR3> positions, scales;
+    positions.reserve(keys.size());
+    scales.reserve(keys.size());
+    out.rotations.resize(3 * keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      positions.push_back(keys[i].pos);
+      scales.push_back(keys[i].scale);
+      encode_quaternion48(&out.rotations[3*i], keys[i].rot);
+    }
+
+    quantize_channel(out.positions, out.pos_bounds, positions, tolerance.max_pos_error);
+    quantize_channel(out.scales, out.scale_bounds, scales, tolerance.max_scale_error);
+
+    bool constant_rot = true;
+    for (size_t i = 1; i < keys.size() && constant_rot; ++i) {
+      constant_rot = angle_deg(decode_quaternion48(&out.rotations[0]), decode_quaternion48(&out.rotations[3*i])) <= tolerance.max_rot_error_deg;
+    }
+    if (constant_rot) {
+      out.rotations.resize(3);
+    }
+  }
+
+  // evaluates the compressed track at every exported key
+  void measure_error(AnimationCompressionStats& stats, const CompressedTrack& track, const AnimationKeys& keys)
+  {
+    stats.max_pos_error = stats.max_rot_error_deg = stats.max_scale_error = 0;
+    for (uint32_t i = 0; i < keys.size(); ++i) {
+      D3DXVECTOR3 pos, scale;
+      D3DXQUATERNION rot;
+      sample_track(track, keys[i].time_in_ms, pos, rot, scale);
+      stats.max_pos_error = std::max<float>(stats.max_pos_error, dist(keys[i].pos, pos));
+      stats.max_rot_error_deg = std::max<float>(stats.max_rot_error_deg, angle_deg(keys[i].rot, rot));
+      stats.max_scale_error = std::max<float>(stats.max_scale_error, dist(keys[i].scale, scale));
+    }
+  }
+
+  bool is_within_bounds(const AnimationCompressionStats& stats, const AnimationCompressionSettings& settings)
+  {
+    return stats.max_pos_error <= settings.max_pos_error && stats.max_rot_error_deg <= settings.max_rot_error_deg &&
+      stats.max_scale_error <= settings.max_scale_error;
+  }
+}
+
+void encode_quaternion48(uint16_t* out, const D3DXQUATERNION& q)
+{
+  D3DXQUATERNION n;
+  D3DXQuaternionNormalize(&n, &q);
+  const float* c = (const float*)&n;
+
+  uint32_t largest = 0;
+  for (uint32_t i = 1; i < 4; ++i) {
+    if (fabs(c[i]) > fabs(c[largest])) {
+      largest = i;
+    }
+  }
+
+  // flip the quaternion so the dropped component is positive, and can be rebuilt from the others
+  const float sign = c[largest] < 0 ? -1.0f : 1.0f;
+  uint64_t bits = largest;
+  for (uint32_t i = 0; i < 4; ++i) {
+    if (i != largest) {
+      const float v = std::min<float>(1, std::max<float>(0, (sign * c[i] / kSmallestThreeRange + 1) * 0.5f));
+      bits = (bits << 15) | (uint32_t)floorf(v * kSmallestThreeMax + 0.5f);
+    }
+  }
+
+  out[0] = (uint16_t)(bits >> 32);
+  out[1] = (uint16_t)(bits >> 16);
+  out[2] = (uint16_t)bits;
+}
+
+D3DXQUATERNION decode_quaternion48(const uint16_t* in)
+{
+  const uint64_t bits = ((uint64_t)in[0] << 32) | ((uint64_t)in[1] << 16) | in[2];
+  const uint32_t largest = (uint32_t)(bits >> 45) & 3;
+
+  float c[4];
+  float sum = 0;
+  int shift = 30;
+  for (uint32_t i = 0; i < 4; ++i) {
+    if (i != largest) {
+      const uint32_t v = (uint32_t)(bits >> shift) & kSmallestThreeMax;
+      c[i] = (v / (float)kSmallestThreeMax * 2 - 1) * kSmallestThreeRange;
+      sum += c[i] * c[i];
+      shift -= 15;
+    }
+  }
+  c[largest] = sqrtf(std::max<float>(0, 1 - sum));
+  return D3DXQUATERNION(c[0], c[1], c[2], c[3]);
+}
+
+void interpolate_keys(const AnimationKey& a, const AnimationKey& b, const float ratio,
+  D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale)
+{
+  D3DXVec3Lerp(&pos, &a.pos, &b.pos, ratio);
+  D3DXVec3Lerp(&scale, &a.scale, &b.scale, ratio);
+
+  // take the shortest path
+  const D3DXQUATERNION rot_b = D3DXQuaternionDot(&a.rot, &b.rot) < 0 ? -b.rot : b.rot;
+  rot = a.rot + ratio * (rot_b - a.rot);
+  D3DXQuaternionNormalize(&rot, &rot);
+}
+
+void CompressedTrack::key(const uint32_t idx, AnimationKey& key) const
+{
+  // constant channels only store the first key
+  key.time_in_ms = time(idx);
+  key.pos = dequantize(&positions[positions.size() == 3 ? 0 : 3 * idx], pos_bounds);
+  key.rot = decode_quaternion48(&rotations[rotations.size() == 3 ? 0 : 3 * idx]);
+  key.scale = dequantize(&scales[scales.size() == 3 ? 0 : 3 * idx], scale_bounds);
+}
+
+uint32_t CompressedTrack::find_key(const uint32_t time_in_ms, const uint32_t hint) const
+{
+  const uint32_t num_keys = this->num_keys();
+  if (num_keys == 0 || time_in_ms <= start_time) {
+    return 0;
+  }
+
+  if (resampled()) {
+    return std::min<uint32_t>(num_keys - 1, (uint32_t)((time_in_ms - start_time) / frame_duration));
+  }
+
+  const uint32_t rel = (time_in_ms - start_time) / time_step;
+  uint32_t idx = std::min<uint32_t>(hint, num_keys - 1);
+  if (times[idx] <= rel) {
+    for (uint32_t i = 0; i < kMaxCursorSteps; ++i, ++idx) {
+      if (idx + 1 == num_keys || rel < times[idx + 1]) {
+        return idx;
+      }
+    }
+  }
+
+  return std::upper_bound(times.begin(), times.end(), rel) - times.begin() - 1;
+}
+
+uint32_t CompressedTrack::find_key(const uint32_t time_in_ms, const uint32_t hint, float& ratio) const
+{
+  const uint32_t idx = find_key(time_in_ms, hint);
+  ratio = 0;
+  if (idx + 1 >= num_keys() || time_in_ms <= start_time) {
+    return idx;
+  }
+
+  if (resampled()) {
+    ratio = std::min<float>(1, (time_in_ms - start_time) / frame_duration - idx);
+  } else {
+    const uint32_t cur_time = time(idx);
+    if (time_in_ms > cur_time) {
+      ratio = (time_in_ms - cur_time) / (float)(time(idx + 1) - cur_time);
+    }
+  }
+  return idx;
+}
+
+uint32_t CompressedTrack::size_in_bytes() const
+{
+  return sizeof(start_time) + sizeof(time_step) + sizeof(frame_duration) + sizeof(num_frames) + sizeof(pos_bounds) + sizeof(scale_bounds) +
+    sizeof(uint16_t) * (times.size() + positions.size() + rotations.size() + scales.size());
+}
+
+void sample_track(const CompressedTrack& track, const uint32_t time_in_ms, D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale)
+{
+  uint32_t cursor = 0;
+  sample_track(track, time_in_ms, cursor, pos, rot, scale);
+}
+
+void sample_track(const CompressedTrack& track, const uint32_t time_in_ms, uint32_t& cursor,
+  D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale)
+{
+  AnimationKey cur;
+  float ratio;
+  const uint32_t idx = cursor = track.find_key(time_in_ms, cursor, ratio);
+  track.key(idx, cur);
+  if (ratio > 0) {
+    AnimationKey next;
+    track.key(idx + 1, next);
+    interpolate_keys(cur, next, ratio, pos, rot, scale);
+    return;
+  }
+
+  pos = cur.pos;
+  rot = cur.rot;
+  scale = cur.scale;
+}
+
+void AnimationCompressionStats::add(const AnimationCompressionStats& rhs)
+{
+  num_keys += rhs.num_keys;
+  num_kept_keys += rhs.num_kept_keys;
+  num_resampled_tracks += rhs.num_resampled_tracks;
+  raw_bytes += rhs.raw_bytes;
+  compressed_bytes += rhs.compressed_bytes;
+  max_pos_error = std::max<float>(max_pos_error, rhs.max_pos_error);
+  max_rot_error_deg = std::max<float>(max_rot_error_deg, rhs.max_rot_error_deg);
+  max_scale_error = std::max<float>(max_scale_error, rhs.max_scale_error);
+}
+
+void AnimationCompressionStats::log() const
+{
+  LOG_INFO_LN("animation: %d of %d keys kept, %d tracks resampled, %d -> %d bytes (%.1f:1), max error pos: %f, rot: %f deg, scale: %f",
+    num_kept_keys, num_keys, num_resampled_tracks, raw_bytes, compressed_bytes, ratio(),
+    max_pos_error, max_rot_error_deg, max_scale_error);
+}
+
+void compress_track(CompressedTrack& out, AnimationCompressionStats& stats, const AnimationKeys& keys,
+  const AnimationCompressionSettings& settings, const uint32_t fps)
+{
+  out = CompressedTrack();
+  stats = AnimationCompressionStats();
+  if (keys.empty()) {
+    return;
+  }
+
+  // Greedily extend each segment for as long as the keys it skips stay within half the tolerance. The
+  // other half is left for the quantization.
+  AnimationCompressionSettings half(settings);
+  half.max_pos_error *= 0.5f;
+  half.max_rot_error_deg *= 0.5f;
+  half.max_scale_error *= 0.5f;
+
+  const uint32_t num_keys = keys.size();
+  std::vector<uint32_t> kept;
+  kept.push_back(0);
+  uint32_t first = 0;
+  for (uint32_t i = 2; i < num_keys; ++i) {
+    if (!can_skip_keys(keys, first, i, half)) {
+      first = i - 1;
+      kept.push_back(first);
+    }
+  }
+  if (num_keys > 1) {
+    kept.push_back(num_keys - 1);
+  }
+
+  // a track where every key is the same only needs one
+  if (kept.size() == 2 && can_skip_keys(keys, 0, num_keys - 1, half) &&
+    is_within_tolerance(keys[0], keys.back().pos, keys.back().rot, keys.back().scale, half)) {
+    kept.pop_back();
+  }
+
+  stats.num_keys = num_keys;
+  stats.raw_bytes = num_keys * sizeof(AnimationKey);
+
+  if (settings.resample && fps > 0 && kept.size() > 1) {
+    // sample the exported keys at every frame, with the last frame at or after the last key
+    out.start_time = keys[0].time_in_ms;
+    out.frame_duration = 1000.0f / fps;
+    out.num_frames = (uint32_t)ceilf((keys.back().time_in_ms - out.start_time) / out.frame_duration) + 1;
+    AnimationKeys frames(out.num_frames);
+    uint32_t cursor = 0;
+    for (uint32_t i = 0; i < out.num_frames; ++i) {
+      sample_keys(frames[i], keys, out.start_time + i * out.frame_duration, cursor);
+    }
+    quantize_keys(out, frames, half);
+    measure_error(stats, out, keys);
+
+    // keys that fall between frames may have been cut off
+    if (is_within_bounds(stats, settings)) {
+      stats.num_kept_keys = out.num_keys();
+      stats.num_resampled_tracks = 1;
+      stats.compressed_bytes = out.size_in_bytes();
+      return;
+    }
+    out = CompressedTrack();
+  }
+
+  // store the times in units of the largest step that divides them all
+  out.start_time = keys[kept[0]].time_in_ms;
+  uint32_t step = 0;
+  for (size_t i = 1; i < kept.size(); ++i) {
+    step = gcd(step, keys[kept[i]].time_in_ms - out.start_time);
+  }
+  const uint32_t range = keys[kept.back()].time_in_ms - out.start_time;
+  out.time_step = std::max<uint32_t>(1, std::max<uint32_t>(step, (range + 0xfffe) / 0xffff));
+
+  AnimationKeys stored;
+  stored.reserve(kept.size());
+  for (size_t i = 0; i < kept.size(); ++i) {
+    const AnimationKey& key = keys[kept[i]];
+    const uint16_t t = (uint16_t)((key.time_in_ms - out.start_time + out.time_step / 2) / out.time_step);
+    // if the range doesn't fit in 16 bits, rounding can put two keys at the same time
+    if (!out.times.empty() && t == out.times.back()) {
+      continue;
+    }
+    out.times.push_back(t);
+    stored.push_back(key);
+  }
+  quantize_keys(out, stored, half);
+
+  stats.num_kept_keys = out.num_keys();
+  stats.compressed_bytes = out.size_in_bytes();
+  measure_error(stats, out, keys);
+}
@@ -0,0 +1,97 @@
+#ifndef ANIMATION_COMPRESSION_HPP
+#define ANIMATION_COMPRESSION_HPP
+
+#include "Quantization.hpp"
+
+struct AnimationKey;
+typedef std::vector<AnimationKey> AnimationKeys;
+
+// how far the decoded track may be from the exported keys
+struct AnimationCompressionSettings
+{
+  AnimationCompressionSettings() : max_pos_error(0.001f), max_rot_error_deg(0.05f), max_scale_error(0.0005f), resample(false) {}
+  float max_pos_error;
+  float max_rot_error_deg;
+  float max_scale_error;
+  // store a key for every frame at the clip's fps instead of reducing the keys. Tracks that don't fit
+  // the error bounds this way are reduced anyway.
+  bool resample;
+};
+
+/**
+ * Keys that can be reconstructed by interpolating their neighbours are dropped, and the rest are
+ * quantized. Positions and scales are 16 bit unorms relative to the track's bounds, and rotations are
+ * stored as the three smallest components, 15 bits each, plus the index of the largest (48 bits).
+ * A channel that doesn't change stores a single value.
+ * A resampled track has a key every frame_duration ms instead, so it doesn't store any times, and
+ * the key is found straight from the time.
+ */
+struct CompressedTrack
+{
+  CompressedTrack() : start_time(0), time_step(1), frame_duration(0), num_frames(0) {}
+
+  bool resampled() const { return frame_duration > 0; }
+  uint32_t num_keys() const { return resampled() ? num_frames : times.size(); }
+  uint32_t time(const uint32_t idx) const
+  {
+    return start_time + (resampled() ? (uint32_t)(idx * frame_duration + 0.5f) : times[idx] * time_step);
+  }
+  // Returns the last key at or before time_in_ms, or 0 if there is none. Starts looking at hint, so
+  // playing forward is O(1), and falls back to a binary search for seeks.
+  uint32_t find_key(const uint32_t time_in_ms, const uint32_t hint) const;
+  // same as above, and ratio is how far time_in_ms is towards the next key
+  uint32_t find_key(const uint32_t time_in_ms, const uint32_t hint, float& ratio) const;
+  void key(const uint32_t idx, AnimationKey& key) const;
+  uint32_t size_in_bytes() const;
+
+  // the times are stored relative to the first key, in units of time_step ms
+  uint32_t start_time;
+  uint32_t time_step;
+  std::vector<uint16_t> times;
+  float frame_duration;     // ms between the keys of a resampled track, otherwise 0
+  uint32_t num_frames;
+
+  QuantizationBounds pos_bounds;
+  QuantizationBounds scale_bounds;
+  std::vector<uint16_t> positions;    // 3 per key
+  std::vector<uint16_t> rotations;    // 3 per key
+  std::vector<uint16_t> scales;       // 3 per key
+};
+
+struct AnimationCompressionStats
+{
+  AnimationCompressionStats() : num_keys(0), num_kept_keys(0), num_resampled_tracks(0), raw_bytes(0), compressed_bytes(0),
+    max_pos_error(0), max_rot_error_deg(0), max_scale_error(0) {}
+  float ratio() const { return compressed_bytes > 0 ? raw_bytes / (float)compressed_bytes : 0; }
+  void add(const AnimationCompressionStats& rhs);
+  void log() const;
+
+  uint32_t num_keys;
+  uint32_t num_kept_keys;
+  uint32_t num_resampled_tracks;
+  uint32_t raw_bytes;
+  uint32_t compressed_bytes;
+  // measured by evaluating the compressed track at every exported key
+  float max_pos_error;
+  float max_rot_error_deg;
+  float max_scale_error;
+};
+
+// fps is only used if settings.resample is set
+void compress_track(CompressedTrack& out, AnimationCompressionStats& stats, const AnimationKeys& keys,
+  const AnimationCompressionSettings& settings, const uint32_t fps = 0);
+
+// Lerps the position and scale, and nlerps the rotation along the shortest path
+void interpolate_keys(const AnimationKey& a, const AnimationKey& b, const float ratio,
+  D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale);
+
+// Interpolates the track at time_in_ms, clamping to the first and last key.
+void sample_track(const CompressedTrack& track, const uint32_t time_in_ms, D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale);
+// same as above, but starts looking for the key at cursor, and leaves it at the key used
+void sample_track(const CompressedTrack& track, const uint32_t time_in_ms, uint32_t& cursor,
+  D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale);
+
+void encode_quaternion48(uint16_t* out, const D3DXQUATERNION& q);
+D3DXQUATERNION decode_quaternion48(const uint16_t* in);
+
+#endif // #ifndef ANIMATION_COMPRESSION_HPP
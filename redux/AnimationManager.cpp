@@ -1,13 +1,34 @@
 #include "stdafx.h"
 #include <celsus/celsus.hpp>
 #include "AnimationManager.hpp"
+#include "Utils.hpp"
+#include "TransformHierarchy.hpp"
+#include "ThreadPool.hpp"
+#include "AnimationClip.hpp"
 
-namespace {
-  D3DXMATRIX matrix_from_key(const AnimationKey& key)
+namespace
+{
+  // nodes per task when sampling, and the smallest batch of subtrees worth composing on its own
+  const uint32_t kAnimationGrainSize = 256;
+  // smaller hierarchies aren't worth the overhead of the pool
+  const uint32_t kMinParallelNodes = 1024;
+
+  // every 2^lod frames, down to every 8th
+  const uint32_t kMaxAnimationLod = 3;
+  const uint32_t kDefaultLodBudget = 256;
+  // the longest frame the lod intervals are based on, so a hitch doesn't push the targets far ahead
+  const uint32_t kMaxLodFrameDelta = 100;
+  // smallest screen radius, as a fraction of the viewport height, for lod 0, 1 and 2
+  const float kLodScreenRadius[] = { 0.1f, 0.03f, 0.01f };
+
+  // the track of every node until a clip is set
+  const CompressedTrack kEmptyTrack;
+
+  void update_manager_range(AnimationManager* const* managers, const uint32_t time, const uint32_t begin, const uint32_t end)
   {
-    D3DXMATRIX mtx;
-    D3DXMatrixTransformation(&mtx, &kVec3Zero, &kQuatId, &key.scale, &kVec3Zero, &key.rot, &key.pos);
-    return mtx;
+    for (uint32_t i = begin; i < end; ++i) {
+      managers[i]->update_transforms(time);
+    }
   }
 }
 
@@ -19,125 +40,130 @@ AnimationManager::AnimationManager()
   , start_time_(0)
   , end_time_(0)
   , loop_animations_(true)
+  , lod_budget_(kDefaultLodBudget)
+  , lod_cursor_(0)
+  , lod_stamp_(0)
+  , update_time_(0)
+  , frame_delta_(1)
+  , classified_(false)
+  , lods_changed_(false)
+  , any_required_(false)
+  , evaluated_(false)
+  , frame_(0)
+  , time_(0)
 {
 }
 
 AnimationManager::~AnimationManager()
 {
-  root_.clear();
+  nodes_.clear();
 }
 
 /**
- * Get the pair of keys that we want to interpolate between, along with the ratio. Returns true if we find
- * a pair, otherwise next is invalid, and we should use the value in cur.
+ * Get the index of the key we want to interpolate from, along with the ratio towards the next one. Returns
+ * true if there is a pair, otherwise cur should be used as is. The cursor is the node's last position, so
+ * normal playback only has to step forward a key or so.
  */ 
 bool AnimationManager::keys_at_time(
-  AnimationKey& cur, AnimationKey& next, float& ratio, const AnimationKeys& keys, const uint32_t time_in_ms)
+  uint32_t& cur, float& ratio, const CompressedTrack& track, uint32_t& cursor, const uint32_t time_in_ms) const
 {
-  // Node found, so look for key frame
-  const uint32_t num_keys = keys.size();
-
-  if (time_in_ms <= keys.front().time_in_ms) {
-    cur = keys.front();
-    return false;
-  }
-
-  if (time_in_ms >= keys.back().time_in_ms) {
-    cur = keys.back();
-    return false;
-  }
+  cur = cursor = track.find_key(time_in_ms, cursor, ratio);
+  return ratio > 0;
+}
 
-  for (uint32_t i = 0; i < num_keys-1; ++i) {
-    if (time_in_ms >= keys[i].time_in_ms && time_in_ms < keys[i+1].time_in_ms) {
-      // Found it, so we interpolate the values
-      cur = keys[i];
-      next = keys[i+1];
-      const float delta = (float)(next.time_in_ms - cur.time_in_ms);
-      ratio = (time_in_ms - cur.time_in_ms) / delta;
-      return true;
-    }
-  }
+void AnimationManager::get_transform_for_node(D3DXMATRIX& mtx, const std::string& node_name)
+{
+  get_transform_for_node(mtx, find_node(node_name));
+}
 
-  // We should never get here..
-  assert(false);
-  return false;
+void AnimationManager::get_transform_for_node(D3DXVECTOR3& pos, const std::string& node_name)
+{
+  get_transform_for_node(pos, find_node(node_name));
 }
 
-const AnimationKeys& AnimationManager::get_keys_for_node(const std::string& node_name) const
+void AnimationManager::get_transform_for_node(D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale, const std::string& node_name)
 {
-  AnimationNodeSPtr node = find_node_by_name(node_name);
-  SUPER_ASSERT(node);
-  return node->keys();
+  get_transform_for_node(pos, rot, scale, find_node(node_name));
 }
 
-void AnimationManager::get_transform_for_node(D3DXMATRIX& mtx, const std::string& node_name)
+void AnimationManager::get_transform_for_node(D3DXMATRIX& mtx, const AnimationNodeHandle node)
 {
-  if (AnimationNodeSPtr node = find_node_by_name(node_name)) {
-    mtx = node->transform();
+  if (node < nodes_.size()) {
+    mtx = evaluate_transform(node);
   } else {
-    LOG_WARNING_LN_ONESHOT("[%s] Node: %s not found", __FUNCTION__, node_name.c_str());
+    LOG_WARNING_LN_ONESHOT("[%s] Invalid node: %d", __FUNCTION__, node);
     mtx = kMtxId;
   }
 }
 
-void AnimationManager::get_transform_for_node(D3DXVECTOR3& pos, const std::string& node_name)
+void AnimationManager::get_transform_for_node(D3DXVECTOR3& pos, const AnimationNodeHandle node)
 {
-  if (AnimationNodeSPtr node = find_node_by_name(node_name)) {
-    D3DXVECTOR3 scale;
-    D3DXQUATERNION rot;
-    node->pos_rot_scale(pos, rot, scale);
+  if (node < nodes_.size()) {
+    pos = get_translation(evaluate_transform(node));
   } else {
-    LOG_WARNING_LN_ONESHOT("[%s] Node: %s not found", __FUNCTION__, node_name.c_str());
+    LOG_WARNING_LN_ONESHOT("[%s] Invalid node: %d", __FUNCTION__, node);
     pos = kVec3Zero;
   }
 }
 
-void AnimationManager::get_transform_for_node(D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale, const std::string& node_name)
+void AnimationManager::get_transform_for_node(D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale, const AnimationNodeHandle node)
 {
-  if (AnimationNodeSPtr node = find_node_by_name(node_name)) {
-    node->pos_rot_scale(pos, rot, scale);
+  if (node < nodes_.size()) {
+    const D3DXMATRIX& mtx = evaluate_transform(node);
+    pos = get_translation(mtx);
+    D3DXQuaternionRotationMatrix(&rot, &mtx);
+    scale = get_scale(mtx);
   } else {
-    LOG_WARNING_LN_ONESHOT("[%s] Node: %s not found", __FUNCTION__, node_name.c_str());
+    LOG_WARNING_LN_ONESHOT("[%s] Invalid node: %d", __FUNCTION__, node);
     pos = kVec3Zero;
     rot = kQuatId;
     scale = kVec3One;
   }
 }
 
-void AnimationManager::calc_transform_at_time(D3DXMATRIX& mtx, const uint32_t time_in_ms, AnimationNode* node)
+void AnimationManager::sample_local_transform(const uint32_t time_in_ms, const AnimationNodeHandle node)
 {
-  const AnimationKeys& keys = node->keys();
+  const CompressedTrack& track = this->track(node);
 
-  switch( keys.size() ) {
+  switch( track.num_keys() ) {
     case 0:
-      mtx = kMtxId;
+      local_pos_[node] = kVec3Zero;
+      local_rot_[node] = kQuatId;
+      local_scale_[node] = kVec3One;
       break;
 
     case 1:
-      mtx = matrix_from_key(keys[0]);
+      {
+        AnimationKey key;
+        track.key(0, key);
+        local_pos_[node] = key.pos;
+        local_rot_[node] = key.rot;
+        local_scale_[node] = key.scale;
+      }
       break;
 
     default:
       {
-        AnimationKey cur, next;
+        uint32_t idx;
         float ratio;
-        if (!keys_at_time(cur, next, ratio, keys, time_in_ms)) {
-          mtx = matrix_from_key(cur);
+        const bool interpolate = keys_at_time(idx, ratio, track, cursors_[node], time_in_ms);
+        AnimationKey cur;
+        track.key(idx, cur);
+        if (!interpolate) {
+          local_pos_[node] = cur.pos;
+          local_rot_[node] = cur.rot;
+          local_scale_[node] = cur.scale;
           return;
         }
 
-        const D3DXMATRIX mtx_cur = matrix_from_key(cur);
-        const D3DXMATRIX mtx_next = matrix_from_key(next);
-        mtx = mtx_cur + ratio * (mtx_next - mtx_cur);
+        // interpolate the same way the compressor does, so the reported error holds
+        AnimationKey next;
+        track.key(idx + 1, next);
+        interpolate_keys(cur, next, ratio, local_pos_[node], local_rot_[node], local_scale_[node]);
       }
   }
 }
 
-void AnimationManager::calc_transform_at_time(D3DXMATRIX& mtx, const uint32_t time_in_ms, const std::string& name)
-{
-  return calc_transform_at_time(mtx, time_in_ms, find_node_by_name(name).get());
-}
-
 uint32_t AnimationManager::get_looped_time(const uint32_t time_in_ms) const
 {
   if (end_time_ == 0) {
@@ -150,46 +176,479 @@ uint32_t AnimationManager::get_looped_time(const uint32_t time_in_ms) const
   return (time_in_ms % end_time_);
 }
 
-AnimationNodeSPtr AnimationManager::find_node_by_name_inner(const std::string& node_name, const AnimationNodeSPtr& cur) const
+AnimationNodeHandle AnimationManager::add_node(const std::string& name, const AnimationNodeHandle parent)
 {
-  if (cur->name() == node_name) {
-    return cur;
+  const AnimationNodeHandle handle = nodes_.size();
+  // the update relies on the parent's world transform being done first
+  SUPER_ASSERT(parent == kInvalidAnimationNode || parent < handle);
+  nodes_.push_back(AnimationNodeSPtr(new AnimationNode(name, this, handle)));
+  parents_.push_back(parent);
+  local_pos_.push_back(kVec3Zero);
+  local_rot_.push_back(kQuatId);
+  local_scale_.push_back(kVec3One);
+  world_.push_back(kMtxId);
+  cursors_.push_back(0);
+  node_classes_.push_back(kStaticNode);
+  required_.push_back(false);
+  lods_.push_back(0);
+  world_frames_.push_back(0);
+  classified_ = false;
+
+  // Start a new batch on a root once the current one is big enough. The loaders add the nodes depth
+  // first, so the subtrees are contiguous, but if a node's parent is in an earlier batch, everything
+  // goes back to a single batch.
+  if (batch_starts_.empty()) {
+    batch_starts_.push_back(handle);
+  } else if (parent == kInvalidAnimationNode) {
+    if (handle - batch_starts_.back() >= kAnimationGrainSize) {
+      batch_starts_.push_back(handle);
+    }
+  } else if (parent < batch_starts_.back()) {
+    batch_starts_.resize(1);
   }
 
-  for (uint32_t i = 0; i < cur->num_children(); ++i) {
-    if (AnimationNodeSPtr result = find_node_by_name_inner(node_name, cur->child(i))) {
-      return result;
+  // the first node with a given name wins, which matches the old depth first search
+  node_index_.insert(std::make_pair(name, handle));
+  return handle;
+}
+
+void AnimationManager::set_clip(const AnimationClipSPtr& clip)
+{
+  SUPER_ASSERT(clip->num_nodes() == nodes_.size() && clip->has_parents(parents_));
+  clip_ = clip;
+  std::fill(cursors_.begin(), cursors_.end(), 0);
+  classified_ = false;
+}
+
+const CompressedTrack& AnimationManager::track(const AnimationNodeHandle node) const
+{
+  return clip_ ? clip_->track(node) : kEmptyTrack;
+}
+
+void AnimationManager::require_node(const AnimationNodeHandle node)
+{
+  required_[node] = true;
+  any_required_ = true;
+  classified_ = false;
+}
+
+void AnimationManager::set_node_lod(const AnimationNodeHandle node, const uint32_t lod)
+{
+  const uint8_t clamped = (uint8_t)std::min<uint32_t>(lod, kMaxAnimationLod);
+  if (lods_[node] != clamped) {
+    lods_[node] = clamped;
+    // only the update lists depend on the lods, and they're rebuilt once for all the changes
+    lods_changed_ = lods_changed_ || required_[node];
+  }
+}
+
+void AnimationManager::classify_nodes()
+{
+  const uint32_t num_nodes = nodes_.size();
+  for (uint32_t i = 0; i < num_nodes; ++i) {
+    const AnimationNodeHandle parent = parents_[i];
+    const bool animated_parent = parent != kInvalidAnimationNode && node_classes_[parent] != kStaticNode;
+    node_classes_[i] = (uint8_t)(track(i).num_keys() > 1 ? kAnimatedNode : animated_parent ? kConstantNode : kStaticNode);
+
+    // the local transform of a node without animation never changes, and neither does the world
+    // transform if all its ancestors are the same
+    if (node_classes_[i] != kAnimatedNode) {
+      sample_local_transform(0, i);
+    }
+    if (node_classes_[i] == kStaticNode) {
+      compose_world_transforms(&world_[0], &local_pos_[0], &local_rot_[0], &local_scale_[0], &parents_[0], i, i + 1);
     }
   }
 
-  return AnimationNodeSPtr();
+  classified_ = true;
+  // invalidate any transform computed on demand
+  ++frame_;
+  build_update_lists();
 }
 
-AnimationNodeSPtr AnimationManager::find_node_by_name(const std::string& node_name) const
+void AnimationManager::build_update_lists()
 {
-  for (uint32_t i = 0; i < root_.size(); ++i) {
-    if (AnimationNodeSPtr result = find_node_by_name_inner(node_name, root_[i])) {
-      return result;
+  const uint32_t num_nodes = nodes_.size();
+  animated_nodes_.clear();
+  dirty_nodes_.clear();
+  dirty_batch_starts_.clear();
+
+  // Nodes are evaluated by update_transforms if a full rate node needs them. If nothing is required,
+  // that's all of them
+  std::vector<uint8_t> eager(num_nodes, !any_required_);
+  for (uint32_t i = num_nodes; any_required_ && i-- > 0; ) {
+    eager[i] = eager[i] || (required_[i] && lods_[i] == 0);
+    if (eager[i] && parents_[i] != kInvalidAnimationNode) {
+      eager[parents_[i]] = true;
     }
   }
-  return AnimationNodeSPtr();
+
+  // keep the interpolation state of nodes that stay at a reduced rate
+  std::vector<LodInstance> old_instances;
+  old_instances.swap(lod_instances_);
+  std::vector<LodInstance>::const_iterator old_it = old_instances.begin();
+
+  for (uint32_t i = 0; i < num_nodes; ++i) {
+    if (node_classes_[i] == kStaticNode) {
+      continue;
+    }
+
+    if (eager[i]) {
+      dirty_nodes_.push_back(i);
+      if (node_classes_[i] == kAnimatedNode) {
+        animated_nodes_.push_back(i);
+      }
+    } else if (required_[i]) {
+      while (old_it != old_instances.end() && old_it->node < i) {
+        ++old_it;
+      }
+      lod_instances_.push_back(old_it != old_instances.end() && old_it->node == i ? *old_it : LodInstance(i));
+    }
+  }
+  lod_cursor_ = 0;
+  if (!lod_instances_.empty()) {
+    lod_stamps_.resize(num_nodes, 0);
+    lod_pos_.resize(num_nodes);
+    lod_rot_.resize(num_nodes);
+    lod_scale_.resize(num_nodes);
+    lod_world_.resize(num_nodes);
+  }
+
+  // no node's parent is in another batch, so the dirty nodes can be split the same way
+  for (size_t i = 0; i < batch_starts_.size(); ++i) {
+    dirty_batch_starts_.push_back(std::lower_bound(dirty_nodes_.begin(), dirty_nodes_.end(), batch_starts_[i]) - dirty_nodes_.begin());
+  }
+
+  lods_changed_ = false;
+  evaluated_ = false;
+}
+
+void AnimationManager::evaluate_node(const AnimationNodeHandle node)
+{
+  if (node_classes_[node] == kStaticNode || world_frames_[node] == frame_) {
+    return;
+  }
+
+  const AnimationNodeHandle parent = parents_[node];
+  if (parent != kInvalidAnimationNode) {
+    evaluate_node(parent);
+  }
+  if (node_classes_[node] == kAnimatedNode) {
+    sample_local_transform(time_, node);
+  }
+  compose_world_transforms(&world_[0], &local_pos_[0], &local_rot_[0], &local_scale_[0], &parents_[0], node, node + 1);
+  world_frames_[node] = frame_;
+}
+
+const D3DXMATRIX& AnimationManager::evaluate_transform(const AnimationNodeHandle node)
+{
+  if (!classified_) {
+    classify_nodes();
+  }
+  evaluate_node(node);
+  return world_[node];
+}
+
+const D3DXMATRIX& AnimationManager::world_transform(const AnimationNodeHandle node) const
+{
+  SUPER_ASSERT(frame_ > 0 && (node_classes_[node] == kStaticNode || world_frames_[node] == frame_));
+  return world_[node];
 }
 
-void AnimationManager::update_transforms_inner(const uint32_t time, AnimationNode* node, const D3DXMATRIX& parent_transform)
+AnimationNodeHandle AnimationManager::find_node(const std::string& node_name) const
 {
-  D3DXMATRIX transform;
-  calc_transform_at_time(transform, time, node);
-  node->set_transform(transform);
-  for (uint32_t i = 0; i < node->num_children(); ++i) {
-    update_transforms_inner(time, node->child(i).get(), transform);
+  NodeIndex::const_iterator it = node_index_.find(node_name);
+  if (it == node_index_.end()) {
+    LOG_WARNING_LN_ONESHOT("[%s] Node: %s not found", __FUNCTION__, node_name.c_str());
+    return kInvalidAnimationNode;
   }
+  return it->second;
+}
+
+AnimationNodeSPtr AnimationManager::find_node_by_name(const std::string& node_name) const
+{
+  NodeIndex::const_iterator it = node_index_.find(node_name);
+  return it == node_index_.end() ? AnimationNodeSPtr() : nodes_[it->second];
 }
 
-void AnimationManager::update_transforms(const uint32_t time)
+void AnimationManager::sample_animated(const uint32_t time_in_ms, const uint32_t begin, const uint32_t end)
 {
+  for (uint32_t i = begin; i < end; ++i) {
+    sample_local_transform(time_in_ms, animated_nodes_[i]);
+  }
+}
+
+void AnimationManager::compose_batches(const uint32_t begin, const uint32_t end)
+{
+  const uint32_t first = dirty_batch_starts_[begin];
+  const uint32_t last = end < dirty_batch_starts_.size() ? dirty_batch_starts_[end] : dirty_nodes_.size();
+  if (first == last) {
+    return;
+  }
+
+  compose_world_transforms_indexed(&world_[0], &local_pos_[0], &local_rot_[0], &local_scale_[0], &parents_[0], &dirty_nodes_[first], last - first);
+  for (uint32_t i = first; i < last; ++i) {
+    world_frames_[dirty_nodes_[i]] = frame_;
+  }
+}
+
+void AnimationManager::update_transforms(const uint32_t time, ThreadPool* pool)
+{
+  if (!classified_) {
+    classify_nodes();
+  } else if (lods_changed_) {
+    build_update_lists();
+  }
+
+  // nothing moves if the time doesn't
   const uint32_t local_time = get_looped_time(time);
+  if (evaluated_ && local_time == time_) {
+    return;
+  }
+  evaluated_ = true;
+  time_ = local_time;
+  ++frame_;
+
+  if (time > update_time_) {
+    frame_delta_ = std::min<uint32_t>(time - update_time_, kMaxLodFrameDelta);
+  }
+  update_time_ = time;
+
+  const uint32_t num_animated = animated_nodes_.size();
+  const uint32_t num_batches = dirty_batch_starts_.size();
+  if (pool == NULL || num_animated < kMinParallelNodes) {
+    sample_animated(local_time, 0, num_animated);
+    compose_batches(0, num_batches);
+  } else {
+    // The tracks are independent, so they're sampled in even chunks, and then composed per batch, which
+    // may be serial for a single big rig
+    pool->parallel_for(num_animated, kAnimationGrainSize, boost::bind(&AnimationManager::sample_animated, this, local_time, _1, _2));
+    pool->parallel_for(num_batches, 1, boost::bind(&AnimationManager::compose_batches, this, _1, _2));
+  }
+
+  update_lod_instances(time);
+}
+
+void AnimationManager::update_lod_instances(const uint32_t time)
+{
+  const uint32_t count = lod_instances_.size();
+  uint32_t budget = lod_budget_;
+  uint32_t next_cursor = lod_cursor_;
+  lod_requests_.clear();
+  for (uint32_t i = 0; i < count; ++i) {
+    const uint32_t idx = (lod_cursor_ + i) % count;
+    LodInstance& instance = lod_instances_[idx];
+    const bool due = !instance.valid || time >= instance.to.time_in_ms || time < instance.from.time_in_ms;
+    // a node that hasn't been evaluated yet has nothing to hold, so it doesn't wait for the budget
+    if (due && (budget > 0 || !instance.valid)) {
+      lod_requests_.push_back(std::make_pair(begin_lod_refresh(instance, time), idx));
+      budget = budget > 0 ? budget - 1 : 0;
+      next_cursor = (idx + 1) % count;
+    }
+  }
+  lod_cursor_ = budget == 0 ? next_cursor : 0;
+
+  // the instances evaluated at the same time share the work on their common ancestors
+  std::sort(lod_requests_.begin(), lod_requests_.end());
+  for (uint32_t begin = 0, end = 0; begin < lod_requests_.size(); begin = end) {
+    while (end < lod_requests_.size() && lod_requests_[end].first == lod_requests_[begin].first) {
+      ++end;
+    }
+    evaluate_lod_targets(begin, end);
+  }
+
+  D3DXVECTOR3 pos, scale;
+  D3DXQUATERNION rot;
+  for (uint32_t i = 0; i < count; ++i) {
+    const LodInstance& instance = lod_instances_[i];
+    lod_pose(instance, time, pos, rot, scale);
+    D3DXMatrixTransformation(&world_[instance.node], &kVec3Zero, &kQuatId, &scale, &kVec3Zero, &rot, &pos);
+    world_frames_[instance.node] = frame_;
+  }
+}
+
+uint32_t AnimationManager::begin_lod_refresh(LodInstance& instance, const uint32_t time)
+{
+  // Time is deterministic, so the next pose is evaluated when it's expected to be needed, and the
+  // node is interpolated towards it. Playing on from the previous target saves an evaluation.
+  // Returns the time to evaluate at.
+  const uint32_t interval = frame_delta_ << lods_[instance.node];
+  if (instance.valid && time >= instance.to.time_in_ms && time < instance.to.time_in_ms + interval) {
+    instance.from = instance.to;
+    return instance.from.time_in_ms + interval;
+  }
+
+  // nothing to go on from, or the time jumped, so the node snaps to its current pose, and goes on
+  // from there next frame
+  instance.valid = false;
+  instance.from.time_in_ms = time;
+  return time;
+}
+
+void AnimationManager::evaluate_lod_targets(const uint32_t begin, const uint32_t end)
+{
+  // evaluates the requested nodes and their ancestors at the same time, without touching the shared state
+  const uint32_t target_time = lod_requests_[begin].first;
+  if (++lod_stamp_ == 0) {
+    std::fill(lod_stamps_.begin(), lod_stamps_.end(), 0);
+    lod_stamp_ = 1;
+  }
+
+  // walk up until an ancestor that's already in, or a static one, which already has its world transform
+  lod_chain_.clear();
+  for (uint32_t i = begin; i < end; ++i) {
+    for (AnimationNodeHandle node = lod_instances_[lod_requests_[i].second].node;
+      node != kInvalidAnimationNode && lod_stamps_[node] != lod_stamp_; node = parents_[node]) {
+      lod_stamps_[node] = lod_stamp_;
+      if (node_classes_[node] == kStaticNode) {
+        lod_world_[node] = world_[node];
+        break;
+      }
+      lod_chain_.push_back(node);
+    }
+  }
+
+  // parents come first, so the chains are composed in a single pass
+  std::sort(lod_chain_.begin(), lod_chain_.end());
+  const uint32_t time_in_ms = get_looped_time(target_time);
+  for (size_t i = 0; i < lod_chain_.size(); ++i) {
+    const uint32_t node = lod_chain_[i];
+    if (node_classes_[node] == kAnimatedNode) {
+      uint32_t cursor = cursors_[node];
+      sample_track(track(node), time_in_ms, cursor, lod_pos_[node], lod_rot_[node], lod_scale_[node]);
+    } else {
+      lod_pos_[node] = local_pos_[node];
+      lod_rot_[node] = local_rot_[node];
+      lod_scale_[node] = local_scale_[node];
+    }
+  }
+  compose_world_transforms_indexed(&lod_world_[0], &lod_pos_[0], &lod_rot_[0], &lod_scale_[0], &parents_[0], &lod_chain_[0], lod_chain_.size());
+
+  for (uint32_t i = begin; i < end; ++i) {
+    LodInstance& instance = lod_instances_[lod_requests_[i].second];
+    D3DXMatrixDecompose(&instance.to.scale, &instance.to.rot, &instance.to.pos, &lod_world_[instance.node]);
+    instance.to.time_in_ms = target_time;
+    if (!instance.valid) {
+      instance.from = instance.to;
+      instance.valid = true;
+    }
+  }
+}
+
+void AnimationManager::lod_pose(const LodInstance& instance, const uint32_t time, D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale) const
+{
+  const uint32_t from_time = instance.from.time_in_ms;
+  const uint32_t to_time = instance.to.time_in_ms;
+  const float ratio = to_time > from_time ? std::min<float>(1, std::max<float>(0, ((float)time - from_time) / (to_time - from_time))) : 1;
+  interpolate_keys(instance.from, instance.to, ratio, pos, rot, scale);
+}
 
-  for (uint32_t i = 0; i < root_.size(); ++i) {
-    update_transforms_inner(local_time, root_[i].get(), kMtxId);
+uint32_t select_animation_lod(const float screen_radius, const bool visible)
+{
+  if (!visible) {
+    return kMaxAnimationLod;
+  }
+  uint32_t lod = 0;
+  while (lod < kMaxAnimationLod && screen_radius < kLodScreenRadius[lod]) {
+    ++lod;
+  }
+  return lod;
+}
+
+void update_animations(AnimationManager* const* managers, const uint32_t count, const uint32_t time, ThreadPool* pool)
+{
+  if (pool != NULL && count > pool->num_threads()) {
+    pool->parallel_for(count, 1, boost::bind(&update_manager_range, managers, time, _1, _2));
+    return;
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    managers[i]->update_transforms(time, pool);
+  }
+}
+
+std::vector<AnimationBenchmark> benchmark_animation(const uint32_t max_threads, const uint32_t iterations)
+{
+  // every node gets the same 2 second clip, with rigs of 32 nodes. Each rig is a chain off its root
+  const uint32_t kNodesPerRig = 32;
+  const uint32_t kNumManagers = 64;
+  AnimationKeys keys;
+  for (uint32_t i = 0; i <= 60; ++i) {
+    const float t = i / 30.0f;
+    D3DXQUATERNION rot;
+    D3DXQuaternionRotationYawPitchRoll(&rot, t, 0.5f * t, 0);
+    keys.push_back(AnimationKey(i * 33, D3DXVECTOR3(sinf(t), cosf(t), t), rot, kVec3One));
+  }
+  CompressedTrack track;
+  AnimationCompressionStats stats;
+  compress_track(track, stats, keys, AnimationCompressionSettings());
+
+  std::vector<AnimationBenchmark> results;
+  for (uint32_t num_nodes = 1024; num_nodes <= 64 * 1024; num_nodes *= 4) {
+    AnimationManager single;
+    single.end_time_ = 2000;
+    std::vector< boost::shared_ptr<AnimationManager> > many(kNumManagers);
+    std::vector<AnimationManager*> managers(kNumManagers);
+    for (uint32_t i = 0; i < kNumManagers; ++i) {
+      many[i].reset(new AnimationManager());
+      many[i]->end_time_ = 2000;
+      managers[i] = many[i].get();
+    }
+
+    for (uint32_t i = 0; i < num_nodes; ++i) {
+      AnimationManager* m = managers[i * kNumManagers / num_nodes];
+      const AnimationNodeHandle parent = m->nodes_.empty() || i % kNodesPerRig == 0 ? kInvalidAnimationNode : m->nodes_.size() - 1;
+      single.add_node("node", i % kNodesPerRig == 0 ? kInvalidAnimationNode : i - 1);
+      m->add_node("node", parent);
+    }
+    single.set_clip(AnimationClipSPtr(new AnimationClip(single.parents_, std::vector<CompressedTrack>(num_nodes, track), 2000)));
+    // the small managers all have the same hierarchy, so they share a clip
+    const AnimationClipSPtr shared_clip(new AnimationClip(managers[0]->parents_,
+      std::vector<CompressedTrack>(managers[0]->nodes_.size(), track), 2000));
+    for (uint32_t i = 0; i < kNumManagers; ++i) {
+      managers[i]->set_clip(shared_clip);
+    }
+
+    for (uint32_t num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+      // the calling thread helps out, so the pool has one thread less
+      boost::scoped_ptr<ThreadPool> pool(num_threads > 1 ? new ThreadPool(num_threads - 1) : NULL);
+      AnimationBenchmark result;
+      result.num_nodes = num_nodes;
+      result.num_threads = num_threads;
+      LARGE_INTEGER start, end;
+
+      QueryPerformanceCounter(&start);
+      for (uint32_t it = 0; it < iterations; ++it) {
+        single.update_transforms(it * 16);
+      }
+      QueryPerformanceCounter(&end);
+      result.serial_ms = elapsed_ms(start, end) / iterations;
+
+      QueryPerformanceCounter(&start);
+      for (uint32_t it = 0; it < iterations; ++it) {
+        single.update_transforms(it * 16, pool.get());
+      }
+      QueryPerformanceCounter(&end);
+      result.parallel_ms = elapsed_ms(start, end) / iterations;
+
+      QueryPerformanceCounter(&start);
+      for (uint32_t it = 0; it < iterations; ++it) {
+        update_animations(&managers[0], kNumManagers, it * 16, NULL);
+      }
+      QueryPerformanceCounter(&end);
+      result.many_serial_ms = elapsed_ms(start, end) / iterations;
+
+      QueryPerformanceCounter(&start);
+      for (uint32_t it = 0; it < iterations; ++it) {
+        update_animations(&managers[0], kNumManagers, it * 16, pool.get());
+      }
+      QueryPerformanceCounter(&end);
+      result.many_parallel_ms = elapsed_ms(start, end) / iterations;
+
+      LOG_INFO_LN("animation: %d nodes, %d threads. single: %.3f -> %.3f ms, %d managers: %.3f -> %.3f ms",
+        num_nodes, num_threads, result.serial_ms, result.parallel_ms, kNumManagers, result.many_serial_ms, result.many_parallel_ms);
+      results.push_back(result);
+    }
   }
+  return results;
 }
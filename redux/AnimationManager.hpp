@@ -4,36 +4,165 @@
 #include "AnimationNode.hpp"
 #include "ReduxTypes.hpp"
 
+class ThreadPool;
+struct AnimationBenchmark;
+
 class AnimationManager 
 {
   friend class ReduxLoader;
+  friend std::vector<AnimationBenchmark> benchmark_animation(const uint32_t max_threads, const uint32_t iterations);
 public:
   AnimationManager();
   ~AnimationManager();
 
   void add_animation_keys(const std::string& name, const AnimationKeys& keys);
-  void update_transforms(const uint32_t time);
+  // If pool isn't NULL, large hierarchies are sampled and composed in parallel
+  void update_transforms(const uint32_t time, ThreadPool* pool = NULL);
 
   void get_transform_for_node(D3DXMATRIX& mtx, const std::string& node_name);
   void get_transform_for_node(D3DXVECTOR3& pos, const std::string& node_name);
   void get_transform_for_node(D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale, const std::string& node_name);
 
+  // the get_transform_for_node functions evaluate the node first if update_transforms didn't
+  AnimationNodeHandle find_node(const std::string& node_name) const;
+  void get_transform_for_node(D3DXMATRIX& mtx, const AnimationNodeHandle node);
+  void get_transform_for_node(D3DXVECTOR3& pos, const AnimationNodeHandle node);
+  void get_transform_for_node(D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale, const AnimationNodeHandle node);
+  // The world transform as of the last update_transforms. Nothing is evaluated, so it's safe to call
+  // from other threads, but the node must be one update_transforms evaluates, like a required node.
+  const D3DXMATRIX& world_transform(const AnimationNodeHandle node) const;
+
+  // Marks a node whose transform is read every frame, like a mesh's. update_transforms only evaluates the
+  // required nodes and their ancestors, or every node if none are required. The rest are evaluated
+  // when they're asked for.
+  void require_node(const AnimationNodeHandle node);
+
+  // A required node at lod > 0 is only evaluated every 2^lod frames, a bit ahead of time, and its world
+  // transform is interpolated in between. Its ancestors are left to the nodes that need them at full rate.
+  // The changes are applied together by the next update_transforms.
+  void set_node_lod(const AnimationNodeHandle node, const uint32_t lod);
+  // the most reduced rate nodes to evaluate per frame. The rest hold their last transform until there's room
+  void set_lod_budget(const uint32_t max_updates) { lod_budget_ = max_updates; }
+
+  // the clip being played, which may be shared with other managers and AnimationCrowds
+  const AnimationClipSPtr& clip() const { return clip_; }
+
+  // the loader compresses the tracks with these, so they have to be set before loading
+  const AnimationCompressionSettings& compression_settings() const { return compression_settings_; }
+  void set_compression_settings(const AnimationCompressionSettings& settings) { compression_settings_ = settings; }
+
 private:
+  // Static nodes have at most one key, and static ancestors, so they're only evaluated once. Constant
+  // nodes have at most one key, but an animated ancestor, so they're only composed.
+  enum NodeClass { kStaticNode, kConstantNode, kAnimatedNode };
+
+  // The world space poses a reduced rate node is interpolated between, as scale, rotation and
+  // translation, so the rotation stays a rotation in between. time_in_ms is when each pose is for.
+  struct LodInstance
+  {
+    LodInstance(const AnimationNodeHandle node) : node(node), valid(false) { from.time_in_ms = to.time_in_ms = 0; }
+    AnimationNodeHandle node;
+    bool valid;
+    AnimationKey from;
+    AnimationKey to;
+  };
+
+  AnimationNodeHandle add_node(const std::string& name, const AnimationNodeHandle parent);
+  // the clip must have the same hierarchy as the manager
+  void set_clip(const AnimationClipSPtr& clip);
+  const CompressedTrack& track(const AnimationNodeHandle node) const;
   AnimationNodeSPtr find_node_by_name(const std::string& node_name) const;
-  AnimationNodeSPtr find_node_by_name_inner(const std::string& node_name, const AnimationNodeSPtr& cur) const;
-  void calc_transform_at_time(D3DXMATRIX& mtx, const uint32_t time_in_ms, const std::string& name);
-  void calc_transform_at_time(D3DXMATRIX& mtx, const uint32_t time_in_ms, AnimationNode* node);
-  void update_transforms_inner(const uint32_t time, AnimationNode* node, const D3DXMATRIX& parent_transform);
+  void sample_local_transform(const uint32_t time_in_ms, const AnimationNodeHandle node);
+  void classify_nodes();
+  void build_update_lists();
+  void evaluate_node(const AnimationNodeHandle node);
+  const D3DXMATRIX& evaluate_transform(const AnimationNodeHandle node);
+  void sample_animated(const uint32_t time_in_ms, const uint32_t begin, const uint32_t end);
+  void compose_batches(const uint32_t begin, const uint32_t end);
+  void update_lod_instances(const uint32_t time);
+  uint32_t begin_lod_refresh(LodInstance& instance, const uint32_t time);
+  void evaluate_lod_targets(const uint32_t begin, const uint32_t end);
+  void lod_pose(const LodInstance& instance, const uint32_t time, D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale) const;
 
-  const AnimationKeys& get_keys_for_node(const std::string& node_name) const;
   uint32_t get_looped_time(const uint32_t time_in_ms) const;
-  bool keys_at_time(AnimationKey& cur, AnimationKey& next, float& delta, const AnimationKeys& keys, const uint32_t time_in_ms);
+  bool keys_at_time(uint32_t& cur, float& ratio, const CompressedTrack& track, uint32_t& cursor, const uint32_t time_in_ms) const;
+
+  // All the per node arrays are indexed by handle, and sorted so a node's parent comes before it. The
+  // hot data touched by every update is kept apart from the names.
+  std::vector<AnimationNodeHandle> parents_;
+  std::vector<D3DXVECTOR3> local_pos_;
+  std::vector<D3DXQUATERNION> local_rot_;
+  std::vector<D3DXVECTOR3> local_scale_;
+  std::vector<D3DXMATRIX> world_;
+  std::vector<uint32_t> cursors_;     // the key each track was at last update
 
-  std::vector<AnimationNodeSPtr> root_;
+  // First node of each batch of whole subtrees. No node's parent is in another batch, so the batches can
+  // be composed independently.
+  std::vector<uint32_t> batch_starts_;
+
+  std::vector<uint8_t> node_classes_;
+  std::vector<uint8_t> required_;
+  std::vector<uint32_t> world_frames_;        // the frame each world transform was last computed
+  // the nodes update_transforms samples and composes, and where each batch starts in dirty_nodes_
+  std::vector<uint32_t> animated_nodes_;
+  std::vector<uint32_t> dirty_nodes_;
+  std::vector<uint32_t> dirty_batch_starts_;
+  std::vector<uint8_t> lods_;
+  std::vector<LodInstance> lod_instances_;
+  uint32_t lod_budget_;
+  uint32_t lod_cursor_;       // where the next frame starts refreshing, so nothing starves when over budget
+  // The instances refreshed this frame, by the time they're evaluated at, and the scratch to evaluate
+  // them in. The ancestors a group shares are stamped, so they're only evaluated once.
+  std::vector< std::pair<uint32_t, uint32_t> > lod_requests_;
+  std::vector<uint32_t> lod_chain_;
+  std::vector<uint32_t> lod_stamps_;
+  uint32_t lod_stamp_;
+  std::vector<D3DXVECTOR3> lod_pos_;
+  std::vector<D3DXQUATERNION> lod_rot_;
+  std::vector<D3DXVECTOR3> lod_scale_;
+  std::vector<D3DXMATRIX> lod_world_;
+  uint32_t update_time_;
+  uint32_t frame_delta_;
+  bool classified_;
+  bool lods_changed_;
+  bool any_required_;
+  bool evaluated_;
+  uint32_t frame_;
+  uint32_t time_;
+
+  std::vector<AnimationNodeSPtr> nodes_;
+  typedef stdext::hash_map<std::string, AnimationNodeHandle> NodeIndex;
+  NodeIndex node_index_;
+
+  AnimationClipSPtr clip_;
   bool loop_animations_;
   uint32_t fps_;
   uint32_t start_time_;
   uint32_t end_time_;
+  AnimationCompressionSettings compression_settings_;
 };
 
+// The lod for an object covering screen_radius of the viewport height. Objects that aren't visible get the lowest rate.
+uint32_t select_animation_lod(const float screen_radius, const bool visible);
+
+// Updates a set of managers, like one per renderable. Many small managers are spread over the pool a
+// manager per task, while a few big ones are each updated in parallel.
+void update_animations(AnimationManager* const* managers, const uint32_t count, const uint32_t time, ThreadPool* pool);
+
+struct AnimationBenchmark
+{
+  AnimationBenchmark() : num_nodes(0), num_threads(0), serial_ms(0), parallel_ms(0), many_serial_ms(0), many_parallel_ms(0) {}
+  uint32_t num_nodes;
+  uint32_t num_threads;     // including the calling thread
+  double serial_ms;
+  double parallel_ms;
+  // the same number of nodes, split over 64 managers
+  double many_serial_ms;
+  double many_parallel_ms;
+};
+
+// Updates synthetic hierarchies of 1k to 64k nodes, with 1 to max_threads threads. Doesn't need a
+// device, so it can run headless.
+std::vector<AnimationBenchmark> benchmark_animation(const uint32_t max_threads, const uint32_t iterations);
+
 #endif // #ifndef ANIMATION_MANAGER_HPP
@@ -1,54 +1,27 @@
 #include "StdAfx.h"
 #include "AnimationNode.hpp"
+#include "AnimationManager.hpp"
 
-AnimationNode::AnimationNode(const std::string& name) 
+AnimationNode::AnimationNode(const std::string& name, const AnimationManager* manager, const AnimationNodeHandle handle) 
   : name_(name) 
-  , pos_(kVec3Zero)
-  , rot_(kQuatId)
-  , scale_(kVec3One)
-  , transform_(kMtxId)
+  , manager_(manager)
+  , handle_(handle)
 {
 }
 
 AnimationNode::~AnimationNode()
 {
-  children_.clear();
-}
-/*
-AnimationNodeSPtr AnimationNode::find_node_by_name(const std::string& node_name)
-{
-  if (node_name == name_) {
-    return this;
-  }
-
-  for (uint32_t i = 0; i < children_.size(); ++i) {
-    if (AnimationNode* result = children_[i]->find_node_by_name(node_name)) {
-      return result;
-    }
-  }
-
-  return NULL;
-}
-*/
-void AnimationNode::pos_rot_scale(D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale) const
-{
-  pos = pos_;
-  rot = rot_;
-  scale = scale_;
 }
 
-void AnimationNode::set_pos_rot_scale(const D3DXVECTOR3& pos, const D3DXQUATERNION& rot, const D3DXVECTOR3& scale)
+const D3DXMATRIX& AnimationNode::transform() const
 {
-  pos_ = pos;
-  rot_ = rot;
-  scale_ = scale;
-  D3DXMatrixTransformation(&transform_, &kVec3Zero, &kQuatId, &scale, &kVec3Zero, &rot, &pos);
+  return manager_->world_transform(handle_);
 }
 
-void AnimationNode::set_transform(const D3DXMATRIX& transform)
+void AnimationNode::pos_rot_scale(D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale) const
 {
-  transform_ = transform;
-  pos_ = get_translation(transform);
-  D3DXQuaternionRotationMatrix(&rot_, &transform);
-  scale_ = get_scale(transform);
+  const D3DXMATRIX& transform = manager_->world_transform(handle_);
+  pos = get_translation(transform);
+  D3DXQuaternionRotationMatrix(&rot, &transform);
+  scale = get_scale(transform);
 }
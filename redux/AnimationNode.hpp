@@ -2,6 +2,7 @@
 #define ANIMATION_NODE_HPP
 
 #include "ReduxTypes.hpp"
+#include "AnimationCompression.hpp"
 
 struct AnimationKey
 {
@@ -16,32 +17,31 @@ struct AnimationKey
 
 typedef std::vector<AnimationKey> AnimationKeys;
 
+class AnimationManager;
+
+/**
+ * The cold half of a node, its name. The transforms live in the AnimationManager's arrays, sorted so
+ * parents come before their children, and are updated in a single linear pass. The tracks are in the
+ * manager's clip.
+ */
 class AnimationNode
 {
   friend class ReduxLoader;
   friend class AnimationManager;
 public:
-  AnimationNode(const std::string& name);
+  AnimationNode(const std::string& name, const AnimationManager* manager, const AnimationNodeHandle handle);
   ~AnimationNode();
 
   const std::string& name() { return name_; }
-  const AnimationKeys& keys() const { return keys_; }
-  D3DXMATRIX transform() const { return transform_; }
-  void set_transform(const D3DXMATRIX& mtx);
-  void pos_rot_scale(D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale) const;
-  void set_pos_rot_scale(const D3DXVECTOR3& pos, const D3DXQUATERNION& rot, const D3DXVECTOR3& scale);
+  AnimationNodeHandle handle() const { return handle_; }
 
-  const uint32_t num_children() const { return children_.size(); }
-  AnimationNodeSPtr child(const uint32_t idx) { return children_[idx]; }
-  //AnimationNodeSPtr find_node_by_name(const std::string& node_name);
+  // world transform, as of the last update_transforms. Doesn't evaluate anything (see AnimationManager::world_transform)
+  const D3DXMATRIX& transform() const;
+  void pos_rot_scale(D3DXVECTOR3& pos, D3DXQUATERNION& rot, D3DXVECTOR3& scale) const;
 private:
-  D3DXVECTOR3 pos_;
-  D3DXQUATERNION rot_;
-  D3DXVECTOR3 scale_;
-  D3DXMATRIX transform_;
   std::string name_;
-  std::vector<AnimationNodeSPtr> children_;
-  AnimationKeys keys_;
+  const AnimationManager* manager_;
+  AnimationNodeHandle handle_;
 };
 
 #endif // #ifndef ANIMATION_NODE_HPP
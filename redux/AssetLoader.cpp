@@ -0,0 +1,64 @@
+#include "stdafx.h"
+#include "AssetLoader.hpp"
+
+FileBuffer read_file(const std::string& filename)
+{
+  FILE* file = NULL;
+  if (fopen_s(&file, filename.c_str(), "rb") != 0 || file == NULL) {
+    throw std::runtime_error(to_string("unable to load file: %s", filename.c_str()));
+  }
+
+  fseek(file, 0, SEEK_END);
+  const long len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  FileBuffer buf(len);
+  const size_t read = len > 0 ? fread(&buf[0], 1, len, file) : 0;
+  fclose(file);
+
+  if (read != (size_t)len) {
+    throw std::runtime_error(to_string("error reading file: %s", filename.c_str()));
+  }
+
+  return buf;
+}
+
+AssetLoader::AssetLoader(ThreadPool* pool)
+  : pool_(pool)
+{
+}
+
+Future<FileBuffer> AssetLoader::read_file_async(const std::string& filename)
+{
+  return pool_->submit<FileBuffer>(boost::bind(&read_file, filename));
+}
+
+bool AssetLoader::process_finalizers()
+{
+  // finalizers are run in the order they were added, but a pending one doesn't block the ones after it
+  for (size_t i = 0; i < finalizers_.size(); ) {
+    // copy it, as the finalizer is allowed to add new finalizers
+    const Finalizer finalizer(finalizers_[i]);
+    bool done = true;
+    try {
+      done = finalizer();
+    } catch (std::exception& e) {
+      LOG_WARNING_LN("[%s] load failed: %s", __FUNCTION__, e.what());
+    }
+
+    if (done) {
+      finalizers_.erase(finalizers_.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+
+  return finalizers_.empty();
+}
+
+void AssetLoader::flush()
+{
+  while (!process_finalizers()) {
+    Sleep(0);
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef ASSET_LOADER_HPP
+#define ASSET_LOADER_HPP
+
+#include "ThreadPool.hpp"
+
+typedef std::vector<uint8_t> FileBuffer;
+
+// reads the whole file, and throws if it can't be opened
+FileBuffer read_file(const std::string& filename);
+
+/**
+ * Runs file io and decoding on the thread pool, and hands the results back to the main thread
+ * for the final (device dependent) buffer and texture creation. The owner calls process_finalizers()
+ * once per frame from the render thread, which runs the finalizers whose futures are ready.
+ * Finalizers may only be added from the main thread.
+ */
+class AssetLoader : boost::noncopyable
+{
+public:
+  AssetLoader(ThreadPool* pool = &ThreadPool::instance());
+
+  Future<FileBuffer> read_file_async(const std::string& filename);
+
+  template<typename T>
+  Future<T> submit(const boost::function<T ()>& fn)
+  {
+    return pool_->submit<T>(fn);
+  }
+
+  template<typename T>
+  void add_finalizer(const Future<T>& future, const boost::function<void (T&)>& fn)
+  {
+    finalizers_.push_back(boost::bind(&AssetLoader::try_finalize<T>, future, fn));
+  }
+
+  // runs all the ready finalizers. Returns true if there is nothing left to finalize
+  bool process_finalizers();
+
+  // blocks until all outstanding jobs are done, and finalizes them
+  void flush();
+
+  bool is_idle() const { return finalizers_.empty(); }
+
+private:
+  typedef boost::function<bool ()> Finalizer;
+
+  template<typename T>
+  static bool try_finalize(const Future<T>& future, const boost::function<void (T&)>& fn)
+  {
+    if (!future.is_ready()) {
+      return false;
+    }
+    fn(future.get());
+    return true;
+  }
+
+  ThreadPool* pool_;
+  std::vector<Finalizer> finalizers_;
+};
+
+#endif // #ifndef ASSET_LOADER_HPP
@@ -0,0 +1,24 @@
+#include "stdafx.h"
+#include "Benchmarks.hpp"
+#include "ThreadPool.hpp"
+#include "Skinning.hpp"
+#include "M2Particles.hpp"
+#include "BlockCompression.hpp"
+#include "TransformHierarchy.hpp"
+#include "AnimationManager.hpp"
+#include "AnimationClip.hpp"
+#include "SphereCulling.hpp"
+
+void run_benchmarks(ThreadPool* pool)
+{
+  const uint32_t num_threads = pool ? pool->num_threads() + 1 : 1;
+  LOG_INFO_LN("running benchmarks with %d threads", num_threads);
+
+  benchmark_skinning(64, 2048, 64, 10, pool);
+  benchmark_particles(256, 100, pool);
+  benchmark_compression(100000, 10, pool);
+  benchmark_transforms(10000, 100);
+  benchmark_animation(num_threads, 20);
+  benchmark_crowd(1000, 20, pool);
+  benchmark_culling(100000, 20);
+}
@@ -0,0 +1,10 @@
+#ifndef BENCHMARKS_HPP
+#define BENCHMARKS_HPP
+
+class ThreadPool;
+
+// Runs every kernel benchmark with its default sizes, logging the results. None of them need a device,
+// so this can run before the system is created.
+void run_benchmarks(ThreadPool* pool);
+
+#endif // #ifndef BENCHMARKS_HPP
@@ -0,0 +1,439 @@
+#include "stdafx.h"
+#include "BlockCompression.hpp"
+#include "Utils.hpp"
+#include "ThreadPool.hpp"
+#include <emmintrin.h>
+
+namespace
+{
+  const uint32_t kStreamId = 'B' | ('L' << 8) | ('K' << 16) | ('Z' << 24);
+  // the top bit of a block size is set if the block is stored uncompressed
+  const uint32_t kStoredBlock = 0x80000000;
+
+  const uint32_t kMinMatch = 4;
+  const uint32_t kMaxOffset = 0xffff;
+  const uint32_t kHashBits = 14;
+
+  uint32_t read32(const uint8_t* p)
+  {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  uint32_t hash32(const uint32_t v)
+  {
+    return (v * 2654435761U) >> (32 - kHashBits);
+  }
+
+  void write_length(std::vector<uint8_t>& dst, uint32_t len)
+  {
+    while (len >= 255) {
+      dst.push_back(255);
+      len -= 255;
+    }
+    dst.push_back((uint8_t)len);
+  }
+
+  bool read_length(const uint8_t*& ip, const uint8_t* end, uint32_t& len)
+  {
+    uint8_t b;
+    do {
+      if (ip == end) {
+        return false;
+      }
+      b = *ip++;
+      len += b;
+    } while (b == 255);
+    return true;
+  }
+
+  // A sequence is a token, literals, and a match. The last sequence of a block has no match
+  void write_sequence(std::vector<uint8_t>& dst, const uint8_t* literals, const uint32_t num_literals,
+    const uint32_t offset, const uint32_t match_len)
+  {
+    const uint32_t lit_code = std::min<uint32_t>(num_literals, 15);
+    const uint32_t match_code = match_len ? std::min<uint32_t>(match_len - kMinMatch, 15) : 0;
+    dst.push_back((uint8_t)(lit_code << 4 | match_code));
+    if (lit_code == 15) {
+      write_length(dst, num_literals - 15);
+    }
+    dst.insert(dst.end(), literals, literals + num_literals);
+    if (match_len) {
+      dst.push_back((uint8_t)(offset & 0xff));
+      dst.push_back((uint8_t)(offset >> 8));
+      if (match_code == 15) {
+        write_length(dst, match_len - kMinMatch - 15);
+      }
+    }
+  }
+
+  // greedy lz, with a hash of the last position each 4 byte sequence was seen at
+  void lz_compress(const uint8_t* src, const uint32_t size, std::vector<uint8_t>& dst)
+  {
+    std::vector<int32_t> table(1 << kHashBits, -1);
+    uint32_t anchor = 0;
+    uint32_t ip = 0;
+    while (ip + kMinMatch <= size) {
+      const uint32_t cur = read32(src + ip);
+      const uint32_t h = hash32(cur);
+      const int32_t ref = table[h];
+      table[h] = ip;
+      if (ref < 0 || ip - ref > kMaxOffset || read32(src + ref) != cur) {
+        ++ip;
+        continue;
+      }
+
+      uint32_t len = kMinMatch;
+      while (ip + len < size && src[ref + len] == src[ip + len]) {
+        ++len;
+      }
+      write_sequence(dst, src + anchor, ip - anchor, ip - ref, len);
+      ip += len;
+      anchor = ip;
+    }
+    write_sequence(dst, src + anchor, size - anchor, 0, 0);
+  }
+
+  bool lz_decompress(const uint8_t* src, const uint32_t src_size, uint8_t* dst, const uint32_t dst_size)
+  {
+    const uint8_t* ip = src;
+    const uint8_t* ip_end = src + src_size;
+    uint8_t* op = dst;
+    uint8_t* op_end = dst + dst_size;
+
+    while (ip < ip_end) {
+      const uint8_t token = *ip++;
+      uint32_t num_literals = token >> 4;
+      if (num_literals == 15 && !read_length(ip, ip_end, num_literals)) {
+        return false;
+      }
+      if (num_literals > (uint32_t)(ip_end - ip) || num_literals > (uint32_t)(op_end - op)) {
+        return false;
+      }
+      memcpy(op, ip, num_literals);
+      ip += num_literals;
+      op += num_literals;
+
+      if (ip == ip_end) {
+        break;
+      }
+
+      if (ip_end - ip < 2) {
+        return false;
+      }
+      const uint32_t offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      uint32_t match_len = token & 15;
+      if (match_len == 15 && !read_length(ip, ip_end, match_len)) {
+        return false;
+      }
+      match_len += kMinMatch;
+      if (offset == 0 || offset > (uint32_t)(op - dst) || match_len > (uint32_t)(op_end - op)) {
+        return false;
+      }
+      // An overlapping match repeats the last offset bytes. Everything written so far is a whole number
+      // of repeats, so the copies can double in size without overlapping
+      const uint8_t* match = op - offset;
+      for (uint32_t copied = 0; copied < match_len; ) {
+        const uint32_t n = std::min(copied + offset, match_len - copied);
+        memcpy(op + copied, match, n);
+        copied += n;
+      }
+      op += match_len;
+    }
+    return op == op_end;
+  }
+
+  void apply_filters(const uint8_t* src, const uint32_t size, const uint32_t stride, const uint32_t filters, uint8_t* dst)
+  {
+    const uint32_t num_elems = size / stride;
+    if (filters & kFilterShuffle) {
+      for (uint32_t b = 0; b < stride; ++b) {
+        for (uint32_t i = 0; i < num_elems; ++i) {
+          dst[b * num_elems + i] = src[i * stride + b];
+        }
+      }
+      // a trailing partial element is left as is
+      memcpy(dst + num_elems * stride, src + num_elems * stride, size - num_elems * stride);
+    } else {
+      memcpy(dst, src, size);
+    }
+
+    if (filters & kFilterDelta) {
+      // after the shuffle, the same byte of consecutive elements is adjacent
+      const uint32_t dist = (filters & kFilterShuffle) ? 1 : stride;
+      for (uint32_t i = size; i-- > dist; ) {
+        dst[i] = (uint8_t)(dst[i] - dst[i - dist]);
+      }
+    }
+  }
+
+  void remove_filters(uint8_t* data, const uint32_t size, const uint32_t stride, const uint32_t filters, std::vector<uint8_t>& scratch)
+  {
+    if (filters & kFilterDelta) {
+      const uint32_t dist = (filters & kFilterShuffle) ? 1 : stride;
+      uint32_t i = dist;
+      if (dist == 1) {
+        // running sum, 16 bytes at a time. The sum within the register takes 4 shifted adds, and then
+        // the last decoded byte is added to all the lanes
+        for (; i + 16 <= size; i += 16) {
+          __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+          v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+          v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+          v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+          v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+          v = _mm_add_epi8(v, _mm_set1_epi8((char)data[i - 1]));
+          _mm_storeu_si128((__m128i*)(data + i), v);
+        }
+      } else if (dist >= 16) {
+        // the bytes added are at least a register back, so they're already decoded
+        for (; i + 16 <= size; i += 16) {
+          const __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+          const __m128i prev = _mm_loadu_si128((const __m128i*)(data + i - dist));
+          _mm_storeu_si128((__m128i*)(data + i), _mm_add_epi8(v, prev));
+        }
+      }
+      for (; i < size; ++i) {
+        data[i] = (uint8_t)(data[i] + data[i - dist]);
+      }
+    }
+
+    if (filters & kFilterShuffle) {
+      const uint32_t num_elems = size / stride;
+      scratch.assign(data, data + num_elems * stride);
+      for (uint32_t i = 0; i < num_elems; ++i) {
+        uint8_t* elem = data + i * stride;
+        for (uint32_t b = 0; b < stride; ++b) {
+          elem[b] = scratch[b * num_elems + i];
+        }
+      }
+    }
+  }
+
+  bool parse_stream(const void* src, const uint32_t src_size, CompressedStreamHeader& header, const uint32_t** block_sizes)
+  {
+    if (src_size < sizeof(CompressedStreamHeader)) {
+      return false;
+    }
+    memcpy(&header, src, sizeof(header));
+    if (header.id != kStreamId || header.stride == 0 || header.block_size == 0 ||
+      header.num_blocks != (header.raw_size + header.block_size - 1) / header.block_size ||
+      src_size - sizeof(header) < header.num_blocks * sizeof(uint32_t)) {
+      return false;
+    }
+    *block_sizes = (const uint32_t*)((const uint8_t*)src + sizeof(header));
+    return true;
+  }
+
+  bool decode_block(const CompressedStreamHeader& header, const uint32_t block, const uint8_t* src, const uint32_t packed_size,
+    uint8_t* dst, std::vector<uint8_t>& scratch)
+  {
+    const uint32_t raw_size = std::min(header.block_size, header.raw_size - block * header.block_size);
+    const uint32_t size = packed_size & ~kStoredBlock;
+    if (packed_size & kStoredBlock) {
+      if (size != raw_size) {
+        return false;
+      }
+      memcpy(dst, src, size);
+    } else if (!lz_decompress(src, size, dst, raw_size)) {
+      return false;
+    }
+    remove_filters(dst, raw_size, header.stride, header.filters, scratch);
+    return true;
+  }
+
+  struct DecodeContext
+  {
+    CompressedStreamHeader header;
+    const uint32_t* block_sizes;
+    const uint8_t* data;
+    std::vector<uint32_t> block_offsets;
+    uint8_t* dst;
+    volatile LONG failed;
+  };
+
+  void decode_block_range(DecodeContext* ctx, const uint32_t begin, const uint32_t end)
+  {
+    std::vector<uint8_t> scratch;
+    for (uint32_t i = begin; i < end; ++i) {
+      if (!decode_block(ctx->header, i, ctx->data + ctx->block_offsets[i], ctx->block_sizes[i],
+        ctx->dst + i * ctx->header.block_size, scratch)) {
+        InterlockedExchange(&ctx->failed, 1);
+      }
+    }
+  }
+}
+
+void compress_stream(const void* src, const uint32_t size, const uint32_t stride, const uint32_t filters,
+  std::vector<uint8_t>& dst, const uint32_t block_size)
+{
+  CompressedStreamHeader header;
+  header.id = kStreamId;
+  header.raw_size = size;
+  header.stride = (uint16_t)std::max<uint32_t>(1, stride);
+  header.block_size = std::max<uint32_t>(header.stride, block_size - block_size % header.stride);
+  header.num_blocks = (size + header.block_size - 1) / header.block_size;
+  header.filters = (uint16_t)filters;
+
+  const uint32_t header_ofs = dst.size();
+  dst.resize(header_ofs + sizeof(header) + header.num_blocks * sizeof(uint32_t));
+  memcpy(&dst[header_ofs], &header, sizeof(header));
+
+  const uint8_t* data = (const uint8_t*)src;
+  std::vector<uint8_t> filtered(header.block_size);
+  std::vector<uint8_t> compressed;
+  for (uint32_t i = 0; i < header.num_blocks; ++i) {
+    const uint32_t raw_size = std::min(header.block_size, size - i * header.block_size);
+    apply_filters(data + i * header.block_size, raw_size, header.stride, filters, &filtered[0]);
+
+    compressed.clear();
+    lz_compress(&filtered[0], raw_size, compressed);
+
+    // keep the block as is if it didn't compress
+    uint32_t packed_size;
+    if (compressed.size() < raw_size) {
+      packed_size = compressed.size();
+      dst.insert(dst.end(), compressed.begin(), compressed.end());
+    } else {
+      packed_size = raw_size | kStoredBlock;
+      dst.insert(dst.end(), filtered.begin(), filtered.begin() + raw_size);
+    }
+    memcpy(&dst[header_ofs + sizeof(header) + i * sizeof(uint32_t)], &packed_size, sizeof(packed_size));
+  }
+}
+
+uint32_t compressed_stream_raw_size(const void* src, const uint32_t src_size)
+{
+  CompressedStreamHeader header;
+  const uint32_t* block_sizes;
+  return parse_stream(src, src_size, header, &block_sizes) ? header.raw_size : 0;
+}
+
+bool decompress_stream(const void* src, const uint32_t src_size, void* dst, ThreadPool* pool)
+{
+  DecodeContext ctx;
+  if (!parse_stream(src, src_size, ctx.header, &ctx.block_sizes)) {
+    return false;
+  }
+
+  // the offsets are a prefix sum of the block sizes, which also checks that the blocks fit
+  const uint32_t table_end = sizeof(CompressedStreamHeader) + ctx.header.num_blocks * sizeof(uint32_t);
+  ctx.data = (const uint8_t*)src + table_end;
+  ctx.block_offsets.resize(ctx.header.num_blocks);
+  uint32_t ofs = 0;
+  for (uint32_t i = 0; i < ctx.header.num_blocks; ++i) {
+    ctx.block_offsets[i] = ofs;
+    ofs += ctx.block_sizes[i] & ~kStoredBlock;
+    if (ofs > src_size - table_end) {
+      return false;
+    }
+  }
+
+  ctx.dst = (uint8_t*)dst;
+  ctx.failed = 0;
+  if (pool) {
+    pool->parallel_for(ctx.header.num_blocks, 1, boost::bind(&decode_block_range, &ctx, _1, _2));
+  } else {
+    decode_block_range(&ctx, 0, ctx.header.num_blocks);
+  }
+  return ctx.failed == 0;
+}
+
+BlockStreamDecoder::BlockStreamDecoder(const void* src, const uint32_t src_size)
+  : src_((const uint8_t*)src)
+  , src_size_(src_size)
+  , block_sizes_(NULL)
+  , next_block_(0)
+  , valid_(false)
+{
+  valid_ = parse_stream(src, src_size, header_, &block_sizes_);
+  if (valid_) {
+    src_ += sizeof(CompressedStreamHeader) + header_.num_blocks * sizeof(uint32_t);
+    src_size_ -= sizeof(CompressedStreamHeader) + header_.num_blocks * sizeof(uint32_t);
+  }
+}
+
+uint32_t BlockStreamDecoder::decode_next(void* dst)
+{
+  if (!valid_ || next_block_ == header_.num_blocks) {
+    return 0;
+  }
+
+  const uint32_t packed_size = block_sizes_[next_block_];
+  const uint32_t size = packed_size & ~kStoredBlock;
+  if (size > src_size_) {
+    valid_ = false;
+    return 0;
+  }
+
+  std::vector<uint8_t> scratch;
+  if (!decode_block(header_, next_block_, src_, packed_size, (uint8_t*)dst, scratch)) {
+    valid_ = false;
+    return 0;
+  }
+  src_ += size;
+  src_size_ -= size;
+  return std::min(header_.block_size, header_.raw_size - next_block_++ * header_.block_size);
+}
+
+CompressionBenchmark benchmark_compression(const uint32_t num_vertices, const uint32_t iterations, ThreadPool* pool)
+{
+  // position, normal and uv on a noisy grid, which is roughly what an exported mesh looks like
+  struct Vertex
+  {
+    D3DXVECTOR3 pos;
+    D3DXVECTOR3 normal;
+    D3DXVECTOR2 uv;
+  };
+
+  std::vector<Vertex> vertices(num_vertices);
+  srand(1);
+  const uint32_t side = std::max<uint32_t>(1, (uint32_t)sqrtf((float)num_vertices));
+  for (uint32_t i = 0; i < num_vertices; ++i) {
+    const float x = (float)(i % side);
+    const float z = (float)(i / side);
+    vertices[i].pos = D3DXVECTOR3(x, sinf(x * 0.1f) + rand() / (float)RAND_MAX * 0.01f, z);
+    vertices[i].normal = D3DXVECTOR3(0, 1, 0);
+    vertices[i].uv = D3DXVECTOR2(x / side, z / side);
+  }
+
+  const uint32_t raw_size = num_vertices * sizeof(Vertex);
+  std::vector<uint8_t> compressed;
+  std::vector<uint8_t> decompressed(raw_size);
+
+  CompressionBenchmark result;
+  result.raw_size = raw_size;
+  LARGE_INTEGER start, end;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    compressed.clear();
+    compress_stream(&vertices[0], raw_size, sizeof(Vertex), kFilterShuffle | kFilterDelta, compressed);
+  }
+  QueryPerformanceCounter(&end);
+  result.compress_ms = elapsed_ms(start, end) / iterations;
+  result.compressed_size = compressed.size();
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    decompress_stream(&compressed[0], compressed.size(), &decompressed[0], NULL);
+  }
+  QueryPerformanceCounter(&end);
+  result.decompress_ms = elapsed_ms(start, end) / iterations;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    decompress_stream(&compressed[0], compressed.size(), &decompressed[0], pool);
+  }
+  QueryPerformanceCounter(&end);
+  result.parallel_decompress_ms = elapsed_ms(start, end) / iterations;
+
+  if (memcmp(&decompressed[0], &vertices[0], raw_size) != 0) {
+    LOG_WARNING_LN("[%s] decompressed data doesn't match", __FUNCTION__);
+  }
+
+  LOG_INFO_LN("compression: %d -> %d bytes, compress %.2f ms, decompress %.2f ms, parallel %.2f ms", result.raw_size,
+    result.compressed_size, result.compress_ms, result.decompress_ms, result.parallel_decompress_ms);
+  return result;
+}
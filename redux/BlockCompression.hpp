@@ -0,0 +1,78 @@
+#ifndef BLOCK_COMPRESSION_HPP
+#define BLOCK_COMPRESSION_HPP
+
+class ThreadPool;
+
+// Filters applied to each block before compressing it. They help with vertex streams, where the same
+// byte of consecutive vertices is usually similar.
+enum BlockFilter
+{
+  kFilterNone = 0,
+  kFilterShuffle = 1 << 0,   // groups byte n of every element together
+  kFilterDelta = 1 << 1,     // stores each byte as the difference to the byte one element back
+};
+
+/**
+ * A stream is split into fixed size blocks, compressed independently with a simple lz codec. The
+ * stream starts with a header and a table of block offsets, so the blocks can be decoded in any order.
+ */
+struct CompressedStreamHeader
+{
+  uint32_t id;
+  uint32_t raw_size;
+  uint32_t block_size;
+  uint32_t num_blocks;
+  uint16_t filters;
+  uint16_t stride;
+};
+
+// Compresses size bytes of src, and appends the stream to dst. The block size is rounded down to a
+// multiple of stride, so the filters never split an element.
+void compress_stream(const void* src, const uint32_t size, const uint32_t stride, const uint32_t filters,
+  std::vector<uint8_t>& dst, const uint32_t block_size = 64 * 1024);
+
+// returns the size of the data the stream decompresses to, or 0 if it isn't a valid stream
+uint32_t compressed_stream_raw_size(const void* src, const uint32_t src_size);
+
+// Decompresses a whole stream to dst, which must hold compressed_stream_raw_size bytes. If pool isn't
+// NULL, the blocks are decoded in parallel. Returns false if the stream is corrupt.
+bool decompress_stream(const void* src, const uint32_t src_size, void* dst, ThreadPool* pool);
+
+// Decodes a stream one block at a time, so only a block needs to be in memory at once
+class BlockStreamDecoder
+{
+public:
+  BlockStreamDecoder(const void* src, const uint32_t src_size);
+
+  bool is_valid() const { return valid_; }
+  uint32_t raw_size() const { return valid_ ? header_.raw_size : 0; }
+  uint32_t max_block_size() const { return valid_ ? header_.block_size : 0; }
+
+  // Decodes the next block to dst, which must hold max_block_size() bytes. Returns the number of bytes
+  // written, or 0 when the stream is done, or corrupt.
+  uint32_t decode_next(void* dst);
+
+private:
+  const uint8_t* src_;
+  uint32_t src_size_;
+  CompressedStreamHeader header_;
+  const uint32_t* block_sizes_;
+  uint32_t next_block_;
+  bool valid_;
+};
+
+struct CompressionBenchmark
+{
+  CompressionBenchmark() : raw_size(0), compressed_size(0), compress_ms(0), decompress_ms(0), parallel_decompress_ms(0) {}
+  uint32_t raw_size;
+  uint32_t compressed_size;
+  double compress_ms;
+  double decompress_ms;
+  double parallel_decompress_ms;
+};
+
+// Compresses a synthetic vertex stream with the shuffle and delta filters, and decodes it serially and
+// in parallel. Doesn't need a device, so it can run headless.
+CompressionBenchmark benchmark_compression(const uint32_t num_vertices, const uint32_t iterations, ThreadPool* pool);
+
+#endif // #ifndef BLOCK_COMPRESSION_HPP
@@ -0,0 +1,108 @@
+#include "stdafx.h"
+#include "CollisionHull.hpp"
+
+void calc_hull_bounds(CollisionHull& hull)
+{
+  if (hull.vertices.empty()) {
+    hull.bounds_min = hull.bounds_max = hull.sphere_center = kVec3Zero;
+    hull.sphere_radius = 0;
+    return;
+  }
+
+  hull.bounds_min = hull.bounds_max = hull.vertices[0];
+  for (size_t i = 1; i < hull.vertices.size(); ++i) {
+    D3DXVec3Minimize(&hull.bounds_min, &hull.bounds_min, &hull.vertices[i]);
+    D3DXVec3Maximize(&hull.bounds_max, &hull.bounds_max, &hull.vertices[i]);
+  }
+
+  hull.sphere_center = 0.5f * (hull.bounds_min + hull.bounds_max);
+  hull.sphere_radius = 0;
+  for (size_t i = 0; i < hull.vertices.size(); ++i) {
+    const D3DXVECTOR3 d(hull.vertices[i] - hull.sphere_center);
+    hull.sphere_radius = std::max(hull.sphere_radius, D3DXVec3LengthSq(&d));
+  }
+  hull.sphere_radius = sqrtf(hull.sphere_radius);
+}
+
+bool intersect_sphere(const D3DXVECTOR3& center, const float radius, const D3DXVECTOR3& org, const D3DXVECTOR3& dir)
+{
+  // distance from the center to the closest point on the ray
+  const D3DXVECTOR3 ofs(center - org);
+  const float len_sq = D3DXVec3LengthSq(&dir);
+  const float t = len_sq > 0 ? std::max(0.0f, D3DXVec3Dot(&ofs, &dir) / len_sq) : 0;
+  const D3DXVECTOR3 closest(org + t * dir - center);
+  return D3DXVec3LengthSq(&closest) <= radius * radius;
+}
+
+bool intersect_box(const D3DXVECTOR3& bounds_min, const D3DXVECTOR3& bounds_max, const D3DXVECTOR3& org, const D3DXVECTOR3& dir)
+{
+  // slab test
+  float t_min = 0;
+  float t_max = FLT_MAX;
+  for (int32_t i = 0; i < 3; ++i) {
+    if (fabsf(dir[i]) < 1e-9f) {
+      if (org[i] < bounds_min[i] || org[i] > bounds_max[i]) {
+        return false;
+      }
+      continue;
+    }
+    const float inv_dir = 1 / dir[i];
+    float t0 = (bounds_min[i] - org[i]) * inv_dir;
+    float t1 = (bounds_max[i] - org[i]) * inv_dir;
+    if (t0 > t1) {
+      std::swap(t0, t1);
+    }
+    t_min = std::max(t_min, t0);
+    t_max = std::min(t_max, t1);
+    if (t_min > t_max) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool intersect_hull(const CollisionHull& hull, const D3DXVECTOR3& org, const D3DXVECTOR3& dir, float& dist)
+{
+  if (!intersect_sphere(hull.sphere_center, hull.sphere_radius, org, dir) ||
+    !intersect_box(hull.bounds_min, hull.bounds_max, org, dir)) {
+    return false;
+  }
+
+  bool hit = false;
+  dist = FLT_MAX;
+  for (size_t i = 0, e = hull.indices.size() / 3; i < e; ++i) {
+    const D3DXVECTOR3& n = hull.normals[i];
+    const float n_dot_dir = D3DXVec3Dot(&n, &dir);
+    if (fabsf(n_dot_dir) < 1e-9f) {
+      continue;
+    }
+
+    const D3DXVECTOR3& v0 = hull.vertices[hull.indices[i*3+0]];
+    const D3DXVECTOR3& v1 = hull.vertices[hull.indices[i*3+1]];
+    const D3DXVECTOR3& v2 = hull.vertices[hull.indices[i*3+2]];
+
+    const D3DXVECTOR3 to_plane(v0 - org);
+    const float t = D3DXVec3Dot(&n, &to_plane) / n_dot_dir;
+    if (t < 0 || t >= dist) {
+      continue;
+    }
+
+    // the hit point has to be on the inside of all the edges
+    const D3DXVECTOR3 p(org + t * dir);
+    const D3DXVECTOR3* verts[] = { &v0, &v1, &v2 };
+    bool inside = true;
+    for (int32_t j = 0; j < 3 && inside; ++j) {
+      const D3DXVECTOR3 edge(*verts[(j+1)%3] - *verts[j]);
+      const D3DXVECTOR3 to_p(p - *verts[j]);
+      D3DXVECTOR3 c;
+      D3DXVec3Cross(&c, &edge, &to_p);
+      inside = D3DXVec3Dot(&c, &n) >= 0;
+    }
+
+    if (inside) {
+      dist = t;
+      hit = true;
+    }
+  }
+  return hit;
+}
@@ -0,0 +1,30 @@
+#ifndef COLLISION_HULL_HPP
+#define COLLISION_HULL_HPP
+
+/**
+ * Low poly stand in for a mesh, used for picking. The face normals are precomputed, so a ray test
+ * is a plane intersection and three edge tests per triangle.
+ */
+struct CollisionHull
+{
+  std::vector<D3DXVECTOR3> vertices;
+  std::vector<uint16_t> indices;
+  std::vector<D3DXVECTOR3> normals;   // one per triangle
+
+  D3DXVECTOR3 bounds_min;
+  D3DXVECTOR3 bounds_max;
+  D3DXVECTOR3 sphere_center;
+  float sphere_radius;
+};
+
+// computes the bounding box and sphere from the vertices
+void calc_hull_bounds(CollisionHull& hull);
+
+// Returns true if the ray hits the hull, and the distance along dir to the closest hit. The ray is in
+// the hull's space, and dir doesn't have to be normalized.
+bool intersect_hull(const CollisionHull& hull, const D3DXVECTOR3& org, const D3DXVECTOR3& dir, float& dist);
+
+bool intersect_sphere(const D3DXVECTOR3& center, const float radius, const D3DXVECTOR3& org, const D3DXVECTOR3& dir);
+bool intersect_box(const D3DXVECTOR3& bounds_min, const D3DXVECTOR3& bounds_max, const D3DXVECTOR3& org, const D3DXVECTOR3& dir);
+
+#endif // #ifndef COLLISION_HULL_HPP
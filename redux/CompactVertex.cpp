@@ -0,0 +1,136 @@
+#include "stdafx.h"
+#include "CompactVertex.hpp"
+
+namespace
+{
+  inline float sign_not_zero(const float v)
+  {
+    return v >= 0 ? 1.0f : -1.0f;
+  }
+
+  inline int16_t to_snorm16(const float v)
+  {
+    const float c = std::min<float>(1, std::max<float>(-1, v));
+    return (int16_t)floorf(c * 32767.0f + (c >= 0 ? 0.5f : -0.5f));
+  }
+
+  inline float from_snorm16(const int16_t v)
+  {
+    return std::max<float>(-1, v / 32767.0f);
+  }
+
+  inline uint16_t to_unorm16(const float v)
+  {
+    const float c = std::min<float>(1, std::max<float>(0, v));
+    return (uint16_t)floorf(c * 65535.0f + 0.5f);
+  }
+}
+
+void oct_encode(int16_t* out, const D3DXVECTOR3& n)
+{
+  // project onto the octahedron |x| + |y| + |z| = 1, and fold the lower hemisphere over the diagonals
+  const float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+  float x = l1 > 0 ? n.x / l1 : 0;
+  float y = l1 > 0 ? n.y / l1 : 0;
+  if (n.z < 0) {
+    const float tx = (1 - fabs(y)) * sign_not_zero(x);
+    const float ty = (1 - fabs(x)) * sign_not_zero(y);
+    x = tx;
+    y = ty;
+  }
+  out[0] = to_snorm16(x);
+  out[1] = to_snorm16(y);
+}
+
+D3DXVECTOR3 oct_decode(const int16_t* in)
+{
+  const float x = from_snorm16(in[0]);
+  const float y = from_snorm16(in[1]);
+  D3DXVECTOR3 n(x, y, 1 - fabs(x) - fabs(y));
+  if (n.z < 0) {
+    n.x = (1 - fabs(y)) * sign_not_zero(x);
+    n.y = (1 - fabs(x)) * sign_not_zero(y);
+  }
+  D3DXVec3Normalize(&n, &n);
+  return n;
+}
+
+D3DXVECTOR3 dequantize_pos(const CompactVertex& v, const QuantizationBounds& bounds)
+{
+  return D3DXVECTOR3(
+    v.pos[0] / 65535.0f * bounds.scale.x + bounds.bias.x,
+    v.pos[1] / 65535.0f * bounds.scale.y + bounds.bias.y,
+    v.pos[2] / 65535.0f * bounds.scale.z + bounds.bias.z);
+}
+
+void quantize_vertices(std::vector<CompactVertex>& out, QuantizationBounds& bounds, QuantizationError& error,
+  const uint8_t* pos, const uint8_t* normal, const uint8_t* uv, const uint32_t vertex_count, const uint32_t stride)
+{
+  out.resize(vertex_count);
+  error = QuantizationError();
+  if (vertex_count == 0) {
+    bounds = QuantizationBounds();
+    return;
+  }
+
+  // find the bounds
+  D3DXVECTOR3 min_pos(FLT_MAX, FLT_MAX, FLT_MAX);
+  D3DXVECTOR3 max_pos(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  for (uint32_t i = 0; i < vertex_count; ++i) {
+    const D3DXVECTOR3& p = *(const D3DXVECTOR3*)(pos + i * stride);
+    D3DXVec3Minimize(&min_pos, &min_pos, &p);
+    D3DXVec3Maximize(&max_pos, &max_pos, &p);
+  }
+
+  bounds.bias = min_pos;
+  bounds.scale = max_pos - min_pos;
+  // avoid dividing by zero for flat meshes
+  for (int32_t j = 0; j < 3; ++j) {
+    if (bounds.scale[j] <= 0) {
+      bounds.scale[j] = 1;
+    }
+  }
+
+  for (uint32_t i = 0; i < vertex_count; ++i) {
+    const D3DXVECTOR3& p = *(const D3DXVECTOR3*)(pos + i * stride);
+    const D3DXVECTOR3& n = *(const D3DXVECTOR3*)(normal + i * stride);
+    const D3DXVECTOR2& t = *(const D3DXVECTOR2*)(uv + i * stride);
+    CompactVertex& v = out[i];
+
+    for (int32_t j = 0; j < 3; ++j) {
+      v.pos[j] = to_unorm16((p[j] - bounds.bias[j]) / bounds.scale[j]);
+    }
+    v.pos[3] = 0;
+
+    D3DXVECTOR3 nn;
+    D3DXVec3Normalize(&nn, &n);
+    oct_encode(v.normal, nn);
+    D3DXFloat32To16Array(&v.uv.x, &t.x, 2);
+
+    // decode again to gather the error stats
+    const D3DXVECTOR3 dp = dequantize_pos(v, bounds);
+    for (int32_t j = 0; j < 3; ++j) {
+      error.max_pos_error = std::max<float>(error.max_pos_error, fabs(dp[j] - p[j]));
+    }
+
+    const D3DXVECTOR3 dn = oct_decode(v.normal);
+    const float cos_angle = std::min<float>(1, std::max<float>(-1, D3DXVec3Dot(&dn, &nn)));
+    error.max_normal_error_deg = std::max<float>(error.max_normal_error_deg, D3DXToDegree(acosf(cos_angle)));
+
+    D3DXVECTOR2 dt;
+    D3DXFloat16To32Array(&dt.x, &v.uv.x, 2);
+    error.max_uv_error = std::max<float>(error.max_uv_error, std::max<float>(fabs(dt.x - t.x), fabs(dt.y - t.y)));
+  }
+}
+
+void compact_vertex_descs(std::vector<D3D10_INPUT_ELEMENT_DESC>& descs)
+{
+  const D3D10_INPUT_ELEMENT_DESC compact_descs[] =
+  {
+    { "POSITION", 0, DXGI_FORMAT_R16G16B16A16_UNORM, 0, offsetof(CompactVertex, pos), D3D10_INPUT_PER_VERTEX_DATA, 0 },
+    { "NORMAL", 0, DXGI_FORMAT_R16G16_SNORM, 0, offsetof(CompactVertex, normal), D3D10_INPUT_PER_VERTEX_DATA, 0 },
+    { "TEXCOORD", 0, DXGI_FORMAT_R16G16_FLOAT, 0, offsetof(CompactVertex, uv), D3D10_INPUT_PER_VERTEX_DATA, 0 },
+  };
+
+  descs.assign(compact_descs, compact_descs + sizeof(compact_descs) / sizeof(compact_descs[0]));
+}
@@ -0,0 +1,38 @@
+#ifndef COMPACT_VERTEX_HPP
+#define COMPACT_VERTEX_HPP
+
+#include "Quantization.hpp"
+
+// 16 byte vertex format. Positions are stored as 16 bit unorms relative to the mesh bounds,
+// normals are octahedral encoded into two 16 bit snorms, and uvs are half floats.
+// The shader reconstructs the position as pos * pos_scale + pos_bias
+struct CompactVertex
+{
+  uint16_t pos[4];
+  int16_t normal[2];
+  D3DXVECTOR2_16F uv;
+};
+
+// max error introduced by the quantization, measured by decoding the compact vertices
+struct QuantizationError
+{
+  QuantizationError() : max_pos_error(0), max_normal_error_deg(0), max_uv_error(0) {}
+  float max_pos_error;
+  float max_normal_error_deg;
+  float max_uv_error;
+};
+
+void oct_encode(int16_t* out, const D3DXVECTOR3& n);
+D3DXVECTOR3 oct_decode(const int16_t* in);
+
+D3DXVECTOR3 dequantize_pos(const CompactVertex& v, const QuantizationBounds& bounds);
+
+// The input streams are strided, so they can point straight into an interleaved vertex blob.
+void quantize_vertices(std::vector<CompactVertex>& out, QuantizationBounds& bounds, QuantizationError& error,
+  const uint8_t* pos, const uint8_t* normal, const uint8_t* uv, const uint32_t vertex_count, const uint32_t stride);
+
+// Fills in the input element descs matching CompactVertex. The semantic names are string literals,
+// so the descs must not be handed to Mesh::input_element_descs_ (which frees them).
+void compact_vertex_descs(std::vector<D3D10_INPUT_ELEMENT_DESC>& descs);
+
+#endif // #ifndef COMPACT_VERTEX_HPP
@@ -3,6 +3,8 @@
 #include "Mesh.hpp"
 #include "ReduxLoader.hpp"
 #include "M2Loader.hpp"
+#include "ScenePackage.hpp"
+#include "ThreadPool.hpp"
 #include <celsus/D3D10Descriptions.hpp>
 #include "../system/Input.hpp"
 #include "../system/SystemInterface.hpp"
@@ -56,6 +58,9 @@ DefaultRenderer::DefaultRenderer(
   , transparent_blend_state_(NULL)
   , current_camera_(0)
   , free_fly_camera_enabled_(true)
+  , camera_eye_node_(kInvalidAnimationNode)
+  , camera_up_node_(kInvalidAnimationNode)
+  , camera_aim_node_(kInvalidAnimationNode)
 {
   system_->add_renderable(this);
 
@@ -178,7 +183,7 @@ void DefaultRenderer::render(const int /*time_in_ms*/)
     const uint32_t cur_time = timeGetTime();
     const uint32_t elapsed_time = (cur_time - start_time) / 10;
 
-    animation_manager_->update_transforms(elapsed_time);
+    animation_manager_->update_transforms(elapsed_time, &ThreadPool::instance());
 
     if (!free_fly_camera_enabled_ && scene_.cameras_.size() > 0) {
 
@@ -191,11 +196,11 @@ void DefaultRenderer::render(const int /*time_in_ms*/)
       strncpy_s(transform_name, sizeof(transform_name), camera->name().c_str(), len);
       transform_name[len] = 0;
 
-      animation_manager_->get_transform_for_node(eye_pos, "camera1_group|camera1");
+      animation_manager_->get_transform_for_node(eye_pos, camera_eye_node_);
       D3DXVECTOR3 up;
-      animation_manager_->get_transform_for_node(up, "camera1_group|camera1_up");
+      animation_manager_->get_transform_for_node(up, camera_up_node_);
       D3DXVECTOR3 aim;
-      animation_manager_->get_transform_for_node(aim, "camera1_group|camera1_aim");
+      animation_manager_->get_transform_for_node(aim, camera_aim_node_);
       camera->set_pos_up_dir(eye_pos, up, aim - eye_pos);
 
       mtx_proj = camera->projection_matrix();
@@ -247,7 +252,7 @@ void DefaultRenderer::render(const int /*time_in_ms*/)
     const uint32_t cur_time = timeGetTime();
     const uint32_t elapsed_time = (cur_time - start_time) / 10;
 
-    animation_manager_->update_transforms(elapsed_time);
+    animation_manager_->update_transforms(elapsed_time, &ThreadPool::instance());
 
     if (!free_fly_camera_enabled_ && scene_.cameras_.size() > 0) {
 
@@ -260,11 +265,11 @@ void DefaultRenderer::render(const int /*time_in_ms*/)
       strncpy_s(transform_name, sizeof(transform_name), camera->name().c_str(), len);
       transform_name[len] = 0;
 
-      animation_manager_->get_transform_for_node(eye_pos, "camera1_group|camera1");
+      animation_manager_->get_transform_for_node(eye_pos, camera_eye_node_);
       D3DXVECTOR3 up;
-      animation_manager_->get_transform_for_node(up, "camera1_group|camera1_up");
+      animation_manager_->get_transform_for_node(up, camera_up_node_);
       D3DXVECTOR3 aim;
-      animation_manager_->get_transform_for_node(aim, "camera1_group|camera1_aim");
+      animation_manager_->get_transform_for_node(aim, camera_aim_node_);
       camera->set_pos_up_dir(eye_pos, up, aim - eye_pos);
 
       mtx_proj = camera->projection_matrix();
@@ -311,27 +316,61 @@ void DefaultRenderer::process_input_callback(const Input& input)
 
 
 #ifdef STANDALONE
-void DefaultRenderer::load_scene(const std::string& filename) 
+bool DefaultRenderer::load_materials_from_package()
 {
-  SCOPED_FUNC_PROFILE();
+  if (!scene_.package_ || scene_.package_->header()->num_materials == 0) {
+    return false;
+  }
 
-  ReduxLoader loader(filename, &scene_, system_.get(), animation_manager_);
-  loader.load();
+  SCOPED_FUNC_PROFILE();
+  const PackageHeader* header = scene_.package_->header();
+
+  // the loader adds the meshes in package order, so the mesh indices can be used directly
+  std::vector<Meshes> meshes_by_material(header->num_materials);
+  for (uint32_t i = 0; i < header->num_meshes && i < scene_.meshes_.size(); ++i) {
+    const int32_t material = header->meshes[i].material;
+    if (material >= 0) {
+      meshes_by_material[material].push_back(scene_.meshes_[i]);
+    }
+  }
 
-  boost::filesystem::path path(filename);
-  const string raw_filename(path.replace_extension().filename());
+  ID3D10Effect* effect = effect_manager_->effect_from_handle(effects_["blinn_effect"]);
+  std::map<std::string, EffectConnection*> connections;
+  for (uint32_t i = 0; i < header->num_materials; ++i) {
+    const PackageMaterial& src = header->materials[i];
+    MaterialSPtr material_ptr = effect_manager_->add_material(create_material(src, effect));
+
+    const std::string effect_name(src.effect.ptr);
+    if (effect_name.empty()) {
+      continue;
+    }
 
+    EffectConnection*& ec = connections[effect_name];
+    if (ec == NULL) {
+      ec = new EffectConnection();
+      ec->effect_ = effect_manager_->effect_from_handle(effects_[effect_name]);
+      effect_connections_.push_back(ec);
+    }
 
-  effects_["blinn_effect"] = system_->load_effect("blinn_effect");
-  effects_["blinn_effect2"] = system_->load_effect("blinn_effect2");
+    MaterialConnection* mc = new MaterialConnection();
+    mc->material_ = material_ptr;
+    mc->meshes_ = meshes_by_material[i];
+    if (material_ptr->is_transparent()) {
+      ec->transparent_materials_.push_back(mc);
+    } else {
+      ec->opaque_materials_.push_back(mc);
+    }
+  }
 
-  std::vector< std::string > textures;
-  std::string json_filename("data/scenes/" + raw_filename + ".json");
+  return true;
+}
 
+bool DefaultRenderer::load_materials_from_json(const std::string& json_filename)
+{
   json::json_element elem;
   if (!json::json_element::load_from_file(elem, json_filename.c_str())) {
     LOG_WARNING_LN("Error loading JSON: %s", json_filename.c_str());
-    return;
+    return false;
   }
 
   const json::json_element& effect_connections = elem.find_object("effect_connections");
@@ -340,7 +379,7 @@ void DefaultRenderer::load_scene(const std::string& filename)
 
   if (!(effect_connections.is_valid() && materials.is_valid() && material_connections.is_valid())) {
     LOG_WARNING_LN("Invalid JSON file: %s", json_filename.c_str());
-    return;
+    return false;
   }
 
   ID3D10Effect* effect = effect_manager_->effect_from_handle(effects_["blinn_effect"]);
@@ -397,6 +436,32 @@ void DefaultRenderer::load_scene(const std::string& filename)
     effect_connections_.push_back(ec);
   }
 
+  return true;
+}
+
+void DefaultRenderer::load_scene(const std::string& filename) 
+{
+  SCOPED_FUNC_PROFILE();
+
+  ReduxLoader loader(filename, &scene_, system_.get(), animation_manager_);
+  loader.load();
+  resolve_camera_nodes();
+
+  boost::filesystem::path path(filename);
+  const string raw_filename(path.replace_extension().filename());
+
+
+  effects_["blinn_effect"] = system_->load_effect("blinn_effect");
+  effects_["blinn_effect2"] = system_->load_effect("blinn_effect2");
+
+  std::vector< std::string > textures;
+  std::string json_filename("data/scenes/" + raw_filename + ".json");
+
+  // the package has the materials already resolved, so the json is only parsed if there isn't one
+  if (!load_materials_from_package() && !load_materials_from_json(json_filename)) {
+    return;
+  }
+
   FOREACH(string texture, textures) {
     system_->load_texture(texture);
   }
@@ -412,6 +477,7 @@ void DefaultRenderer::load_scene(const std::string& filename)
   SCOPED_FUNC_PROFILE();
   ReduxLoader loader(filename, &scene_, system_, animation_manager_);
   loader.load();
+  resolve_camera_nodes();
 
   boost::filesystem::path path(filename);
   const string raw_filename(path.replace_extension().filename());
@@ -441,6 +507,13 @@ void DefaultRenderer::load_scene(const std::string& filename)
 #endif
 
 
+void DefaultRenderer::resolve_camera_nodes()
+{
+  camera_eye_node_ = animation_manager_->find_node("camera1_group|camera1");
+  camera_up_node_ = animation_manager_->find_node("camera1_group|camera1_up");
+  camera_aim_node_ = animation_manager_->find_node("camera1_group|camera1_aim");
+}
+
 void DefaultRenderer::material_changed(const MeshName& mesh_name, const MaterialName& material_name)
 {
   create_mesh_lists();
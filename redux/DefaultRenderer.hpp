@@ -86,12 +86,18 @@ private:
 
   void  create_mesh_lists();
   void  create_input_layout();
+  void  resolve_camera_nodes();
   void  material_changed(const MeshName& mesh_name, const MaterialName& material_name);
 
   void  render_meshes(ID3D10BlendState* blend_state, ID3D10DepthStencilState* depth_state, MeshesByMaterial& meshes);
 
   void  add_material_connection(const std::string& mesh_name, const std::string& material_name);
 
+#ifdef STANDALONE
+  bool  load_materials_from_package();
+  bool  load_materials_from_json(const std::string& json_filename);
+#endif
+
   Scene scene_;
   uint32_t current_camera_;
   bool free_fly_camera_enabled_;
@@ -103,6 +109,9 @@ private:
   MaterialsByEffect effect_list_;
 
   AnimationManager* animation_manager_;
+  AnimationNodeHandle camera_eye_node_;
+  AnimationNodeHandle camera_up_node_;
+  AnimationNodeHandle camera_aim_node_;
 
   std::map<EffectName, Handle> effects_;
 
@@ -0,0 +1,137 @@
+#include "stdafx.h"
+#include "DrawList.hpp"
+#include "MeshBvh.hpp"
+#include "Mesh.hpp"
+#include "AnimationNode.hpp"
+#include "Utils.hpp"
+
+namespace
+{
+  const uint32_t kRadixBits = 8;
+  const uint32_t kRadixSize = 1 << kRadixBits;
+  const uint32_t kNumRadixPasses = 64 / kRadixBits;
+  const uint32_t kMaxDepthBucket = (1 << kDrawKeyDepthBits) - 1;
+}
+
+uint64_t make_draw_key(const DrawState& state, const uint32_t depth, const uint32_t mesh)
+{
+  SUPER_ASSERT(state.effect < (1 << kDrawKeyEffectBits) && state.material < (1 << kDrawKeyMaterialBits));
+  SUPER_ASSERT(depth <= kMaxDepthBucket && mesh < (1 << kDrawKeyMeshBits));
+
+  const uint64_t pass = state.pass;
+  const uint64_t material = ((uint64_t)state.effect << kDrawKeyMaterialBits) | state.material;
+  const uint32_t material_bits = kDrawKeyEffectBits + kDrawKeyMaterialBits;
+  const uint32_t pass_shift = 64 - 2;
+
+  if (state.pass == kTransparentPass) {
+    const uint64_t inv_depth = kMaxDepthBucket - depth;
+    return (pass << pass_shift) | (inv_depth << (material_bits + kDrawKeyMeshBits)) | (material << kDrawKeyMeshBits) | mesh;
+  }
+  return (pass << pass_shift) | (material << (kDrawKeyDepthBits + kDrawKeyMeshBits)) | ((uint64_t)depth << kDrawKeyMeshBits) | mesh;
+}
+
+uint32_t depth_bucket(const float dist, const float max_dist)
+{
+  if (max_dist <= 0) {
+    return 0;
+  }
+  return (uint32_t)(std::min<float>(1, std::max<float>(0, dist / max_dist)) * kMaxDepthBucket);
+}
+
+void radix_sort_keys(std::vector<uint64_t>& keys, std::vector<uint64_t>& scratch)
+{
+  const uint32_t num_keys = keys.size();
+  scratch.resize(num_keys);
+  if (num_keys < 2) {
+    return;
+  }
+
+  // the histograms for every byte are built in one go
+  uint32_t counts[kNumRadixPasses][kRadixSize];
+  memset(counts, 0, sizeof(counts));
+  for (uint32_t i = 0; i < num_keys; ++i) {
+    const uint64_t key = keys[i];
+    for (uint32_t j = 0; j < kNumRadixPasses; ++j) {
+      ++counts[j][(key >> (j * kRadixBits)) & (kRadixSize - 1)];
+    }
+  }
+
+  uint64_t* src = &keys[0];
+  uint64_t* dst = &scratch[0];
+  for (uint32_t j = 0; j < kNumRadixPasses; ++j) {
+    const uint32_t shift = j * kRadixBits;
+    uint32_t* count = counts[j];
+    if (count[(src[0] >> shift) & (kRadixSize - 1)] == num_keys) {
+      continue;
+    }
+
+    uint32_t offset = 0;
+    for (uint32_t k = 0; k < kRadixSize; ++k) {
+      const uint32_t c = count[k];
+      count[k] = offset;
+      offset += c;
+    }
+    for (uint32_t i = 0; i < num_keys; ++i) {
+      const uint64_t key = src[i];
+      dst[count[(key >> shift) & (kRadixSize - 1)]++] = key;
+    }
+    std::swap(src, dst);
+  }
+
+  // an odd number of passes leaves the result in scratch
+  if (src != &keys[0]) {
+    keys.swap(scratch);
+  }
+}
+
+void prepare_draw_list(DrawList& list, const MeshBvh& bvh, const std::vector<MeshSPtr>& meshes, const std::vector<DrawState>& states)
+{
+  list.visible.clear();
+  if (list.cull) {
+    D3DXPLANE planes[6];
+    planes_from_proj_matrix(planes, list.view * list.proj, true);
+    bvh.cull(list.visible, planes, 6);
+  } else {
+    for (uint32_t i = 0, e = bvh.num_meshes(); i < e; ++i) {
+      list.visible.push_back(i);
+    }
+  }
+
+  // the distance to the sphere, bucketed relative to the furthest visible mesh
+  const uint32_t num_visible = list.visible.size();
+  list.distances.resize(num_visible);
+  float max_dist = 0;
+  for (uint32_t i = 0; i < num_visible; ++i) {
+    const uint32_t idx = list.visible[i];
+    const D3DXVECTOR3 to_center(bvh.center(idx) - list.pos);
+    list.distances[i] = std::max<float>(0, D3DXVec3Length(&to_center) - bvh.radius(idx));
+    max_dist = std::max<float>(max_dist, list.distances[i]);
+  }
+
+  const DrawState default_state;
+  list.keys.resize(num_visible);
+  for (uint32_t i = 0; i < num_visible; ++i) {
+    const uint32_t idx = list.visible[i];
+    const DrawState& state = states.empty() ? default_state : states[idx];
+    uint32_t depth = depth_bucket(list.distances[i], max_dist);
+    if (state.pass == kOpaquePass && !list.front_to_back) {
+      depth = kMaxDepthBucket - depth;
+    }
+    list.keys[i] = make_draw_key(state, depth, idx);
+  }
+  radix_sort_keys(list.keys, list.scratch);
+
+  const D3DXMATRIX view_proj = list.view * list.proj;
+  list.items.resize(num_visible);
+  for (uint32_t i = 0; i < num_visible; ++i) {
+    DrawItem& item = list.items[i];
+    item.mesh = meshes[draw_key_mesh(list.keys[i])].get();
+    // a const read of this frame's transform, which asserts that it was evaluated
+    const D3DXMATRIX& world = item.mesh->animation_node()->transform();
+    const D3DXMATRIX world_view = world * list.view;
+    const D3DXMATRIX world_view_proj = world * view_proj;
+    D3DXMatrixTranspose(&item.matrices[0], &world);
+    D3DXMatrixTranspose(&item.matrices[1], &world_view);
+    D3DXMatrixTranspose(&item.matrices[2], &world_view_proj);
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef DRAW_LIST_HPP
+#define DRAW_LIST_HPP
+
+#include "ReduxTypes.hpp"
+
+class MeshBvh;
+
+enum DrawPass
+{
+  kOpaquePass,
+  kTransparentPass,
+};
+
+// The state a mesh is drawn with. The ids are indices into the renderer's effect and material lists
+struct DrawState
+{
+  DrawState() : pass(kOpaquePass), effect(0), material(0) {}
+  DrawState(const DrawPass pass, const uint32_t effect, const uint32_t material) : pass(pass), effect(effect), material(material) {}
+  DrawPass pass;
+  uint32_t effect;
+  uint32_t material;
+};
+
+/**
+ * Draws are ordered by a single 64 bit key, from the top bit down:
+ *   opaque:       pass:2 | effect:8 | material:14 | depth:20 | mesh:20
+ *   transparent:  pass:2 | depth:20 | effect:8 | material:14 | mesh:20
+ * so opaque draws are grouped by state and go front to back within a group, while transparent draws
+ * go back to front regardless of state. The mesh id at the bottom keeps the order stable between frames.
+ */
+const uint32_t kDrawKeyEffectBits = 8;
+const uint32_t kDrawKeyMaterialBits = 14;
+const uint32_t kDrawKeyDepthBits = 20;
+const uint32_t kDrawKeyMeshBits = 20;
+
+// depth is a bucket in [0, 1 << kDrawKeyDepthBits), and is flipped for transparent draws
+uint64_t make_draw_key(const DrawState& state, const uint32_t depth, const uint32_t mesh);
+inline uint32_t draw_key_mesh(const uint64_t key) { return (uint32_t)(key & ((1 << kDrawKeyMeshBits) - 1)); }
+
+// Maps dist in [0, max_dist] to a depth bucket
+uint32_t depth_bucket(const float dist, const float max_dist);
+
+// LSD radix sort, a byte at a time. Bytes that are the same in every key are skipped, so keys that only
+// use a few of their fields are cheap. scratch ends up the same size as keys, and keeping it around means
+// sorting doesn't allocate.
+void radix_sort_keys(std::vector<uint64_t>& keys, std::vector<uint64_t>& scratch);
+
+// What the submit phase needs to draw a mesh. The matrices are transposed, ready for the object cbuffer
+struct DrawItem
+{
+  Mesh* mesh;
+  D3DXMATRIX matrices[3];   // world, world * view, world * view * proj
+};
+
+/**
+ * The draws of one view, in submit order. Prepared on a worker, and only read once that's done, so
+ * the views can be prepared at the same time.
+ */
+struct DrawList
+{
+  DrawList() : cull(true), front_to_back(true) {}
+
+  D3DXVECTOR3 pos;
+  D3DXMATRIX view;
+  D3DXMATRIX proj;
+  bool cull;
+  bool front_to_back;   // only for the opaque draws, transparent ones are always back to front
+
+  std::vector<DrawItem> items;
+
+  // kept between frames, so preparing doesn't allocate
+  std::vector<uint32_t> visible;
+  std::vector<float> distances;
+  std::vector<uint64_t> keys;
+  std::vector<uint64_t> scratch;
+};
+
+// Culls the meshes against the list's view, sorts them on their draw keys, and computes their matrices. The
+// bvh must have been built over meshes, and update_transforms must have run for the frame. The transforms
+// are read with AnimationNode::transform, which never evaluates, so lists can be prepared on any thread.
+// states has the state of each mesh, or is empty if they're all opaque with the same state.
+void prepare_draw_list(DrawList& list, const MeshBvh& bvh, const std::vector<MeshSPtr>& meshes, const std::vector<DrawState>& states);
+
+#endif // #ifndef DRAW_LIST_HPP
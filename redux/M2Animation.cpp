@@ -0,0 +1,163 @@
+#include "stdafx.h"
+#include "M2Animation.hpp"
+
+namespace
+{
+  float interpolate(const float a, const float b, const float t)
+  {
+    return a + t * (b - a);
+  }
+
+  D3DXVECTOR3 interpolate(const D3DXVECTOR3& a, const D3DXVECTOR3& b, const float t)
+  {
+    return a + t * (b - a);
+  }
+
+  D3DXQUATERNION interpolate(const D3DXQUATERNION& a, const D3DXQUATERNION& b, const float t)
+  {
+    // nlerp, taking the shortest path. The keys are dense enough that it's indistinguishable from slerp
+    const float sign = D3DXQuaternionDot(&a, &b) < 0 ? -1.0f : 1.0f;
+    D3DXQUATERNION res(a + t * (sign * b - a));
+    D3DXQuaternionNormalize(&res, &res);
+    return res;
+  }
+
+  template<typename T>
+  T sample_keys(const uint32_t* times, const T* values, const uint32_t count, const uint32_t time_in_ms,
+    const bool interpolated, uint32_t& cursor)
+  {
+    if (count == 1 || time_in_ms <= times[0]) {
+      return values[0];
+    }
+
+    const uint32_t key = M2Animation::find_key(times, count, time_in_ms, cursor);
+    if (key + 1 == count || !interpolated) {
+      return values[key];
+    }
+
+    const float ratio = (time_in_ms - times[key]) / (float)(times[key + 1] - times[key]);
+    return interpolate(values[key], values[key + 1], ratio);
+  }
+}
+
+uint32_t M2Animation::sequence_duration(const uint32_t sequence) const
+{
+  return sequence < sequences_.size() ? sequences_[sequence].duration : 0;
+}
+
+int32_t M2Animation::find_sequence(const uint16_t id) const
+{
+  for (size_t i = 0; i < sequences_.size(); ++i) {
+    if (sequences_[i].id == id) {
+      return (int32_t)i;
+    }
+  }
+  return -1;
+}
+
+void M2Animation::init_instance(M2AnimationInstance& instance, const uint32_t sequence) const
+{
+  instance.sequence = sequence;
+  instance.cursors.assign(bones_.size() * NumChannels, 0);
+  instance.palette.resize(bones_.size(), kMtxId);
+}
+
+uint32_t M2Animation::find_key(const uint32_t* times, const uint32_t count, const uint32_t time_in_ms, uint32_t& cursor)
+{
+  // returns the last key with time <= time_in_ms. Try the cached key and the one after it
+  // before falling back to a binary search
+  if (cursor < count && times[cursor] <= time_in_ms) {
+    if (cursor + 1 == count || time_in_ms < times[cursor + 1]) {
+      return cursor;
+    }
+    if (cursor + 2 == count || time_in_ms < times[cursor + 2]) {
+      return ++cursor;
+    }
+  }
+
+  const uint32_t* it = std::upper_bound(times, times + count, time_in_ms);
+  cursor = it == times ? 0 : (uint32_t)(it - times) - 1;
+  return cursor;
+}
+
+uint32_t M2Animation::global_time(const int16_t global_sequence, const uint32_t time_in_ms, const uint32_t global_time_in_ms) const
+{
+  if (global_sequence < 0) {
+    return time_in_ms;
+  }
+  const uint32_t duration = global_sequences_[global_sequence];
+  return duration > 0 ? global_time_in_ms % duration : 0;
+}
+
+template<typename T>
+T M2Animation::sample(const Track<T>& track, const T& default_value, const uint32_t sequence, const uint32_t bone_idx,
+  const Channel channel, const uint32_t time_in_ms, const uint32_t global_time_in_ms, uint32_t& cursor) const
+{
+  const KeyRange& range = track.ranges[sequence * bones_.size() + bone_idx];
+  if (range.count == 0) {
+    return default_value;
+  }
+
+  const Bone& bone = bones_[bone_idx];
+  return sample_keys(&track.times[range.first], &track.values[range.first], range.count,
+    global_time(bone.global_sequence[channel], time_in_ms, global_time_in_ms), bone.interpolate[channel], cursor);
+}
+
+template<typename T>
+T M2Animation::sample_param_track(const M2ParamTrack<T>& track, const T& default_value, const uint32_t sequence,
+  const uint32_t time_in_ms, const uint32_t global_time_in_ms, uint32_t& cursor) const
+{
+  if (sequence >= track.keys.ranges.size()) {
+    return default_value;
+  }
+  const KeyRange& range = track.keys.ranges[sequence];
+  if (range.count == 0) {
+    return default_value;
+  }
+
+  return sample_keys(&track.keys.times[range.first], &track.keys.values[range.first], range.count,
+    global_time(track.global_sequence, time_in_ms, global_time_in_ms), track.interpolate, cursor);
+}
+
+float M2Animation::sample_param(const M2ParamTrack<float>& track, const float default_value, const uint32_t sequence,
+  const uint32_t time_in_ms, const uint32_t global_time_in_ms, uint32_t& cursor) const
+{
+  return sample_param_track(track, default_value, sequence, time_in_ms, global_time_in_ms, cursor);
+}
+
+D3DXVECTOR3 M2Animation::sample_param(const M2ParamTrack<D3DXVECTOR3>& track, const D3DXVECTOR3& default_value, const uint32_t sequence,
+  const uint32_t time_in_ms, const uint32_t global_time_in_ms, uint32_t& cursor) const
+{
+  return sample_param_track(track, default_value, sequence, time_in_ms, global_time_in_ms, cursor);
+}
+
+void M2Animation::update(M2AnimationInstance& instance, const uint32_t time_in_ms, const uint32_t global_time_in_ms) const
+{
+  const uint32_t num_bones = bones_.size();
+  if (instance.palette.size() != num_bones || instance.sequence >= sequences_.size()) {
+    return;
+  }
+
+  const D3DXQUATERNION identity(0, 0, 0, 1);
+  const uint32_t seq = instance.sequence;
+
+  for (uint32_t i = 0; i < num_bones; ++i) {
+    const Bone& bone = bones_[i];
+    uint32_t* cursors = &instance.cursors[i * NumChannels];
+
+    const D3DXVECTOR3 translation(sample(translations_, kVec3Zero, seq, i, Translation, time_in_ms, global_time_in_ms, cursors[Translation]));
+    const D3DXQUATERNION rotation(sample(rotations_, identity, seq, i, Rotation, time_in_ms, global_time_in_ms, cursors[Rotation]));
+    const D3DXVECTOR3 scale(sample(scales_, kVec3One, seq, i, Scale, time_in_ms, global_time_in_ms, cursors[Scale]));
+
+    // scale and rotate around the pivot, then translate
+    D3DXMATRIX local;
+    D3DXMatrixTransformation(&local, &bone.pivot, NULL, &scale, &bone.pivot, &rotation, &translation);
+
+    // the bones are sorted so the parents come first
+    if (bone.parent >= 0) {
+      D3DXMatrixMultiply(&instance.palette[i], &local, &instance.palette[bone.parent]);
+    } else {
+      instance.palette[i] = local;
+    }
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef M2_ANIMATION_HPP
+#define M2_ANIMATION_HPP
+
+// per instance playback state
+struct M2AnimationInstance
+{
+  M2AnimationInstance() : sequence(0) {}
+  uint32_t sequence;
+  // last key used, per bone and channel. Forward playback usually hits the cached key or the next one
+  std::vector<uint32_t> cursors;
+  // bone matrices, in the same (y/z swapped) space as the mesh
+  std::vector<D3DXMATRIX> palette;
+};
+
+template<typename T> struct M2ParamTrack;
+
+/**
+ * Decoded m2 bone animation. The keys of every channel are stored in one array, grouped by sequence,
+ * so all the keys of a sequence are contiguous. Tracks driven by a global sequence are stored once,
+ * and shared by all sequences.
+ */
+class M2Animation
+{
+  friend class M2Loader;
+public:
+  enum Channel { Translation, Rotation, Scale, NumChannels };
+
+  struct KeyRange
+  {
+    KeyRange() : first(0), count(0) {}
+    uint32_t first;
+    uint32_t count;
+  };
+
+  template<typename T>
+  struct Track
+  {
+    std::vector<uint32_t> times;
+    std::vector<T> values;
+    // indexed by sequence * num_bones + bone
+    std::vector<KeyRange> ranges;
+  };
+
+  struct Sequence
+  {
+    uint16_t id;
+    uint32_t duration;
+    uint32_t flags;
+  };
+
+  struct Bone
+  {
+    int16_t parent;
+    D3DXVECTOR3 pivot;
+    int16_t global_sequence[NumChannels];
+    bool interpolate[NumChannels];
+  };
+
+  uint32_t num_bones() const { return bones_.size(); }
+  uint32_t num_sequences() const { return sequences_.size(); }
+  uint32_t sequence_duration(const uint32_t sequence) const;
+  // returns the index of the first sequence with the given animation id, or -1
+  int32_t find_sequence(const uint16_t id) const;
+
+  void init_instance(M2AnimationInstance& instance, const uint32_t sequence) const;
+
+  // time_in_ms is the time into the instance's sequence, global_time_in_ms drives the global sequences
+  void update(M2AnimationInstance& instance, const uint32_t time_in_ms, const uint32_t global_time_in_ms) const;
+
+  static uint32_t find_key(const uint32_t* times, const uint32_t count, const uint32_t time_in_ms, uint32_t& cursor);
+
+  // Samples an animated parameter that isn't tied to a bone, like the emitter settings. cursor is the
+  // last key used, kept by the caller like the bone cursors in M2AnimationInstance.
+  float sample_param(const M2ParamTrack<float>& track, const float default_value, const uint32_t sequence,
+    const uint32_t time_in_ms, const uint32_t global_time_in_ms, uint32_t& cursor) const;
+  D3DXVECTOR3 sample_param(const M2ParamTrack<D3DXVECTOR3>& track, const D3DXVECTOR3& default_value, const uint32_t sequence,
+    const uint32_t time_in_ms, const uint32_t global_time_in_ms, uint32_t& cursor) const;
+
+private:
+  template<typename T>
+  T sample_param_track(const M2ParamTrack<T>& track, const T& default_value, const uint32_t sequence,
+    const uint32_t time_in_ms, const uint32_t global_time_in_ms, uint32_t& cursor) const;
+
+  uint32_t global_time(const int16_t global_sequence, const uint32_t time_in_ms, const uint32_t global_time_in_ms) const;
+
+  template<typename T>
+  T sample(const Track<T>& track, const T& default_value, const uint32_t sequence, const uint32_t bone_idx,
+    const Channel channel, const uint32_t time_in_ms, const uint32_t global_time_in_ms, uint32_t& cursor) const;
+
+  std::vector<Sequence> sequences_;
+  std::vector<uint32_t> global_sequences_;
+  std::vector<Bone> bones_;
+  Track<D3DXVECTOR3> translations_;
+  Track<D3DXQUATERNION> rotations_;
+  Track<D3DXVECTOR3> scales_;
+};
+
+// Keys are stored like the bone channels, but with one range per sequence
+template<typename T>
+struct M2ParamTrack
+{
+  M2ParamTrack() : global_sequence(-1), interpolate(false) {}
+  int16_t global_sequence;
+  bool interpolate;
+  M2Animation::Track<T> keys;
+};
+
+#endif // #ifndef M2_ANIMATION_HPP
@@ -2,6 +2,14 @@
 #include "Scene.hpp"
 #include "M2Loader.hpp"
 #include "Mesh.hpp"
+#include "CompactVertex.hpp"
+#include "AssetLoader.hpp"
+#include "TextureDiskCache.hpp"
+#include "Skinning.hpp"
+#include "M2Animation.hpp"
+#include "M2Particles.hpp"
+#include "CollisionHull.hpp"
+#include "Utils.hpp"
 
 #define THROW_ON_FALSE(x) if (!(x)) { throw std::runtime_error("Error calling: " # x); }
 
@@ -133,8 +141,8 @@ struct M2Header
   CountOffset global_sequence;  // 20
   CountOffset animation;  // 28
   CountOffset c;  // 36
-  CountOffset d;  // 44
-  CountOffset bones;  // 52
+  CountOffset bones;  // 44
+  CountOffset key_bone_lookup;  // 52
   //CountOffset f;  // 60
   CountOffset vertices; // 68
   uint32_t  num_views;
@@ -151,8 +159,8 @@ struct M2Header
   CountOffset texture_unit_def;
   CountOffset transparency_lookup;
   //CountOffset texture_anim_lookup;
-  MinMaxRadius dummy0;
-  MinMaxRadius dummy1;
+  MinMaxRadius bounding_box;
+  MinMaxRadius collision_box;
   CountOffset bounding_triangles;
   CountOffset bounding_vertices;
   CountOffset bounding_normals;
@@ -176,6 +184,141 @@ struct Vertex
   D3DXVECTOR2 pad;
 };
 
+struct AnimationSequence
+{
+  uint16_t id;
+  uint16_t sub_id;
+  uint32_t duration;
+  float move_speed;
+  uint32_t flags;
+  int16_t frequency;
+  uint16_t pad;
+  uint32_t replay_min;
+  uint32_t replay_max;
+  uint32_t blend_time;
+  MinMaxRadius bounds;
+  int16_t next_animation;
+  uint16_t alias_next;
+};
+
+// the keys are only stored in the .m2 for sequences with this flag set, the rest live in .anim files
+const uint32_t kSequenceInline = 0x20;
+
+// timestamps and values are arrays of CountOffset, one per sequence, pointing to the actual keys.
+// If global_sequence is set there is only one array, which is played using the global sequence's duration
+struct AnimationBlock
+{
+  uint16_t interpolation;
+  int16_t global_sequence;
+  CountOffset timestamps;
+  CountOffset values;
+};
+
+struct Bone
+{
+  int32_t key_bone_id;
+  uint32_t flags;
+  int16_t parent;
+  uint16_t submesh_id;
+  uint32_t name_crc;
+  AnimationBlock translation;
+  AnimationBlock rotation;
+  AnimationBlock scale;
+  D3DXVECTOR3 pivot;
+};
+
+struct CompressedQuaternion
+{
+  int16_t x, y, z, w;
+};
+
+// The lifetime tracks of the particles have no interpolation or global sequence, and the timestamps
+// are 16 bit fixed point, where 32767 is the end of the particle's life
+struct FakeAnimationBlock
+{
+  CountOffset timestamps;
+  CountOffset values;
+};
+
+struct ParticleEmitter
+{
+  int32_t id;                         // 0x000
+  uint32_t flags;
+  D3DXVECTOR3 pos;
+  uint16_t bone;                      // 0x014
+  uint16_t texture;
+  CountOffset geometry_model;         // 0x018
+  CountOffset recursion_model;
+  uint8_t blend;                      // 0x028
+  uint8_t emitter_type;
+  uint16_t color_index;
+  uint8_t particle_type;
+  uint8_t head_or_tail;
+  uint16_t texture_tile_rotation;
+  uint16_t texture_rows;              // 0x030
+  uint16_t texture_cols;
+  AnimationBlock speed;               // 0x034
+  AnimationBlock speed_variation;
+  AnimationBlock vertical_range;
+  AnimationBlock horizontal_range;
+  AnimationBlock gravity;
+  AnimationBlock lifespan;
+  float lifespan_variation;           // 0x0ac
+  AnimationBlock emission_rate;
+  float emission_rate_variation;
+  AnimationBlock area_length;         // 0x0c8
+  AnimationBlock area_width;
+  AnimationBlock z_source;
+  FakeAnimationBlock color;           // 0x104
+  FakeAnimationBlock alpha;
+  FakeAnimationBlock scale;
+  D3DXVECTOR2 scale_variation;
+  FakeAnimationBlock head_cell;       // 0x13c
+  FakeAnimationBlock tail_cell;
+  float tail_length;                  // 0x15c
+  float twinkle_speed;
+  float twinkle_percent;
+  float twinkle_scale[2];
+  float burst_multiplier;
+  float drag;                         // 0x174
+  float base_spin;
+  float base_spin_variation;
+  float spin;
+  float spin_variation;
+  D3DXVECTOR3 tumble_min;             // 0x188
+  D3DXVECTOR3 tumble_max;
+  D3DXVECTOR3 wind;                   // 0x1a0
+  float wind_time;
+  float follow_speed1;
+  float follow_scale1;
+  float follow_speed2;
+  float follow_scale2;
+  CountOffset spline_points;          // 0x1c0
+  AnimationBlock enabled;             // 0x1c8
+};
+
+struct RibbonEmitter
+{
+  int32_t id;                         // 0x00
+  int32_t bone;
+  D3DXVECTOR3 pos;
+  CountOffset texture_indices;        // 0x14
+  CountOffset material_indices;
+  AnimationBlock color;               // 0x24
+  AnimationBlock alpha;
+  AnimationBlock height_above;
+  AnimationBlock height_below;
+  float edges_per_second;             // 0x74
+  float edge_lifetime;
+  float gravity;
+  uint16_t texture_rows;              // 0x80
+  uint16_t texture_cols;
+  AnimationBlock texture_slot;
+  AnimationBlock visibility;          // 0x98
+  int16_t priority_plane;
+  uint16_t padding;
+};
+
 struct Triangle
 {
   uint16_t  indices[3];
@@ -206,8 +349,10 @@ bool read_generic_vector_count(std::vector<T>& v, FileReader& f, const int32_t c
 }
 
 
-M2Loader::M2Loader()
+M2Loader::M2Loader(const bool compact_vertices, AssetLoader* asset_loader)
   : scene_(NULL)
+  , compact_vertices_(compact_vertices)
+  , asset_loader_(asset_loader)
 {
 }
 
@@ -223,6 +368,131 @@ D3DXVECTOR3 swap_yz(const D3DXVECTOR3& v)
   return D3DXVECTOR3(v.x, v.z, v.y);
 }
 
+float decompress_quat_component(const int16_t v)
+{
+  return (v < 0 ? v + 32768 : v - 32767) / 32767.0f;
+}
+
+// Swapping y and z is a reflection, so the rotation is mirrored as well. The axis is swapped, and
+// the angle is negated, which for a unit quaternion is the same as negating the vector part
+D3DXQUATERNION swap_yz(const CompressedQuaternion& q)
+{
+  return D3DXQUATERNION(-decompress_quat_component(q.x), -decompress_quat_component(q.z), 
+    -decompress_quat_component(q.y), decompress_quat_component(q.w));
+}
+
+template<typename T>
+T copy_key(const T& v)
+{
+  return v;
+}
+
+float fixed16_to_float(const int16_t& v)
+{
+  return v / 32767.0f;
+}
+
+float uint8_to_float(const uint8_t& v)
+{
+  return v;
+}
+
+D3DXVECTOR3 color_to_unit(const D3DXVECTOR3& v)
+{
+  return v / 255.0f;
+}
+
+// Appends the keys of one channel for one sequence, and returns the range they occupy
+template<typename Src, typename Dst>
+M2Animation::KeyRange append_keys(M2Animation::Track<Dst>& track, const FileReader& f, const AnimationBlock& block, const uint32_t idx,
+  Dst (*convert)(const Src&))
+{
+  M2Animation::KeyRange range;
+  if (idx >= block.timestamps.count || idx >= block.values.count) {
+    return range;
+  }
+
+  const CountOffset& times = ((const CountOffset*)(f.buf_ + block.timestamps.offset))[idx];
+  const CountOffset& values = ((const CountOffset*)(f.buf_ + block.values.offset))[idx];
+  range.first = track.times.size();
+  range.count = std::min(times.count, values.count);
+
+  const uint32_t* src_times = (const uint32_t*)(f.buf_ + times.offset);
+  const Src* src_values = (const Src*)(f.buf_ + values.offset);
+  for (uint32_t i = 0; i < range.count; ++i) {
+    track.times.push_back(src_times[i]);
+    track.values.push_back(convert(src_values[i]));
+  }
+  return range;
+}
+
+template<typename Src, typename Dst>
+void load_track(M2Animation::Track<Dst>& track, const FileReader& f, const std::vector<Bone>& bones, 
+  const std::vector<AnimationSequence>& sequences, AnimationBlock Bone::*block)
+{
+  const uint32_t num_bones = bones.size();
+  track.ranges.resize(sequences.size() * num_bones);
+
+  // the global sequence tracks go first, and are shared by all the sequences
+  for (uint32_t i = 0; i < num_bones; ++i) {
+    const AnimationBlock& b = bones[i].*block;
+    if (b.global_sequence >= 0) {
+      const M2Animation::KeyRange range(append_keys<Src>(track, f, b, 0, &swap_yz));
+      for (uint32_t j = 0; j < sequences.size(); ++j) {
+        track.ranges[j * num_bones + i] = range;
+      }
+    }
+  }
+
+  // the rest are grouped by sequence
+  for (uint32_t j = 0; j < sequences.size(); ++j) {
+    if (!(sequences[j].flags & kSequenceInline)) {
+      continue;
+    }
+    for (uint32_t i = 0; i < num_bones; ++i) {
+      const AnimationBlock& b = bones[i].*block;
+      if (b.global_sequence < 0) {
+        track.ranges[j * num_bones + i] = append_keys<Src>(track, f, b, j, &swap_yz);
+      }
+    }
+  }
+}
+
+// The emitter tracks are laid out like the bone tracks, but there is only one of each
+template<typename Src, typename Dst>
+void load_param_track(M2ParamTrack<Dst>& track, const FileReader& f, const AnimationBlock& block,
+  const std::vector<AnimationSequence>& sequences, const uint32_t num_global_sequences, Dst (*convert)(const Src&))
+{
+  track.global_sequence = block.global_sequence < (int16_t)num_global_sequences ? block.global_sequence : -1;
+  track.interpolate = block.interpolation != 0;
+  track.keys.ranges.resize(sequences.size());
+
+  if (block.global_sequence >= 0) {
+    if (track.global_sequence >= 0) {
+      std::fill(track.keys.ranges.begin(), track.keys.ranges.end(), append_keys<Src>(track.keys, f, block, 0, convert));
+    }
+    return;
+  }
+
+  for (uint32_t j = 0; j < sequences.size(); ++j) {
+    if (sequences[j].flags & kSequenceInline) {
+      track.keys.ranges[j] = append_keys<Src>(track.keys, f, block, j, convert);
+    }
+  }
+}
+
+template<typename Src, typename Dst>
+void load_lifetime_track(M2LifetimeTrack<Dst>& track, const FileReader& f, const FakeAnimationBlock& block, Dst (*convert)(const Src&))
+{
+  const uint32_t count = std::min(block.timestamps.count, block.values.count);
+  const uint16_t* times = (const uint16_t*)(f.buf_ + block.timestamps.offset);
+  const Src* values = (const Src*)(f.buf_ + block.values.offset);
+  for (uint32_t i = 0; i < count; ++i) {
+    track.times.push_back(times[i] / 32767.0f);
+    track.values.push_back(convert(values[i]));
+  }
+}
+
 struct BlpHeader
 {
   char  id[4];
@@ -504,32 +774,6 @@ void DecompressImage( uint8_t* rgba, int32_t width, int32_t height, void const*
   }
 }
 
-#define BITMAP_SIGNATURE 'MB'
-
-struct BitmapFileheader
-{
-  uint16_t Signature;
-  uint32_t Size;
-  uint32_t Reserved;
-  uint32_t BitsOffset;
-};
-
-struct BitmapHeader
-{
-  uint32_t HeaderSize;
-  int32_t Width;
-  int32_t Height;
-  uint16_t Planes;
-  uint16_t BitCount;
-  uint32_t Compression;
-  uint32_t SizeImage;
-  int32_t PelsPerMeterX;
-  int32_t PelsPerMeterY;
-  uint32_t ClrUsed;
-  uint32_t ClrImportant;
-};
-
-
 struct Dbc
 {
   uint8_t header[4];
@@ -729,51 +973,179 @@ void ItemDatabase::load()
   }
 }
 
-ID3D10ShaderResourceView* load_blp(cstr filename)
+// Decodes all the mips of the blp into the texture cache's layout
+FileBuffer decode_blp(const FileBuffer& blp)
 {
-
-  FileReader f;
-  if (!f.open(filename)) {
-    throw std::runtime_error(to_string("unable to load file: %s", filename));
+  if (blp.size() < sizeof(BlpHeader)) {
+    throw std::runtime_error("invalid blp");
+  }
+  const BlpHeader& header = *(const BlpHeader*)&blp[0];
+
+  // only keep the mips that are actually in the file
+  uint32_t num_mips = 0;
+  const uint32_t max_mips = header.has_mip_maps ? CachedTextureHeader::kMaxMips : 1;
+  while (num_mips < max_mips && header.mip_sizes[num_mips] > 0 &&
+    header.mip_offsets[num_mips] + header.mip_sizes[num_mips] <= blp.size() &&
+    ((header.width >> num_mips) > 0 || (header.height >> num_mips) > 0)) {
+    ++num_mips;
+  }
+  if (num_mips == 0) {
+    throw std::runtime_error("blp has no image data");
   }
 
-  BlpHeader header;
-  f.read(&header);
-
-  // create a bmp in memory
-  const uint32_t header_size = sizeof(BitmapFileheader) + sizeof(BitmapHeader);
-  const uint32_t total_size = header_size + header.width * header.height * 4;
+  CachedTextureHeader cached;
+  ZeroMemory(&cached, sizeof(cached));
+  uint32_t ofs = (sizeof(CachedTextureHeader) + 15) & ~15;
+  for (uint32_t i = 0; i < num_mips; ++i) {
+    const uint32_t w = std::max<uint32_t>(1, header.width >> i);
+    const uint32_t h = std::max<uint32_t>(1, header.height >> i);
+    cached.mip_offsets[i] = ofs;
+    cached.mip_sizes[i] = w * h * 4;
+    ofs = (ofs + cached.mip_sizes[i] + 15) & ~15;
+  }
 
-  uint8_t* bmp = new uint8_t[total_size];
-  BitmapFileheader* file_header = (BitmapFileheader*)&bmp[0];
-  BitmapHeader* bitmap_header = (BitmapHeader*)&bmp[sizeof(BitmapFileheader)];
-  uint8_t* decoded_data = bmp + header_size;
+  FileBuffer res(ofs);
+  init_cached_texture_header(cached, header.width, header.height, num_mips);
+  memcpy(&res[0], &cached, sizeof(cached));
+  for (uint32_t i = 0; i < num_mips; ++i) {
+    const uint32_t w = std::max<uint32_t>(1, header.width >> i);
+    const uint32_t h = std::max<uint32_t>(1, header.height >> i);
+    DecompressImage(&res[cached.mip_offsets[i]], w, h, &blp[header.mip_offsets[i]], kDxt1);
+  }
 
-  DecompressImage(decoded_data, header.width, header.height, &f.buf_[header.mip_offsets[0]], kDxt1);
+  return res;
+}
 
-  ZeroMemory(file_header, sizeof(BitmapFileheader));
-  ZeroMemory(bitmap_header, sizeof(BitmapHeader));
-  file_header->Signature = BITMAP_SIGNATURE;
-  file_header->Size = header.width * header.height * 4 + header_size;
-  file_header->BitsOffset = header_size;
+// Returns the decoded blp from the texture cache, or decodes it and adds it to the cache.
+// Doesn't touch the device, so it's safe to call from the thread pool
+FileBuffer load_blp_data(const std::string& filename)
+{
+  const FileBuffer blp(read_file(filename));
+  TextureDiskCache& cache = TextureDiskCache::instance();
+  const TextureCacheKey key(TextureDiskCache::make_key(blp, kDxt1));
+
+  FileBuffer res;
+  if (!cache.load(key, res)) {
+    res = decode_blp(blp);
+    cache.store(key, res);
+  }
+  return res;
+}
 
-  bitmap_header->HeaderSize = sizeof(BitmapHeader);
-  bitmap_header->Width = header.width;
-  bitmap_header->Height = header.height;
-  bitmap_header->Planes = 1;
-  bitmap_header->BitCount = 32;
-  bitmap_header->SizeImage = header.width * header.height * 4;
+ID3D10ShaderResourceView* create_blp_texture(const FileBuffer& data)
+{
+  if (!is_valid_cached_texture(data)) {
+    return NULL;
+  }
+  const CachedTextureHeader& header = *(const CachedTextureHeader*)&data[0];
+
+  D3D10_TEXTURE2D_DESC desc;
+  ZeroMemory(&desc, sizeof(desc));
+  desc.Width = header.width;
+  desc.Height = header.height;
+  desc.MipLevels = header.num_mips;
+  desc.ArraySize = 1;
+  desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+  desc.SampleDesc.Count = 1;
+  desc.Usage = D3D10_USAGE_IMMUTABLE;
+  desc.BindFlags = D3D10_BIND_SHADER_RESOURCE;
+
+  // the mips are used in place
+  D3D10_SUBRESOURCE_DATA init_data[CachedTextureHeader::kMaxMips];
+  for (uint32_t i = 0; i < header.num_mips; ++i) {
+    init_data[i].pSysMem = &data[header.mip_offsets[i]];
+    init_data[i].SysMemPitch = std::max<uint32_t>(1, header.width >> i) * 4;
+    init_data[i].SysMemSlicePitch = 0;
+  }
 
-  ID3D10ShaderResourceView* texture = NULL;
-  if (FAILED(D3DX10CreateShaderResourceViewFromMemory(g_d3d_device, bmp, total_size, NULL, NULL, &texture, NULL))) {
+  ID3D10Texture2D* texture = NULL;
+  if (FAILED(g_d3d_device->CreateTexture2D(&desc, init_data, &texture))) {
     return NULL;
   }
 
-  SAFE_ADELETE(bmp);
+  ID3D10ShaderResourceView* view = NULL;
+  const HRESULT hr = g_d3d_device->CreateShaderResourceView(texture, NULL, &view);
+  SAFE_RELEASE(texture);
+  return SUCCEEDED(hr) ? view : NULL;
+}
 
-  return texture;
+ID3D10ShaderResourceView* load_blp(cstr filename)
+{
+  return create_blp_texture(load_blp_data(filename));
 };
 
+void set_scene_texture(Scene* scene, const uint32_t idx, FileBuffer& data)
+{
+  scene->textures_[idx] = create_blp_texture(data);
+}
+
+bool load_item_database(const boost::shared_ptr<ItemDatabase>& db)
+{
+  db->load();
+  return true;
+}
+
+/*
+
+  look up stuff like this:
+
+    - read the triangles array from the skin (using triangles.count / 3)
+    - this is the global index list, pointing into the verts
+
+    - for a sub mesh, use triangle_ofs/3 and triangle_count/3
+      - use triangle_ofs/3 to find the starting index in the triangle list
+      - triangle_count/3 says how many triangles to use
+
+
+*/
+
+// Reads the triangles of the submesh with the given part id, or the first submesh if part_id is -1,
+// as indices into the global vertex list.
+bool load_skin_triangles(std::vector<int32_t>& out, int32_t& part_id, const std::string& filename)
+{
+  FileReader f;
+  if (!f.open(filename.c_str())) {
+    return false;
+  }
+
+  SkinHeader skin_header;
+  f.read(&skin_header);
+
+  std::vector<int16_t> indices;
+  f.set_pos(skin_header.indices.offset);
+  read_generic_vector_count(indices, f, skin_header.indices.count);
+
+  std::vector<Triangle> triangles;
+  f.set_pos(skin_header.triangles.offset);
+  read_generic_vector_count(triangles, f, skin_header.triangles.count / 3);
+
+  std::vector<Submesh> sub_meshes;
+  f.set_pos(skin_header.submeshes.offset);
+  read_generic_vector_count(sub_meshes, f, skin_header.submeshes.count);
+
+  const Submesh* submesh = NULL;
+  for (size_t i = 0; i < sub_meshes.size() && submesh == NULL; ++i) {
+    if (part_id == -1 || sub_meshes[i].part_id == part_id) {
+      submesh = &sub_meshes[i];
+    }
+  }
+
+  if (submesh == NULL) {
+    return false;
+  }
+  part_id = submesh->part_id;
+
+  out.resize(submesh->tri_cnt);
+  for (int32_t i = 0, e = submesh->tri_cnt / 3; i < e; ++i) {
+    const Triangle &cur_triangle = triangles[submesh->tri_ofs / 3 + i];
+    for (int32_t j = 0; j < 3; ++j) {
+      static int32_t swapper[] = { 0, 2, 1 };
+      out[i*3+j] = (uint16_t)indices[cur_triangle.indices[swapper[j]]];
+    }
+  }
+  return true;
+}
+
 const ItemDisplayInfoRecord* find_record(const uint32_t part_id, const std::vector<ItemDisplayInfoRecord>& records)
 {
   for (size_t i = 0; i < records.size(); ++i) {
@@ -786,16 +1158,185 @@ const ItemDisplayInfoRecord* find_record(const uint32_t part_id, const std::vect
 }
 
 
-void M2Loader::load(const char* filename, Scene* scene)
+void M2Loader::load_animation(const FileReader& f, const M2Header& header)
 {
-  filesystem::path root(filesystem::path(filename).replace_extension());
-  const std::string skin_filename(root.string() + "00.skin");
+  std::vector<Bone> bones(header.bones.count);
+  std::vector<AnimationSequence> sequences(header.animation.count);
+  if (bones.empty() || sequences.empty()) {
+    return;
+  }
+  memcpy(&bones[0], f.buf_ + header.bones.offset, bones.size() * sizeof(Bone));
+  memcpy(&sequences[0], f.buf_ + header.animation.offset, sequences.size() * sizeof(AnimationSequence));
 
-  FileReader f2;
-  f2.open(skin_filename.c_str());
+  M2Animation* animation = new M2Animation();
 
-  SkinHeader skin_header;
-  f2.read(&skin_header);
+  if (header.global_sequence.count > 0) {
+    const uint32_t* global_sequences = (const uint32_t*)(f.buf_ + header.global_sequence.offset);
+    animation->global_sequences_.assign(global_sequences, global_sequences + header.global_sequence.count);
+  }
+
+  animation->sequences_.resize(sequences.size());
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    M2Animation::Sequence& s = animation->sequences_[i];
+    s.id = sequences[i].id;
+    s.duration = sequences[i].duration;
+    s.flags = sequences[i].flags;
+  }
+
+  animation->bones_.resize(bones.size());
+  for (size_t i = 0; i < bones.size(); ++i) {
+    const Bone& src = bones[i];
+    M2Animation::Bone& dst = animation->bones_[i];
+    // the bones are evaluated in order, so a parent has to come before its children
+    dst.parent = src.parent < (int16_t)i ? src.parent : -1;
+    if (dst.parent != src.parent) {
+      LOG_WARNING_LN("bone %d has parent %d, which comes after it. ignoring parent", i, src.parent);
+    }
+    dst.pivot = swap_yz(src.pivot);
+    const AnimationBlock* blocks[] = { &src.translation, &src.rotation, &src.scale };
+    for (int32_t j = 0; j < M2Animation::NumChannels; ++j) {
+      const int16_t global_sequence = blocks[j]->global_sequence;
+      dst.global_sequence[j] = global_sequence < (int16_t)animation->global_sequences_.size() ? global_sequence : -1;
+      dst.interpolate[j] = blocks[j]->interpolation != 0;
+      if (global_sequence >= 0 && dst.global_sequence[j] < 0) {
+        LOG_WARNING_LN("bone %d references missing global sequence %d", i, global_sequence);
+      }
+    }
+  }
+
+  load_track<D3DXVECTOR3>(animation->translations_, f, bones, sequences, &Bone::translation);
+  load_track<CompressedQuaternion>(animation->rotations_, f, bones, sequences, &Bone::rotation);
+  load_track<D3DXVECTOR3>(animation->scales_, f, bones, sequences, &Bone::scale);
+
+  LOG_INFO_LN("animation: %d bones, %d sequences, %d keys", bones.size(), sequences.size(), 
+    animation->translations_.times.size() + animation->rotations_.times.size() + animation->scales_.times.size());
+
+  animation_.reset(animation);
+}
+
+// The bounding lumps are a low poly version of the model, used by the client for collision
+CollisionHull* load_collision_hull(const FileReader& f, const M2Header& header)
+{
+  const uint32_t num_triangles = header.bounding_triangles.count / 3;
+  if (num_triangles == 0 || header.bounding_vertices.count == 0) {
+    return NULL;
+  }
+
+  CollisionHull* hull = new CollisionHull();
+
+  const D3DXVECTOR3* vertices = (const D3DXVECTOR3*)(f.buf_ + header.bounding_vertices.offset);
+  hull->vertices.resize(header.bounding_vertices.count);
+  for (uint32_t i = 0; i < header.bounding_vertices.count; ++i) {
+    hull->vertices[i] = swap_yz(vertices[i]);
+  }
+
+  // swap the winding, like the mesh, so it matches the swapped normals
+  const uint16_t* indices = (const uint16_t*)(f.buf_ + header.bounding_triangles.offset);
+  hull->indices.resize(num_triangles * 3);
+  for (uint32_t i = 0; i < num_triangles; ++i) {
+    hull->indices[i*3+0] = indices[i*3+0];
+    hull->indices[i*3+1] = indices[i*3+2];
+    hull->indices[i*3+2] = indices[i*3+1];
+  }
+
+  const D3DXVECTOR3* normals = (const D3DXVECTOR3*)(f.buf_ + header.bounding_normals.offset);
+  hull->normals.resize(num_triangles);
+  for (uint32_t i = 0; i < num_triangles; ++i) {
+    if (header.bounding_normals.count == num_triangles) {
+      hull->normals[i] = swap_yz(normals[i]);
+    } else {
+      const D3DXVECTOR3& v0 = hull->vertices[hull->indices[i*3+0]];
+      const D3DXVECTOR3 e1(hull->vertices[hull->indices[i*3+1]] - v0);
+      const D3DXVECTOR3 e2(hull->vertices[hull->indices[i*3+2]] - v0);
+      D3DXVec3Cross(&hull->normals[i], &e1, &e2);
+      D3DXVec3Normalize(&hull->normals[i], &hull->normals[i]);
+    }
+  }
+
+  calc_hull_bounds(*hull);
+  return hull;
+}
+
+void M2Loader::load_emitters(const FileReader& f, const M2Header& header, const std::vector<int32_t>& scene_textures)
+{
+  // the tracks are sampled through the animation, so there's nothing to drive them without one
+  if (!animation_ || (header.particle_emitters.count == 0 && header.ribbon_emitters.count == 0)) {
+    return;
+  }
+
+  std::vector<AnimationSequence> sequences(header.animation.count);
+  memcpy(&sequences[0], f.buf_ + header.animation.offset, sequences.size() * sizeof(AnimationSequence));
+  const uint32_t num_global_sequences = animation_->global_sequences_.size();
+
+  M2Emitters* emitters = new M2Emitters();
+
+  const ParticleEmitter* particles = (const ParticleEmitter*)(f.buf_ + header.particle_emitters.offset);
+  emitters->particles.resize(header.particle_emitters.count);
+  for (uint32_t i = 0; i < header.particle_emitters.count; ++i) {
+    const ParticleEmitter& src = particles[i];
+    M2ParticleEmitterDef& dst = emitters->particles[i];
+    dst.flags = src.flags;
+    dst.pos = swap_yz(src.pos);
+    dst.bone = (int16_t)src.bone;
+    dst.texture = src.texture < scene_textures.size() ? scene_textures[src.texture] : -1;
+    dst.blend = src.blend;
+    dst.type = src.emitter_type;
+    dst.tile_rows = src.texture_rows;
+    dst.tile_cols = src.texture_cols;
+    dst.lifespan_variation = src.lifespan_variation;
+    dst.emission_rate_variation = src.emission_rate_variation;
+    dst.drag = src.drag;
+
+    const std::pair<M2ParamTrack<float> M2ParticleEmitterDef::*, const AnimationBlock*> tracks[] = {
+      std::make_pair(&M2ParticleEmitterDef::speed, &src.speed),
+      std::make_pair(&M2ParticleEmitterDef::speed_variation, &src.speed_variation),
+      std::make_pair(&M2ParticleEmitterDef::vertical_range, &src.vertical_range),
+      std::make_pair(&M2ParticleEmitterDef::horizontal_range, &src.horizontal_range),
+      std::make_pair(&M2ParticleEmitterDef::gravity, &src.gravity),
+      std::make_pair(&M2ParticleEmitterDef::lifespan, &src.lifespan),
+      std::make_pair(&M2ParticleEmitterDef::emission_rate, &src.emission_rate),
+      std::make_pair(&M2ParticleEmitterDef::area_length, &src.area_length),
+      std::make_pair(&M2ParticleEmitterDef::area_width, &src.area_width),
+    };
+    for (size_t j = 0; j < sizeof(tracks) / sizeof(tracks[0]); ++j) {
+      load_param_track<float>(dst.*tracks[j].first, f, *tracks[j].second, sequences, num_global_sequences, &copy_key<float>);
+    }
+    load_param_track<uint8_t>(dst.enabled, f, src.enabled, sequences, num_global_sequences, &uint8_to_float);
+
+    load_lifetime_track<D3DXVECTOR3>(dst.color, f, src.color, &color_to_unit);
+    load_lifetime_track<int16_t>(dst.alpha, f, src.alpha, &fixed16_to_float);
+    load_lifetime_track<D3DXVECTOR2>(dst.scale, f, src.scale, &copy_key<D3DXVECTOR2>);
+  }
+
+  const RibbonEmitter* ribbons = (const RibbonEmitter*)(f.buf_ + header.ribbon_emitters.offset);
+  emitters->ribbons.resize(header.ribbon_emitters.count);
+  for (uint32_t i = 0; i < header.ribbon_emitters.count; ++i) {
+    const RibbonEmitter& src = ribbons[i];
+    M2RibbonEmitterDef& dst = emitters->ribbons[i];
+    dst.pos = swap_yz(src.pos);
+    dst.bone = (int16_t)src.bone;
+    if (src.texture_indices.count > 0) {
+      const uint16_t texture = *(const uint16_t*)(f.buf_ + src.texture_indices.offset);
+      dst.texture = texture < scene_textures.size() ? scene_textures[texture] : -1;
+    }
+    dst.edges_per_second = src.edges_per_second;
+    dst.edge_lifetime = src.edge_lifetime;
+    dst.gravity = src.gravity;
+
+    load_param_track<D3DXVECTOR3>(dst.color, f, src.color, sequences, num_global_sequences, &copy_key<D3DXVECTOR3>);
+    load_param_track<int16_t>(dst.alpha, f, src.alpha, sequences, num_global_sequences, &fixed16_to_float);
+    load_param_track<float>(dst.height_above, f, src.height_above, sequences, num_global_sequences, &copy_key<float>);
+    load_param_track<float>(dst.height_below, f, src.height_below, sequences, num_global_sequences, &copy_key<float>);
+    load_param_track<uint8_t>(dst.visibility, f, src.visibility, sequences, num_global_sequences, &uint8_to_float);
+  }
+
+  LOG_INFO_LN("emitters: %d particle, %d ribbon", emitters->particles.size(), emitters->ribbons.size());
+  emitters_.reset(emitters);
+}
+
+void M2Loader::load(const char* filename, Scene* scene)
+{
+  filesystem::path root(filesystem::path(filename).replace_extension());
 
   scene_ = scene;
 
@@ -806,6 +1347,8 @@ void M2Loader::load(const char* filename, Scene* scene)
 
   uint32_t p = (uint32_t)(&header.vertices.count) - (uint32_t)(&header);
 
+  load_animation(f, header);
+
   // load global vertex list
   typedef std::vector<Vertex> Vertices;
   std::vector<Vertex> vertices;
@@ -821,89 +1364,161 @@ void M2Loader::load(const char* filename, Scene* scene)
 
   const std::string texture_path("C:/projects/MpqExtract/dump/");
 
+  // the scene's index for each of the model's textures, or -1 if it wasn't loaded
+  std::vector<int32_t> scene_textures(textures.size(), -1);
+
   for (int32_t i = 0, e = textures.size(); i < e; ++i) {
     if (textures[i].filename_len > 1) {
       const std::string texture_filename(texture_path + (const char*)&f.buf_[textures[i].filename_ofs]);
       LOG_INFO_LN("loading texture: %s", texture_filename.c_str());
       if (textures[i].type == 0) {
-        ID3D10ShaderResourceView* texture = load_blp(texture_filename.c_str());
-        scene->textures_.push_back(texture);
+        scene_textures[i] = scene->textures_.size();
+        if (asset_loader_) {
+          // decode on the thread pool, and create the texture on the main thread once it's done
+          const uint32_t idx = scene->textures_.size();
+          scene->textures_.push_back(NULL);
+          asset_loader_->add_finalizer<FileBuffer>(
+            asset_loader_->submit<FileBuffer>(boost::bind(&load_blp_data, texture_filename)),
+            boost::bind(&set_scene_texture, scene, idx, _1));
+        } else {
+          ID3D10ShaderResourceView* texture = load_blp(texture_filename.c_str());
+          scene->textures_.push_back(texture);
+        }
       }
     }
   }
   const char* texture_names = (const char*)&f.buf_[header.textures.offset + header.textures.count * sizeof(Texture)];
 
-  ItemDatabase db;
-  db.load();
-
-  const DirEntry *entry = db.find_dir_entry(1);
-
-  std::vector<int16_t> indices;
-  f2.set_pos(skin_header.indices.offset);
-  read_generic_vector_count(indices, f2, skin_header.indices.count);
-
-  std::vector<Triangle> triangles;
-  f2.set_pos(skin_header.triangles.offset);
-  read_generic_vector_count(triangles, f2, skin_header.triangles.count / 3);
-
-  std::vector<Submesh> sub_meshes;
-  f2.set_pos(skin_header.submeshes.offset);
-  read_generic_vector_count(sub_meshes, f2, skin_header.submeshes.count);
-
-  std::vector<TextureUnit> texture_units;
-  f2.set_pos(skin_header.texture_units.offset);
-  read_generic_vector_count(texture_units, f2, skin_header.texture_units.count);
-
-/*
-
-  look up stuff like this:
-
-    - read the triangles array from the skin (using triangles.count / 3)
-    - this is the global index list, pointing into the verts
+  load_emitters(f, header, scene_textures);
 
-    - for a sub mesh, use triangle_ofs/3 and triangle_count/3
-      - use triangle_ofs/3 to find the starting index in the triangle list
-      - triangle_count/3 says how many triangles to use
+  // the dbc files are loaded in the background while we parse the skin
+  boost::shared_ptr<ItemDatabase> db(new ItemDatabase());
+  Future<bool> db_loaded;
+  if (asset_loader_) {
+    db_loaded = asset_loader_->submit<bool>(boost::bind(&load_item_database, db));
+  } else {
+    db->load();
+  }
 
+  // each view is a lower detail version of the model. Use the first submesh of the full detail
+  // skin, and the submesh with the same part id in the others
+  std::vector< std::vector<int32_t> > lods;
+  int32_t part_id = -1;
+  for (uint32_t i = 0, e = std::max<uint32_t>(1, header.num_views); i < e; ++i) {
+    const std::string skin_filename(to_string("%s%02d.skin", root.string().c_str(), i));
+    std::vector<int32_t> lod;
+    if (!load_skin_triangles(lod, part_id, skin_filename)) {
+      break;
+    }
+    lods.push_back(lod);
+  }
 
-*/
+  if (lods.empty()) {
+    LOG_ERROR_LN("Error loading skin for: %s", filename);
+    return;
+  }
 
+  // the lods share one vertex buffer, holding the vertices used by any of them
+  std::vector<int32_t> remap(vertices.size(), -1);
+  for (size_t i = 0; i < lods.size(); ++i) {
+    for (size_t j = 0; j < lods[i].size(); ++j) {
+      remap[lods[i][j]] = 0;
+    }
+  }
+  std::vector<int32_t> used_vertices;
+  for (int32_t i = 0, e = remap.size(); i < e; ++i) {
+    if (remap[i] >= 0) {
+      remap[i] = used_vertices.size();
+      used_vertices.push_back(i);
+    }
+  }
+  const uint32_t num_verts = used_vertices.size();
 
   Mesh* mesh = new Mesh("test");
   mesh->vertex_buffer_stride_ = sizeof(M2Vertex);
   mesh->index_buffer_format_ = DXGI_FORMAT_R16_UINT;
 
-  // create a mesh from the first submesh
-  const Submesh &submesh = sub_meshes[0];
-
-  const int32_t vertex_count = submesh.tri_cnt;
-  std::vector<M2Vertex> verts;
-  verts.resize(submesh.vtx_cnt);
-  std::vector<int16_t> idx;
-  idx.resize(vertex_count);
-  int max_idx = 0;
-  for (int32_t i = 0, e = submesh.tri_cnt / 3; i < e; ++i) {
-    const Triangle &cur_triangle = triangles[submesh.tri_ofs / 3 + i];
-    for (int32_t j = 0; j < 3; ++j) {
-      static int32_t swapper[] = { 0, 2, 1 };
-      const int16_t cur_idx = indices[cur_triangle.indices[swapper[j]]];
-      idx[i*3+j] = cur_idx;
-    }
-  }
-
-  for (int32_t i = 0, e = submesh.vtx_cnt; i < e; ++i) {
-    const Vertex &cur_vtx = vertices[submesh.vtx_ofs + i];
+  std::vector<M2Vertex> verts(num_verts);
+  for (uint32_t i = 0; i < num_verts; ++i) {
+    const Vertex &cur_vtx = vertices[used_vertices[i]];
     verts[i].pos = swap_yz(cur_vtx.pos);
     verts[i].normal = swap_yz(cur_vtx.normal);
     verts[i].uv = cur_vtx.uv;
   }
 
-  create_static_vertex_buffer(mesh->vertex_buffer_, g_d3d_device, (uint8_t*)&verts[0].pos.x, submesh.vtx_cnt, sizeof(M2Vertex));
-  create_static_index_buffer(mesh->index_buffer_, g_d3d_device, (uint8_t*)&idx[0], vertex_count, 2);
-  mesh->index_count_ = vertex_count;
+  // the skinning writes full precision vertices every frame, so only static meshes are quantized
+  const bool skinned = header.bones.count > 0;
+
+  if (skinned) {
+    // keep the bind pose and the weights around, and skin into a dynamic buffer every frame
+    SkinMesh* skin = new SkinMesh();
+    skin->num_bones = header.bones.count;
+    skin->layout = SkinOutputLayout(sizeof(M2Vertex), offsetof(M2Vertex, pos), offsetof(M2Vertex, normal), offsetof(M2Vertex, uv));
+    skin->vertices.resize(num_verts);
+    for (uint32_t i = 0; i < num_verts; ++i) {
+      const Vertex &cur_vtx = vertices[used_vertices[i]];
+      SkinVertex& v = skin->vertices[i];
+      v.pos = verts[i].pos;
+      v.normal = verts[i].normal;
+      v.uv = verts[i].uv;
+      memcpy(v.bone_weights, cur_vtx.bone_weights, sizeof(v.bone_weights));
+      memcpy(v.bone_index, cur_vtx.bone_index, sizeof(v.bone_index));
+    }
+    if (const uint32_t num_dropped = validate_bone_indices(*skin)) {
+      LOG_WARNING_LN("[%s] dropped %d influences of bones outside the %d in the model", __FUNCTION__, num_dropped, skin->num_bones);
+    }
+    mesh->skin_mesh_.reset(skin);
+    mesh->vertex_buffer_ = create_dynamic_buffer(g_d3d_device, D3D10_BIND_VERTEX_BUFFER, num_verts * sizeof(M2Vertex));
+  } else if (compact_vertices_) {
+    std::vector<CompactVertex> compact_verts;
+    QuantizationError error;
+    quantize_vertices(compact_verts, mesh->quantization_bounds_, error, 
+      (const uint8_t*)&verts[0].pos, (const uint8_t*)&verts[0].normal, (const uint8_t*)&verts[0].uv, num_verts, sizeof(M2Vertex));
+    LOG_INFO_LN("compact vertices: %d -> %d bytes/vertex. max error, pos: %f, normal: %f deg, uv: %f", 
+      sizeof(M2Vertex), sizeof(CompactVertex), error.max_pos_error, error.max_normal_error_deg, error.max_uv_error);
+
+    mesh->compact_vertices_ = true;
+    mesh->vertex_buffer_stride_ = sizeof(CompactVertex);
+    create_static_vertex_buffer(mesh->vertex_buffer_, g_d3d_device, (uint8_t*)&compact_verts[0], num_verts, sizeof(CompactVertex));
+  } else {
+    create_static_vertex_buffer(mesh->vertex_buffer_, g_d3d_device, (uint8_t*)&verts[0].pos.x, num_verts, sizeof(M2Vertex));
+  }
+
+  for (size_t i = 0; i < lods.size(); ++i) {
+    std::vector<uint16_t> idx(lods[i].size());
+    for (size_t j = 0; j < idx.size(); ++j) {
+      idx[j] = (uint16_t)remap[lods[i][j]];
+    }
+
+    ID3D10Buffer* index_buffer = NULL;
+    create_static_index_buffer(index_buffer, g_d3d_device, (uint8_t*)&idx[0], idx.size(), 2);
+    if (i == 0) {
+      mesh->index_buffer_ = index_buffer;
+      mesh->index_count_ = idx.size();
+    } else {
+      mesh->lods_.push_back(Mesh::IndexLod(index_buffer, idx.size()));
+    }
+    LOG_INFO_LN("lod %d: %d triangles", i, idx.size() / 3);
+  }
+
+  // the bounding box is in the model's space, so it has to be swapped like the vertices
+  const D3DXVECTOR3 bb_min(swap_yz(header.bounding_box.min));
+  const D3DXVECTOR3 bb_max(swap_yz(header.bounding_box.max));
+  const D3DXVECTOR3 extents(0.5f * (bb_max - bb_min));
+  mesh->bounding_sphere_center_ = 0.5f * (bb_min + bb_max);
+  mesh->bounding_sphere_radius_ = D3DXVec3Length(&extents);
+
+  mesh->collision_hull_.reset(load_collision_hull(f, header));
+  if (const CollisionHullSPtr& hull = mesh->collision_hull_) {
+    LOG_INFO_LN("collision hull: %d triangles, %d vertices", hull->indices.size() / 3, hull->vertices.size());
+  }
 
   scene_->meshes_.push_back(MeshSPtr(mesh));
 
+  if (db_loaded.is_valid()) {
+    db_loaded.get();
+  }
+  const DirEntry *entry = db->find_dir_entry(1);
 }
 
 #pragma pack(pop)
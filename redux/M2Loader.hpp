@@ -1,17 +1,37 @@
 #ifndef M2LOADER_HPP
 #define M2LOADER_HPP
 
+#include "ReduxTypes.hpp"
+
 struct Scene;
+struct FileReader;
+struct M2Header;
+class AssetLoader;
 
 class M2Loader
 {
 public:
-  M2Loader();
+  // if compact_vertices is set, the vertices of unskinned meshes are quantized to CompactVertex. If an asset_loader is
+  // given, the textures are decoded on its thread pool and created by its finalizers, so they
+  // won't be valid until the owner has called AssetLoader::process_finalizers.
+  M2Loader(const bool compact_vertices = false, AssetLoader* asset_loader = NULL);
   void  load(const char* filename, Scene* scene);
 
+  // the bone animation of the last loaded model, or empty if it has no bones
+  const M2AnimationSPtr& animation() const { return animation_; }
+  // the particle and ribbon emitters of the last loaded model, or empty if it has none
+  const M2EmittersSPtr& emitters() const { return emitters_; }
+
 private:
 
+  void load_animation(const FileReader& f, const M2Header& header);
+  void load_emitters(const FileReader& f, const M2Header& header, const std::vector<int32_t>& scene_textures);
+
   Scene* scene_;
+  bool compact_vertices_;
+  AssetLoader* asset_loader_;
+  M2AnimationSPtr animation_;
+  M2EmittersSPtr emitters_;
 
 };
 
@@ -0,0 +1,617 @@
+#include "stdafx.h"
+#include "M2Particles.hpp"
+#include "Utils.hpp"
+#include "ThreadPool.hpp"
+
+namespace
+{
+  // emitters per chunk when splitting the update over the thread pool
+  const uint32_t kEmitterGrainSize = 16;
+  const uint32_t kMaxParticlesPerEmitter = 1024;
+  const uint32_t kMaxRibbonEdges = 256;
+  const uint32_t kVerticesPerQuad = 6;
+
+  // xorshift, so every emitter can have its own generator and the result doesn't depend on the
+  // order the emitters are updated in
+  inline float random_unit(uint32_t& state)
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state & 0xffffff) / (float)0x1000000;
+  }
+
+  inline float random_signed(uint32_t& state)
+  {
+    return 2 * random_unit(state) - 1;
+  }
+
+  template<typename T>
+  T lerp(const T& a, const T& b, const float t)
+  {
+    return a + t * (b - a);
+  }
+
+  template<typename T>
+  T sample_lifetime(const M2LifetimeTrack<T>& track, const T& default_value, const float t)
+  {
+    const uint32_t count = std::min(track.times.size(), track.values.size());
+    if (count == 0) {
+      return default_value;
+    }
+    if (count == 1 || t <= track.times[0]) {
+      return track.values[0];
+    }
+    for (uint32_t i = 1; i < count; ++i) {
+      if (t < track.times[i]) {
+        const float span = track.times[i] - track.times[i-1];
+        return lerp(track.values[i-1], track.values[i], span > 0 ? (t - track.times[i-1]) / span : 0);
+      }
+    }
+    return track.values[count - 1];
+  }
+
+  float max_value(const M2ParamTrack<float>& track, const float default_value)
+  {
+    return track.keys.values.empty() ? default_value : *std::max_element(track.keys.values.begin(), track.keys.values.end());
+  }
+
+  inline void write_vertex(ParticleVertex* dst, const D3DXVECTOR3& pos, const D3DXCOLOR& color, const float u, const float v)
+  {
+    dst->pos = pos;
+    dst->color = color;
+    dst->uv = D3DXVECTOR2(u, v);
+  }
+
+  // two triangles, a-b-c and c-b-d
+  inline void write_quad(ParticleVertex* dst, const ParticleVertex& a, const ParticleVertex& b, const ParticleVertex& c, const ParticleVertex& d)
+  {
+    dst[0] = a;
+    dst[1] = b;
+    dst[2] = c;
+    dst[3] = c;
+    dst[4] = b;
+    dst[5] = d;
+  }
+}
+
+M2ParticleEmitterDef::M2ParticleEmitterDef()
+  : flags(0)
+  , pos(kVec3Zero)
+  , bone(-1)
+  , texture(-1)
+  , blend(0)
+  , type(Plane)
+  , tile_rows(1)
+  , tile_cols(1)
+  , lifespan_variation(0)
+  , emission_rate_variation(0)
+  , drag(0)
+{
+}
+
+ParticleBlend M2ParticleEmitterDef::particle_blend() const
+{
+  // opaque, alpha key and alpha are all drawn alpha blended, as the particles fade out
+  switch (blend) {
+    case 0:
+    case 1:
+    case 2: return AlphaBlend;
+    case 3:
+    case 4: return AdditiveBlend;
+    case 5: return ModulateBlend;
+    case 6: return Modulate2xBlend;
+  }
+  LOG_WARNING_LN_ONESHOT("[%s] Unknown blend mode: %d", __FUNCTION__, blend);
+  return AlphaBlend;
+}
+
+M2RibbonEmitterDef::M2RibbonEmitterDef()
+  : pos(kVec3Zero)
+  , bone(-1)
+  , texture(-1)
+  , edges_per_second(0)
+  , edge_lifetime(0)
+  , gravity(0)
+{
+}
+
+M2ParticleSystem::M2ParticleSystem(const M2AnimationSPtr& animation, const M2EmittersSPtr& emitters, const uint32_t seed)
+  : animation_(animation)
+  , emitters_(emitters)
+{
+  // size the pools for the worst case of the tracks, so nothing is allocated while running
+  particle_pools_.resize(emitters_->particles.size());
+  for (size_t i = 0; i < particle_pools_.size(); ++i) {
+    const M2ParticleEmitterDef& def = emitters_->particles[i];
+    const float rate = max_value(def.emission_rate, 0) * (1 + def.emission_rate_variation);
+    const float lifespan = max_value(def.lifespan, 1) * (1 + def.lifespan_variation);
+    ParticlePool& pool = particle_pools_[i];
+    pool.capacity = std::min(kMaxParticlesPerEmitter, (uint32_t)ceilf(rate * lifespan) + 1);
+    pool.data.resize(pool.capacity * NumParticleStreams);
+    pool.rng = seed + (uint32_t)i * 0x9e3779b9;
+    if (pool.rng == 0) {
+      pool.rng = 1;
+    }
+  }
+
+  ribbon_pools_.resize(emitters_->ribbons.size());
+  for (size_t i = 0; i < ribbon_pools_.size(); ++i) {
+    const M2RibbonEmitterDef& def = emitters_->ribbons[i];
+    RibbonPool& pool = ribbon_pools_[i];
+    pool.capacity = std::min(kMaxRibbonEdges, (uint32_t)ceilf(def.edges_per_second * def.edge_lifetime) + 2);
+    pool.data.resize(pool.capacity * NumRibbonStreams);
+  }
+}
+
+uint32_t M2ParticleSystem::max_vertices() const
+{
+  uint32_t res = 0;
+  for (size_t i = 0; i < particle_pools_.size(); ++i) {
+    res += particle_pools_[i].capacity * kVerticesPerQuad;
+  }
+  for (size_t i = 0; i < ribbon_pools_.size(); ++i) {
+    res += ribbon_pools_[i].capacity * kVerticesPerQuad;
+  }
+  return res;
+}
+
+uint32_t M2ParticleSystem::num_particles() const
+{
+  uint32_t res = 0;
+  for (size_t i = 0; i < particle_pools_.size(); ++i) {
+    res += particle_pools_[i].count;
+  }
+  return res;
+}
+
+D3DXMATRIX M2ParticleSystem::emitter_matrix(const UpdateContext& ctx, const int16_t bone, const D3DXVECTOR3& pos) const
+{
+  D3DXMATRIX mtx;
+  D3DXMatrixTranslation(&mtx, pos.x, pos.y, pos.z);
+  const std::vector<D3DXMATRIX>& palette = ctx.instance->palette;
+  if (bone >= 0 && bone < (int16_t)palette.size()) {
+    D3DXMatrixMultiply(&mtx, &mtx, &palette[bone]);
+  }
+  return mtx;
+}
+
+void M2ParticleSystem::update(const M2AnimationInstance& instance, const uint32_t time_in_ms, const uint32_t global_time_in_ms,
+  const float dt, ThreadPool* pool)
+{
+  UpdateContext ctx;
+  ctx.instance = &instance;
+  ctx.time_in_ms = time_in_ms;
+  ctx.global_time_in_ms = global_time_in_ms;
+  ctx.dt = dt;
+
+  const uint32_t num_emitters = particle_pools_.size() + ribbon_pools_.size();
+  if (pool) {
+    pool->parallel_for(num_emitters, kEmitterGrainSize, boost::bind(&M2ParticleSystem::update_range, this, &ctx, _1, _2));
+  } else {
+    update_range(&ctx, 0, num_emitters);
+  }
+}
+
+void M2ParticleSystem::update_range(const UpdateContext* ctx, const uint32_t begin, const uint32_t end)
+{
+  // the particle emitters come first, then the ribbons
+  const uint32_t num_particle_emitters = particle_pools_.size();
+  for (uint32_t i = begin; i < end; ++i) {
+    if (i < num_particle_emitters) {
+      update_particles(*ctx, i);
+    } else {
+      update_ribbon(*ctx, i - num_particle_emitters);
+    }
+  }
+}
+
+void M2ParticleSystem::update_particles(const UpdateContext& ctx, const uint32_t idx)
+{
+  const M2ParticleEmitterDef& def = emitters_->particles[idx];
+  ParticlePool& pool = particle_pools_[idx];
+  const M2Animation& a = *animation_;
+  const uint32_t seq = ctx.instance->sequence;
+  const uint32_t t = ctx.time_in_ms;
+  const uint32_t gt = ctx.global_time_in_ms;
+  const float dt = ctx.dt;
+
+  float* px = pool.stream(PosX);
+  float* py = pool.stream(PosY);
+  float* pz = pool.stream(PosZ);
+  float* vx = pool.stream(VelX);
+  float* vy = pool.stream(VelY);
+  float* vz = pool.stream(VelZ);
+  float* age = pool.stream(Age);
+  float* lifespan = pool.stream(Lifespan);
+
+  // retire the dead particles by moving the last live one into their slot
+  for (uint32_t i = 0; i < pool.count; ) {
+    age[i] += dt;
+    if (age[i] < lifespan[i]) {
+      ++i;
+      continue;
+    }
+    const uint32_t last = --pool.count;
+    px[i] = px[last]; py[i] = py[last]; pz[i] = pz[last];
+    vx[i] = vx[last]; vy[i] = vy[last]; vz[i] = vz[last];
+    age[i] = age[last];
+    lifespan[i] = lifespan[last];
+  }
+
+  // gravity pulls along -y, as z is up in the m2 files
+  const uint32_t count = pool.count;
+  const float gravity = a.sample_param(def.gravity, 0, seq, t, gt, pool.cursors[GravityParam]);
+  const float damping = std::max(0.0f, 1 - def.drag * dt);
+  for (uint32_t i = 0; i < count; ++i) {
+    vy[i] -= gravity * dt;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    vx[i] *= damping;
+    vy[i] *= damping;
+    vz[i] *= damping;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    px[i] += vx[i] * dt;
+    py[i] += vy[i] * dt;
+    pz[i] += vz[i] * dt;
+  }
+
+  if (a.sample_param(def.enabled, 1, seq, t, gt, pool.cursors[EnabledParam]) <= 0) {
+    pool.spawn_acc = 0;
+    return;
+  }
+
+  const float rate = a.sample_param(def.emission_rate, 0, seq, t, gt, pool.cursors[RateParam]);
+  pool.spawn_acc += std::max(0.0f, rate * (1 + def.emission_rate_variation * random_signed(pool.rng))) * dt;
+  const uint32_t num_spawned = std::min((uint32_t)pool.spawn_acc, pool.capacity - pool.count);
+  pool.spawn_acc -= (uint32_t)pool.spawn_acc;
+  if (num_spawned == 0) {
+    return;
+  }
+
+  const D3DXMATRIX mtx(emitter_matrix(ctx, def.bone, def.pos));
+  const float speed = a.sample_param(def.speed, 0, seq, t, gt, pool.cursors[SpeedParam]);
+  const float speed_variation = a.sample_param(def.speed_variation, 0, seq, t, gt, pool.cursors[SpeedVariationParam]);
+  const float vertical_range = a.sample_param(def.vertical_range, 0, seq, t, gt, pool.cursors[VerticalRangeParam]);
+  const float horizontal_range = a.sample_param(def.horizontal_range, 0, seq, t, gt, pool.cursors[HorizontalRangeParam]);
+  const float base_lifespan = a.sample_param(def.lifespan, 1, seq, t, gt, pool.cursors[LifespanParam]);
+  const float area_length = a.sample_param(def.area_length, 0, seq, t, gt, pool.cursors[AreaLengthParam]);
+  const float area_width = a.sample_param(def.area_width, 0, seq, t, gt, pool.cursors[AreaWidthParam]);
+
+  for (uint32_t i = 0; i < num_spawned; ++i) {
+    // position and direction in the emitter's space, where y is up
+    D3DXVECTOR3 ofs, dir;
+    if (def.type == M2ParticleEmitterDef::Sphere) {
+      const D3DXVECTOR3 r(random_signed(pool.rng), random_signed(pool.rng), random_signed(pool.rng));
+      D3DXVec3Normalize(&dir, &r);
+      ofs = dir * (area_length * random_unit(pool.rng));
+    } else {
+      ofs = D3DXVECTOR3(0.5f * area_length * random_signed(pool.rng), 0, 0.5f * area_width * random_signed(pool.rng));
+      const float polar = vertical_range * random_signed(pool.rng);
+      const float azimuth = horizontal_range * random_signed(pool.rng);
+      dir = D3DXVECTOR3(sinf(polar) * cosf(azimuth), cosf(polar), sinf(polar) * sinf(azimuth));
+    }
+    dir *= speed * (1 + speed_variation * random_signed(pool.rng));
+
+    D3DXVECTOR3 pos, vel;
+    D3DXVec3TransformCoord(&pos, &ofs, &mtx);
+    D3DXVec3TransformNormal(&vel, &dir, &mtx);
+
+    const uint32_t j = pool.count++;
+    px[j] = pos.x; py[j] = pos.y; pz[j] = pos.z;
+    vx[j] = vel.x; vy[j] = vel.y; vz[j] = vel.z;
+    age[j] = 0;
+    lifespan[j] = std::max(0.001f, base_lifespan * (1 + def.lifespan_variation * random_signed(pool.rng)));
+  }
+}
+
+void M2ParticleSystem::update_ribbon(const UpdateContext& ctx, const uint32_t idx)
+{
+  const M2RibbonEmitterDef& def = emitters_->ribbons[idx];
+  RibbonPool& pool = ribbon_pools_[idx];
+  const M2Animation& a = *animation_;
+  const uint32_t seq = ctx.instance->sequence;
+  const uint32_t t = ctx.time_in_ms;
+  const uint32_t gt = ctx.global_time_in_ms;
+  const float dt = ctx.dt;
+
+  float* age = pool.stream(EdgeAge);
+  float* top_y = pool.stream(TopY);
+  float* bottom_y = pool.stream(BottomY);
+
+  // the oldest edges are at the tail of the ring
+  while (pool.count > 0 && age[pool.edge(0)] + dt >= def.edge_lifetime) {
+    --pool.count;
+  }
+  for (uint32_t i = 0; i < pool.count; ++i) {
+    const uint32_t e = pool.edge(i);
+    age[e] += dt;
+    top_y[e] -= def.gravity * dt;
+    bottom_y[e] -= def.gravity * dt;
+  }
+
+  const D3DXVECTOR3 color(a.sample_param(def.color, kVec3One, seq, t, gt, pool.cursors[ColorParam]));
+  pool.color = D3DXCOLOR(color.x, color.y, color.z, a.sample_param(def.alpha, 1, seq, t, gt, pool.cursors[AlphaParam]));
+  pool.visible = a.sample_param(def.visibility, 1, seq, t, gt, pool.cursors[VisibilityParam]) > 0;
+
+  const D3DXMATRIX mtx(emitter_matrix(ctx, def.bone, def.pos));
+  const D3DXVECTOR3 above(0, a.sample_param(def.height_above, 0, seq, t, gt, pool.cursors[HeightAboveParam]), 0);
+  const D3DXVECTOR3 below(0, -a.sample_param(def.height_below, 0, seq, t, gt, pool.cursors[HeightBelowParam]), 0);
+  D3DXVec3TransformCoord(&pool.top, &above, &mtx);
+  D3DXVec3TransformCoord(&pool.bottom, &below, &mtx);
+
+  // leave an edge behind at the emitter's current position. If the frame covers more than one
+  // edge, they would all be in the same spot, so only one is added
+  pool.spawn_acc += def.edges_per_second * dt;
+  if (pool.spawn_acc < 1) {
+    return;
+  }
+  pool.spawn_acc -= (uint32_t)pool.spawn_acc;
+
+  const uint32_t e = pool.head;
+  pool.stream(TopX)[e] = pool.top.x;
+  pool.stream(TopY)[e] = pool.top.y;
+  pool.stream(TopZ)[e] = pool.top.z;
+  pool.stream(BottomX)[e] = pool.bottom.x;
+  pool.stream(BottomY)[e] = pool.bottom.y;
+  pool.stream(BottomZ)[e] = pool.bottom.z;
+  age[e] = 0;
+  pool.head = (pool.head + 1) % pool.capacity;
+  pool.count = std::min(pool.count + 1, pool.capacity);
+}
+
+void M2ParticleSystem::write_vertices(ParticleVertex* dst, const D3DXMATRIX& view, std::vector<ParticleBatch>& batches, ThreadPool* pool) const
+{
+  // Every emitter gets its own range, so they can be written independently, but the emitters that share
+  // a texture and blend mode are laid out next to each other, so each group is drawn as one batch
+  std::vector<EmitterRange>& ranges = ranges_;
+  ranges.clear();
+  const uint32_t num_particle_emitters = particle_pools_.size();
+  for (uint32_t i = 0, e = num_particle_emitters + ribbon_pools_.size(); i < e; ++i) {
+    EmitterRange range;
+    range.emitter = i;
+    if (i < num_particle_emitters) {
+      const M2ParticleEmitterDef& def = emitters_->particles[i];
+      range.num_vertices = particle_pools_[i].count * kVerticesPerQuad;
+      range.texture = def.texture;
+      range.blend = def.particle_blend();
+    } else {
+      const RibbonPool& ribbon = ribbon_pools_[i - num_particle_emitters];
+      range.num_vertices = ribbon.visible ? ribbon.count * kVerticesPerQuad : 0;
+      range.texture = emitters_->ribbons[i - num_particle_emitters].texture;
+      range.blend = AlphaBlend;
+    }
+    if (range.num_vertices > 0) {
+      ranges.push_back(range);
+    }
+  }
+  std::stable_sort(ranges.begin(), ranges.end(), EmitterRangeLess());
+
+  const size_t first_batch = batches.size();
+  uint32_t num_vertices = 0;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    EmitterRange& range = ranges[i];
+    range.first_vertex = num_vertices;
+    num_vertices += range.num_vertices;
+    if (batches.size() > first_batch && batches.back().texture == range.texture && batches.back().blend == range.blend) {
+      batches.back().num_vertices += range.num_vertices;
+      continue;
+    }
+    ParticleBatch batch;
+    batch.first_vertex = range.first_vertex;
+    batch.num_vertices = range.num_vertices;
+    batch.texture = range.texture;
+    batch.blend = range.blend;
+    batches.push_back(batch);
+  }
+
+  // the billboards are spanned by the camera's right and up vectors, the first two columns of the view matrix
+  WriteContext ctx;
+  ctx.dst = dst;
+  ctx.right = D3DXVECTOR3(view._11, view._21, view._31);
+  ctx.up = D3DXVECTOR3(view._12, view._22, view._32);
+  ctx.ranges = &ranges;
+
+  const uint32_t num_ranges = ranges.size();
+  if (pool) {
+    pool->parallel_for(num_ranges, kEmitterGrainSize,
+      boost::bind(&M2ParticleSystem::write_range, this, &ctx, _1, _2));
+  } else {
+    write_range(&ctx, 0, num_ranges);
+  }
+}
+
+void M2ParticleSystem::write_range(const WriteContext* ctx, const uint32_t begin, const uint32_t end) const
+{
+  const uint32_t num_particle_emitters = particle_pools_.size();
+  for (uint32_t i = begin; i < end; ++i) {
+    const EmitterRange& range = (*ctx->ranges)[i];
+    ParticleVertex* dst = ctx->dst + range.first_vertex;
+    if (range.emitter < num_particle_emitters) {
+      write_particles(*ctx, range.emitter, dst);
+    } else {
+      write_ribbon(range.emitter - num_particle_emitters, dst);
+    }
+  }
+}
+
+void M2ParticleSystem::write_particles(const WriteContext& ctx, const uint32_t idx, ParticleVertex* dst) const
+{
+  const M2ParticleEmitterDef& def = emitters_->particles[idx];
+  const ParticlePool& pool = particle_pools_[idx];
+  const float* px = pool.stream(PosX);
+  const float* py = pool.stream(PosY);
+  const float* pz = pool.stream(PosZ);
+  const float* age = pool.stream(Age);
+  const float* lifespan = pool.stream(Lifespan);
+
+  // use the first cell of the texture atlas
+  const float u1 = 1.0f / std::max<uint16_t>(1, def.tile_cols);
+  const float v1 = 1.0f / std::max<uint16_t>(1, def.tile_rows);
+
+  ParticleVertex corners[4];
+  for (uint32_t i = 0; i < pool.count; ++i) {
+    const float t = age[i] / lifespan[i];
+    const D3DXVECTOR3 color(sample_lifetime(def.color, kVec3One, t));
+    const D3DXCOLOR c(color.x, color.y, color.z, sample_lifetime(def.alpha, 1.0f, t));
+    const D3DXVECTOR2 scale(sample_lifetime(def.scale, D3DXVECTOR2(1, 1), t));
+
+    const D3DXVECTOR3 center(px[i], py[i], pz[i]);
+    const D3DXVECTOR3 right(scale.x * ctx.right);
+    const D3DXVECTOR3 up(scale.y * ctx.up);
+    write_vertex(&corners[0], center - right + up, c, 0, 0);
+    write_vertex(&corners[1], center + right + up, c, u1, 0);
+    write_vertex(&corners[2], center - right - up, c, 0, v1);
+    write_vertex(&corners[3], center + right - up, c, u1, v1);
+    write_quad(dst, corners[0], corners[1], corners[2], corners[3]);
+    dst += kVerticesPerQuad;
+  }
+}
+
+void M2ParticleSystem::write_ribbon(const uint32_t idx, ParticleVertex* dst) const
+{
+  const RibbonPool& pool = ribbon_pools_[idx];
+  const float* top_x = pool.stream(TopX);
+  const float* top_y = pool.stream(TopY);
+  const float* top_z = pool.stream(TopZ);
+  const float* bottom_x = pool.stream(BottomX);
+  const float* bottom_y = pool.stream(BottomY);
+  const float* bottom_z = pool.stream(BottomZ);
+
+  // u runs along the ribbon, from the emitter to the oldest edge. The newest stored edge connects to
+  // the emitter's current position
+  ParticleVertex prev_top, prev_bottom;
+  write_vertex(&prev_top, pool.top, pool.color, 0, 0);
+  write_vertex(&prev_bottom, pool.bottom, pool.color, 0, 1);
+  for (uint32_t i = 0; i < pool.count; ++i) {
+    const uint32_t e = pool.edge(pool.count - 1 - i);
+    const float u = (i + 1) / (float)pool.count;
+    ParticleVertex top, bottom;
+    write_vertex(&top, D3DXVECTOR3(top_x[e], top_y[e], top_z[e]), pool.color, u, 0);
+    write_vertex(&bottom, D3DXVECTOR3(bottom_x[e], bottom_y[e], bottom_z[e]), pool.color, u, 1);
+    write_quad(dst, prev_top, top, prev_bottom, bottom);
+    dst += kVerticesPerQuad;
+    prev_top = top;
+    prev_bottom = bottom;
+  }
+}
+
+namespace
+{
+  void set_constant(M2ParamTrack<float>& track, const float value)
+  {
+    track.keys.times.assign(1, 0);
+    track.keys.values.assign(1, value);
+    M2Animation::KeyRange range;
+    range.count = 1;
+    track.keys.ranges.assign(1, range);
+  }
+}
+
+ParticleBenchmark benchmark_particles(const uint32_t num_emitters, const uint32_t iterations, ThreadPool* pool)
+{
+  // emitters spread out on a grid, without any bones or animation
+  M2EmittersSPtr emitters(new M2Emitters());
+  srand(1);
+  const uint32_t num_ribbons = num_emitters / 8;
+  const uint32_t grid_size = (uint32_t)ceilf(sqrtf((float)num_emitters));
+  for (uint32_t i = 0; i < num_emitters; ++i) {
+    const D3DXVECTOR3 pos((float)(i % grid_size), 0, (float)(i / grid_size));
+    if (i < num_ribbons) {
+      M2RibbonEmitterDef def;
+      def.pos = pos;
+      def.edges_per_second = 30;
+      def.edge_lifetime = 1;
+      def.gravity = 0.5f;
+      set_constant(def.height_above, 0.25f);
+      set_constant(def.height_below, 0.25f);
+      emitters->ribbons.push_back(def);
+    } else {
+      M2ParticleEmitterDef def;
+      def.pos = pos;
+      def.type = (uint8_t)(i % 2 ? M2ParticleEmitterDef::Plane : M2ParticleEmitterDef::Sphere);
+      def.lifespan_variation = 0.25f;
+      def.drag = 0.1f;
+      set_constant(def.emission_rate, 20 + (float)(rand() % 30));
+      set_constant(def.lifespan, 2);
+      set_constant(def.speed, 2);
+      set_constant(def.speed_variation, 0.5f);
+      set_constant(def.vertical_range, 0.5f);
+      set_constant(def.horizontal_range, (float)D3DX_PI);
+      set_constant(def.gravity, 1);
+      set_constant(def.area_length, 0.5f);
+      set_constant(def.area_width, 0.5f);
+      def.color.times.push_back(0);
+      def.color.values.push_back(kVec3One);
+      def.color.times.push_back(1);
+      def.color.values.push_back(D3DXVECTOR3(1, 0.5f, 0));
+      def.alpha.times.push_back(0);
+      def.alpha.values.push_back(1);
+      def.alpha.times.push_back(1);
+      def.alpha.values.push_back(0);
+      emitters->particles.push_back(def);
+    }
+  }
+
+  M2AnimationSPtr animation(new M2Animation());
+  M2AnimationInstance instance;
+  M2ParticleSystem serial(animation, emitters);
+  M2ParticleSystem parallel(animation, emitters);
+  std::vector<ParticleVertex> vertices(serial.max_vertices());
+  std::vector<ParticleBatch> batches;
+  const D3DXVECTOR3 eye(0, 10, -10);
+  const D3DXVECTOR3 up(0, 1, 0);
+  D3DXMATRIX view;
+  D3DXMatrixLookAtLH(&view, &eye, &kVec3Zero, &up);
+
+  // run until the pools are full, so the timed frames are in a steady state
+  const float dt = 1 / 60.0f;
+  uint32_t time_in_ms = 0;
+  for (uint32_t i = 0; i < 180; ++i, time_in_ms += 16) {
+    serial.update(instance, time_in_ms, time_in_ms, dt, NULL);
+    parallel.update(instance, time_in_ms, time_in_ms, dt, pool);
+  }
+
+  ParticleBenchmark result;
+  LARGE_INTEGER start, end;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    serial.update(instance, time_in_ms + it * 16, time_in_ms + it * 16, dt, NULL);
+  }
+  QueryPerformanceCounter(&end);
+  result.update_ms = elapsed_ms(start, end) / iterations;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    parallel.update(instance, time_in_ms + it * 16, time_in_ms + it * 16, dt, pool);
+  }
+  QueryPerformanceCounter(&end);
+  result.parallel_update_ms = elapsed_ms(start, end) / iterations;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    batches.clear();
+    serial.write_vertices(&vertices[0], view, batches, NULL);
+  }
+  QueryPerformanceCounter(&end);
+  result.write_ms = elapsed_ms(start, end) / iterations;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    batches.clear();
+    parallel.write_vertices(&vertices[0], view, batches, pool);
+  }
+  QueryPerformanceCounter(&end);
+  result.parallel_write_ms = elapsed_ms(start, end) / iterations;
+
+  result.num_particles = parallel.num_particles();
+  const uint32_t num_threads = pool ? pool->num_threads() : 0;
+
+  LOG_INFO_LN("particles %d emitters (%d ribbons), %d particles. update: %.3f ms, %d threads: %.3f ms. write: %.3f ms, %d threads: %.3f ms",
+    num_emitters, num_ribbons, result.num_particles, result.update_ms, num_threads, result.parallel_update_ms,
+    result.write_ms, num_threads, result.parallel_write_ms);
+
+  return result;
+}
@@ -0,0 +1,227 @@
+#ifndef M2_PARTICLES_HPP
+#define M2_PARTICLES_HPP
+
+#include "ReduxTypes.hpp"
+#include "M2Animation.hpp"
+
+class ThreadPool;
+
+// A property that changes over a particle's life. The times are normalized to [0, 1]
+template<typename T>
+struct M2LifetimeTrack
+{
+  std::vector<float> times;
+  std::vector<T> values;
+};
+
+// the blend states the particle techniques implement
+enum ParticleBlend { AlphaBlend, AdditiveBlend, ModulateBlend, Modulate2xBlend };
+
+struct M2ParticleEmitterDef
+{
+  enum Type { Plane = 1, Sphere = 2, Spline = 3 };
+
+  M2ParticleEmitterDef();
+  ParticleBlend particle_blend() const;
+
+  uint32_t flags;
+  D3DXVECTOR3 pos;
+  int16_t bone;
+  int32_t texture;    // index into the scene's textures, or -1
+  uint8_t blend;      // the m2 material blend mode
+  uint8_t type;
+  uint16_t tile_rows;
+  uint16_t tile_cols;
+
+  M2ParamTrack<float> speed;
+  M2ParamTrack<float> speed_variation;
+  M2ParamTrack<float> vertical_range;
+  M2ParamTrack<float> horizontal_range;
+  M2ParamTrack<float> gravity;
+  M2ParamTrack<float> lifespan;
+  M2ParamTrack<float> emission_rate;
+  M2ParamTrack<float> area_length;
+  M2ParamTrack<float> area_width;
+  M2ParamTrack<float> enabled;
+  float lifespan_variation;
+  float emission_rate_variation;
+  float drag;
+
+  M2LifetimeTrack<D3DXVECTOR3> color;   // [0, 1]
+  M2LifetimeTrack<float> alpha;
+  M2LifetimeTrack<D3DXVECTOR2> scale;
+};
+
+struct M2RibbonEmitterDef
+{
+  M2RibbonEmitterDef();
+
+  D3DXVECTOR3 pos;
+  int16_t bone;
+  int32_t texture;    // index into the scene's textures, or -1
+
+  M2ParamTrack<D3DXVECTOR3> color;
+  M2ParamTrack<float> alpha;
+  M2ParamTrack<float> height_above;
+  M2ParamTrack<float> height_below;
+  M2ParamTrack<float> visibility;
+  float edges_per_second;
+  float edge_lifetime;
+  float gravity;
+};
+
+struct M2Emitters
+{
+  std::vector<M2ParticleEmitterDef> particles;
+  std::vector<M2RibbonEmitterDef> ribbons;
+};
+
+struct ParticleVertex
+{
+  D3DXVECTOR3 pos;
+  D3DXCOLOR color;
+  D3DXVECTOR2 uv;
+};
+
+// A run of triangles in the particle vertex buffer that share a texture and blend mode
+struct ParticleBatch
+{
+  uint32_t first_vertex;
+  uint32_t num_vertices;
+  int32_t texture;
+  ParticleBlend blend;
+};
+
+/**
+ * Simulates the emitters of one m2 instance. Every emitter owns a fixed size pool, stored as separate
+ * float streams so the integration loops run over contiguous memory. The emitters don't share any
+ * mutable state, so they are updated in parallel, and their geometry is written to disjoint ranges
+ * of the vertex buffer.
+ */
+class M2ParticleSystem : boost::noncopyable
+{
+public:
+  M2ParticleSystem(const M2AnimationSPtr& animation, const M2EmittersSPtr& emitters, const uint32_t seed = 1);
+
+  // Advances all the emitters by dt seconds. The emitters are attached to the bones in the instance's
+  // palette, and the tracks are sampled at the instance's sequence. If pool is NULL, the emitters are
+  // updated on the calling thread.
+  void update(const M2AnimationInstance& instance, const uint32_t time_in_ms, const uint32_t global_time_in_ms,
+    const float dt, ThreadPool* pool);
+
+  // Writes camera facing quads for the particles and strips for the ribbons, as a triangle list.
+  // The emitters are grouped by texture and blend mode, and one batch is appended per group.
+  void write_vertices(ParticleVertex* dst, const D3DXMATRIX& view, std::vector<ParticleBatch>& batches, ThreadPool* pool) const;
+
+  // upper bound on the vertices written, for sizing the vertex buffer
+  uint32_t max_vertices() const;
+  uint32_t num_particles() const;
+
+private:
+
+  enum ParticleStream { PosX, PosY, PosZ, VelX, VelY, VelZ, Age, Lifespan, NumParticleStreams };
+  enum RibbonStream { TopX, TopY, TopZ, BottomX, BottomY, BottomZ, EdgeAge, NumRibbonStreams };
+  // the animated parameters of each emitter type, which keep a key cursor each
+  enum ParticleParam { GravityParam, EnabledParam, RateParam, SpeedParam, SpeedVariationParam, VerticalRangeParam,
+    HorizontalRangeParam, LifespanParam, AreaLengthParam, AreaWidthParam, NumParticleParams };
+  enum RibbonParam { ColorParam, AlphaParam, VisibilityParam, HeightAboveParam, HeightBelowParam, NumRibbonParams };
+
+  struct ParticlePool
+  {
+    ParticlePool() : count(0), capacity(0), spawn_acc(0), rng(0) { std::fill(cursors, cursors + NumParticleParams, 0); }
+    float* stream(const ParticleStream s) { return &data[s * capacity]; }
+    const float* stream(const ParticleStream s) const { return &data[s * capacity]; }
+    uint32_t count;
+    uint32_t capacity;
+    float spawn_acc;
+    uint32_t rng;
+    uint32_t cursors[NumParticleParams];
+    std::vector<float> data;
+  };
+
+  // the edges are a ring buffer, with head being the next one written
+  struct RibbonPool
+  {
+    RibbonPool() : head(0), count(0), capacity(0), spawn_acc(0), color(1, 1, 1, 1), visible(false) { std::fill(cursors, cursors + NumRibbonParams, 0); }
+    float* stream(const RibbonStream s) { return &data[s * capacity]; }
+    const float* stream(const RibbonStream s) const { return &data[s * capacity]; }
+    uint32_t edge(const uint32_t i) const { return (head + capacity - count + i) % capacity; }
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+    float spawn_acc;
+    D3DXCOLOR color;
+    // the edge at the emitter, which the newest stored edge connects to
+    D3DXVECTOR3 top;
+    D3DXVECTOR3 bottom;
+    bool visible;
+    uint32_t cursors[NumRibbonParams];
+    std::vector<float> data;
+  };
+
+  struct UpdateContext
+  {
+    const M2AnimationInstance* instance;
+    uint32_t time_in_ms;
+    uint32_t global_time_in_ms;
+    float dt;
+  };
+
+  // where an emitter's geometry goes in the vertex buffer
+  struct EmitterRange
+  {
+    uint32_t emitter;     // particle emitters first, then ribbons
+    uint32_t first_vertex;
+    uint32_t num_vertices;
+    int32_t texture;
+    ParticleBlend blend;
+  };
+
+  struct EmitterRangeLess
+  {
+    bool operator()(const EmitterRange& a, const EmitterRange& b) const
+    {
+      return a.blend != b.blend ? a.blend < b.blend : a.texture < b.texture;
+    }
+  };
+
+  struct WriteContext
+  {
+    ParticleVertex* dst;
+    D3DXVECTOR3 right;
+    D3DXVECTOR3 up;
+    const std::vector<EmitterRange>* ranges;
+  };
+
+  void update_range(const UpdateContext* ctx, const uint32_t begin, const uint32_t end);
+  void update_particles(const UpdateContext& ctx, const uint32_t idx);
+  void update_ribbon(const UpdateContext& ctx, const uint32_t idx);
+  D3DXMATRIX emitter_matrix(const UpdateContext& ctx, const int16_t bone, const D3DXVECTOR3& pos) const;
+
+  void write_range(const WriteContext* ctx, const uint32_t begin, const uint32_t end) const;
+  void write_particles(const WriteContext& ctx, const uint32_t idx, ParticleVertex* dst) const;
+  void write_ribbon(const uint32_t idx, ParticleVertex* dst) const;
+
+  M2AnimationSPtr animation_;
+  M2EmittersSPtr emitters_;
+  std::vector<ParticlePool> particle_pools_;
+  std::vector<RibbonPool> ribbon_pools_;
+  // scratch for write_vertices, kept to avoid reallocating it every frame
+  mutable std::vector<EmitterRange> ranges_;
+};
+
+struct ParticleBenchmark
+{
+  ParticleBenchmark() : update_ms(0), parallel_update_ms(0), write_ms(0), parallel_write_ms(0), num_particles(0) {}
+  double update_ms;
+  double parallel_update_ms;
+  double write_ms;
+  double parallel_write_ms;
+  uint32_t num_particles;
+};
+
+// Simulates num_emitters synthetic emitters, an eighth of them ribbons, and writes their geometry to
+// system memory. Doesn't need a device, so it can run headless.
+ParticleBenchmark benchmark_particles(const uint32_t num_emitters, const uint32_t iterations, ThreadPool* pool);
+
+#endif // #ifndef M2_PARTICLES_HPP
@@ -8,6 +8,11 @@
 #include "../system/SystemInterface.hpp"
 #include <yajl/yajl_parse.h>
 #include "EffectWrapper.hpp"
+#include "CompactVertex.hpp"
+#include "AssetLoader.hpp"
+#include "Skinning.hpp"
+#include "CollisionHull.hpp"
+#include "Utils.hpp"
 
 namespace mpl = boost::mpl;
 
@@ -19,19 +24,60 @@ namespace
   const float far_plane = 1000;
   const float fov = static_cast<float>(D3DX_PI) * 0.25f;
   const float aspect_ratio = width / height;
+
+  // indexed by ParticleBlend
+  const char* kParticleTechniques[] = {
+    "render_particles", "render_particles_additive", "render_particles_modulate", "render_particles_modulate2x"
+  };
+
+  ID3D10ShaderResourceView* create_white_texture(ID3D10Device* device)
+  {
+    D3D10_TEXTURE2D_DESC desc;
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width = desc.Height = 1;
+    desc.MipLevels = desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D10_USAGE_IMMUTABLE;
+    desc.BindFlags = D3D10_BIND_SHADER_RESOURCE;
+
+    const uint32_t white = 0xffffffff;
+    D3D10_SUBRESOURCE_DATA init_data;
+    init_data.pSysMem = &white;
+    init_data.SysMemPitch = sizeof(white);
+    init_data.SysMemSlicePitch = 0;
+
+    ID3D10Texture2D* texture = NULL;
+    if (FAILED(device->CreateTexture2D(&desc, &init_data, &texture))) {
+      return NULL;
+    }
+    ID3D10ShaderResourceView* view = NULL;
+    const HRESULT hr = device->CreateShaderResourceView(texture, NULL, &view);
+    SAFE_RELEASE(texture);
+    return SUCCEEDED(hr) ? view : NULL;
+  }
 }
 
 M2Renderer::M2Renderer(const SystemSPtr& system, const EffectManagerSPtr& effect_manager)
   : system_(system)
   , effect_manager_(effect_manager)
   , animation_manager_(new AnimationManager())
+  , asset_loader_(new AssetLoader())
   , opaque_blend_state_(NULL)
   , transparent_blend_state_(NULL)
   , current_camera_(0)
   , free_fly_camera_enabled_(true)
+  , compact_vertices_(true)
+  , lod_(0)
+  , picked_(false)
+  , particles_(NULL)
+  , particle_vertex_buffer_(NULL)
+  , particle_layout_(NULL)
+  , default_texture_(NULL)
   , effect_(NULL)
 {
   system_->add_renderable(this);
+  default_texture_ = create_white_texture(system_->get_device());
 
   opaque_blend_state_ = rt::D3D10::BlendDescription()
     .BlendEnable_(0, FALSE)
@@ -60,6 +106,9 @@ M2Renderer::M2Renderer(const SystemSPtr& system, const EffectManagerSPtr& effect
 
 M2Renderer::~M2Renderer()
 {
+  // wait for any outstanding loads, as they reference the scene
+  asset_loader_->flush();
+  SAFE_DELETE(asset_loader_);
   SAFE_DELETE(effect_);
   clear_vector(loaded_effects_);
   clear_vector(loaded_materials_);
@@ -72,6 +121,11 @@ M2Renderer::~M2Renderer()
   SAFE_RELEASE(opaque_depth_stencil_state_);
   SAFE_RELEASE(transparent_depth_stencil_state_);
 
+  SAFE_DELETE(particles_);
+  SAFE_RELEASE(particle_vertex_buffer_);
+  SAFE_RELEASE(particle_layout_);
+  SAFE_RELEASE(default_texture_);
+
   SAFE_DELETE(animation_manager_);
   container_delete(effect_connections_);
   system_.reset();
@@ -95,6 +149,18 @@ bool M2Renderer::close()
 
 void M2Renderer::render(const int32_t time_in_ms, const int32_t delta) 
 {
+  // the textures are created by the finalizers, so wait for them. Once they're done, a texture that
+  // failed to load is replaced, rather than keeping the model from drawing
+  const bool loading = !asset_loader_->process_finalizers();
+  ID3D10ShaderResourceView* diffuse_texture = scene_.textures_.empty() ? NULL : scene_.textures_.front();
+  if (diffuse_texture == NULL) {
+    if (loading) {
+      return;
+    }
+    LOG_WARNING_LN_ONESHOT("[%s] No diffuse texture, using the default", __FUNCTION__);
+    diffuse_texture = default_texture_;
+  }
+
   D3DXVECTOR3 eye_pos;
   D3DXMATRIX mtx_proj;
   D3DXMATRIX mtx_view;
@@ -114,9 +180,110 @@ void M2Renderer::render(const int32_t time_in_ms, const int32_t delta)
   e->set_variable("projection", mtx_proj);
   e->set_variable("eye_pos", eye_pos);
   e->set_variable("world", kMtxId);
-  e->set_resource("diffuse_texture", scene_.textures_.front());
-  e->set_technique("render");
-  meshes.front()->render();
+  // the picked model is drawn untextured, to highlight it
+  e->set_resource("diffuse_texture", picked_ ? default_texture_ : diffuse_texture);
+
+  const MeshSPtr& mesh = meshes.front();
+
+  // the emitters are attached to the bones, so the animation is updated even if the mesh is culled
+  if (animation_) {
+    const uint32_t duration = animation_->sequence_duration(animation_instance_.sequence);
+    animation_->update(animation_instance_, duration > 0 ? time_in_ms % duration : 0, time_in_ms);
+  }
+
+  // the m2 meshes are in world space, so the bounds can be tested as is
+  D3DXPLANE planes[6];
+  planes_from_proj_matrix(planes, mtx_proj, true);
+  if (is_sphere_visible(mesh->bounding_sphere_center(), mesh->bounding_sphere_radius(), kMtxId, mtx_view, planes)) {
+    render_mesh(mesh, eye_pos);
+  }
+
+  render_particles(time_in_ms, delta, mtx_view);
+}
+
+void M2Renderer::render_mesh(const MeshSPtr& mesh, const D3DXVECTOR3& eye_pos)
+{
+  EffectWrapper* e = effect_connections_.front()->effect_;
+
+  if (const SkinMeshSPtr& skin = mesh->skin_mesh()) {
+    uint8_t* data = NULL;
+    if (SUCCEEDED(mesh->vertex_buffer()->Map(D3D10_MAP_WRITE_DISCARD, 0, (void**)&data))) {
+      skin_mesh(*skin, &animation_instance_.palette[0], data, &ThreadPool::instance());
+      mesh->vertex_buffer()->Unmap();
+    }
+  }
+
+  if (mesh->compact_vertices()) {
+    e->set_variable("pos_scale", mesh->quantization_bounds().scale);
+    e->set_variable("pos_bias", mesh->quantization_bounds().bias);
+    e->set_technique("render_compact");
+  } else {
+    e->set_technique("render");
+  }
+
+  // pick the skin from the size of the bounding sphere on screen
+  const D3DXVECTOR3 to_center(mesh->bounding_sphere_center() - eye_pos);
+  const float dist = D3DXVec3Length(&to_center);
+  const float radius = mesh->bounding_sphere_radius();
+  const float screen_size = dist > radius ? radius / (dist * tanf(0.5f * fov)) : 1;
+  lod_ = select_mesh_lod(lod_, mesh->num_lods(), screen_size);
+  mesh->render_lod(lod_);
+}
+
+void M2Renderer::render_particles(const int32_t time_in_ms, const int32_t delta, const D3DXMATRIX& mtx_view)
+{
+  if (!particles_) {
+    return;
+  }
+
+  // clamp the step, so a hitch doesn't spawn a burst of particles
+  const uint32_t duration = animation_->sequence_duration(animation_instance_.sequence);
+  particles_->update(animation_instance_, duration > 0 ? time_in_ms % duration : 0, time_in_ms,
+    std::min(0.1f, delta / 1000.0f), &ThreadPool::instance());
+
+  particle_batches_.clear();
+  ParticleVertex* data = NULL;
+  if (FAILED(particle_vertex_buffer_->Map(D3D10_MAP_WRITE_DISCARD, 0, (void**)&data))) {
+    return;
+  }
+  particles_->write_vertices(data, mtx_view, particle_batches_, &ThreadPool::instance());
+  particle_vertex_buffer_->Unmap();
+
+  const UINT stride = sizeof(ParticleVertex);
+  const UINT offset = 0;
+  g_d3d_device->IASetInputLayout(particle_layout_);
+  g_d3d_device->IASetVertexBuffers(0, 1, &particle_vertex_buffer_, &stride, &offset);
+
+  for (size_t i = 0; i < particle_batches_.size(); ++i) {
+    const ParticleBatch& batch = particle_batches_[i];
+    if (batch.texture < 0 || batch.texture >= (int32_t)scene_.textures_.size() || scene_.textures_[batch.texture] == NULL) {
+      continue;
+    }
+    effect_->set_resource("diffuse_texture", scene_.textures_[batch.texture]);
+    effect_->set_technique(kParticleTechniques[batch.blend]);
+    g_d3d_device->Draw(batch.num_vertices, batch.first_vertex);
+  }
+
+  // the particle techniques enable blending, which the mesh techniques don't reset
+  const float blend_factor[] = { 0, 0, 0, 0 };
+  g_d3d_device->OMSetBlendState(opaque_blend_state_, blend_factor, 0xffffffff);
+}
+
+void M2Renderer::pick(const D3DXVECTOR3& org, const D3DXVECTOR3& dir)
+{
+  // test against the collision hull if there is one, otherwise just use the bounding sphere
+  bool picked = false;
+  for (size_t i = 0; i < scene_.meshes_.size() && !picked; ++i) {
+    const MeshSPtr& mesh = scene_.meshes_[i];
+    if (const CollisionHullSPtr& hull = mesh->collision_hull()) {
+      float dist;
+      picked = intersect_hull(*hull, org, dir, dist);
+    } else {
+      picked = intersect_sphere(mesh->bounding_sphere_center(), mesh->bounding_sphere_radius(), org, dir);
+    }
+  }
+
+  picked_ = picked;
 }
 
 void M2Renderer::process_input_callback(const Input& input)
@@ -148,7 +315,7 @@ void M2Renderer::load_scene(const std::string& filename)
 {
   SCOPED_FUNC_PROFILE();
 
-  M2Loader l;
+  M2Loader l(compact_vertices_, asset_loader_);
   //l.load("data//scenes//Draenei//Female//DraeneiFemale.m2", &scene_);
   //l.load("C:/projects/MpqExtract/dump/World/ArtTest/Boxtest/xyz.m2", &scene_);
 //  l.load("C:/projects/MpqExtract/dump/World/critter/bats/bat02.m2", &scene_);
@@ -166,16 +333,51 @@ void M2Renderer::load_scene(const std::string& filename)
   effect_connections_.push_back(ec);
 
   D3D10_PASS_DESC desc;
-  effect_->get_pass_desc(desc, "render");
   ID3D10InputLayout* layout = NULL;
 
-  if (!create_input_layout<mpl::vector<D3DXVECTOR3, D3DXNORMAL, D3DXVECTOR2> >(layout, desc, g_d3d_device)) {
-    LOG_ERROR("Error creating input layout");
-    return;
+  // skinned meshes are always written at full precision, so the layout follows the mesh
+  if (mc->meshes_.front()->compact_vertices()) {
+    effect_->get_pass_desc(desc, "render_compact");
+    std::vector<D3D10_INPUT_ELEMENT_DESC> descs;
+    compact_vertex_descs(descs);
+    if (FAILED(g_d3d_device->CreateInputLayout(&descs[0], descs.size(), desc.pIAInputSignature, desc.IAInputSignatureSize, &layout))) {
+      LOG_ERROR("Error creating input layout");
+      return;
+    }
+  } else {
+    effect_->get_pass_desc(desc, "render");
+    if (!create_input_layout<mpl::vector<D3DXVECTOR3, D3DXNORMAL, D3DXVECTOR2> >(layout, desc, g_d3d_device)) {
+      LOG_ERROR("Error creating input layout");
+      return;
+    }
   }
 
   mc->meshes_.front()->set_input_layout(layout);
 
+  // play the stand animation if there is one. Without any animation the mesh stays in the bind pose
+  if (const SkinMeshSPtr& skin = mc->meshes_.front()->skin_mesh()) {
+    animation_ = l.animation();
+    if (animation_ && animation_->num_bones() == skin->num_bones) {
+      const int32_t stand = animation_->find_sequence(0);
+      animation_->init_instance(animation_instance_, stand >= 0 ? stand : 0);
+    } else {
+      animation_.reset();
+      animation_instance_.palette.resize(skin->num_bones, kMtxId);
+    }
+  }
+
+  // the emitters are driven by the animation, and follow its bones
+  if (animation_ && l.emitters()) {
+    particles_ = new M2ParticleSystem(animation_, l.emitters());
+    particle_vertex_buffer_ = create_dynamic_buffer(g_d3d_device, D3D10_BIND_VERTEX_BUFFER, particles_->max_vertices() * sizeof(ParticleVertex));
+    effect_->get_pass_desc(desc, "render_particles");
+    if (!particle_vertex_buffer_ || 
+      !create_input_layout<mpl::vector<D3DXVECTOR3, D3DXCOLOR, D3DXVECTOR2> >(particle_layout_, desc, g_d3d_device)) {
+      LOG_ERROR_LN("Error creating particle buffers");
+      SAFE_DELETE(particles_);
+    }
+  }
+
   system_->add_process_input_callback(boost::bind(&M2Renderer::process_input_callback, this, _1));
 }
 
@@ -9,6 +9,8 @@
 #include "Scene.hpp"
 #include "ReduxTypes.hpp"
 #include "AnimationManager.hpp"
+#include "M2Animation.hpp"
+#include "M2Particles.hpp"
 #include "../system/EffectManager.hpp"
 #include "../system/Renderable.hpp"
 
@@ -20,6 +22,7 @@ class EffectMgr;
 struct Input;
 class EventArgs;
 class EffectWrapper;
+class AssetLoader;
 
 typedef std::vector<MeshSPtr> Meshes;
 
@@ -36,6 +39,7 @@ public:
   virtual bool init();
   virtual bool close();
   virtual void  render(const int32_t time_in_ms, const int32_t delta);
+  virtual void pick(const D3DXVECTOR3& org, const D3DXVECTOR3& dir);
 
   void  load_scene(const std::string& filename);
 private:
@@ -80,9 +84,15 @@ private:
 
   void file_changed(const EventArgs* args);
 
+  void render_mesh(const MeshSPtr& mesh, const D3DXVECTOR3& eye_pos);
+  void render_particles(const int32_t time_in_ms, const int32_t delta, const D3DXMATRIX& mtx_view);
+
   Scene scene_;
   uint32_t current_camera_;
   bool free_fly_camera_enabled_;
+  bool compact_vertices_;
+  uint32_t lod_;
+  bool picked_;
 
   LoadedEffects loaded_effects_;
   LoadedMaterials loaded_materials_;
@@ -91,6 +101,16 @@ private:
   MaterialsByEffect effect_list_;
 
   AnimationManager* animation_manager_;
+  AssetLoader* asset_loader_;
+  M2AnimationSPtr animation_;
+  M2AnimationInstance animation_instance_;
+
+  M2ParticleSystem* particles_;
+  std::vector<ParticleBatch> particle_batches_;
+  ID3D10Buffer* particle_vertex_buffer_;
+  ID3D10InputLayout* particle_layout_;
+  // used when the model's texture couldn't be loaded
+  ID3D10ShaderResourceView* default_texture_;
 
   std::map<EffectName, Handle> effects_;
 
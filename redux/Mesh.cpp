@@ -2,13 +2,21 @@
 #include "Mesh.hpp"
 #include <celsus/Logger.hpp>
 
+namespace
+{
+  // screen size below which each lod after the first is used
+  const float kLodThresholds[] = { 0.25f, 0.1f, 0.04f, 0.015f };
+  const float kLodHysteresis = 0.15f;
+}
 
 Mesh::Mesh(const std::string& name) 
   : name_(name)
   , index_count_(0)
   , vertex_buffer_stride_(0)
   , vertex_buffer_(NULL)
+  , index_buffer_(NULL)
   , input_layout2_(NULL)
+  , compact_vertices_(false)
 {
   D3DXMATRIX world_matrix;
   D3DXMatrixIdentity(&world_matrix);
@@ -18,10 +26,15 @@ Mesh::~Mesh()
 {
   SAFE_RELEASE(vertex_buffer_);
   SAFE_RELEASE(index_buffer_);
+  for (size_t i = 0; i < lods_.size(); ++i) {
+    SAFE_RELEASE(lods_[i].index_buffer);
+  }
   SAFE_RELEASE(input_layout2_);
 
-  FOREACH(D3D10_INPUT_ELEMENT_DESC desc, input_element_descs_) {
-    free((void*)(desc.SemanticName));
+  if (!package_) {
+    FOREACH(D3D10_INPUT_ELEMENT_DESC desc, input_element_descs_) {
+      free((void*)(desc.SemanticName));
+    }
   }
 }
 
@@ -34,3 +47,18 @@ void Mesh::set_input_layout(ID3D10InputLayout* layout)
 {
   input_layout2_ = layout;
 }
+
+uint32_t select_mesh_lod(const uint32_t cur_lod, const uint32_t num_lods, const float screen_size)
+{
+  const uint32_t max_lod = std::min<uint32_t>(num_lods, sizeof(kLodThresholds) / sizeof(kLodThresholds[0]) + 1) - 1;
+  uint32_t lod = std::min(cur_lod, max_lod);
+
+  // step down while we're clearly smaller than the current lod's threshold, and up while clearly bigger
+  while (lod < max_lod && screen_size < kLodThresholds[lod] * (1 - kLodHysteresis)) {
+    ++lod;
+  }
+  while (lod > 0 && screen_size > kLodThresholds[lod - 1] * (1 + kLodHysteresis)) {
+    --lod;
+  }
+  return lod;
+}
@@ -2,6 +2,7 @@
 #define MESH_HPP
 
 #include "ReduxTypes.hpp"
+#include "CompactVertex.hpp"
 #include "../system/Handle.hpp"
 #include "../system/SystemInterface.hpp"
 
@@ -24,6 +25,20 @@ public:
   D3DXVECTOR3 bounding_sphere_center() const;
   float bounding_sphere_radius() const;
 
+  bool compact_vertices() const { return compact_vertices_; }
+  const QuantizationBounds& quantization_bounds() const { return quantization_bounds_; }
+
+  // bind pose for cpu skinned meshes. The vertex buffer is dynamic, and is skinned into every frame
+  const SkinMeshSPtr& skin_mesh() const { return skin_mesh_; }
+  ID3D10Buffer* vertex_buffer() const { return vertex_buffer_; }
+
+  // lod 0 is the regular index buffer, the others are lower detail index buffers over the same vertices
+  uint32_t num_lods() const { return lods_.size() + 1; }
+  void render_lod(const uint32_t lod);
+
+  // simplified geometry for picking, if the source format has it
+  const CollisionHullSPtr& collision_hull() const { return collision_hull_; }
+
   void set_input_layout(ID3D10InputLayout* layout);
 private:
   friend class FbxProxy;
@@ -43,6 +58,24 @@ private:
   D3DXVECTOR3 bounding_sphere_center_;
   float bounding_sphere_radius_;
 
+  // set if the vertex buffer holds CompactVertex
+  bool compact_vertices_;
+  QuantizationBounds quantization_bounds_;
+
+  SkinMeshSPtr skin_mesh_;
+
+  struct IndexLod
+  {
+    IndexLod(ID3D10Buffer* index_buffer, const uint32_t index_count) : index_buffer(index_buffer), index_count(index_count) {}
+    ID3D10Buffer* index_buffer;
+    uint32_t index_count;
+  };
+  std::vector<IndexLod> lods_;
+
+  CollisionHullSPtr collision_hull_;
+
+  // set if the mesh was loaded from a package. The semantic names then point into it, and aren't freed
+  ScenePackageSPtr package_;
   std::vector<D3D10_INPUT_ELEMENT_DESC>  input_element_descs_;
   Handle  input_layout_;
   ID3D10InputLayout*  input_layout2_;
@@ -100,4 +133,24 @@ inline void Mesh::render()
 
 }
 
+inline void Mesh::render_lod(const uint32_t lod)
+{
+  if (lod == 0 || lod > lods_.size()) {
+    render();
+    return;
+  }
+
+  assert(input_layout2_ != NULL);
+  const IndexLod& cur = lods_[lod - 1];
+  const UINT offset = 0;
+  g_d3d_device->IASetInputLayout(input_layout2_);
+  g_d3d_device->IASetIndexBuffer(cur.index_buffer, index_buffer_format_, 0);
+  g_d3d_device->IASetVertexBuffers(0, 1, &vertex_buffer_, &vertex_buffer_stride_, &offset);
+  g_d3d_device->DrawIndexed(cur.index_count, 0, 0);
+}
+
+// Picks the lod for a mesh whose bounding sphere covers screen_size of the viewport's height. To avoid
+// popping back and forth, the lod only changes once the size is a bit past the threshold.
+uint32_t select_mesh_lod(const uint32_t cur_lod, const uint32_t num_lods, const float screen_size);
+
 #endif
@@ -0,0 +1,232 @@
+#include "stdafx.h"
+#include "MeshBvh.hpp"
+#include "Mesh.hpp"
+#include "AnimationNode.hpp"
+#include "Utils.hpp"
+
+namespace
+{
+  const uint32_t kMaxLeafSize = 4;
+  // the tree is rebuilt once refitting has grown the boxes this much
+  const float kRebuildAreaRatio = 2.0f;
+  const uint32_t kMaxCullDepth = 64;
+
+  struct CenterLess
+  {
+    CenterLess(const std::vector<float>& values) : values(values) {}
+    bool operator()(const uint32_t a, const uint32_t b) const { return values[a] < values[b]; }
+    const std::vector<float>& values;
+  };
+
+  inline float box_area(const D3DXVECTOR3& min_pos, const D3DXVECTOR3& max_pos)
+  {
+    const D3DXVECTOR3 d(max_pos - min_pos);
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+}
+
+MeshBvh::MeshBvh()
+  : built_area_(0)
+{
+}
+
+void MeshBvh::update_spheres()
+{
+  // same bounds as the renderers cull with
+  for (uint32_t i = 0, e = meshes_.size(); i < e; ++i) {
+    const Mesh& mesh = *meshes_[mesh_order_[i]];
+    const D3DXVECTOR3 center(mesh.bounding_sphere_center());
+    if (AnimationNodeSPtr node = mesh.animation_node()) {
+      const D3DXMATRIX& world = node->transform();
+      const D3DXVECTOR3 scale(get_scale(world));
+      D3DXVECTOR3 ws_center;
+      D3DXVec3TransformCoord(&ws_center, &center, &world);
+      spheres_.set(i, ws_center, D3DXVec3Length(&scale) * mesh.bounding_sphere_radius());
+    } else {
+      spheres_.set(i, center, mesh.bounding_sphere_radius());
+    }
+  }
+}
+
+void MeshBvh::build(const std::vector<MeshSPtr>& meshes)
+{
+  if (&meshes != &meshes_) {
+    meshes_ = meshes;
+  }
+  spheres_.resize(meshes_.size());
+  mesh_order_.resize(meshes_.size());
+  mesh_slots_.resize(meshes_.size());
+  for (uint32_t i = 0, e = mesh_order_.size(); i < e; ++i) {
+    mesh_order_[i] = i;
+  }
+
+  nodes_.clear();
+  if (meshes_.empty()) {
+    built_area_ = 0;
+    return;
+  }
+
+  // the spheres are in mesh order while building, and are then moved to tree order
+  update_spheres();
+  nodes_.reserve(2 * meshes_.size() / kMaxLeafSize + 1);
+  build_node(0, meshes_.size());
+  built_area_ = surface_area();
+
+  update_spheres();
+  for (uint32_t i = 0, e = mesh_order_.size(); i < e; ++i) {
+    mesh_slots_[mesh_order_[i]] = i;
+  }
+}
+
+uint32_t MeshBvh::build_node(const uint32_t first, const uint32_t count)
+{
+  const uint32_t idx = nodes_.size();
+  nodes_.push_back(Node());
+
+  D3DXVECTOR3 min_pos(FLT_MAX, FLT_MAX, FLT_MAX), max_pos(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  D3DXVECTOR3 min_center(min_pos), max_center(max_pos);
+  for (uint32_t i = first; i < first + count; ++i) {
+    const uint32_t idx = mesh_order_[i];
+    const D3DXVECTOR3 c(spheres_.center(idx));
+    const D3DXVECTOR3 r(spheres_.radius[idx], spheres_.radius[idx], spheres_.radius[idx]);
+    const D3DXVECTOR3 lo(c - r), hi(c + r);
+    D3DXVec3Minimize(&min_pos, &min_pos, &lo);
+    D3DXVec3Maximize(&max_pos, &max_pos, &hi);
+    D3DXVec3Minimize(&min_center, &min_center, &c);
+    D3DXVec3Maximize(&max_center, &max_center, &c);
+  }
+
+  uint32_t right = 0;
+  if (count > kMaxLeafSize) {
+    // split at the median along the axis where the centers are the most spread out
+    const D3DXVECTOR3 extents(max_center - min_center);
+    const uint32_t axis = extents.x > extents.y ? (extents.x > extents.z ? 0 : 2) : (extents.y > extents.z ? 1 : 2);
+    const uint32_t half = count / 2;
+    std::nth_element(mesh_order_.begin() + first, mesh_order_.begin() + first + half, mesh_order_.begin() + first + count,
+      CenterLess(axis == 0 ? spheres_.x : axis == 1 ? spheres_.y : spheres_.z));
+    build_node(first, half);
+    right = build_node(first + half, count - half);
+  }
+
+  Node& node = nodes_[idx];
+  node.min_pos = min_pos;
+  node.max_pos = max_pos;
+  node.first = first;
+  node.count = count;
+  node.right = right;
+  return idx;
+}
+
+float MeshBvh::surface_area() const
+{
+  float area = 0;
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    area += box_area(nodes_[i].min_pos, nodes_[i].max_pos);
+  }
+  return area;
+}
+
+void MeshBvh::refit()
+{
+  if (nodes_.empty()) {
+    return;
+  }
+
+  update_spheres();
+
+  // children come after their parents, so a backwards pass sees them first
+  for (uint32_t i = nodes_.size(); i-- > 0; ) {
+    Node& node = nodes_[i];
+    if (node.right != 0) {
+      const Node& left = nodes_[i + 1];
+      const Node& right = nodes_[node.right];
+      D3DXVec3Minimize(&node.min_pos, &left.min_pos, &right.min_pos);
+      D3DXVec3Maximize(&node.max_pos, &left.max_pos, &right.max_pos);
+      continue;
+    }
+
+    node.min_pos = D3DXVECTOR3(FLT_MAX, FLT_MAX, FLT_MAX);
+    node.max_pos = -node.min_pos;
+    for (uint32_t j = node.first; j < node.first + node.count; ++j) {
+      const D3DXVECTOR3 c(spheres_.center(j));
+      const D3DXVECTOR3 r(spheres_.radius[j], spheres_.radius[j], spheres_.radius[j]);
+      const D3DXVECTOR3 lo(c - r), hi(c + r);
+      D3DXVec3Minimize(&node.min_pos, &node.min_pos, &lo);
+      D3DXVec3Maximize(&node.max_pos, &node.max_pos, &hi);
+    }
+  }
+
+  if (surface_area() > kRebuildAreaRatio * built_area_) {
+    build(meshes_);
+  }
+}
+
+void MeshBvh::cull(std::vector<uint32_t>& visible, const D3DXPLANE* planes, const uint32_t num_planes) const
+{
+  if (nodes_.empty()) {
+    return;
+  }
+
+  // each entry carries the planes its parent wasn't completely inside of
+  uint32_t stack_nodes[kMaxCullDepth];
+  uint32_t stack_masks[kMaxCullDepth];
+  uint32_t sp = 0;
+  stack_nodes[sp] = 0;
+  stack_masks[sp++] = (1 << num_planes) - 1;
+
+  while (sp > 0) {
+    --sp;
+    const Node& node = nodes_[stack_nodes[sp]];
+    uint32_t mask = stack_masks[sp];
+
+    bool outside = false;
+    for (uint32_t j = 0; j < num_planes && !outside; ++j) {
+      if (!(mask & (1 << j))) {
+        continue;
+      }
+      // the corners furthest along and against the plane normal
+      const D3DXPLANE& p = planes[j];
+      const D3DXVECTOR3 pos_corner(p.a > 0 ? node.max_pos.x : node.min_pos.x, p.b > 0 ? node.max_pos.y : node.min_pos.y, p.c > 0 ? node.max_pos.z : node.min_pos.z);
+      const D3DXVECTOR3 neg_corner(p.a > 0 ? node.min_pos.x : node.max_pos.x, p.b > 0 ? node.min_pos.y : node.max_pos.y, p.c > 0 ? node.min_pos.z : node.max_pos.z);
+      if (distance_to_point(p, pos_corner) < 0) {
+        outside = true;
+      } else if (distance_to_point(p, neg_corner) >= 0) {
+        mask &= ~(1 << j);
+      }
+    }
+
+    if (outside) {
+      continue;
+    }
+
+    if (mask == 0) {
+      visible.insert(visible.end(), mesh_order_.begin() + node.first, mesh_order_.begin() + node.first + node.count);
+    } else if (node.right == 0) {
+      // only the planes the leaf straddles, four spheres at a time
+      D3DXPLANE active[32];
+      uint32_t num_active = 0;
+      for (uint32_t j = 0; j < num_planes; ++j) {
+        if (mask & (1 << j)) {
+          active[num_active++] = planes[j];
+        }
+      }
+      for (uint32_t i = node.first; i < node.first + node.count; i += 4) {
+        uint32_t inside = cull_spheres4(spheres_, i, active, num_active);
+        if (node.first + node.count - i < 4) {
+          inside &= (1 << (node.first + node.count - i)) - 1;
+        }
+        for (uint32_t j = 0; inside != 0; ++j, inside >>= 1) {
+          if (inside & 1) {
+            visible.push_back(mesh_order_[i + j]);
+          }
+        }
+      }
+    } else {
+      SUPER_ASSERT(sp + 2 <= kMaxCullDepth);
+      stack_nodes[sp] = node.right;
+      stack_masks[sp++] = mask;
+      stack_nodes[sp] = &node - &nodes_[0] + 1;
+      stack_masks[sp++] = mask;
+    }
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef MESH_BVH_HPP
+#define MESH_BVH_HPP
+
+#include "ReduxTypes.hpp"
+#include "SphereCulling.hpp"
+
+/**
+ * Bounding volume hierarchy over the world space bounding spheres of a set of meshes. Built once per
+ * scene, and refit every frame after the animation update, which is enough as long as the meshes move
+ * together. If refitting has made the boxes a lot bigger than when they were built, the tree is rebuilt.
+ */
+class MeshBvh
+{
+public:
+  MeshBvh();
+
+  void build(const std::vector<MeshSPtr>& meshes);
+  void refit();
+
+  // Appends the index of every mesh whose sphere isn't outside planes, which point inwards. Subtrees
+  // completely inside or outside are handled without looking at their meshes.
+  void cull(std::vector<uint32_t>& visible, const D3DXPLANE* planes, const uint32_t num_planes) const;
+
+  uint32_t num_meshes() const { return meshes_.size(); }
+  D3DXVECTOR3 center(const uint32_t idx) const { return spheres_.center(mesh_slots_[idx]); }
+  float radius(const uint32_t idx) const { return spheres_.radius[mesh_slots_[idx]]; }
+
+  // The spheres are stored in tree order, so each leaf's spheres are next to each other. mesh_index
+  // maps them back.
+  const SphereSoA& spheres() const { return spheres_; }
+  uint32_t mesh_index(const uint32_t slot) const { return mesh_order_[slot]; }
+
+private:
+  // Nodes are stored depth first, so the left child follows its parent, and every subtree's meshes are
+  // a contiguous range of mesh_order_
+  struct Node
+  {
+    D3DXVECTOR3 min_pos;
+    D3DXVECTOR3 max_pos;
+    uint32_t first;
+    uint32_t count;
+    uint32_t right;     // 0 for a leaf
+  };
+
+  void update_spheres();
+  uint32_t build_node(const uint32_t first, const uint32_t count);
+  float surface_area() const;
+
+  std::vector<MeshSPtr> meshes_;
+  SphereSoA spheres_;
+  std::vector<uint32_t> mesh_order_;
+  std::vector<uint32_t> mesh_slots_;
+  std::vector<Node> nodes_;
+  float built_area_;
+};
+
+#endif // #ifndef MESH_BVH_HPP
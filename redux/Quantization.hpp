@@ -0,0 +1,12 @@
+#ifndef QUANTIZATION_HPP
+#define QUANTIZATION_HPP
+
+// Maps quantized unorm values back to the source range, as value * scale + bias
+struct QuantizationBounds
+{
+  QuantizationBounds() : scale(kVec3One), bias(kVec3Zero) {}
+  D3DXVECTOR3 scale;
+  D3DXVECTOR3 bias;
+};
+
+#endif // #ifndef QUANTIZATION_HPP
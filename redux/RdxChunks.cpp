@@ -0,0 +1,99 @@
+#include "stdafx.h"
+#include "RdxChunks.hpp"
+
+namespace
+{
+  uint32_t to_ms(const float time)
+  {
+    return time > 0 ? (uint32_t)(time * 1000.0f) : 0;
+  }
+
+  void read_hierarchy_inner(ChunkIo& reader, std::vector<RdxNode>& nodes, const int32_t parent)
+  {
+    const int32_t idx = nodes.size();
+    nodes.push_back(RdxNode(reader.read_string(), parent));
+    const uint32_t num_children = reader.read_int();
+    for (uint32_t i = 0; i < num_children; ++i) {
+      read_hierarchy_inner(reader, nodes, idx);
+    }
+  }
+}
+
+void index_rdx(uint8_t* data, const uint32_t data_len, std::vector<RdxChunk>& chunks)
+{
+  ChunkIo reader;
+  reader.init_reader(data, data_len);
+  for (; !reader.is_eof(); reader.next()) {
+    chunks.push_back(RdxChunk(reader.cur_header(), reader));
+  }
+}
+
+void read_rdx_hierarchy(ChunkIo& reader, std::vector<RdxNode>& nodes)
+{
+  const std::string root_name(reader.read_string());
+  assert(root_name == "root");
+  const uint32_t num_children = reader.read_int();
+  for (uint32_t i = 0; i < num_children; ++i) {
+    read_hierarchy_inner(reader, nodes, -1);
+  }
+}
+
+void read_rdx_mesh(ChunkIo& reader, RdxMesh& mesh)
+{
+  mesh.name = reader.read_string();
+  mesh.transform_name = reader.read_string();
+  const uint32_t input_desc_count = reader.read_int();
+  mesh.input_elements.resize(input_desc_count);
+  for (uint32_t i = 0; i < input_desc_count; ++i) {
+    RdxInputElement& e = mesh.input_elements[i];
+    e.semantic_name = reader.read_cstring();
+    e.semantic_index = reader.read_int();
+    e.format = reader.read_int();
+    e.input_slot = reader.read_int();
+    e.aligned_byte_offset = reader.read_int();
+  }
+  mesh.vertex_count = reader.read_int();
+  mesh.vertex_size = reader.read_int();
+  mesh.vertices = reader.read_data(mesh.vertex_count * mesh.vertex_size);
+  mesh.index_count = reader.read_int();
+  mesh.index_size = reader.read_int();
+  mesh.indices = reader.read_data(mesh.index_count * mesh.index_size);
+  mesh.bounding_sphere_center = reader.read_generic<D3DXVECTOR3>();
+  mesh.bounding_sphere_radius = reader.read_generic<float>();
+}
+
+void read_rdx_camera(ChunkIo& reader, RdxCamera& camera)
+{
+  camera.name = reader.read_string();
+  camera.eye_pos = reader.read_generic<D3DXVECTOR3>();
+  camera.forward = reader.read_generic<D3DXVECTOR3>();
+  camera.up = reader.read_generic<D3DXVECTOR3>();
+  camera.right = reader.read_generic<D3DXVECTOR3>();
+  camera.aspect_ratio = reader.read_generic<float>();
+  camera.horizontal_fov = reader.read_generic<float>();
+  camera.vertical_fov = reader.read_generic<float>();
+  camera.near_plane = reader.read_generic<float>();
+  camera.far_plane = reader.read_generic<float>();
+}
+
+void read_rdx_animation(ChunkIo& reader, RdxAnimation& animation)
+{
+  animation.fps = reader.read_uint();
+  animation.start_time = to_ms(reader.read_generic<float>());
+  animation.end_time = to_ms(reader.read_generic<float>());
+  const uint32_t num_tracks = reader.read_uint();
+  animation.tracks.resize(num_tracks);
+  for (uint32_t i = 0; i < num_tracks; ++i) {
+    RdxTrack& track = animation.tracks[i];
+    track.node_name = reader.read_string();
+    const uint32_t num_keys = reader.read_uint();
+    track.keys.reserve(num_keys);
+    for (uint32_t j = 0; j < num_keys; ++j) {
+      const uint32_t time = to_ms(reader.read_generic<float>());
+      const D3DXVECTOR3 pos = reader.read_generic<D3DXVECTOR3>();
+      const D3DXQUATERNION rot = reader.read_generic<D3DXQUATERNION>();
+      const D3DXVECTOR3 scale = reader.read_generic<D3DXVECTOR3>();
+      track.keys.push_back(AnimationKey(time, pos, rot, scale));
+    }
+  }
+}
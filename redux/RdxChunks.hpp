@@ -0,0 +1,87 @@
+#ifndef RDX_CHUNKS_HPP
+#define RDX_CHUNKS_HPP
+
+#include "AnimationNode.hpp"
+#include <celsus/ChunkIO.hpp>
+
+// The chunks of an .rdx scene, decoded into plain structs. Nothing is created, and the vertex and index
+// data is left in the file buffer. Used by both the package cook and ReduxLoader.
+
+struct RdxNode
+{
+  RdxNode(const std::string& name, const int32_t parent) : name(name), parent(parent) {}
+  std::string name;
+  int32_t parent;     // the parents come before their children, -1 for the top level nodes
+};
+
+struct RdxInputElement
+{
+  std::string semantic_name;
+  uint32_t semantic_index;
+  uint32_t format;
+  uint32_t input_slot;
+  uint32_t aligned_byte_offset;
+};
+
+struct RdxMesh
+{
+  std::string name;
+  std::string transform_name;
+  std::vector<RdxInputElement> input_elements;
+  uint32_t vertex_count;
+  uint32_t vertex_size;
+  uint8_t* vertices;
+  uint32_t index_count;
+  uint32_t index_size;
+  uint8_t* indices;
+  D3DXVECTOR3 bounding_sphere_center;
+  float bounding_sphere_radius;
+};
+
+struct RdxCamera
+{
+  std::string name;
+  D3DXVECTOR3 eye_pos;
+  D3DXVECTOR3 forward;
+  D3DXVECTOR3 up;
+  D3DXVECTOR3 right;
+  float aspect_ratio;
+  float horizontal_fov;
+  float vertical_fov;
+  float near_plane;
+  float far_plane;
+};
+
+struct RdxTrack
+{
+  std::string node_name;
+  AnimationKeys keys;
+};
+
+struct RdxAnimation
+{
+  uint32_t fps;
+  uint32_t start_time;
+  uint32_t end_time;
+  std::vector<RdxTrack> tracks;
+};
+
+// A chunk found by index_rdx. The reader is positioned at the chunk, so the chunks can be decoded in
+// any order, and on any thread, without walking the file again
+struct RdxChunk
+{
+  RdxChunk(const ChunkHeader& header, const ChunkIo& reader) : header(header), reader(reader) {}
+  ChunkHeader header;
+  ChunkIo reader;
+};
+
+// walks the chunk headers once. The data has to outlive the chunks
+void index_rdx(uint8_t* data, const uint32_t data_len, std::vector<RdxChunk>& chunks);
+
+// the root node is skipped, so the top level nodes have no parent
+void read_rdx_hierarchy(ChunkIo& reader, std::vector<RdxNode>& nodes);
+void read_rdx_mesh(ChunkIo& reader, RdxMesh& mesh);
+void read_rdx_camera(ChunkIo& reader, RdxCamera& camera);
+void read_rdx_animation(ChunkIo& reader, RdxAnimation& animation);
+
+#endif // #ifndef RDX_CHUNKS_HPP
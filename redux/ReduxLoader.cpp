@@ -2,19 +2,53 @@
 #include "../system/SystemInterface.hpp"
 #include "ReduxLoader.hpp"
 #include <celsus/ErrorHandling.hpp>
-#include <celsus/ChunkIO.hpp>
 #include "Mesh.hpp"
 #include "AnimationManager.hpp"
 #include "Scene.hpp"
 #include "Camera.hpp"
+#include "ScenePackage.hpp"
+#include "ThreadPool.hpp"
+#include "BlockCompression.hpp"
+#include "AnimationCompression.hpp"
+#include "AnimationClip.hpp"
+#include "RdxChunks.hpp"
 
 using namespace std;
 using namespace boost::filesystem;
 
 namespace 
 {
+  // the mesh chunks vary a lot in size, so keep the ranges small to balance the load
+  const uint32_t kChunkGrainSize = 2;
 }
 
+struct ReduxLoader::AnimationChunk
+{
+  uint32_t fps;
+  uint32_t start_time;
+  uint32_t end_time;
+  std::vector< std::pair<AnimationNodeSPtr, CompressedTrack> > tracks;
+  AnimationCompressionStats stats;
+};
+
+// A chunk that's decoded on the thread pool. The results are merged into the scene in file order
+struct ReduxLoader::ChunkJob
+{
+  ChunkJob(const RdxChunk& chunk) : chunk(chunk) {}
+  RdxChunk chunk;
+  MeshSPtr mesh;
+  CameraPtr camera;
+  boost::shared_ptr<AnimationChunk> animation;
+  std::string error;
+};
+
+struct ReduxLoader::LoadContext
+{
+  uint8_t* data;
+  uint32_t data_len;
+  std::vector<ChunkJob> chunks;
+};
+
 ReduxLoader::ReduxLoader(const std::string& filename, Scene* scene, SystemInterface* system, AnimationManager* animation_manager)
   : filename_(filename)
   , scene_(scene)
@@ -27,184 +61,313 @@ void ReduxLoader::load()
 {
   SCOPED_FUNC_PROFILE();
 
+  const AnimationCompressionSettings& settings = animation_manager_->compression_settings();
   path rdx_path(filename_);
   string rdx_filename(rdx_path.replace_extension("rdx").string());
+  string package_filename(scene_package_filename(rdx_filename, settings));
+  // the materials are in the same json file the renderers use
+  const string raw_filename(rdx_path.replace_extension().filename());
+  string json_filename("data/scenes/" + raw_filename + ".json");
+
+  // Load from the cooked package if possible. It's cooked again if it's out of date, or can't be
+  // opened, which is also the case when it's from an older version, or its tracks were compressed
+  // with other settings
+  ScenePackageSPtr package(new ScenePackage());
+  bool opened = !is_package_stale(package_filename, rdx_filename, json_filename) && package->open(package_filename);
+  if (opened && !is_package_compressed_with(*package, settings)) {
+    // closed first, so the file can be replaced
+    package->close();
+    opened = false;
+  }
+  if (opened || (cook_scene_package(rdx_filename, json_filename, package_filename, true, settings) && package->open(package_filename))) {
+    // the clip is shared by everything that loads this cook of the package. The settings are part of
+    // the package's name, and the time and size change when it's cooked again
+    const string clip_name(to_string("%s:%u:%u", package_filename.c_str(),
+      (uint32_t)last_write_time(package_filename), package->header()->size));
+    load_package(package, clip_name);
+    return;
+  }
 
-  uint8_t* data = 0;
-  uint32_t data_len = 0;
-  ENFORCE(load_file(data, data_len, rdx_filename.c_str()))(rdx_filename);
-
-  ChunkIo reader;
-  reader.init_reader(data, data_len);
-  while (!reader.is_eof()) {
-    ChunkHeader header = reader.cur_header();
-    switch ( header.id_) {
-      case ChunkHeader::Info: 
-        {
-        }
-        break;
+  LoadContext ctx;
+  ctx.data = 0;
+  ctx.data_len = 0;
+  ENFORCE(load_file(ctx.data, ctx.data_len, rdx_filename.c_str()))(rdx_filename);
+
+  // index the chunks, and load the hierarchy right away, as the other chunks look up their nodes in it
+  std::vector<RdxChunk> chunks;
+  index_rdx(ctx.data, ctx.data_len, chunks);
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    switch (chunks[i].header.id_) {
       case ChunkHeader::Hierarchy:
-        {
-          load_hierarchy(reader);
-        }
+        load_hierarchy(chunks[i].reader);
         break;
       case ChunkHeader::Mesh:
-        {
-          load_mesh(reader);
-        }
-        break;
-      case ChunkHeader::Light:
-        {
-        }
-        break;
       case ChunkHeader::Camera:
-        {
-          load_camera(reader);
-        }
-        break;
-
       case ChunkHeader::Animation:
-        {
-          load_animation(reader);
-        }
+        ctx.chunks.push_back(ChunkJob(chunks[i]));
         break;
     }
-    reader.next();
   }
+
+  ThreadPool::instance().parallel_for(ctx.chunks.size(), kChunkGrainSize,
+    boost::bind(&ReduxLoader::load_chunk_range, this, &ctx, _1, _2));
+
+  for (size_t i = 0; i < ctx.chunks.size(); ++i) {
+    const ChunkJob& job = ctx.chunks[i];
+    if (!job.error.empty()) {
+      SAFE_ADELETE(ctx.data);
+      throw std::runtime_error(job.error);
+    }
+    if (job.mesh) {
+      scene_->meshes_.push_back(job.mesh);
+      if (job.mesh->animation_node_) {
+        animation_manager_->require_node(job.mesh->animation_node_->handle());
+      }
+    } else if (job.camera) {
+      scene_->cameras_.push_back(job.camera);
+    } else if (job.animation) {
+      apply_animation(*job.animation);
+    }
+  }
+
+  SAFE_ADELETE(ctx.data);
 }
 
-void ReduxLoader::load_camera(ChunkIo& reader)
+void ReduxLoader::load_chunk_range(LoadContext* ctx, const uint32_t begin, const uint32_t end)
 {
-  Camera* camera = new Camera();
-  camera->name_ = reader.read_string();
+  // every job has its own reader, positioned at its chunk by index_rdx
+  for (uint32_t i = begin; i < end; ++i) {
+    ChunkJob& job = ctx->chunks[i];
+    ChunkIo& reader = job.chunk.reader;
+
+    // an exception can't be allowed to escape the pool, so it's passed back to load()
+    try {
+      switch (job.chunk.header.id_) {
+        case ChunkHeader::Mesh:
+          job.mesh = load_mesh(reader);
+          break;
+        case ChunkHeader::Camera:
+          job.camera = load_camera(reader);
+          break;
+        case ChunkHeader::Animation:
+          job.animation.reset(new AnimationChunk());
+          load_animation(reader, *job.animation);
+          break;
+      }
+    } catch (std::exception& e) {
+      job.error = e.what();
+    }
+  }
+}
+
+void ReduxLoader::load_package(const ScenePackageSPtr& package, const std::string& clip_name)
+{
+  SCOPED_FUNC_PROFILE();
+  const PackageHeader* header = package->header();
 
-  camera->eye_pos_ = reader.read_generic<D3DXVECTOR3>();
-  camera->forward_vector_ = reader.read_generic<D3DXVECTOR3>();
-  camera->up_vector_ = reader.read_generic<D3DXVECTOR3>();
-  camera->right_vector_ = reader.read_generic<D3DXVECTOR3>();
+  // the parents are stored before their children
+  std::vector<AnimationNodeHandle> nodes(header->num_nodes);
+  for (uint32_t i = 0; i < header->num_nodes; ++i) {
+    const PackageNode& src = header->nodes[i];
+    nodes[i] = animation_manager_->add_node(src.name.ptr, src.parent < 0 ? kInvalidAnimationNode : nodes[src.parent]);
+  }
 
-  camera->aspect_ratio_ = reader.read_generic<float>();
-  camera->horizontal_fov_ = reader.read_generic<float>();
-  camera->vertical_fov_ = reader.read_generic<float>();
-  camera->near_plane_ = reader.read_generic<float>();
-  camera->far_plane_ = reader.read_generic<float>();
+  animation_manager_->fps_ = header->fps;
+  animation_manager_->start_time_ = header->start_time;
+  animation_manager_->end_time_ = header->end_time;
+  // The tracks were compressed when the package was cooked. Everything that loads the scene shares
+  // the clip, so they're only copied out of the package once
+  AnimationClipSPtr clip = find_shared_clip(clip_name);
+  if (!clip || !clip->has_parents(animation_manager_->parents_)) {
+    std::vector<CompressedTrack> tracks(header->num_nodes);
+    for (uint32_t i = 0; i < header->num_tracks; ++i) {
+      const PackageTrack& src = header->tracks[i];
+      create_track(tracks[nodes[src.node]], src);
+    }
+    clip.reset(new AnimationClip(animation_manager_->parents_, tracks, header->end_time));
+    add_shared_clip(clip_name, clip);
+  }
+  animation_manager_->set_clip(clip);
+
+  for (uint32_t i = 0; i < header->num_cameras; ++i) {
+    const PackageCamera& src = header->cameras[i];
+    Camera* camera = new Camera();
+    camera->name_ = src.name.ptr;
+    camera->eye_pos_ = src.eye_pos;
+    camera->forward_vector_ = src.forward;
+    camera->up_vector_ = src.up;
+    camera->right_vector_ = src.right;
+    camera->aspect_ratio_ = src.aspect_ratio;
+    camera->horizontal_fov_ = src.horizontal_fov;
+    camera->vertical_fov_ = src.vertical_fov;
+    camera->near_plane_ = src.near_plane;
+    camera->far_plane_ = src.far_plane;
+    camera->update();
+    scene_->cameras_.push_back(CameraPtr(camera));
+  }
 
-  camera->update();
+  std::vector<uint8_t> vertex_data;
+  std::vector<uint8_t> index_data;
+  for (uint32_t i = 0; i < header->num_meshes; ++i) {
+    const PackageMesh& src = header->meshes[i];
+    Mesh* mesh = new Mesh(src.name.ptr);
+    mesh->package_ = package;
+    mesh->transform_name_ = src.transform_name.ptr;
+    if (src.node >= 0) {
+      mesh->animation_node_ = animation_manager_->nodes_[nodes[src.node]];
+      animation_manager_->require_node(nodes[src.node]);
+    }
 
-  scene_->cameras_.push_back(CameraPtr(camera));
+    D3D10_INPUT_ELEMENT_DESC desc;
+    ZeroMemory(&desc, sizeof(desc));
+    for (uint32_t j = 0; j < src.num_input_elements; ++j) {
+      const PackageInputElement& e = src.input_elements[j];
+      desc.SemanticName = e.semantic_name.ptr;
+      desc.SemanticIndex = e.semantic_index;
+      desc.Format = static_cast<DXGI_FORMAT>(e.format);
+      desc.InputSlot = e.input_slot;
+      desc.AlignedByteOffset = e.aligned_byte_offset;
+      mesh->input_element_descs_.push_back(desc);
+    }
 
+    // the buffers are created straight from the mapped file, unless the data has to be decompressed first
+    ENFORCE(src.index_size == 2 || src.index_size == 4)(src.index_size);
+    const uint8_t* vertices = src.vertices.ptr;
+    const uint8_t* indices = src.indices.ptr;
+    if (src.flags & PackageMesh::Compressed) {
+      vertex_data.resize(src.vertex_count * src.vertex_size + 1);
+      index_data.resize(src.index_count * src.index_size + 1);
+      ENFORCE(compressed_stream_raw_size(src.vertices.ptr, src.vertex_data_size) == src.vertex_count * src.vertex_size &&
+        decompress_stream(src.vertices.ptr, src.vertex_data_size, &vertex_data[0], &ThreadPool::instance()))(src.name.ptr);
+      ENFORCE(compressed_stream_raw_size(src.indices.ptr, src.index_data_size) == src.index_count * src.index_size &&
+        decompress_stream(src.indices.ptr, src.index_data_size, &index_data[0], &ThreadPool::instance()))(src.name.ptr);
+      vertices = &vertex_data[0];
+      indices = &index_data[0];
+    }
+    create_static_vertex_buffer(mesh->vertex_buffer_, g_d3d_device, vertices, src.vertex_count, src.vertex_size);
+    create_static_index_buffer(mesh->index_buffer_, g_d3d_device, indices, src.index_count, src.index_size);
+    mesh->index_buffer_format_ = src.index_size == 2 ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT;
+    mesh->index_count_ = src.index_count;
+    mesh->vertex_buffer_stride_ = src.vertex_size;
+    mesh->bounding_sphere_center_ = src.bounding_sphere_center;
+    mesh->bounding_sphere_radius_ = src.bounding_sphere_radius;
+
+    scene_->meshes_.push_back(MeshSPtr(mesh));
+  }
+
+  scene_->package_ = package;
 }
 
-void ReduxLoader::load_hierarchy_inner(ChunkIo& reader, AnimationNode* parent)
+CameraPtr ReduxLoader::load_camera(ChunkIo& reader)
 {
-  const string name(reader.read_string());
-  AnimationNode* cur = new AnimationNode(name);
-
-  if (parent == NULL) {
-    // top level node
-    animation_manager_->root_.push_back(AnimationNodeSPtr(cur));
-  } else {
-    parent->children_.push_back(AnimationNodeSPtr(cur));
-  }
+  RdxCamera src;
+  read_rdx_camera(reader, src);
 
-  const uint32_t num_children = reader.read_int();
-  for (uint32_t i = 0; i < num_children; ++i) {
-    load_hierarchy_inner(reader, cur);
-  }
+  Camera* camera = new Camera();
+  camera->name_ = src.name;
+  camera->eye_pos_ = src.eye_pos;
+  camera->forward_vector_ = src.forward;
+  camera->up_vector_ = src.up;
+  camera->right_vector_ = src.right;
+  camera->aspect_ratio_ = src.aspect_ratio;
+  camera->horizontal_fov_ = src.horizontal_fov;
+  camera->vertical_fov_ = src.vertical_fov;
+  camera->near_plane_ = src.near_plane;
+  camera->far_plane_ = src.far_plane;
+
+  camera->update();
+
+  return CameraPtr(camera);
 }
 
 void ReduxLoader::load_hierarchy(ChunkIo& reader) 
 {
-  // We don't want a single root node, so we just ignore the root
-  const string root_name(reader.read_string());
-  assert(root_name == "root");
-  const uint32_t num_children = reader.read_int();
-  // read children
-  for (uint32_t i = 0; i < num_children; ++i) {
-    load_hierarchy_inner(reader, NULL);
+  // We don't want a single root node, so it's skipped by read_rdx_hierarchy
+  std::vector<RdxNode> src;
+  read_rdx_hierarchy(reader, src);
+
+  // the parents come before their children
+  std::vector<AnimationNodeHandle> nodes(src.size());
+  for (size_t i = 0; i < src.size(); ++i) {
+    nodes[i] = animation_manager_->add_node(src[i].name, src[i].parent < 0 ? kInvalidAnimationNode : nodes[src[i].parent]);
   }
 }
 
-uint32_t to_ms(const float time)
+void ReduxLoader::load_animation(ChunkIo& reader, AnimationChunk& animation)
 {
-  SUPER_ASSERT(time >= 0.0f);
-  return (uint32_t)(time * 1000.0f);
+  RdxAnimation src;
+  read_rdx_animation(reader, src);
+  animation.fps = src.fps;
+  animation.start_time = src.start_time;
+  animation.end_time = src.end_time;
+
+  for (size_t i = 0; i < src.tracks.size(); ++i) {
+    // compressed here, so the work is spread over the pool along with the rest of the chunk
+    const RdxTrack& track = src.tracks[i];
+    if (AnimationNodeSPtr node = animation_manager_->find_node_by_name(track.node_name)) {
+      animation.tracks.push_back(std::make_pair(node, CompressedTrack()));
+      AnimationCompressionStats stats;
+      compress_track(animation.tracks.back().second, stats, track.keys, animation_manager_->compression_settings(), animation.fps);
+      animation.stats.add(stats);
+    } else {
+      LOG_WARNING_LN("[%s] Unable to find node: %s", __FUNCTION__, track.node_name.c_str());
+    }
+  }
 }
 
-void ReduxLoader::load_animation(ChunkIo& reader)
+void ReduxLoader::apply_animation(const AnimationChunk& animation)
 {
-  animation_manager_->fps_ = reader.read_uint();
-  animation_manager_->start_time_ = to_ms(reader.read_generic<float>());
-  animation_manager_->end_time_ = to_ms(reader.read_generic<float>());
-
-  const uint32_t num_tracks = reader.read_uint();
-  for (uint32_t i = 0; i < num_tracks; ++i) {
-
-    string node_name(reader.read_string());
-    const uint32_t num_keys = reader.read_uint();
-    AnimationKeys keys;
-    for (uint32_t j = 0; j < num_keys; ++j) {
-      const uint32_t time = to_ms(reader.read_generic<float>());
-      const D3DXVECTOR3 pos = reader.read_generic<D3DXVECTOR3>();
-      const D3DXQUATERNION rot = reader.read_generic<D3DXQUATERNION>();
-      const D3DXVECTOR3 scale = reader.read_generic<D3DXVECTOR3>();
-      keys.push_back(AnimationKey(time, pos, rot, scale));
-    }
-
-    if (AnimationNodeSPtr node = animation_manager_->find_node_by_name(node_name)) {
-      node->keys_ = keys;
-    } else {
-      LOG_WARNING_LN("[%s] Unable to find node: %s", __FUNCTION__, node_name.c_str());
-    }
+  animation_manager_->fps_ = animation.fps;
+  animation_manager_->start_time_ = animation.start_time;
+  animation_manager_->end_time_ = animation.end_time;
+  std::vector<CompressedTrack> tracks(animation_manager_->nodes_.size());
+  for (size_t i = 0; i < animation.tracks.size(); ++i) {
+    tracks[animation.tracks[i].first->handle()] = animation.tracks[i].second;
   }
+  // not shared, as there's no cooked package to identify the data by
+  animation_manager_->set_clip(AnimationClipSPtr(new AnimationClip(animation_manager_->parents_, tracks, animation.end_time)));
+  animation.stats.log();
 }
 
 extern ID3D10Device* g_d3d_device;
 
 
-void ReduxLoader::load_mesh(ChunkIo& reader)
+MeshSPtr ReduxLoader::load_mesh(ChunkIo& reader)
 {
-  const string mesh_name(reader.read_string());
-  Mesh* mesh = new Mesh(mesh_name);
-  LOG_VERBOSE_LN("loading mesh: %s", mesh_name.c_str());
-  mesh->transform_name_ = reader.read_string();
+  RdxMesh src;
+  read_rdx_mesh(reader, src);
+  Mesh* mesh = new Mesh(src.name);
+  LOG_VERBOSE_LN("loading mesh: %s", src.name.c_str());
+  mesh->transform_name_ = src.transform_name;
   mesh->animation_node_ = animation_manager_->find_node_by_name(mesh->transform_name_);
 
-  const uint32_t input_desc_count = reader.read_int();
   D3D10_INPUT_ELEMENT_DESC desc;
   ZeroMemory(&desc, sizeof(desc));
-  for (uint32_t i = 0; i < input_desc_count; ++i) {
-    desc.SemanticName = _strdup(reader.read_cstring());     // memory is freed in the mesh's dtor
-    desc.SemanticIndex = reader.read_int();
-    desc.Format = static_cast<DXGI_FORMAT>(reader.read_int());
-    desc.InputSlot = reader.read_int();
-    desc.AlignedByteOffset = reader.read_int();
+  for (size_t i = 0; i < src.input_elements.size(); ++i) {
+    const RdxInputElement& e = src.input_elements[i];
+    desc.SemanticName = _strdup(e.semantic_name.c_str());     // memory is freed in the mesh's dtor
+    desc.SemanticIndex = e.semantic_index;
+    desc.Format = static_cast<DXGI_FORMAT>(e.format);
+    desc.InputSlot = e.input_slot;
+    desc.AlignedByteOffset = e.aligned_byte_offset;
     mesh->input_element_descs_.push_back(desc);
   }
 
-  const uint32_t vertex_count = reader.read_int();
-  const uint32_t vertex_size = reader.read_int();
-  uint8_t* vertex_data = reader.read_data(vertex_count * vertex_size);
 //  mesh->vertex_buffer_ = system_->create_vertex_buffer(vertex_data, vertex_count, vertex_size);
-  create_static_vertex_buffer(mesh->vertex_buffer_, g_d3d_device, vertex_data, vertex_count, vertex_size);
+  create_static_vertex_buffer(mesh->vertex_buffer_, g_d3d_device, src.vertices, src.vertex_count, src.vertex_size);
   //ENFORCE(mesh->vertex_buffer_.is_valid());
 
-  const uint32_t index_count = reader.read_int();
-  const uint32_t index_size = reader.read_int();
-  ENFORCE(index_size == 2 || index_size == 4)(index_size);
-  uint8_t* index_data = reader.read_data(index_count * index_size);
+  ENFORCE(src.index_size == 2 || src.index_size == 4)(src.index_size);
   //mesh->index_buffer_ = system_->create_index_buffer(index_data, index_count, index_size);
-  create_static_index_buffer(mesh->index_buffer_, g_d3d_device, index_data, index_count, index_size);
-  mesh->index_buffer_format_ = index_size == 2 ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT;
+  create_static_index_buffer(mesh->index_buffer_, g_d3d_device, src.indices, src.index_count, src.index_size);
+  mesh->index_buffer_format_ = src.index_size == 2 ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT;
   //ENFORCE(mesh->index_buffer_.is_valid());
 
-  mesh->index_count_ = index_count;
-  mesh->vertex_buffer_stride_ = vertex_size;
-
-  mesh->bounding_sphere_center_ = reader.read_generic<D3DXVECTOR3>();
-  mesh->bounding_sphere_radius_ = reader.read_generic<float>();
+  mesh->index_count_ = src.index_count;
+  mesh->vertex_buffer_stride_ = src.vertex_size;
 
-  scene_->meshes_.push_back(MeshSPtr(mesh));
+  mesh->bounding_sphere_center_ = src.bounding_sphere_center;
+  mesh->bounding_sphere_radius_ = src.bounding_sphere_radius;
 
+  return MeshSPtr(mesh);
 }
-
@@ -15,11 +15,17 @@ public:
   ReduxLoader(const std::string& filename, Scene* scene, SystemInterface* system, AnimationManager* animation_manager);
   void load();
 private:
-  void load_camera(ChunkIo& reader);
-  void  load_mesh(ChunkIo& reader);
-  void  load_hierarchy_inner(ChunkIo& reader, AnimationNode* parent);
+  struct AnimationChunk;
+  struct ChunkJob;
+  struct LoadContext;
+
+  void load_package(const ScenePackageSPtr& package, const std::string& clip_name);
+  void load_chunk_range(LoadContext* ctx, const uint32_t begin, const uint32_t end);
+  CameraPtr load_camera(ChunkIo& reader);
+  MeshSPtr  load_mesh(ChunkIo& reader);
   void  load_hierarchy(ChunkIo& reader);
-  void  load_animation(ChunkIo& reader);
+  void  load_animation(ChunkIo& reader, AnimationChunk& animation);
+  void  apply_animation(const AnimationChunk& animation);
 
   std::string filename_;
   Scene* scene_;
@@ -9,6 +9,12 @@ class Handle;
 //class Material;
 class AnimationNode;
 class AnimationManager;
+struct SkinMesh;
+class M2Animation;
+struct CollisionHull;
+struct M2Emitters;
+class ScenePackage;
+class AnimationClip;
 
 #ifdef STANDALONE
 //typedef Handle EffectObj;
@@ -27,6 +33,12 @@ typedef boost::shared_ptr<Mesh> MeshSPtr;
 typedef boost::shared_ptr<Light> LightPtr;
 typedef boost::shared_ptr<Camera> CameraPtr;
 typedef boost::shared_ptr<AnimationNode> AnimationNodeSPtr;
+typedef boost::shared_ptr<SkinMesh> SkinMeshSPtr;
+typedef boost::shared_ptr<M2Animation> M2AnimationSPtr;
+typedef boost::shared_ptr<CollisionHull> CollisionHullSPtr;
+typedef boost::shared_ptr<M2Emitters> M2EmittersSPtr;
+typedef boost::shared_ptr<ScenePackage> ScenePackageSPtr;
+typedef boost::shared_ptr<AnimationClip> AnimationClipSPtr;
 
 typedef std::string MeshName;
 typedef std::string MaterialName;
@@ -34,4 +46,9 @@ typedef std::string EffectName;
 typedef std::string NodeName;
 typedef uint32_t NodeId;
 
+// Index into the AnimationManager's node table. Resolve a name once with find_node, and use the handle
+// in per frame code. Handles stay valid until the manager is destroyed.
+typedef uint32_t AnimationNodeHandle;
+const AnimationNodeHandle kInvalidAnimationNode = 0xffffffff;
+
 #endif // #ifndef REDUX_TYPES_HPP
@@ -22,6 +22,7 @@ void Scene::reset()
   clear_vector(lights_);
   clear_vector(cameras_);
   clear_vector(meshes_);
+  package_.reset();
 }
 
 void Scene::create_input_layout(SystemInterface& system, const D3D10_PASS_DESC& desc)
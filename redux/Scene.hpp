@@ -21,6 +21,8 @@ public:
   std::vector<CameraPtr> cameras_;
   std::vector<ID3D10ShaderResourceView*> textures_;
   Meshes meshes_;
+  // the cooked scene the meshes were loaded from, if any. The materials are created from it
+  ScenePackageSPtr package_;
 };
 
 #endif
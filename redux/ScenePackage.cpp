@@ -0,0 +1,739 @@
+#include "stdafx.h"
+#include "ScenePackage.hpp"
+#include "../system/EffectManager.hpp"
+#include "RdxChunks.hpp"
+#include "ThreadPool.hpp"
+#include "BlockCompression.hpp"
+
+namespace filesystem = boost::filesystem;
+
+namespace
+{
+  const char kPackageId[4] = { 'R', 'D', 'X', 'P' };
+  const uint32_t kPackageVersion = 3;
+  // alignment of the vertex, index and key data
+  const uint32_t kDataAlignment = 16;
+  // the chunks and tracks vary a lot in size, so keep the ranges small to balance the load
+  const uint32_t kCookGrainSize = 2;
+
+  // the scene, as read from the .rdx and .json files
+  struct CookedMesh : RdxMesh
+  {
+    CookedMesh() : material(-1) {}
+    int32_t material;
+    // the compressed vertex and index data, if the package is compressed
+    std::vector<uint8_t> vertex_stream;
+    std::vector<uint8_t> index_stream;
+  };
+
+  struct CookedTrack
+  {
+    int32_t node;
+    AnimationKeys keys;
+    CompressedTrack compressed;
+    AnimationCompressionStats stats;
+  };
+
+  struct CookedMaterialValue
+  {
+    std::string name;
+    uint32_t type;
+    float value[4];
+  };
+
+  struct CookedMaterial
+  {
+    CookedMaterial() : transparency(0) {}
+    std::string name;
+    std::string effect;
+    float transparency;
+    std::vector<CookedMaterialValue> values;
+  };
+
+  struct CookedScene
+  {
+    CookedScene() : fps(0), start_time(0), end_time(0) {}
+    std::vector<RdxNode> nodes;
+    std::vector<CookedMesh> meshes;
+    std::vector<RdxCamera> cameras;
+    std::vector<CookedTrack> tracks;
+    std::vector<CookedMaterial> materials;
+    uint32_t fps;
+    uint32_t start_time;
+    uint32_t end_time;
+  };
+
+  /**
+   * Builds the package in memory. Everything is addressed by offset, as the buffer moves when it grows,
+   * and every pointer written is added to the relocation table.
+   */
+  class PackageWriter
+  {
+  public:
+    uint32_t alloc(const uint32_t size, const uint32_t alignment = 8)
+    {
+      const uint32_t ofs = (buf_.size() + alignment - 1) & ~(alignment - 1);
+      buf_.resize(ofs + size, 0);
+      return ofs;
+    }
+
+    template<typename T>
+    uint32_t alloc_array(const uint32_t count, const uint32_t alignment = 8)
+    {
+      return alloc(count * sizeof(T), alignment);
+    }
+
+    template<typename T>
+    T* at(const uint32_t ofs)
+    {
+      return (T*)&buf_[ofs];
+    }
+
+    // writes the target offset to the pointer at ptr_ofs, and remembers to patch it
+    void set_ptr(const uint32_t ptr_ofs, const uint32_t target_ofs)
+    {
+      *at<uint64_t>(ptr_ofs) = target_ofs;
+      relocations_.push_back(ptr_ofs);
+    }
+
+    // the strings are stored once, no matter how many times they're referenced
+    void set_string(const uint32_t ptr_ofs, const std::string& str)
+    {
+      pending_strings_.push_back(std::make_pair(ptr_ofs, str));
+    }
+
+    uint32_t add_data(const void* data, const uint32_t size)
+    {
+      const uint32_t ofs = alloc(size, kDataAlignment);
+      if (size > 0) {
+        memcpy(&buf_[ofs], data, size);
+      }
+      return ofs;
+    }
+
+    template<typename T>
+    uint32_t add_vector(const std::vector<T>& v)
+    {
+      return v.empty() ? 0 : add_data(&v[0], v.size() * sizeof(T));
+    }
+
+    uint32_t num_relocations() const { return relocations_.size(); }
+
+    void write_strings()
+    {
+      std::map<std::string, uint32_t> interned;
+      for (size_t i = 0; i < pending_strings_.size(); ++i) {
+        const std::string& str = pending_strings_[i].second;
+        std::map<std::string, uint32_t>::iterator it = interned.find(str);
+        if (it == interned.end()) {
+          const uint32_t ofs = alloc(str.size() + 1, 1);
+          memcpy(&buf_[ofs], str.c_str(), str.size() + 1);
+          it = interned.insert(std::make_pair(str, ofs)).first;
+        }
+        set_ptr(pending_strings_[i].first, it->second);
+      }
+      pending_strings_.clear();
+    }
+
+    uint32_t write_relocations()
+    {
+      const uint32_t ofs = alloc_array<uint32_t>(relocations_.size(), 4);
+      if (!relocations_.empty()) {
+        memcpy(at<uint32_t>(ofs), &relocations_[0], relocations_.size() * sizeof(uint32_t));
+      }
+      return ofs;
+    }
+
+    bool save(const std::string& filename)
+    {
+      // write to a temporary and rename it, so a partially written package never looks valid
+      const std::string tmp_name(filename + ".tmp");
+      FILE* file = NULL;
+      if (fopen_s(&file, tmp_name.c_str(), "wb") != 0 || file == NULL) {
+        LOG_WARNING_LN("Unable to write package: %s", tmp_name.c_str());
+        return false;
+      }
+      const size_t written = fwrite(&buf_[0], 1, buf_.size(), file);
+      fclose(file);
+      if (written != buf_.size()) {
+        LOG_WARNING_LN("Error writing package: %s", tmp_name.c_str());
+        filesystem::remove(tmp_name);
+        return false;
+      }
+      if (filesystem::exists(filename)) {
+        filesystem::remove(filename);
+      }
+      filesystem::rename(tmp_name, filename);
+      return true;
+    }
+
+    uint32_t size() const { return buf_.size(); }
+
+  private:
+    std::vector<uint8_t> buf_;
+    std::vector<uint32_t> relocations_;
+    std::vector< std::pair<uint32_t, std::string> > pending_strings_;
+  };
+
+#define PTR_OFS(base, type, member) ((base) + offsetof(type, member))
+
+  int32_t find_node(const CookedScene& scene, const std::string& name)
+  {
+    for (size_t i = 0; i < scene.nodes.size(); ++i) {
+      if (scene.nodes[i].name == name) {
+        return (int32_t)i;
+      }
+    }
+    return -1;
+  }
+
+  // A chunk decoded on the thread pool. The results are merged into the scene in file order
+  struct CookJob
+  {
+    CookJob(const RdxChunk& chunk) : chunk(chunk) {}
+    RdxChunk chunk;
+    CookedMesh mesh;
+    RdxCamera camera;
+    RdxAnimation animation;
+  };
+
+  void decode_chunks(std::vector<CookJob>* jobs, const uint32_t begin, const uint32_t end)
+  {
+    for (uint32_t i = begin; i < end; ++i) {
+      CookJob& job = (*jobs)[i];
+      switch (job.chunk.header.id_) {
+        case ChunkHeader::Mesh:
+          read_rdx_mesh(job.chunk.reader, job.mesh);
+          break;
+        case ChunkHeader::Camera:
+          read_rdx_camera(job.chunk.reader, job.camera);
+          break;
+        case ChunkHeader::Animation:
+          read_rdx_animation(job.chunk.reader, job.animation);
+          break;
+      }
+    }
+  }
+
+  // The chunks are decoded the same way as in ReduxLoader, but nothing is created. The hierarchy is
+  // read first, as the tracks are matched to its nodes, and the rest of the chunks are decoded on the pool
+  void read_rdx(const std::vector<RdxChunk>& chunks, CookedScene& scene)
+  {
+    std::vector<CookJob> jobs;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+      RdxChunk chunk(chunks[i]);
+      switch (chunk.header.id_) {
+        case ChunkHeader::Hierarchy:
+          read_rdx_hierarchy(chunk.reader, scene.nodes);
+          break;
+        case ChunkHeader::Mesh:
+        case ChunkHeader::Camera:
+        case ChunkHeader::Animation:
+          jobs.push_back(CookJob(chunk));
+          break;
+      }
+    }
+
+    ThreadPool::instance().parallel_for(jobs.size(), kCookGrainSize, boost::bind(&decode_chunks, &jobs, _1, _2));
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      CookJob& job = jobs[i];
+      switch (job.chunk.header.id_) {
+        case ChunkHeader::Mesh:
+          scene.meshes.push_back(job.mesh);
+          break;
+
+        case ChunkHeader::Camera:
+          scene.cameras.push_back(job.camera);
+          break;
+
+        case ChunkHeader::Animation:
+          scene.fps = job.animation.fps;
+          scene.start_time = job.animation.start_time;
+          scene.end_time = job.animation.end_time;
+          for (size_t j = 0; j < job.animation.tracks.size(); ++j) {
+            RdxTrack& src = job.animation.tracks[j];
+            CookedTrack track;
+            track.node = find_node(scene, src.node_name);
+            if (track.node < 0) {
+              LOG_WARNING_LN("[%s] Unable to find node: %s", __FUNCTION__, src.node_name.c_str());
+              continue;
+            }
+            track.keys.swap(src.keys);
+            scene.tracks.push_back(track);
+          }
+          break;
+      }
+    }
+  }
+
+  struct CompressContext
+  {
+    CookedScene* scene;
+    AnimationCompressionSettings settings;
+  };
+
+  // the tracks come first, then the meshes, if their streams are compressed
+  void compress_range(const CompressContext* ctx, const uint32_t begin, const uint32_t end)
+  {
+    CookedScene& scene = *ctx->scene;
+    const uint32_t num_tracks = scene.tracks.size();
+    for (uint32_t i = begin; i < end; ++i) {
+      if (i < num_tracks) {
+        CookedTrack& track = scene.tracks[i];
+        compress_track(track.compressed, track.stats, track.keys, ctx->settings, scene.fps);
+        continue;
+      }
+      // the shuffle and delta filters line up the bytes of each vertex attribute, and of the indices
+      CookedMesh& mesh = scene.meshes[i - num_tracks];
+      compress_stream(mesh.vertices, mesh.vertex_count * mesh.vertex_size, mesh.vertex_size, kFilterShuffle | kFilterDelta, mesh.vertex_stream);
+      compress_stream(mesh.indices, mesh.index_count * mesh.index_size, mesh.index_size, kFilterShuffle | kFilterDelta, mesh.index_stream);
+    }
+  }
+
+  bool read_materials(const std::string& json_filename, CookedScene& scene)
+  {
+    json::json_element elem;
+    if (!json::json_element::load_from_file(elem, json_filename.c_str())) {
+      return false;
+    }
+
+    const json::json_element& effect_connections = elem.find_object("effect_connections");
+    const json::json_element& materials = elem.find_object("materials");
+    const json::json_element& material_connections = elem.find_object("material_connections");
+    if (!(effect_connections.is_valid() && materials.is_valid() && material_connections.is_valid())) {
+      LOG_WARNING_LN("Invalid JSON file: %s", json_filename.c_str());
+      return false;
+    }
+
+    std::map<std::string, int32_t> material_index;
+    for (uint32_t i = 0; i < materials.length(); ++i) {
+      CookedMaterial material;
+      material.name = materials[i].find_object("name").get<std::string>();
+      const json::json_element& values = materials[i].find_object("values");
+      for (uint32_t j = 0; j < values.length(); ++j) {
+        const std::string name(values[j].find_object("name").get<std::string>());
+        const std::string type(values[j].find_object("type").get<std::string>());
+        const json::json_element& value(values[j].find_object("value"));
+
+        if (name == "transparency") {
+          material.transparency = (float)value.get<double>();
+          continue;
+        }
+
+        CookedMaterialValue v;
+        ZeroMemory(v.value, sizeof(v.value));
+        v.name = name;
+        uint32_t num_floats = 0;
+        if (type == "float") {
+          v.type = PackageMaterialValue::Float;
+          v.value[0] = (float)value.get<double>();
+        } else if (type == "color") {
+          v.type = PackageMaterialValue::Color;
+          num_floats = 4;
+        } else if (type == "vector2") {
+          v.type = PackageMaterialValue::Vector2;
+          num_floats = 2;
+        } else if (type == "vector3") {
+          v.type = PackageMaterialValue::Vector3;
+          num_floats = 3;
+        } else if (type == "vector4") {
+          v.type = PackageMaterialValue::Vector4;
+          num_floats = 4;
+        } else {
+          LOG_WARNING_LN("Unknown material value type: %s", type.c_str());
+          continue;
+        }
+        for (uint32_t k = 0; k < num_floats; ++k) {
+          v.value[k] = (float)value[k].get<double>();
+        }
+        material.values.push_back(v);
+      }
+      material_index[material.name] = scene.materials.size();
+      scene.materials.push_back(material);
+    }
+
+    for (uint32_t i = 0; i < effect_connections.length(); ++i) {
+      const std::string effect_name(effect_connections[i].find_object("effect").get<std::string>());
+      const json::json_element& effect_materials = effect_connections[i].find_object("materials");
+      for (uint32_t j = 0; j < effect_materials.length(); ++j) {
+        std::map<std::string, int32_t>::iterator it = material_index.find(effect_materials[j].get<std::string>());
+        if (it != material_index.end()) {
+          scene.materials[it->second].effect = effect_name;
+        }
+      }
+    }
+
+    for (uint32_t i = 0; i < material_connections.length(); ++i) {
+      const std::string mesh_name(material_connections[i].find_object("mesh").get<std::string>());
+      const std::string material_name(material_connections[i].find_object("material").get<std::string>());
+      std::map<std::string, int32_t>::iterator it = material_index.find(material_name);
+      bool found = false;
+      for (size_t j = 0; j < scene.meshes.size() && it != material_index.end(); ++j) {
+        if (scene.meshes[j].name == mesh_name) {
+          scene.meshes[j].material = it->second;
+          found = true;
+        }
+      }
+      if (!found) {
+        LOG_WARNING_LN("Unable to connect mesh %s to material %s", mesh_name.c_str(), material_name.c_str());
+      }
+    }
+
+    return true;
+  }
+
+  void write_package(PackageWriter& w, const CookedScene& scene, const bool compress, const AnimationCompressionSettings& animation_settings)
+  {
+    // the header and every table with pointers go first, then the strings and the bulk data
+    const uint32_t header_ofs = w.alloc(sizeof(PackageHeader));
+    const uint32_t nodes_ofs = w.alloc_array<PackageNode>(scene.nodes.size());
+    const uint32_t meshes_ofs = w.alloc_array<PackageMesh>(scene.meshes.size());
+    const uint32_t cameras_ofs = w.alloc_array<PackageCamera>(scene.cameras.size());
+    const uint32_t tracks_ofs = w.alloc_array<PackageTrack>(scene.tracks.size());
+    const uint32_t materials_ofs = w.alloc_array<PackageMaterial>(scene.materials.size());
+
+    std::vector<uint32_t> input_elements_ofs(scene.meshes.size());
+    for (size_t i = 0; i < scene.meshes.size(); ++i) {
+      input_elements_ofs[i] = w.alloc_array<PackageInputElement>(scene.meshes[i].input_elements.size());
+    }
+    std::vector<uint32_t> values_ofs(scene.materials.size());
+    for (size_t i = 0; i < scene.materials.size(); ++i) {
+      values_ofs[i] = w.alloc_array<PackageMaterialValue>(scene.materials[i].values.size());
+    }
+
+    for (size_t i = 0; i < scene.nodes.size(); ++i) {
+      const uint32_t ofs = nodes_ofs + i * sizeof(PackageNode);
+      w.set_string(PTR_OFS(ofs, PackageNode, name), scene.nodes[i].name);
+      w.at<PackageNode>(ofs)->parent = scene.nodes[i].parent;
+    }
+
+    for (size_t i = 0; i < scene.cameras.size(); ++i) {
+      const uint32_t ofs = cameras_ofs + i * sizeof(PackageCamera);
+      const RdxCamera& src = scene.cameras[i];
+      w.set_string(PTR_OFS(ofs, PackageCamera, name), src.name);
+      PackageCamera* dst = w.at<PackageCamera>(ofs);
+      dst->eye_pos = src.eye_pos;
+      dst->forward = src.forward;
+      dst->up = src.up;
+      dst->right = src.right;
+      dst->aspect_ratio = src.aspect_ratio;
+      dst->horizontal_fov = src.horizontal_fov;
+      dst->vertical_fov = src.vertical_fov;
+      dst->near_plane = src.near_plane;
+      dst->far_plane = src.far_plane;
+    }
+
+    for (size_t i = 0; i < scene.materials.size(); ++i) {
+      const CookedMaterial& src = scene.materials[i];
+      const uint32_t ofs = materials_ofs + i * sizeof(PackageMaterial);
+      w.set_string(PTR_OFS(ofs, PackageMaterial, name), src.name);
+      w.set_string(PTR_OFS(ofs, PackageMaterial, effect), src.effect);
+      w.set_ptr(PTR_OFS(ofs, PackageMaterial, values), values_ofs[i]);
+      w.at<PackageMaterial>(ofs)->num_values = src.values.size();
+      w.at<PackageMaterial>(ofs)->transparency = src.transparency;
+      for (size_t j = 0; j < src.values.size(); ++j) {
+        const uint32_t value_ofs = values_ofs[i] + j * sizeof(PackageMaterialValue);
+        w.set_string(PTR_OFS(value_ofs, PackageMaterialValue, name), src.values[j].name);
+        PackageMaterialValue* dst = w.at<PackageMaterialValue>(value_ofs);
+        dst->type = src.values[j].type;
+        memcpy(dst->value, src.values[j].value, sizeof(dst->value));
+      }
+    }
+
+    for (size_t i = 0; i < scene.meshes.size(); ++i) {
+      const CookedMesh& src = scene.meshes[i];
+      const uint32_t ofs = meshes_ofs + i * sizeof(PackageMesh);
+      w.set_string(PTR_OFS(ofs, PackageMesh, name), src.name);
+      w.set_string(PTR_OFS(ofs, PackageMesh, transform_name), src.transform_name);
+      w.set_ptr(PTR_OFS(ofs, PackageMesh, input_elements), input_elements_ofs[i]);
+      for (size_t j = 0; j < src.input_elements.size(); ++j) {
+        const RdxInputElement& e = src.input_elements[j];
+        const uint32_t element_ofs = input_elements_ofs[i] + j * sizeof(PackageInputElement);
+        w.set_string(PTR_OFS(element_ofs, PackageInputElement, semantic_name), e.semantic_name);
+        PackageInputElement* dst = w.at<PackageInputElement>(element_ofs);
+        dst->semantic_index = e.semantic_index;
+        dst->format = e.format;
+        dst->input_slot = e.input_slot;
+        dst->aligned_byte_offset = e.aligned_byte_offset;
+      }
+      PackageMesh* dst = w.at<PackageMesh>(ofs);
+      dst->num_input_elements = src.input_elements.size();
+      dst->vertex_count = src.vertex_count;
+      dst->vertex_size = src.vertex_size;
+      dst->index_count = src.index_count;
+      dst->index_size = src.index_size;
+      dst->node = find_node(scene, src.transform_name);
+      dst->material = src.material;
+      dst->bounding_sphere_center = src.bounding_sphere_center;
+      dst->bounding_sphere_radius = src.bounding_sphere_radius;
+    }
+
+    PackageHeader* header = w.at<PackageHeader>(header_ofs);
+    memcpy(header->id, kPackageId, sizeof(kPackageId));
+    header->version = kPackageVersion;
+    header->num_nodes = scene.nodes.size();
+    header->num_meshes = scene.meshes.size();
+    header->num_cameras = scene.cameras.size();
+    header->num_tracks = scene.tracks.size();
+    header->num_materials = scene.materials.size();
+    header->fps = scene.fps;
+    header->start_time = scene.start_time;
+    header->end_time = scene.end_time;
+    header->max_pos_error = animation_settings.max_pos_error;
+    header->max_rot_error_deg = animation_settings.max_rot_error_deg;
+    header->max_scale_error = animation_settings.max_scale_error;
+    header->resample = animation_settings.resample ? 1 : 0;
+    w.set_ptr(PTR_OFS(header_ofs, PackageHeader, nodes), nodes_ofs);
+    w.set_ptr(PTR_OFS(header_ofs, PackageHeader, meshes), meshes_ofs);
+    w.set_ptr(PTR_OFS(header_ofs, PackageHeader, cameras), cameras_ofs);
+    w.set_ptr(PTR_OFS(header_ofs, PackageHeader, tracks), tracks_ofs);
+    w.set_ptr(PTR_OFS(header_ofs, PackageHeader, materials), materials_ofs);
+
+    w.write_strings();
+
+    for (size_t i = 0; i < scene.tracks.size(); ++i) {
+      const CompressedTrack& src = scene.tracks[i].compressed;
+      const uint32_t ofs = tracks_ofs + i * sizeof(PackageTrack);
+      w.set_ptr(PTR_OFS(ofs, PackageTrack, times), w.add_vector(src.times));
+      w.set_ptr(PTR_OFS(ofs, PackageTrack, positions), w.add_vector(src.positions));
+      w.set_ptr(PTR_OFS(ofs, PackageTrack, rotations), w.add_vector(src.rotations));
+      w.set_ptr(PTR_OFS(ofs, PackageTrack, scales), w.add_vector(src.scales));
+      PackageTrack* dst = w.at<PackageTrack>(ofs);
+      dst->pos_bounds = src.pos_bounds;
+      dst->scale_bounds = src.scale_bounds;
+      dst->num_times = src.times.size();
+      dst->num_positions = src.positions.size();
+      dst->num_rotations = src.rotations.size();
+      dst->num_scales = src.scales.size();
+      dst->start_time = src.start_time;
+      dst->time_step = src.time_step;
+      dst->frame_duration = src.frame_duration;
+      dst->num_frames = src.num_frames;
+      dst->node = scene.tracks[i].node;
+    }
+
+    for (size_t i = 0; i < scene.meshes.size(); ++i) {
+      const CookedMesh& src = scene.meshes[i];
+      const uint32_t ofs = meshes_ofs + i * sizeof(PackageMesh);
+      if (compress) {
+        w.at<PackageMesh>(ofs)->vertex_data_size = src.vertex_stream.size();
+        w.set_ptr(PTR_OFS(ofs, PackageMesh, vertices), w.add_vector(src.vertex_stream));
+        w.at<PackageMesh>(ofs)->index_data_size = src.index_stream.size();
+        w.set_ptr(PTR_OFS(ofs, PackageMesh, indices), w.add_vector(src.index_stream));
+        w.at<PackageMesh>(ofs)->flags = PackageMesh::Compressed;
+      } else {
+        const uint32_t vertex_data_size = src.vertex_count * src.vertex_size;
+        const uint32_t index_data_size = src.index_count * src.index_size;
+        w.at<PackageMesh>(ofs)->vertex_data_size = vertex_data_size;
+        w.at<PackageMesh>(ofs)->index_data_size = index_data_size;
+        w.set_ptr(PTR_OFS(ofs, PackageMesh, vertices), w.add_data(src.vertices, vertex_data_size));
+        w.set_ptr(PTR_OFS(ofs, PackageMesh, indices), w.add_data(src.indices, index_data_size));
+      }
+    }
+
+    // the relocation table goes last, it's only read once when opening the package
+    const uint32_t num_relocations = w.num_relocations();
+    const uint32_t relocation_ofs = w.write_relocations();
+
+    header = w.at<PackageHeader>(header_ofs);
+    header->num_relocations = num_relocations;
+    header->relocations = relocation_ofs;
+    header->size = w.size();
+  }
+}
+
+ScenePackage::ScenePackage()
+  : file_(INVALID_HANDLE_VALUE)
+  , mapping_(NULL)
+  , base_(NULL)
+  , header_(NULL)
+{
+}
+
+ScenePackage::~ScenePackage()
+{
+  close();
+}
+
+void ScenePackage::close()
+{
+  if (base_) {
+    UnmapViewOfFile(base_);
+    base_ = NULL;
+  }
+  if (mapping_) {
+    CloseHandle(mapping_);
+    mapping_ = NULL;
+  }
+  if (file_ != INVALID_HANDLE_VALUE) {
+    CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+  }
+  header_ = NULL;
+}
+
+bool ScenePackage::open(const std::string& filename)
+{
+  close();
+
+  file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file_ == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  const DWORD file_size = GetFileSize(file_, NULL);
+
+  // copy-on-write, so the pages with pointers can be patched, while the rest stay shared with the file cache
+  mapping_ = CreateFileMappingA(file_, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  base_ = mapping_ ? (uint8_t*)MapViewOfFile(mapping_, FILE_MAP_COPY, 0, 0, 0) : NULL;
+  if (base_ == NULL || file_size < sizeof(PackageHeader)) {
+    LOG_WARNING_LN("Unable to map package: %s", filename.c_str());
+    close();
+    return false;
+  }
+
+  const PackageHeader* header = (const PackageHeader*)base_;
+  if (memcmp(header->id, kPackageId, sizeof(kPackageId)) != 0 || header->version != kPackageVersion || header->size != file_size ||
+    header->relocations + header->num_relocations * sizeof(uint32_t) > file_size) {
+    LOG_WARNING_LN("Invalid package: %s", filename.c_str());
+    close();
+    return false;
+  }
+
+  const uint32_t* relocations = (const uint32_t*)(base_ + header->relocations);
+  for (uint32_t i = 0; i < header->num_relocations; ++i) {
+    const uint32_t slot = relocations[i];
+    if (slot + sizeof(uint64_t) > file_size || *(const uint64_t*)(base_ + slot) > file_size) {
+      LOG_WARNING_LN("Invalid relocation in package: %s", filename.c_str());
+      close();
+      return false;
+    }
+    const uint64_t offset = *(const uint64_t*)(base_ + slot);
+    *(uint8_t**)(base_ + slot) = base_ + offset;
+  }
+
+  header_ = header;
+  return true;
+}
+
+bool cook_scene_package(const std::string& rdx_filename, const std::string& json_filename, const std::string& package_filename,
+  const bool compress, const AnimationCompressionSettings& animation_settings)
+{
+  SCOPED_FUNC_PROFILE();
+
+  uint8_t* data = NULL;
+  uint32_t data_len = 0;
+  if (!load_file(data, data_len, rdx_filename.c_str())) {
+    LOG_WARNING_LN("Unable to load: %s", rdx_filename.c_str());
+    return false;
+  }
+
+  // the tracks and the vertex and index streams are compressed once here, so loading the package
+  // doesn't touch the keys. Everything but the hierarchy is done on the pool
+  CookedScene scene;
+  std::vector<RdxChunk> chunks;
+  try {
+    index_rdx(data, data_len, chunks);
+    read_rdx(chunks, scene);
+
+    if (filesystem::exists(json_filename) && !read_materials(json_filename, scene)) {
+      LOG_WARNING_LN("Error loading JSON: %s", json_filename.c_str());
+    }
+
+    CompressContext ctx;
+    ctx.scene = &scene;
+    ctx.settings = animation_settings;
+    const uint32_t num_jobs = scene.tracks.size() + (compress ? scene.meshes.size() : 0);
+    ThreadPool::instance().parallel_for(num_jobs, kCookGrainSize, boost::bind(&compress_range, &ctx, _1, _2));
+  } catch (std::exception& e) {
+    LOG_WARNING_LN("Error cooking %s: %s", rdx_filename.c_str(), e.what());
+    SAFE_ADELETE(data);
+    return false;
+  }
+
+  AnimationCompressionStats stats;
+  for (size_t i = 0; i < scene.tracks.size(); ++i) {
+    stats.add(scene.tracks[i].stats);
+  }
+  if (!scene.tracks.empty()) {
+    stats.log();
+  }
+
+  PackageWriter writer;
+  write_package(writer, scene, compress, animation_settings);
+  const bool res = writer.save(package_filename);
+  SAFE_ADELETE(data);
+
+  if (res) {
+    LOG_INFO_LN("cooked %s: %d meshes, %d nodes, %d materials, %d bytes", package_filename.c_str(),
+      scene.meshes.size(), scene.nodes.size(), scene.materials.size(), writer.size());
+  }
+  return res;
+}
+
+std::string scene_package_filename(const std::string& rdx_filename, const AnimationCompressionSettings& settings)
+{
+  boost::crc_32_type crc;
+  crc.process_bytes(&settings.max_pos_error, sizeof(settings.max_pos_error));
+  crc.process_bytes(&settings.max_rot_error_deg, sizeof(settings.max_rot_error_deg));
+  crc.process_bytes(&settings.max_scale_error, sizeof(settings.max_scale_error));
+  const uint32_t resample = settings.resample ? 1 : 0;
+  crc.process_bytes(&resample, sizeof(resample));
+  return filesystem::path(rdx_filename).replace_extension(to_string("%08x.rdp", crc.checksum())).string();
+}
+
+bool is_package_stale(const std::string& package_filename, const std::string& rdx_filename, const std::string& json_filename)
+{
+  if (!filesystem::exists(package_filename)) {
+    return true;
+  }
+  const std::time_t package_time = filesystem::last_write_time(package_filename);
+  return (filesystem::exists(rdx_filename) && filesystem::last_write_time(rdx_filename) > package_time) ||
+    (filesystem::exists(json_filename) && filesystem::last_write_time(json_filename) > package_time);
+}
+
+bool is_package_compressed_with(const ScenePackage& package, const AnimationCompressionSettings& settings)
+{
+  const PackageHeader* header = package.header();
+  return header->max_pos_error == settings.max_pos_error && header->max_rot_error_deg == settings.max_rot_error_deg &&
+    header->max_scale_error == settings.max_scale_error && (header->resample != 0) == settings.resample;
+}
+
+void create_track(CompressedTrack& out, const PackageTrack& src)
+{
+  out.start_time = src.start_time;
+  out.time_step = src.time_step;
+  out.frame_duration = src.frame_duration;
+  out.num_frames = src.num_frames;
+  out.pos_bounds = src.pos_bounds;
+  out.scale_bounds = src.scale_bounds;
+  out.times.assign(src.times.ptr, src.times.ptr + src.num_times);
+  out.positions.assign(src.positions.ptr, src.positions.ptr + src.num_positions);
+  out.rotations.assign(src.rotations.ptr, src.rotations.ptr + src.num_rotations);
+  out.scales.assign(src.scales.ptr, src.scales.ptr + src.num_scales);
+}
+
+Material* create_material(const PackageMaterial& src, ID3D10Effect* effect)
+{
+  Material* material = new Material();
+  material->name_.set(src.name.ptr);
+  material->effect_ = effect;
+  material->transparency_ = src.transparency;
+
+  for (uint32_t i = 0; i < src.num_values; ++i) {
+    const PackageMaterialValue& value = src.values[i];
+    ID3D10EffectVariable* effect_variable = effect->GetVariableByName(value.name.ptr);
+    if (!effect_variable) {
+      continue;
+    }
+    if (value.type == PackageMaterialValue::Float) {
+      if (ID3D10EffectScalarVariable* typed_variable = effect_variable->AsScalar()) {
+        material->scalar_variables_.push_back(std::make_pair(typed_variable, value.value[0]));
+      }
+    } else if (ID3D10EffectVectorVariable* typed_variable = effect_variable->AsVector()) {
+      // the unused components are zero, so all the vector types can be set as a color
+      material->color_variables_.push_back(std::make_pair(typed_variable, D3DXCOLOR(value.value[0], value.value[1], value.value[2], value.value[3])));
+    }
+  }
+  return material;
+}
@@ -0,0 +1,189 @@
+#ifndef SCENE_PACKAGE_HPP
+#define SCENE_PACKAGE_HPP
+
+#include "ReduxTypes.hpp"
+#include "AnimationNode.hpp"
+#include "AnimationCompression.hpp"
+
+struct Material;
+
+// Pointers in the package are stored as offsets from the start of the file, and patched to real
+// pointers when the package is opened. They take 8 bytes, so the layout is the same for 32 and 64 bit.
+template<typename T>
+struct PackagePtr
+{
+  union
+  {
+    uint64_t offset;
+    T* ptr;
+  };
+  T* operator->() const { return ptr; }
+  T& operator[](const uint32_t idx) const { return ptr[idx]; }
+};
+
+struct PackageNode
+{
+  PackagePtr<const char> name;
+  int32_t parent;     // the parents come before their children, -1 for the top level nodes
+  uint32_t pad;
+};
+
+struct PackageInputElement
+{
+  PackagePtr<const char> semantic_name;
+  uint32_t semantic_index;
+  uint32_t format;
+  uint32_t input_slot;
+  uint32_t aligned_byte_offset;
+};
+
+struct PackageMesh
+{
+  enum Flags { Compressed = 1 };    // the vertex and index data are compressed streams
+  PackagePtr<const char> name;
+  PackagePtr<const char> transform_name;
+  PackagePtr<PackageInputElement> input_elements;
+  PackagePtr<uint8_t> vertices;
+  PackagePtr<uint8_t> indices;
+  uint32_t num_input_elements;
+  uint32_t vertex_count;
+  uint32_t vertex_size;
+  uint32_t index_count;
+  uint32_t index_size;
+  uint32_t vertex_data_size;    // bytes stored in the package
+  uint32_t index_data_size;
+  int32_t node;       // -1 if the transform wasn't found
+  int32_t material;   // -1 if the mesh isn't connected to a material
+  D3DXVECTOR3 bounding_sphere_center;
+  float bounding_sphere_radius;
+  uint32_t flags;
+};
+
+struct PackageCamera
+{
+  PackagePtr<const char> name;
+  D3DXVECTOR3 eye_pos;
+  D3DXVECTOR3 forward;
+  D3DXVECTOR3 up;
+  D3DXVECTOR3 right;
+  float aspect_ratio;
+  float horizontal_fov;
+  float vertical_fov;
+  float near_plane;
+  float far_plane;
+};
+
+// a CompressedTrack, compressed when the package is cooked
+struct PackageTrack
+{
+  PackagePtr<uint16_t> times;
+  PackagePtr<uint16_t> positions;
+  PackagePtr<uint16_t> rotations;
+  PackagePtr<uint16_t> scales;
+  QuantizationBounds pos_bounds;
+  QuantizationBounds scale_bounds;
+  uint32_t num_times;
+  uint32_t num_positions;
+  uint32_t num_rotations;
+  uint32_t num_scales;
+  uint32_t start_time;
+  uint32_t time_step;
+  float frame_duration;
+  uint32_t num_frames;
+  int32_t node;
+  uint32_t pad;
+};
+
+struct PackageMaterialValue
+{
+  enum Type { Float, Color, Vector2, Vector3, Vector4 };
+  PackagePtr<const char> name;
+  uint32_t type;
+  float value[4];
+  uint32_t pad;
+};
+
+struct PackageMaterial
+{
+  PackagePtr<const char> name;
+  PackagePtr<const char> effect;    // the effect the material is connected to, or an empty string
+  PackagePtr<PackageMaterialValue> values;
+  uint32_t num_values;
+  float transparency;
+};
+
+struct PackageHeader
+{
+  char id[4];
+  uint32_t version;
+  uint32_t size;
+  uint32_t num_relocations;
+  uint64_t relocations;     // offset of the relocation table, which isn't needed after loading
+  PackagePtr<PackageNode> nodes;
+  PackagePtr<PackageMesh> meshes;
+  PackagePtr<PackageCamera> cameras;
+  PackagePtr<PackageTrack> tracks;
+  PackagePtr<PackageMaterial> materials;
+  uint32_t num_nodes;
+  uint32_t num_meshes;
+  uint32_t num_cameras;
+  uint32_t num_tracks;
+  uint32_t num_materials;
+  uint32_t fps;
+  uint32_t start_time;
+  uint32_t end_time;
+  // the settings the tracks were compressed with
+  float max_pos_error;
+  float max_rot_error_deg;
+  float max_scale_error;
+  uint32_t resample;
+};
+
+/**
+ * A cooked scene, with the hierarchy, meshes, cameras, animation and resolved materials in one file.
+ * The file is mapped copy-on-write, and the only work done when opening it is patching the pointers
+ * listed in the relocation table. The tables with pointers come first in the file, so the fix-ups
+ * only touch the first few pages, and the vertex and index data is never copied.
+ */
+class ScenePackage : boost::noncopyable
+{
+public:
+  ScenePackage();
+  ~ScenePackage();
+
+  bool open(const std::string& filename);
+  void close();
+
+  const PackageHeader* header() const { return header_; }
+
+private:
+  HANDLE file_;
+  HANDLE mapping_;
+  uint8_t* base_;
+  const PackageHeader* header_;
+};
+
+// Cooks the .rdx scene and its .json materials into a package. The json file is optional. If compress
+// is set, the vertex and index data are stored as compressed streams (see BlockCompression.hpp).
+// The animation tracks are always compressed, with the given settings.
+bool cook_scene_package(const std::string& rdx_filename, const std::string& json_filename, const std::string& package_filename,
+  const bool compress, const AnimationCompressionSettings& animation_settings);
+
+// The package for the .rdx file. The compression settings are part of the name, so each set of settings
+// keeps its own package, and loading the scene with other settings doesn't cook over it
+std::string scene_package_filename(const std::string& rdx_filename, const AnimationCompressionSettings& settings);
+
+// returns true if the package is missing, or older than any of the sources that exist
+bool is_package_stale(const std::string& package_filename, const std::string& rdx_filename, const std::string& json_filename);
+
+// returns true if the package's tracks were compressed with the given settings
+bool is_package_compressed_with(const ScenePackage& package, const AnimationCompressionSettings& settings);
+
+// Copies the cooked track, nothing is decoded. The arrays are copied rather than referenced, as the clip
+// is shared through find_shared_clip, and can outlive the package it was made from
+void create_track(CompressedTrack& out, const PackageTrack& src);
+
+// creates a material from its cooked values, bound to the variables of the given effect
+Material* create_material(const PackageMaterial& src, ID3D10Effect* effect);
+
+#endif // #ifndef SCENE_PACKAGE_HPP
@@ -2,6 +2,7 @@
 #include "ShadowRenderer.hpp"
 #include "Mesh.hpp"
 #include "ReduxLoader.hpp"
+#include "ScenePackage.hpp"
 #include "EffectWrapper.hpp"
 #include <celsus/D3D10Descriptions.hpp>
 #include "../system/Input.hpp"
@@ -12,6 +13,9 @@
 #include "DebugRenderer.hpp"
 #include "TextureCache.hpp"
 #include "PostProcess.hpp"
+#include "AssetLoader.hpp"
+#include "Utils.hpp"
+#include "ThreadPool.hpp"
 
 using namespace std;
 using namespace boost::assign;
@@ -685,131 +689,75 @@ bool ShadowRenderer::close()
   return true;
 }
 
-struct SortedMesh
-{
-  SortedMesh(const float dist, Mesh* mesh) : dist(dist), mesh(mesh) {}
-  float dist;
-  Mesh* mesh;
-};
-
-bool operator<(const SortedMesh& a, const SortedMesh& b)
-{
-  return a.dist < b.dist;
-}
-
-bool operator>(const SortedMesh& a, const SortedMesh& b)
-{
-  return a.dist > b.dist;
-}
-
-float distance_to_point(const D3DXPLANE& plane, const D3DXVECTOR3& pt)
-{
-  return plane.a * pt.x + plane.b * pt.y + plane.c * pt.z + plane.d;
-}
-
-void planes_from_proj_matrix(D3DXPLANE* planes, const D3DXMATRIX& proj, const bool normalize)
+void ShadowRenderer::build_draw_states()
 {
+  // the draw keys hold indices into effect_connections_ and their material lists instead of the names
+  stdext::hash_map<Mesh*, uint32_t> mesh_indices;
+  for (uint32_t i = 0, e = scene_.meshes_.size(); i < e; ++i) {
+    mesh_indices[scene_.meshes_[i].get()] = i;
+  }
 
-  // Left clipping plane
-  planes[0].a = proj._14 + proj._11;
-  planes[0].b = proj._24 + proj._21;
-  planes[0].c = proj._34 + proj._31;
-  planes[0].d = proj._44 + proj._41;
-
-  // Right clipping plane
-  planes[1].a = proj._14 - proj._11;
-  planes[1].b = proj._24 - proj._21;
-  planes[1].c = proj._34 - proj._31;
-  planes[1].d = proj._44 - proj._41;
-
-  // Top clipping plane
-  planes[2].a = proj._14 - proj._12;
-  planes[2].b = proj._24 - proj._22;
-  planes[2].c = proj._34 - proj._32;
-  planes[2].d = proj._44 - proj._42;
-
-  // Bottom clipping plane
-  planes[3].a = proj._14 + proj._12;
-  planes[3].b = proj._24 + proj._22;
-  planes[3].c = proj._34 + proj._32;
-  planes[3].d = proj._44 + proj._42;
-
-  // Near clipping plane
-  planes[4].a = proj._13;
-  planes[4].b = proj._23;
-  planes[4].c = proj._33;
-  planes[4].d = proj._43;
-
-  // Far clipping plane
-  planes[5].a = proj._14 - proj._13;
-  planes[5].b = proj._24 - proj._23;
-  planes[5].c = proj._34 - proj._33;
-  planes[5].d = proj._44 - proj._43;
-
-  // Normalize the plane equations, if requested
-  if (normalize)
-  {
-    for (uint32_t i = 0; i < 6; ++i) {
-      D3DXPlaneNormalize(&planes[i], &planes[i]);
+  draw_states_.assign(scene_.meshes_.size(), DrawState());
+  for (uint32_t i = 0, e = effect_connections_.size(); i < e; ++i) {
+    const EffectConnection* ec = effect_connections_[i];
+    const uint32_t num_opaque = ec->opaque_materials_.size();
+    for (uint32_t j = 0, je = num_opaque + ec->transparent_materials_.size(); j < je; ++j) {
+      const bool opaque = j < num_opaque;
+      const MaterialConnection* mc = opaque ? ec->opaque_materials_[j] : ec->transparent_materials_[j - num_opaque];
+      for (uint32_t k = 0, ke = mc->meshes_.size(); k < ke; ++k) {
+        stdext::hash_map<Mesh*, uint32_t>::iterator it = mesh_indices.find(mc->meshes_[k].get());
+        if (it != mesh_indices.end()) {
+          draw_states_[it->second] = DrawState(opaque ? kOpaquePass : kTransparentPass, i, j);
+        }
+      }
     }
   }
 }
 
-bool is_sphere_visible(const D3DXVECTOR3& center, const float radius, const D3DXMATRIX& world, const D3DXMATRIX& view, const D3DXPLANE* planes)
+void ShadowRenderer::prepare_draw_lists(const uint32_t begin, const uint32_t end)
 {
-  D3DXVECTOR3 ws_center;
-  D3DXVec3TransformCoord(&ws_center, &center, &world);
-
-  // transform center to view space
-  D3DXVECTOR3 vs_center;
-  D3DXVec3TransformCoord(&vs_center, &ws_center, &view);
-  const float scale = D3DXVec3Length(&get_scale(world));
-  const float scaled_radius = scale * radius;
-
-  // if the signed distance is negative and greater than the bounding sphere radius,
-  // then the sphere is outside the frustum
-  for (uint32_t j = 0; j < 6; ++j) {
-    const float dist = distance_to_point(planes[j], vs_center);
-    if (dist < - scaled_radius) {
-      return false;
-    }
+  DrawList* lists[] = { &light_draws_, &camera_draws_ };
+  for (uint32_t i = begin; i < end; ++i) {
+    prepare_draw_list(*lists[i], mesh_bvh_, scene_.meshes_, draw_states_);
   }
-  return true;
 }
 
-bool is_mesh_visible(D3DXVECTOR3& vs_center, MeshSPtr mesh, const D3DXMATRIX& view, D3DXPLANE* planes)
+void ShadowRenderer::update_animation_lods(const D3DXMATRIX& view, const D3DXMATRIX& proj)
 {
-  const D3DXVECTOR3 center = mesh->bounding_sphere_center();
-  const float radius = mesh->bounding_sphere_radius();
-  const D3DXMATRIX world_mtx = mesh->animation_node()->transform();
-  D3DXVECTOR3 ws_center;
-  D3DXVec3TransformCoord(&ws_center, &center, &world_mtx);
-
-  // transform center to view space
-  D3DXVec3TransformCoord(&vs_center, &ws_center, &view);
-  const float scale = D3DXVec3Length(&get_scale(world_mtx));
-  const float scaled_radius = scale * radius;
-
-  // if the signed distance is negative and greater than the bounding sphere radius,
-  // then the sphere is outside the frustum
-  for (uint32_t j = 0; j < 6; ++j) {
-    const float dist = distance_to_point(planes[j], vs_center);
-    if (dist < - scaled_radius) {
-      return false;
-    }
+  D3DXPLANE planes[6];
+  planes_from_proj_matrix(planes, view * proj, true);
+
+  // the bvh keeps the world space spheres, so they can all be culled in one go
+  const SphereSoA& spheres = mesh_bvh_.spheres();
+  visible_.clear();
+  cull_spheres(visible_, spheres, 0, spheres.count, planes, 6);
+  mesh_visible_.assign(spheres.count, false);
+  for (uint32_t i = 0, e = visible_.size(); i < e; ++i) {
+    mesh_visible_[mesh_bvh_.mesh_index(visible_[i])] = true;
   }
 
-  return true;
+  for (uint32_t i = 0, e = scene_.meshes_.size(); i < e; ++i) {
+    const MeshSPtr& m = scene_.meshes_[i];
+    if (!m->animation_node()) {
+      continue;
+    }
+
+    // proj._22 is cot(fov / 2), so this is the radius as a fraction of the viewport height
+    const D3DXVECTOR3 center(mesh_bvh_.center(i));
+    const float view_z = center.x * view._13 + center.y * view._23 + center.z * view._33 + view._43;
+    const float screen_radius = mesh_bvh_.radius(i) * proj._22 / std::max<float>(near_plane, view_z);
+    animation_manager_->set_node_lod(m->animation_node()->handle(), select_animation_lod(screen_radius, mesh_visible_[i] != 0));
+  }
 }
 
-void ShadowRenderer::render_inner(const D3DXVECTOR3& pos, const D3DXMATRIX& view, const D3DXMATRIX& proj, const std::string& technique)
+void ShadowRenderer::render_inner(const DrawList& draws, const std::string& technique)
 {
   ID3D10Device* device = system_->get_device();
   system_->set_primitive_topology(D3D10_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 
   EffectWrapper* e = effect_connections_.front()->effect_;
 
-  e->set_variable("g_ViewPos", pos);
+  e->set_variable("g_ViewPos", draws.pos);
 
   D3DXMATRIX light_view;
   D3DXMatrixLookAtLH(&light_view, &light_pos, &(light_pos + light_dir), &light_up);
@@ -818,9 +766,6 @@ void ShadowRenderer::render_inner(const D3DXVECTOR3& pos, const D3DXMATRIX& view
   float Far  = light_dist_atten_.y;
   D3DXMatrixPerspectiveFovLH(&light_proj, (float)D3DXToRadian(light_fov_), 1, Near, Far);
 
-  D3DXPLANE planes[6];
-  planes_from_proj_matrix(planes, proj, true);
-
   e->set_variable("g_LightPosition", light_pos);
   e->set_variable("g_LightDirection", light_dir);
   e->set_variable("g_LightFOV", (float)D3DXToRadian(light_fov_));
@@ -857,53 +802,11 @@ void ShadowRenderer::render_inner(const D3DXVECTOR3& pos, const D3DXMATRIX& view
   e->get_cbuffer(object_cbuffer, "object_related");
 
 
-  EffectConnection* ec = effect_connections_.front();
-  const Meshes& meshes = ec->opaque_materials_.front()->meshes_;
-
-  // sort the mesh wrt the eye pos
-  std::vector<SortedMesh> sorted_meshes;
-  sorted_meshes.reserve(meshes.size());
-  D3DXVECTOR3 vs_center;
-  visible_meshes_ = 0;
-
-  for (uint32_t i = 0, e = meshes.size(); i < e; ++i) {
-
-    const MeshSPtr& m = meshes[i];
-    bool visible = true;
-    if (cull_meshes_) {
-      visible = is_mesh_visible(vs_center, m, view, planes);
-    } else {
-      D3DXVec3TransformCoord(&vs_center, &m->bounding_sphere_center(), &(m->animation_node()->transform() * view));
-    }
-    if (visible) {
-      visible_meshes_++;
-      const float dist = std::max<float>(0, D3DXVec3Length(&(vs_center - pos)) - m->bounding_sphere_radius());
-      sorted_meshes.push_back(SortedMesh(dist, m.get()));
-    }
-  }
-
-  if (sort_meshes_) {
-    std::sort(sorted_meshes.begin(), sorted_meshes.end(), std::less<SortedMesh>());
-  } else {
-    std::sort(sorted_meshes.begin(), sorted_meshes.end(), std::greater<SortedMesh>());
-  }
-
-  for (uint32_t i = 0, e = sorted_meshes.size(); i < e; ++i) {
-
-    Mesh* m = sorted_meshes[i].mesh;
-
-    const D3DXMATRIX world_mtx = m->animation_node()->transform();
-    const D3DXMATRIX world_view_mtx = world_mtx * view;
-    const D3DXMATRIX world_view_proj_mtx = world_view_mtx * proj;
-
-    D3DXMATRIX mm[3];
-    D3DXMatrixTranspose(&mm[0], &world_mtx);
-    D3DXMatrixTranspose(&mm[1], &world_view_mtx);
-    D3DXMatrixTranspose(&mm[2], &world_view_proj_mtx);
-
-    device->UpdateSubresource(object_cbuffer, D3D10CalcSubresource(0,0,1), NULL, (void*)&mm[0], sizeof(D3DXMATRIX) * 3, 0);
-
-    m->render(*system_);
+  // everything but the submits was done when the list was prepared
+  for (uint32_t i = 0, e = draws.items.size(); i < e; ++i) {
+    const DrawItem& item = draws.items[i];
+    device->UpdateSubresource(object_cbuffer, D3D10CalcSubresource(0,0,1), NULL, (void*)&item.matrices[0], sizeof(D3DXMATRIX) * 3, 0);
+    item.mesh->render(*system_);
   }
 
 }
@@ -920,11 +823,37 @@ void ShadowRenderer::render(const int /*time_in_ms*/)
   const uint32_t cur_time = timeGetTime();
   const uint32_t elapsed_time = (cur_time - start_time) / 10;
 
-  animation_manager_->update_transforms(elapsed_time);
+  animation_manager_->update_transforms(elapsed_time, &ThreadPool::instance());
+  mesh_bvh_.refit();
 
   system_->get_free_fly_camera(eye_pos, mtx_view);
   D3DXMatrixPerspectiveFovLH(&mtx_proj, fov, aspect_ratio, near_plane, far_plane);
 
+  if (draw_meshes_) {
+    // The views are prepared at the same time, on the pool and this thread. Neither touches the
+    // device, so the submits below only walk the lists
+    D3DXMATRIX light_view;
+    D3DXMatrixLookAtLH(&light_view, &light_pos, &(light_pos + light_dir), &light_up);
+    D3DXMATRIX light_proj;
+    D3DXMatrixPerspectiveFovLH(&light_proj, (float)D3DXToRadian(light_fov_), 1, 0.04f, light_dist_atten_.y);
+
+    light_draws_.pos = light_pos;
+    light_draws_.view = light_view;
+    light_draws_.proj = light_proj;
+    camera_draws_.pos = eye_pos;
+    camera_draws_.view = mtx_view;
+    camera_draws_.proj = mtx_proj;
+    light_draws_.cull = camera_draws_.cull = cull_meshes_;
+    light_draws_.front_to_back = camera_draws_.front_to_back = sort_meshes_;
+
+    ThreadPool::instance().parallel_for(2, 1, boost::bind(&ShadowRenderer::prepare_draw_lists, this, _1, _2));
+    visible_meshes_ = camera_draws_.items.size();
+  }
+
+  // picked up by the next update. This can reclassify the animation nodes, so it has to wait until
+  // the lists are done reading the transforms
+  update_animation_lods(mtx_view, mtx_proj);
+
   if (draw_meshes_) {
     ID3D10ShaderResourceView *const pSRV[1] = {NULL};
     device->PSSetShaderResources(0, 1, pSRV);
@@ -941,14 +870,7 @@ void ShadowRenderer::render(const int /*time_in_ms*/)
     device->OMSetRenderTargets(1, &rt, depth_stencil_view_);
     device->RSSetViewports(1, &shadow_viewport_);
 
-    D3DXMATRIX light_view;
-    D3DXMatrixLookAtLH(&light_view, &light_pos, &(light_pos + light_dir), &light_up);
-    D3DXMATRIX light_proj;
-    float Near = 0.04f;
-    float Far  = light_dist_atten_.y;
-    D3DXMatrixPerspectiveFovLH(&light_proj, (float)D3DXToRadian(light_fov_), 1, Near, Far);
-
-    render_inner(light_pos, light_view, light_proj, "Depth");
+    render_inner(light_draws_, "Depth");
 
     shadow_effect_->set_technique("Depth");
     m_SAT = GenerateSATRecursiveDouble(shadow_map_, false);
@@ -964,7 +886,7 @@ void ShadowRenderer::render(const int /*time_in_ms*/)
 
     var_min_filter_width_->SetFloat(min_filter_width_);
 
-    render_inner(eye_pos, mtx_view, mtx_proj, "Shading");
+    render_inner(camera_draws_, "Shading");
     effect_connections_.front()->effect_->set_technique("Shading");
     device->PSSetShaderResources(0, 1, pSRV);
 
@@ -1029,18 +951,28 @@ void ShadowRenderer::process_input_callback(const Input& input)
 void ShadowRenderer::load_scene(const std::string& filename) 
 {
   SCOPED_FUNC_PROFILE();
-  ReduxLoader loader(filename, &scene_, system_.get(), animation_manager_);
-  loader.load();
 
   boost::filesystem::path path(filename);
   const string raw_filename(path.replace_extension().filename());
+  std::string json_filename("data/scenes/" + raw_filename + ".json");
 
+  // read the materials in the background while the scene is loading
+  AssetLoader asset_loader;
+  Future<FileBuffer> json_file = asset_loader.read_file_async(json_filename);
+
+  // Every animated node is sampled each frame, so the tracks are resampled to the clip's fps, and the
+  // keys are found straight from the time. The package is cooked again if it was cooked without it
+  AnimationCompressionSettings animation_settings;
+  animation_settings.resample = true;
+  animation_manager_->set_compression_settings(animation_settings);
+
+  ReduxLoader loader(filename, &scene_, system_.get(), animation_manager_);
+  loader.load();
 
   effect_handles_["blinn_effect"] = system_->load_effect("blinn_effect");
   effect_handles_["blinn_effect2"] = system_->load_effect("blinn_effect2");
 
   std::vector< std::string > textures;
-  std::string json_filename("data/scenes/" + raw_filename + ".json");
 
   ID3D10Effect* effect = effect_manager_->effect_from_handle(effect_handles_["blinn_effect"]);
   g_haxor_effect = effect;
@@ -1048,21 +980,27 @@ void ShadowRenderer::load_scene(const std::string& filename)
   MaterialConnections material_connections2;
   EffectConnections effect_cons;
 
-  uint8_t* buf;
-  uint32_t len;
-  if (!load_file(buf, len, json_filename.c_str())) {
-    throw std::exception("error loading json");
-  }
+  if (scene_.package_ && scene_.package_->header()->num_materials > 0) {
+    // the materials were cooked into the package, so the json read is never waited on
+    const PackageHeader* header = scene_.package_->header();
+    for (uint32_t i = 0; i < header->num_materials; ++i) {
+      effect_manager_->add_material(create_material(header->materials[i], effect));
+    }
+  } else {
+    const FileBuffer& json = json_file.get();
+    if (json.empty()) {
+      throw std::exception("error loading json");
+    }
 
-  std::vector<Material*> materials2;
-  StateMachine s(material_connections2, effect_cons, materials2);
-  yajl_handle h = yajl_alloc(&s.callbacks_, NULL, NULL, &s);
-  yajl_parse(h, buf, len);
-  yajl_free(h);
-  SAFE_ADELETE(buf);
+    std::vector<Material*> materials2;
+    StateMachine s(material_connections2, effect_cons, materials2);
+    yajl_handle h = yajl_alloc(&s.callbacks_, NULL, NULL, &s);
+    yajl_parse(h, &json[0], json.size());
+    yajl_free(h);
 
-  for (uint32_t i = 0, e = materials2.size(); i < e; ++i) {
-    effect_manager_->add_material(materials2[i]);
+    for (uint32_t i = 0, e = materials2.size(); i < e; ++i) {
+      effect_manager_->add_material(materials2[i]);
+    }
   }
 
   EffectConnection* ec = new EffectConnection();
@@ -1071,6 +1009,10 @@ void ShadowRenderer::load_scene(const std::string& filename)
   mc->meshes_ = scene_.meshes_;
   ec->opaque_materials_.push_back(mc);
   effect_connections_.push_back(ec);
+  // the bvh reads the mesh transforms, which are only there once they've been updated
+  animation_manager_->update_transforms(0);
+  mesh_bvh_.build(scene_.meshes_);
+  build_draw_states();
 /*
   for (EffectConnections::iterator i = effect_cons.begin(), e = effect_cons.end(); i != e; ++i) {
 
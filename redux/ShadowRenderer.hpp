@@ -9,6 +9,8 @@
 #include "Scene.hpp"
 #include "ReduxTypes.hpp"
 #include "AnimationManager.hpp"
+#include "MeshBvh.hpp"
+#include "DrawList.hpp"
 #include "../system/EffectManager.hpp"
 #include "../system/Renderable.hpp"
 #include "../system/Serializer.hpp"
@@ -91,7 +93,10 @@ private:
 
   void  add_material_connection(const std::string& mesh_name, const std::string& material_name);
 
-  void  render_inner(const D3DXVECTOR3& pos, const D3DXMATRIX& view, const D3DXMATRIX& proj, const std::string& technique);
+  void  update_animation_lods(const D3DXMATRIX& view, const D3DXMATRIX& proj);
+  void  build_draw_states();
+  void  prepare_draw_lists(const uint32_t begin, const uint32_t end);
+  void  render_inner(const DrawList& draws, const std::string& technique);
   void  render_debug(const D3DXMATRIX& view, const D3DXMATRIX& proj);
 
   Scene scene_;
@@ -133,6 +138,12 @@ private:
   bool debug_draw_;
   bool draw_meshes_;
   uint32_t visible_meshes_;
+  MeshBvh mesh_bvh_;
+  std::vector<uint32_t> visible_;
+  std::vector<uint8_t> mesh_visible_;
+  std::vector<DrawState> draw_states_;
+  DrawList light_draws_;
+  DrawList camera_draws_;
 
   // Setup for SAT generation
   void InitGenerateSAT(int RDSamplesPerPass = 4);
@@ -0,0 +1,226 @@
+#include "stdafx.h"
+#include "Skinning.hpp"
+#include "Utils.hpp"
+#include "ThreadPool.hpp"
+#include <xmmintrin.h>
+
+namespace
+{
+  // vertices per chunk when splitting a mesh over the thread pool
+  const uint32_t kSkinningGrainSize = 1024;
+
+  inline void store3(uint8_t* dst, const __m128 v)
+  {
+    float tmp[4];
+    _mm_storeu_ps(tmp, v);
+    memcpy(dst, tmp, 3 * sizeof(float));
+  }
+
+  inline __m128 transform_point(const __m128 x, const __m128 y, const __m128 z,
+    const __m128 r0, const __m128 r1, const __m128 r2, const __m128 r3)
+  {
+    // row vector convention, p' = x * r0 + y * r1 + z * r2 + r3
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, r0), _mm_mul_ps(y, r1)), _mm_add_ps(_mm_mul_ps(z, r2), r3));
+  }
+
+  inline __m128 normalize3(const __m128 v)
+  {
+    const __m128 sq = _mm_mul_ps(v, v);
+    const __m128 len_sq = _mm_add_ss(_mm_add_ss(sq, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(1,1,1,1))), _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(2,2,2,2)));
+    if (_mm_cvtss_f32(len_sq) <= 0) {
+      return v;
+    }
+    const __m128 inv_len = _mm_div_ps(_mm_set1_ps(1), _mm_sqrt_ps(_mm_shuffle_ps(len_sq, len_sq, _MM_SHUFFLE(0,0,0,0))));
+    return _mm_mul_ps(v, inv_len);
+  }
+
+  struct SkinBatchJob
+  {
+    const SkinMesh* mesh;
+    const D3DXMATRIX* palette;
+    uint8_t* dst;
+  };
+
+  void skin_batch_range(const std::vector<SkinBatchJob>* jobs, const uint32_t begin, const uint32_t end)
+  {
+    for (uint32_t i = begin; i < end; ++i) {
+      const SkinBatchJob& job = (*jobs)[i];
+      skin_vertices(*job.mesh, 0, job.mesh->vertices.size(), job.palette, job.dst);
+    }
+  }
+}
+
+uint32_t validate_bone_indices(SkinMesh& mesh)
+{
+  uint32_t num_dropped = 0;
+  for (size_t i = 0; i < mesh.vertices.size(); ++i) {
+    SkinVertex& v = mesh.vertices[i];
+    for (int32_t j = 0; j < 4; ++j) {
+      if (v.bone_index[j] >= mesh.num_bones) {
+        num_dropped += v.bone_weights[j] > 0 ? 1 : 0;
+        v.bone_index[j] = 0;
+        v.bone_weights[j] = 0;
+      }
+    }
+  }
+  return num_dropped;
+}
+
+void skin_vertices(const SkinMesh& mesh, const uint32_t begin, const uint32_t end, const D3DXMATRIX* palette, uint8_t* dst)
+{
+  const SkinOutputLayout& layout = mesh.layout;
+
+  for (uint32_t i = begin; i < end; ++i) {
+    const SkinVertex& v = mesh.vertices[i];
+    uint8_t* out = dst + i * layout.stride;
+
+    const uint32_t weight_sum = v.bone_weights[0] + v.bone_weights[1] + v.bone_weights[2] + v.bone_weights[3];
+    if (weight_sum == 0) {
+      memcpy(out + layout.pos_ofs, &v.pos, sizeof(D3DXVECTOR3));
+      memcpy(out + layout.normal_ofs, &v.normal, sizeof(D3DXVECTOR3));
+      memcpy(out + layout.uv_ofs, &v.uv, sizeof(D3DXVECTOR2));
+      continue;
+    }
+
+    // blend the bone matrices
+    const float inv_sum = 1.0f / weight_sum;
+    __m128 r0 = _mm_setzero_ps();
+    __m128 r1 = _mm_setzero_ps();
+    __m128 r2 = _mm_setzero_ps();
+    __m128 r3 = _mm_setzero_ps();
+    for (int32_t j = 0; j < 4; ++j) {
+      if (v.bone_weights[j] == 0) {
+        continue;
+      }
+      const __m128 w = _mm_set1_ps(v.bone_weights[j] * inv_sum);
+      const D3DXMATRIX& m = palette[v.bone_index[j]];
+      r0 = _mm_add_ps(r0, _mm_mul_ps(w, _mm_loadu_ps(&m._11)));
+      r1 = _mm_add_ps(r1, _mm_mul_ps(w, _mm_loadu_ps(&m._21)));
+      r2 = _mm_add_ps(r2, _mm_mul_ps(w, _mm_loadu_ps(&m._31)));
+      r3 = _mm_add_ps(r3, _mm_mul_ps(w, _mm_loadu_ps(&m._41)));
+    }
+
+    const __m128 pos = transform_point(_mm_set1_ps(v.pos.x), _mm_set1_ps(v.pos.y), _mm_set1_ps(v.pos.z), r0, r1, r2, r3);
+    const __m128 normal = transform_point(_mm_set1_ps(v.normal.x), _mm_set1_ps(v.normal.y), _mm_set1_ps(v.normal.z), r0, r1, r2, _mm_setzero_ps());
+
+    store3(out + layout.pos_ofs, pos);
+    store3(out + layout.normal_ofs, normalize3(normal));
+    memcpy(out + layout.uv_ofs, &v.uv, sizeof(D3DXVECTOR2));
+  }
+}
+
+void skin_vertices_scalar(const SkinMesh& mesh, const uint32_t begin, const uint32_t end, const D3DXMATRIX* palette, uint8_t* dst)
+{
+  const SkinOutputLayout& layout = mesh.layout;
+
+  for (uint32_t i = begin; i < end; ++i) {
+    const SkinVertex& v = mesh.vertices[i];
+    uint8_t* out = dst + i * layout.stride;
+
+    const uint32_t weight_sum = v.bone_weights[0] + v.bone_weights[1] + v.bone_weights[2] + v.bone_weights[3];
+    D3DXVECTOR3 pos(v.pos);
+    D3DXVECTOR3 normal(v.normal);
+    if (weight_sum > 0) {
+      pos = kVec3Zero;
+      normal = kVec3Zero;
+      for (int32_t j = 0; j < 4; ++j) {
+        if (v.bone_weights[j] == 0) {
+          continue;
+        }
+        const float w = v.bone_weights[j] / (float)weight_sum;
+        D3DXVECTOR3 p, n;
+        D3DXVec3TransformCoord(&p, &v.pos, &palette[v.bone_index[j]]);
+        D3DXVec3TransformNormal(&n, &v.normal, &palette[v.bone_index[j]]);
+        pos += w * p;
+        normal += w * n;
+      }
+      D3DXVec3Normalize(&normal, &normal);
+    }
+
+    memcpy(out + layout.pos_ofs, &pos, sizeof(D3DXVECTOR3));
+    memcpy(out + layout.normal_ofs, &normal, sizeof(D3DXVECTOR3));
+    memcpy(out + layout.uv_ofs, &v.uv, sizeof(D3DXVECTOR2));
+  }
+}
+
+void skin_mesh(const SkinMesh& mesh, const D3DXMATRIX* palette, uint8_t* dst, ThreadPool* pool)
+{
+  if (pool == NULL) {
+    skin_vertices(mesh, 0, mesh.vertices.size(), palette, dst);
+    return;
+  }
+  pool->parallel_for(mesh.vertices.size(), kSkinningGrainSize, boost::bind(&skin_vertices, boost::cref(mesh), _1, _2, palette, dst));
+}
+
+SkinningBenchmark benchmark_skinning(const uint32_t num_meshes, const uint32_t vertices_per_mesh, const uint32_t num_bones,
+  const uint32_t iterations, ThreadPool* pool)
+{
+  // one shared mesh and palette, but separate destinations, like a crowd of the same character
+  SkinMesh mesh;
+  mesh.num_bones = num_bones;
+  mesh.layout = SkinOutputLayout(32, 0, 12, 24);
+  mesh.vertices.resize(vertices_per_mesh);
+  srand(1);
+  for (uint32_t i = 0; i < vertices_per_mesh; ++i) {
+    SkinVertex& v = mesh.vertices[i];
+    v.pos = D3DXVECTOR3((float)rand(), (float)rand(), (float)rand()) / RAND_MAX;
+    v.normal = kVec3One;
+    v.uv = D3DXVECTOR2(0, 0);
+    uint32_t left = 255;
+    for (int32_t j = 0; j < 4; ++j) {
+      v.bone_weights[j] = (uint8_t)(j == 3 ? left : rand() % (left + 1));
+      left -= v.bone_weights[j];
+      v.bone_index[j] = (uint8_t)(rand() % num_bones);
+    }
+  }
+
+  std::vector<D3DXMATRIX> palette(num_bones);
+  for (uint32_t i = 0; i < num_bones; ++i) {
+    D3DXMatrixTranslation(&palette[i], (float)i, 0, 0);
+  }
+
+  std::vector<uint8_t> dst(num_meshes * vertices_per_mesh * mesh.layout.stride);
+  std::vector<SkinBatchJob> jobs(num_meshes);
+  for (uint32_t i = 0; i < num_meshes; ++i) {
+    jobs[i].mesh = &mesh;
+    jobs[i].palette = &palette[0];
+    jobs[i].dst = &dst[i * vertices_per_mesh * mesh.layout.stride];
+  }
+
+  SkinningBenchmark result;
+  LARGE_INTEGER start, end;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    for (uint32_t i = 0; i < num_meshes; ++i) {
+      skin_vertices_scalar(mesh, 0, vertices_per_mesh, &palette[0], jobs[i].dst);
+    }
+  }
+  QueryPerformanceCounter(&end);
+  result.scalar_ms = elapsed_ms(start, end) / iterations;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    skin_batch_range(&jobs, 0, num_meshes);
+  }
+  QueryPerformanceCounter(&end);
+  result.sse_ms = elapsed_ms(start, end) / iterations;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    if (pool == NULL) {
+      skin_batch_range(&jobs, 0, num_meshes);
+    } else {
+      pool->parallel_for(num_meshes, 1, boost::bind(&skin_batch_range, &jobs, _1, _2));
+    }
+  }
+  QueryPerformanceCounter(&end);
+  result.parallel_ms = elapsed_ms(start, end) / iterations;
+
+  result.vertices_per_ms = result.parallel_ms > 0 ? num_meshes * vertices_per_mesh / result.parallel_ms : 0;
+
+  LOG_INFO_LN("skinning %d x %d verts, %d bones. scalar: %.3f ms, sse: %.3f ms, sse + %d threads: %.3f ms",
+    num_meshes, vertices_per_mesh, num_bones, result.scalar_ms, result.sse_ms, pool ? pool->num_threads() : 0, result.parallel_ms);
+
+  return result;
+}
@@ -0,0 +1,64 @@
+#ifndef SKINNING_HPP
+#define SKINNING_HPP
+
+class ThreadPool;
+
+// bind pose vertex, as stored in the m2 file
+struct SkinVertex
+{
+  D3DXVECTOR3 pos;
+  D3DXVECTOR3 normal;
+  D3DXVECTOR2 uv;
+  uint8_t bone_weights[4];
+  uint8_t bone_index[4];
+};
+
+// where the skinned attributes go in the destination vertex
+struct SkinOutputLayout
+{
+  SkinOutputLayout() : stride(0), pos_ofs(0), normal_ofs(0), uv_ofs(0) {}
+  SkinOutputLayout(const uint32_t stride, const uint32_t pos_ofs, const uint32_t normal_ofs, const uint32_t uv_ofs)
+    : stride(stride), pos_ofs(pos_ofs), normal_ofs(normal_ofs), uv_ofs(uv_ofs) {}
+  uint32_t stride;
+  uint32_t pos_ofs;
+  uint32_t normal_ofs;
+  uint32_t uv_ofs;
+};
+
+struct SkinMesh
+{
+  SkinMesh() : num_bones(0) {}
+  std::vector<SkinVertex> vertices;
+  uint32_t num_bones;
+  SkinOutputLayout layout;
+};
+
+// Drops the influences of bones outside [0, num_bones), so the skinning can index the palette without
+// checking. Run once when the mesh is loaded. Returns the number of influences dropped.
+uint32_t validate_bone_indices(SkinMesh& mesh);
+
+// Linear blend skinning of [begin, end). The palette holds one matrix per bone, and dst points to the
+// first vertex of the destination (usually a mapped dynamic vertex buffer). The bone indices must have
+// been validated.
+void skin_vertices(const SkinMesh& mesh, const uint32_t begin, const uint32_t end, const D3DXMATRIX* palette, uint8_t* dst);
+
+// reference implementation of skin_vertices, without sse
+void skin_vertices_scalar(const SkinMesh& mesh, const uint32_t begin, const uint32_t end, const D3DXMATRIX* palette, uint8_t* dst);
+
+// skins the whole mesh, partitioning the vertices across the thread pool if there is one
+void skin_mesh(const SkinMesh& mesh, const D3DXMATRIX* palette, uint8_t* dst, ThreadPool* pool);
+
+struct SkinningBenchmark
+{
+  SkinningBenchmark() : scalar_ms(0), sse_ms(0), parallel_ms(0), vertices_per_ms(0) {}
+  double scalar_ms;
+  double sse_ms;
+  double parallel_ms;
+  double vertices_per_ms;
+};
+
+// Skins num_meshes synthetic meshes with random weights. Doesn't need a device, so it can run headless.
+SkinningBenchmark benchmark_skinning(const uint32_t num_meshes, const uint32_t vertices_per_mesh, const uint32_t num_bones,
+  const uint32_t iterations, ThreadPool* pool);
+
+#endif // #ifndef SKINNING_HPP
@@ -0,0 +1,167 @@
+#include "stdafx.h"
+#include "SphereCulling.hpp"
+#include "Utils.hpp"
+#include <xmmintrin.h>
+
+namespace
+{
+  // what ShadowRenderer did per mesh before the spheres were kept in world space
+  bool is_sphere_visible_per_mesh(const D3DXVECTOR3& center, const float radius, const D3DXMATRIX& world, const D3DXMATRIX& view, const D3DXPLANE* planes)
+  {
+    D3DXVECTOR3 ws_center, vs_center;
+    D3DXVec3TransformCoord(&ws_center, &center, &world);
+    D3DXVec3TransformCoord(&vs_center, &ws_center, &view);
+    const D3DXVECTOR3 scale(get_scale(world));
+    const float scaled_radius = D3DXVec3Length(&scale) * radius;
+    for (uint32_t j = 0; j < 6; ++j) {
+      if (distance_to_point(planes[j], vs_center) < -scaled_radius) {
+        return false;
+      }
+    }
+    return true;
+  }
+}
+
+void SphereSoA::resize(const uint32_t size)
+{
+  count = size;
+  const uint32_t padded = size + 3;
+  x.resize(padded, 0);
+  y.resize(padded, 0);
+  z.resize(padded, 0);
+  radius.resize(padded, 0);
+}
+
+void SphereSoA::set(const uint32_t idx, const D3DXVECTOR3& center, const float r)
+{
+  x[idx] = center.x;
+  y[idx] = center.y;
+  z[idx] = center.z;
+  radius[idx] = r;
+}
+
+uint32_t cull_spheres4(const SphereSoA& spheres, const uint32_t first, const D3DXPLANE* planes, const uint32_t num_planes)
+{
+  const __m128 x = _mm_loadu_ps(&spheres.x[first]);
+  const __m128 y = _mm_loadu_ps(&spheres.y[first]);
+  const __m128 z = _mm_loadu_ps(&spheres.z[first]);
+  const __m128 neg_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.radius[first]));
+
+  // a sphere is outside if its center is further than its radius behind any plane
+  __m128 inside = _mm_cmpeq_ps(x, x);
+  for (uint32_t j = 0; j < num_planes; ++j) {
+    const D3DXPLANE& p = planes[j];
+    const __m128 dist = _mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p.a), x), _mm_mul_ps(_mm_set1_ps(p.b), y)),
+      _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p.c), z), _mm_set1_ps(p.d)));
+    inside = _mm_and_ps(inside, _mm_cmpge_ps(dist, neg_radius));
+  }
+  return _mm_movemask_ps(inside);
+}
+
+void cull_spheres(std::vector<uint32_t>& visible, const SphereSoA& spheres, const uint32_t begin, const uint32_t end,
+  const D3DXPLANE* planes, const uint32_t num_planes)
+{
+  for (uint32_t i = begin; i < end; i += 4) {
+    uint32_t mask = cull_spheres4(spheres, i, planes, num_planes);
+    if (end - i < 4) {
+      mask &= (1 << (end - i)) - 1;
+    }
+    for (uint32_t j = 0; mask != 0; ++j, mask >>= 1) {
+      if (mask & 1) {
+        visible.push_back(i + j);
+      }
+    }
+  }
+}
+
+void cull_spheres_scalar(std::vector<uint32_t>& visible, const SphereSoA& spheres, const uint32_t begin, const uint32_t end,
+  const D3DXPLANE* planes, const uint32_t num_planes)
+{
+  for (uint32_t i = begin; i < end; ++i) {
+    const D3DXVECTOR3 center(spheres.center(i));
+    bool inside = true;
+    for (uint32_t j = 0; j < num_planes && inside; ++j) {
+      inside = distance_to_point(planes[j], center) >= -spheres.radius[i];
+    }
+    if (inside) {
+      visible.push_back(i);
+    }
+  }
+}
+
+CullingBenchmark benchmark_culling(const uint32_t num_spheres, const uint32_t iterations)
+{
+  // spheres spread around the origin, with the camera in the middle looking down z
+  std::vector<D3DXMATRIX> worlds(num_spheres);
+  std::vector<D3DXVECTOR3> centers(num_spheres);
+  std::vector<float> radii(num_spheres);
+  SphereSoA spheres;
+  spheres.resize(num_spheres);
+  srand(1);
+  for (uint32_t i = 0; i < num_spheres; ++i) {
+    const D3DXVECTOR3 pos(rand() % 2000 - 1000.0f, rand() % 200 - 100.0f, rand() % 2000 - 1000.0f);
+    const float s = 0.5f + rand() / (float)RAND_MAX;
+    D3DXQUATERNION rot;
+    D3DXQuaternionRotationYawPitchRoll(&rot, rand() / (float)RAND_MAX * 6, 0, 0);
+    const D3DXVECTOR3 scale(s, s, s);
+    D3DXMatrixTransformation(&worlds[i], &kVec3Zero, &kQuatId, &scale, &kVec3Zero, &rot, &pos);
+    centers[i] = D3DXVECTOR3(rand() % 10 - 5.0f, rand() % 10 - 5.0f, rand() % 10 - 5.0f);
+    radii[i] = 1.0f + rand() % 10;
+
+    D3DXVECTOR3 ws_center;
+    D3DXVec3TransformCoord(&ws_center, &centers[i], &worlds[i]);
+    const D3DXVECTOR3 world_scale(get_scale(worlds[i]));
+    spheres.set(i, ws_center, D3DXVec3Length(&world_scale) * radii[i]);
+  }
+
+  D3DXMATRIX view, proj;
+  const D3DXVECTOR3 at(0, 0, 1), up(0, 1, 0);
+  D3DXMatrixLookAtLH(&view, &kVec3Zero, &at, &up);
+  D3DXMatrixPerspectiveFovLH(&proj, (float)D3DX_PI / 4, 4 / 3.0f, 1, 1000);
+  D3DXPLANE view_planes[6], world_planes[6];
+  planes_from_proj_matrix(view_planes, proj, true);
+  planes_from_proj_matrix(world_planes, view * proj, true);
+
+  CullingBenchmark result;
+  std::vector<uint32_t> scalar_visible, sse_visible;
+  scalar_visible.reserve(num_spheres);
+  sse_visible.reserve(num_spheres);
+  LARGE_INTEGER start, end;
+
+  uint32_t per_mesh_visible = 0;
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    per_mesh_visible = 0;
+    for (uint32_t i = 0; i < num_spheres; ++i) {
+      per_mesh_visible += is_sphere_visible_per_mesh(centers[i], radii[i], worlds[i], view, view_planes) ? 1 : 0;
+    }
+  }
+  QueryPerformanceCounter(&end);
+  result.per_mesh_ms = elapsed_ms(start, end) / iterations;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    scalar_visible.clear();
+    cull_spheres_scalar(scalar_visible, spheres, 0, num_spheres, world_planes, 6);
+  }
+  QueryPerformanceCounter(&end);
+  result.scalar_ms = elapsed_ms(start, end) / iterations;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    sse_visible.clear();
+    cull_spheres(sse_visible, spheres, 0, num_spheres, world_planes, 6);
+  }
+  QueryPerformanceCounter(&end);
+  result.sse_ms = elapsed_ms(start, end) / iterations;
+
+  result.spheres_per_ms = result.sse_ms > 0 ? num_spheres / result.sse_ms : 0;
+  result.num_visible = sse_visible.size();
+  result.results_match = scalar_visible == sse_visible;
+
+  LOG_INFO_LN("culling: %d spheres, %d visible (%d per mesh). per mesh: %.3f ms, soa scalar: %.3f ms, sse: %.3f ms%s",
+    num_spheres, result.num_visible, per_mesh_visible, result.per_mesh_ms, result.scalar_ms, result.sse_ms,
+    result.results_match ? "" : " - MISMATCH");
+  return result;
+}
@@ -0,0 +1,45 @@
+#ifndef SPHERE_CULLING_HPP
+#define SPHERE_CULLING_HPP
+
+// World space bounding spheres, with an array per component so four can be loaded at once. The arrays
+// have three spheres of padding, so four can be loaded starting at any of them.
+struct SphereSoA
+{
+  SphereSoA() : count(0) {}
+  void resize(const uint32_t size);
+  void set(const uint32_t idx, const D3DXVECTOR3& center, const float radius);
+  D3DXVECTOR3 center(const uint32_t idx) const { return D3DXVECTOR3(x[idx], y[idx], z[idx]); }
+
+  uint32_t count;
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> z;
+  std::vector<float> radius;
+};
+
+// Returns a bit per sphere in [first, first + 4) that isn't outside any of the planes, which point inwards.
+uint32_t cull_spheres4(const SphereSoA& spheres, const uint32_t first, const D3DXPLANE* planes, const uint32_t num_planes);
+
+// Appends the index of every sphere in [begin, end) that isn't outside the planes. Four at a time, with SSE.
+void cull_spheres(std::vector<uint32_t>& visible, const SphereSoA& spheres, const uint32_t begin, const uint32_t end,
+  const D3DXPLANE* planes, const uint32_t num_planes);
+
+// reference implementation of cull_spheres
+void cull_spheres_scalar(std::vector<uint32_t>& visible, const SphereSoA& spheres, const uint32_t begin, const uint32_t end,
+  const D3DXPLANE* planes, const uint32_t num_planes);
+
+struct CullingBenchmark
+{
+  CullingBenchmark() : per_mesh_ms(0), scalar_ms(0), sse_ms(0), spheres_per_ms(0), num_visible(0), results_match(false) {}
+  double per_mesh_ms;     // the old path: each sphere transformed through its world and view matrix, then tested
+  double scalar_ms;
+  double sse_ms;
+  double spheres_per_ms;
+  uint32_t num_visible;
+  bool results_match;
+};
+
+// Culls num_spheres random spheres against a camera frustum. Doesn't need a device, so it can run headless.
+CullingBenchmark benchmark_culling(const uint32_t num_spheres, const uint32_t iterations);
+
+#endif // #ifndef SPHERE_CULLING_HPP
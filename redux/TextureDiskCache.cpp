@@ -0,0 +1,234 @@
+#include "stdafx.h"
+#include "TextureDiskCache.hpp"
+
+namespace filesystem = boost::filesystem;
+
+namespace
+{
+  const uint32_t kCachedTextureId = 'XTCR';
+  const uint32_t kCachedTextureVersion = 2;
+
+  const char* kCacheDirectory = "cache/textures";
+  const uint64_t kDefaultMaxSize = 256 * 1024 * 1024;
+
+  struct CacheEntry
+  {
+    CacheEntry(const filesystem::path& path, const uint64_t size, const std::time_t last_used)
+      : path(path), size(size), last_used(last_used) {}
+    bool operator<(const CacheEntry& rhs) const { return last_used < rhs.last_used; }
+    filesystem::path path;
+    uint64_t size;
+    std::time_t last_used;
+  };
+
+  // 64 bit fnv-1a
+  const uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ull;
+  const uint64_t kFnvPrime = 0x100000001b3ull;
+
+  uint64_t fnv1a(const void* data, const size_t len, uint64_t hash)
+  {
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i = 0; i < len; ++i) {
+      hash = (hash ^ p[i]) * kFnvPrime;
+    }
+    return hash;
+  }
+
+  struct ScopedLock
+  {
+    ScopedLock(CRITICAL_SECTION* cs) : cs(cs) { EnterCriticalSection(cs); }
+    ~ScopedLock() { LeaveCriticalSection(cs); }
+    CRITICAL_SECTION* cs;
+  };
+}
+
+void init_cached_texture_header(CachedTextureHeader& header, const uint32_t width, const uint32_t height, const uint32_t num_mips)
+{
+  header.id = kCachedTextureId;
+  header.version = kCachedTextureVersion;
+  header.width = width;
+  header.height = height;
+  header.num_mips = num_mips;
+}
+
+bool is_valid_cached_texture(const FileBuffer& buf)
+{
+  if (buf.size() < sizeof(CachedTextureHeader)) {
+    return false;
+  }
+
+  const CachedTextureHeader* header = (const CachedTextureHeader*)&buf[0];
+  if (header->id != kCachedTextureId || header->version != kCachedTextureVersion ||
+    header->num_mips == 0 || header->num_mips > CachedTextureHeader::kMaxMips) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < header->num_mips; ++i) {
+    if ((uint64_t)header->mip_offsets[i] + header->mip_sizes[i] > buf.size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TextureDiskCache::TextureDiskCache(const std::string& directory, const uint64_t max_size)
+  : directory_(directory)
+  , max_size_(max_size)
+  , size_(0)
+  , scanned_(false)
+{
+  InitializeCriticalSection(&cs_);
+}
+
+TextureDiskCache::~TextureDiskCache()
+{
+  DeleteCriticalSection(&cs_);
+}
+
+TextureDiskCache& TextureDiskCache::instance()
+{
+  static TextureDiskCache cache(kCacheDirectory, kDefaultMaxSize);
+  return cache;
+}
+
+TextureCacheKey TextureDiskCache::make_key(const FileBuffer& source, const uint32_t settings)
+{
+  // the crc is independent of the hash, so a false hit needs both to collide on a source of the same size
+  boost::crc_32_type crc;
+  uint64_t hash = kFnvOffsetBasis;
+  if (!source.empty()) {
+    crc.process_bytes(&source[0], source.size());
+    hash = fnv1a(&source[0], source.size(), hash);
+  }
+  hash = fnv1a(&settings, sizeof(settings), hash);
+  hash = fnv1a(&kCachedTextureVersion, sizeof(kCachedTextureVersion), hash);
+
+  TextureCacheKey key;
+  key.hash = hash;
+  key.source_size = (uint32_t)source.size();
+  key.source_crc = crc.checksum();
+  key.settings = settings;
+  return key;
+}
+
+std::string TextureDiskCache::filename(const TextureCacheKey& key) const
+{
+  return to_string("%s/%08x%08x.tex", directory_.c_str(), (uint32_t)(key.hash >> 32), (uint32_t)key.hash);
+}
+
+bool TextureDiskCache::load(const TextureCacheKey& key, FileBuffer& buf)
+{
+  const std::string name(filename(key));
+  try {
+    if (!filesystem::exists(name)) {
+      return false;
+    }
+    // read rather than mapped, as the buffer is handed to a finalizer on the main thread after the
+    // file may have been evicted, and CreateTexture2D copies the initial data anyway
+    buf = read_file(name);
+    if (!is_valid_cached_texture(buf)) {
+      LOG_WARNING_LN("[%s] invalid cache entry: %s", __FUNCTION__, name.c_str());
+      return false;
+    }
+    const CachedTextureHeader* header = (const CachedTextureHeader*)&buf[0];
+    if (header->source_size != key.source_size || header->source_crc != key.source_crc || header->settings != key.settings) {
+      LOG_WARNING_LN("[%s] cache entry is for a different source: %s", __FUNCTION__, name.c_str());
+      return false;
+    }
+
+    // the modification time doubles as the last used time
+    ScopedLock lock(&cs_);
+    filesystem::last_write_time(name, std::time(NULL));
+    return true;
+  } catch (std::exception& e) {
+    // it might have been evicted after the exists check, so it's just a miss
+    LOG_WARNING_LN("[%s] error reading %s: %s", __FUNCTION__, name.c_str(), e.what());
+    return false;
+  }
+}
+
+void TextureDiskCache::store(const TextureCacheKey& key, const FileBuffer& buf)
+{
+  if (!is_valid_cached_texture(buf)) {
+    return;
+  }
+
+  CachedTextureHeader header = *(const CachedTextureHeader*)&buf[0];
+  header.source_size = key.source_size;
+  header.source_crc = key.source_crc;
+  header.settings = key.settings;
+
+  ScopedLock lock(&cs_);
+  const std::string name(filename(key));
+  const std::string tmp_name(name + ".tmp");
+  try {
+    scan();
+    filesystem::create_directories(directory_);
+
+    // write to a temporary and rename it, so a partially written file never looks valid
+    FILE* file = NULL;
+    if (fopen_s(&file, tmp_name.c_str(), "wb") != 0 || file == NULL) {
+      LOG_WARNING_LN("[%s] unable to create: %s", __FUNCTION__, tmp_name.c_str());
+      return;
+    }
+    const size_t written = fwrite(&header, 1, sizeof(header), file) +
+      fwrite(&buf[sizeof(header)], 1, buf.size() - sizeof(header), file);
+    fclose(file);
+    if (written != buf.size()) {
+      LOG_WARNING_LN("[%s] error writing: %s", __FUNCTION__, tmp_name.c_str());
+      filesystem::remove(tmp_name);
+      return;
+    }
+
+    if (filesystem::exists(name)) {
+      size_ -= std::min<uint64_t>(size_, filesystem::file_size(name));
+      filesystem::remove(name);
+    }
+    filesystem::rename(tmp_name, name);
+    size_ += buf.size();
+
+    evict(name);
+  } catch (std::exception& e) {
+    LOG_WARNING_LN("[%s] error writing %s: %s", __FUNCTION__, name.c_str(), e.what());
+  }
+}
+
+void TextureDiskCache::scan()
+{
+  if (scanned_) {
+    return;
+  }
+  scanned_ = true;
+
+  size_ = 0;
+  if (!filesystem::exists(directory_)) {
+    return;
+  }
+  for (filesystem::directory_iterator it(directory_), end; it != end; ++it) {
+    if (filesystem::is_regular_file(it->path())) {
+      size_ += filesystem::file_size(it->path());
+    }
+  }
+}
+
+void TextureDiskCache::evict(const std::string& keep)
+{
+  if (size_ <= max_size_) {
+    return;
+  }
+
+  std::vector<CacheEntry> entries;
+  for (filesystem::directory_iterator it(directory_), end; it != end; ++it) {
+    if (filesystem::is_regular_file(it->path()) && it->path() != filesystem::path(keep)) {
+      entries.push_back(CacheEntry(it->path(), filesystem::file_size(it->path()), filesystem::last_write_time(it->path())));
+    }
+  }
+
+  // oldest first
+  std::sort(entries.begin(), entries.end());
+  for (size_t i = 0; i < entries.size() && size_ > max_size_; ++i) {
+    filesystem::remove(entries[i].path);
+    size_ -= std::min(size_, entries[i].size);
+    LOG_INFO_LN("[%s] evicted: %s", __FUNCTION__, entries[i].path.string().c_str());
+  }
+}
@@ -0,0 +1,73 @@
+#ifndef TEXTURE_DISK_CACHE_HPP
+#define TEXTURE_DISK_CACHE_HPP
+
+#include "AssetLoader.hpp"
+
+// Layout of a cached texture. The mips follow the header as tightly packed 32 bit rgba, each one
+// 16 byte aligned, so the buffer can be passed straight to CreateTexture2D as initial data.
+struct CachedTextureHeader
+{
+  enum { kMaxMips = 16 };
+  uint32_t id;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t num_mips;
+  // the source the entry was made from, written by TextureDiskCache::store
+  uint32_t source_size;
+  uint32_t source_crc;
+  uint32_t settings;
+  uint32_t mip_offsets[kMaxMips];
+  uint32_t mip_sizes[kMaxMips];
+};
+
+// The hash names the cache file. The rest is stored in the entry and compared on load, so a hash
+// collision is a miss rather than the wrong texture
+struct TextureCacheKey
+{
+  uint64_t hash;
+  uint32_t source_size;
+  uint32_t source_crc;
+  uint32_t settings;
+};
+
+// sets the id and version, and the dimensions. The mip offsets and sizes are left alone
+void init_cached_texture_header(CachedTextureHeader& header, const uint32_t width, const uint32_t height, const uint32_t num_mips);
+
+// returns false if the buffer isn't a complete cached texture of the current version
+bool is_valid_cached_texture(const FileBuffer& buf);
+
+/**
+ * On disk cache of processed textures, keyed by a hash of the source file and the settings used
+ * to process it. The total size is capped, and the least recently used entries are evicted first.
+ * Safe to use from the thread pool.
+ */
+class TextureDiskCache : boost::noncopyable
+{
+public:
+  TextureDiskCache(const std::string& directory, const uint64_t max_size);
+  ~TextureDiskCache();
+
+  static TextureDiskCache& instance();
+
+  static TextureCacheKey make_key(const FileBuffer& source, const uint32_t settings);
+
+  // returns true, and fills in buf, if the key is in the cache
+  bool load(const TextureCacheKey& key, FileBuffer& buf);
+  // buf's header is stamped with the key
+  void store(const TextureCacheKey& key, const FileBuffer& buf);
+
+private:
+  std::string filename(const TextureCacheKey& key) const;
+  void scan();
+  // removes the least recently used entries (other than keep) until the cache fits
+  void evict(const std::string& keep);
+
+  std::string directory_;
+  uint64_t max_size_;
+  uint64_t size_;
+  bool scanned_;
+  CRITICAL_SECTION cs_;
+};
+
+#endif // #ifndef TEXTURE_DISK_CACHE_HPP
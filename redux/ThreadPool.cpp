@@ -0,0 +1,174 @@
+#include "stdafx.h"
+#include "ThreadPool.hpp"
+
+namespace
+{
+  enum {
+    kJobKey = 1,
+    kShutdownKey = 2,
+  };
+}
+
+namespace
+{
+  struct ParallelForState : boost::noncopyable
+  {
+    ParallelForState(const uint32_t count, const uint32_t grain_size, const ThreadPool::RangeFn& fn)
+      : next_chunk(0)
+      , chunks_done(0)
+      , num_chunks((count + grain_size - 1) / grain_size)
+      , count(count)
+      , grain_size(grain_size)
+      , fn(fn)
+      , done_event(CreateEvent(NULL, TRUE, FALSE, NULL))
+      , failed(0)
+    {
+    }
+
+    ~ParallelForState()
+    {
+      CloseHandle(done_event);
+    }
+
+    volatile LONG next_chunk;
+    volatile LONG chunks_done;
+    const LONG num_chunks;
+    const uint32_t count;
+    const uint32_t grain_size;
+    ThreadPool::RangeFn fn;
+    HANDLE done_event;
+    // the first chunk to throw stores its error, which parallel_for rethrows once all chunks are done
+    volatile LONG failed;
+    std::string error;
+  };
+
+  void set_chunk_error(ParallelForState* state, const std::string& error)
+  {
+    if (InterlockedCompareExchange(&state->failed, 1, 0) == 0) {
+      state->error = error;
+    }
+  }
+
+  // grab chunks until there are none left. Jobs that start after all the chunks are taken just return.
+  // A chunk that throws still counts as done, so the caller never waits for it. Once one has failed,
+  // the rest are skipped.
+  void run_chunks(const boost::shared_ptr<ParallelForState>& state)
+  {
+    LONG chunk;
+    while ((chunk = InterlockedIncrement(&state->next_chunk) - 1) < state->num_chunks) {
+      const uint32_t begin = chunk * state->grain_size;
+      const uint32_t end = std::min<uint32_t>(state->count, begin + state->grain_size);
+      if (!state->failed) {
+        try {
+          state->fn(begin, end);
+        } catch (std::exception& e) {
+          set_chunk_error(state.get(), e.what());
+        } catch (...) {
+          set_chunk_error(state.get(), "unknown exception in parallel_for");
+        }
+      }
+      if (InterlockedIncrement(&state->chunks_done) == state->num_chunks) {
+        SetEvent(state->done_event);
+      }
+    }
+  }
+}
+
+ThreadPool::ThreadPool(const uint32_t num_threads)
+  : completion_port_(CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0))
+{
+  uint32_t count = num_threads;
+  if (count == 0) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    count = std::max<uint32_t>(1, info.dwNumberOfProcessors - 1);
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    DWORD thread_id;
+    threads_.push_back(CreateThread(0, 0, worker_thread, (void*)this, 0, &thread_id));
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  for (uint32_t i = 0; i < threads_.size(); ++i) {
+    PostQueuedCompletionStatus(completion_port_, 0, kShutdownKey, NULL);
+  }
+
+  if (!threads_.empty()) {
+    WaitForMultipleObjects(threads_.size(), &threads_[0], TRUE, INFINITE);
+  }
+
+  for (uint32_t i = 0; i < threads_.size(); ++i) {
+    CloseHandle(threads_[i]);
+  }
+  CloseHandle(completion_port_);
+}
+
+ThreadPool& ThreadPool::instance()
+{
+  static ThreadPool obj;
+  return obj;
+}
+
+void ThreadPool::add_job(const Job& job)
+{
+  // the job is smuggled through the overlapped pointer, and deleted by the worker
+  PostQueuedCompletionStatus(completion_port_, 0, kJobKey, (OVERLAPPED*)new Job(job));
+}
+
+void ThreadPool::parallel_for(const uint32_t count, const uint32_t grain_size, const RangeFn& fn)
+{
+  if (count == 0) {
+    return;
+  }
+
+  if (count <= grain_size) {
+    fn(0, count);
+    return;
+  }
+
+  boost::shared_ptr<ParallelForState> state(new ParallelForState(count, std::max<uint32_t>(1, grain_size), fn));
+  const uint32_t num_jobs = std::min<uint32_t>(state->num_chunks - 1, threads_.size());
+  for (uint32_t i = 0; i < num_jobs; ++i) {
+    add_job(boost::bind(&run_chunks, state));
+  }
+
+  // the calling thread helps out, so this can't deadlock even if the pool is busy
+  run_chunks(state);
+  WaitForSingleObject(state->done_event, INFINITE);
+  if (state->failed) {
+    throw std::runtime_error(state->error);
+  }
+}
+
+DWORD WINAPI ThreadPool::worker_thread(void* param)
+{
+  ThreadPool* pool = (ThreadPool*)param;
+
+  while (true) {
+    DWORD bytes;
+    ULONG_PTR key = 0;
+    OVERLAPPED* overlapped = NULL;
+    if (!GetQueuedCompletionStatus(pool->completion_port_, &bytes, &key, &overlapped, INFINITE)) {
+      continue;
+    }
+
+    if (key == kShutdownKey) {
+      break;
+    }
+
+    Job* job = (Job*)overlapped;
+    try {
+      (*job)();
+    } catch (std::exception& e) {
+      LOG_WARNING_LN("[%s] job threw: %s", __FUNCTION__, e.what());
+    } catch (...) {
+      LOG_WARNING_LN("[%s] job threw an unknown exception", __FUNCTION__);
+    }
+    delete job;
+  }
+
+  return 0;
+}
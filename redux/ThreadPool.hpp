@@ -0,0 +1,97 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+template<typename T>
+struct FutureState : boost::noncopyable
+{
+  FutureState() : event_(CreateEvent(NULL, TRUE, FALSE, NULL)), failed_(false) {}
+  ~FutureState() { CloseHandle(event_); }
+  HANDLE event_;
+  T value_;
+  bool failed_;
+  std::string error_;
+};
+
+/**
+ * Handle to the result of a job running on the thread pool. get() blocks until the job is done, and
+ * rethrows any exception the job threw as a std::runtime_error.
+ */
+template<typename T>
+class Future
+{
+public:
+  Future() {}
+  explicit Future(const boost::shared_ptr< FutureState<T> >& state) : state_(state) {}
+
+  bool is_valid() const { return !!state_; }
+  bool is_ready() const { return WaitForSingleObject(state_->event_, 0) == WAIT_OBJECT_0; }
+  void wait() const { WaitForSingleObject(state_->event_, INFINITE); }
+  T& get() const
+  {
+    wait();
+    if (state_->failed_) {
+      throw std::runtime_error(state_->error_);
+    }
+    return state_->value_;
+  }
+
+private:
+  boost::shared_ptr< FutureState<T> > state_;
+};
+
+template<typename T>
+void run_future_job(const boost::function<T ()>& fn, const boost::shared_ptr< FutureState<T> >& state)
+{
+  try {
+    state->value_ = fn();
+  } catch (std::exception& e) {
+    state->failed_ = true;
+    state->error_ = e.what();
+  } catch (...) {
+    state->failed_ = true;
+    state->error_ = "unknown exception in job";
+  }
+  SetEvent(state->event_);
+}
+
+/**
+ * Fixed size pool of worker threads, fed through a completion port. Jobs must not block on futures
+ * of other jobs, as that can starve the pool.
+ */
+class ThreadPool : boost::noncopyable
+{
+public:
+  typedef boost::function<void ()> Job;
+
+  // num_threads == 0 creates one thread per core, minus one for the main thread
+  ThreadPool(const uint32_t num_threads = 0);
+  ~ThreadPool();
+
+  static ThreadPool& instance();
+
+  void add_job(const Job& job);
+
+  template<typename T>
+  Future<T> submit(const boost::function<T ()>& fn)
+  {
+    boost::shared_ptr< FutureState<T> > state(new FutureState<T>());
+    add_job(boost::bind(&run_future_job<T>, fn, state));
+    return Future<T>(state);
+  }
+
+  // Splits [0, count) into chunks of grain_size, and calls fn(begin, end) for each of them, using
+  // both the pool and the calling thread. Returns when all chunks are done. If any chunk throws, the
+  // first error is rethrown as a std::runtime_error once the others have finished.
+  typedef boost::function<void (const uint32_t, const uint32_t)> RangeFn;
+  void parallel_for(const uint32_t count, const uint32_t grain_size, const RangeFn& fn);
+
+  uint32_t num_threads() const { return threads_.size(); }
+
+private:
+  static DWORD WINAPI worker_thread(void* param);
+
+  HANDLE completion_port_;
+  std::vector<HANDLE> threads_;
+};
+
+#endif // #ifndef THREAD_POOL_HPP
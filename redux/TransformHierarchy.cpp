@@ -0,0 +1,128 @@
+#include "stdafx.h"
+#include "TransformHierarchy.hpp"
+#include "Utils.hpp"
+#include <xmmintrin.h>
+
+namespace
+{
+  inline __m128 combine(const float x, const float y, const float z, const __m128 r0, const __m128 r1, const __m128 r2)
+  {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(x), r0), _mm_mul_ps(_mm_set1_ps(y), r1)), _mm_mul_ps(_mm_set1_ps(z), r2));
+  }
+
+  inline void compose_node(D3DXMATRIX* world, const D3DXVECTOR3* pos, const D3DXQUATERNION* rot, const D3DXVECTOR3* scale,
+    const AnimationNodeHandle* parents, const uint32_t i)
+  {
+    // the rows of scale * rotation, same layout as D3DXMatrixRotationQuaternion
+    const D3DXQUATERNION& q = rot[i];
+    const float x2 = q.x + q.x, y2 = q.y + q.y, z2 = q.z + q.z;
+    const float xx = q.x * x2, yy = q.y * y2, zz = q.z * z2;
+    const float xy = q.x * y2, xz = q.x * z2, yz = q.y * z2;
+    const float wx = q.w * x2, wy = q.w * y2, wz = q.w * z2;
+    const D3DXVECTOR3& s = scale[i];
+    const float m00 = s.x * (1 - yy - zz), m01 = s.x * (xy + wz), m02 = s.x * (xz - wy);
+    const float m10 = s.y * (xy - wz), m11 = s.y * (1 - xx - zz), m12 = s.y * (yz + wx);
+    const float m20 = s.z * (xz + wy), m21 = s.z * (yz - wx), m22 = s.z * (1 - xx - yy);
+    const D3DXVECTOR3& t = pos[i];
+
+    float* out = &world[i]._11;
+    const AnimationNodeHandle parent = parents[i];
+    if (parent == kInvalidAnimationNode) {
+      _mm_storeu_ps(out + 0, _mm_set_ps(0, m02, m01, m00));
+      _mm_storeu_ps(out + 4, _mm_set_ps(0, m12, m11, m10));
+      _mm_storeu_ps(out + 8, _mm_set_ps(0, m22, m21, m20));
+      _mm_storeu_ps(out + 12, _mm_set_ps(1, t.z, t.y, t.x));
+      return;
+    }
+
+    // row vector convention, so world = local * parent. The local matrix has (0, 0, 0, 1) as its last
+    // column, so each row only needs three of the parent's rows, plus the translation for the last one
+    const float* p = &world[parent]._11;
+    const __m128 p0 = _mm_loadu_ps(p + 0);
+    const __m128 p1 = _mm_loadu_ps(p + 4);
+    const __m128 p2 = _mm_loadu_ps(p + 8);
+    const __m128 p3 = _mm_loadu_ps(p + 12);
+    _mm_storeu_ps(out + 0, combine(m00, m01, m02, p0, p1, p2));
+    _mm_storeu_ps(out + 4, combine(m10, m11, m12, p0, p1, p2));
+    _mm_storeu_ps(out + 8, combine(m20, m21, m22, p0, p1, p2));
+    _mm_storeu_ps(out + 12, _mm_add_ps(combine(t.x, t.y, t.z, p0, p1, p2), p3));
+  }
+}
+
+void compose_world_transforms(D3DXMATRIX* world, const D3DXVECTOR3* pos, const D3DXQUATERNION* rot, const D3DXVECTOR3* scale,
+  const AnimationNodeHandle* parents, const uint32_t begin, const uint32_t end)
+{
+  for (uint32_t i = begin; i < end; ++i) {
+    compose_node(world, pos, rot, scale, parents, i);
+  }
+}
+
+void compose_world_transforms_indexed(D3DXMATRIX* world, const D3DXVECTOR3* pos, const D3DXQUATERNION* rot, const D3DXVECTOR3* scale,
+  const AnimationNodeHandle* parents, const uint32_t* nodes, const uint32_t count)
+{
+  for (uint32_t i = 0; i < count; ++i) {
+    compose_node(world, pos, rot, scale, parents, nodes[i]);
+  }
+}
+
+void compose_world_transforms_scalar(D3DXMATRIX* world, const D3DXVECTOR3* pos, const D3DXQUATERNION* rot, const D3DXVECTOR3* scale,
+  const AnimationNodeHandle* parents, const uint32_t begin, const uint32_t end)
+{
+  for (uint32_t i = begin; i < end; ++i) {
+    D3DXMATRIX local;
+    D3DXMatrixTransformation(&local, &kVec3Zero, &kQuatId, &scale[i], &kVec3Zero, &rot[i], &pos[i]);
+    if (parents[i] == kInvalidAnimationNode) {
+      world[i] = local;
+    } else {
+      D3DXMatrixMultiply(&world[i], &local, &world[parents[i]]);
+    }
+  }
+}
+
+TransformBenchmark benchmark_transforms(const uint32_t num_nodes, const uint32_t iterations)
+{
+  // a forest of short chains, roughly the shape of a character rig
+  std::vector<AnimationNodeHandle> parents(num_nodes);
+  std::vector<D3DXVECTOR3> pos(num_nodes);
+  std::vector<D3DXQUATERNION> rot(num_nodes);
+  std::vector<D3DXVECTOR3> scale(num_nodes, kVec3One);
+  srand(1);
+  for (uint32_t i = 0; i < num_nodes; ++i) {
+    parents[i] = i % 8 == 0 ? kInvalidAnimationNode : i - 1 - rand() % (i % 8);
+    pos[i] = D3DXVECTOR3((float)rand(), (float)rand(), (float)rand()) / RAND_MAX;
+    rot[i] = D3DXQUATERNION((float)rand(), (float)rand(), (float)rand(), (float)rand());
+    D3DXQuaternionNormalize(&rot[i], &rot[i]);
+  }
+
+  std::vector<D3DXMATRIX> world_scalar(num_nodes);
+  std::vector<D3DXMATRIX> world_sse(num_nodes);
+
+  TransformBenchmark result;
+  LARGE_INTEGER start, end;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    compose_world_transforms_scalar(&world_scalar[0], &pos[0], &rot[0], &scale[0], &parents[0], 0, num_nodes);
+  }
+  QueryPerformanceCounter(&end);
+  result.scalar_ms = elapsed_ms(start, end) / iterations;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t it = 0; it < iterations; ++it) {
+    compose_world_transforms(&world_sse[0], &pos[0], &rot[0], &scale[0], &parents[0], 0, num_nodes);
+  }
+  QueryPerformanceCounter(&end);
+  result.sse_ms = elapsed_ms(start, end) / iterations;
+  result.nodes_per_ms = result.sse_ms > 0 ? num_nodes / result.sse_ms : 0;
+
+  for (uint32_t i = 0; i < num_nodes; ++i) {
+    for (uint32_t j = 0; j < 16; ++j) {
+      const float d = fabs(((const float*)world_scalar[i])[j] - ((const float*)world_sse[i])[j]);
+      result.max_error = std::max<float>(result.max_error, d);
+    }
+  }
+
+  LOG_INFO_LN("transforms: %d nodes, scalar: %.3f ms, sse: %.3f ms, %.0f nodes/ms, max error: %f",
+    num_nodes, result.scalar_ms, result.sse_ms, result.nodes_per_ms, result.max_error);
+  return result;
+}
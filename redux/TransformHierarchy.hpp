@@ -0,0 +1,33 @@
+#ifndef TRANSFORM_HIERARCHY_HPP
+#define TRANSFORM_HIERARCHY_HPP
+
+#include "ReduxTypes.hpp"
+
+// Builds the world matrices of nodes [begin, end) from their local pos/rot/scale. parents[i] is
+// kInvalidAnimationNode for a root, and is otherwise smaller than i, so a forward pass always has the
+// parent's world matrix ready. The rotations must be normalized.
+void compose_world_transforms(D3DXMATRIX* world, const D3DXVECTOR3* pos, const D3DXQUATERNION* rot, const D3DXVECTOR3* scale,
+  const AnimationNodeHandle* parents, const uint32_t begin, const uint32_t end);
+
+// Same as compose_world_transforms, for the nodes listed in nodes. They must be sorted, so the parents still come first,
+// and any parent not in the list must already be up to date.
+void compose_world_transforms_indexed(D3DXMATRIX* world, const D3DXVECTOR3* pos, const D3DXQUATERNION* rot, const D3DXVECTOR3* scale,
+  const AnimationNodeHandle* parents, const uint32_t* nodes, const uint32_t count);
+
+// reference implementation of compose_world_transforms, using D3DXMatrixTransformation and D3DXMatrixMultiply
+void compose_world_transforms_scalar(D3DXMATRIX* world, const D3DXVECTOR3* pos, const D3DXQUATERNION* rot, const D3DXVECTOR3* scale,
+  const AnimationNodeHandle* parents, const uint32_t begin, const uint32_t end);
+
+struct TransformBenchmark
+{
+  TransformBenchmark() : scalar_ms(0), sse_ms(0), nodes_per_ms(0), max_error(0) {}
+  double scalar_ms;
+  double sse_ms;
+  double nodes_per_ms;
+  float max_error;    // largest difference between the two world matrices
+};
+
+// Composes a synthetic hierarchy of num_nodes nodes. Doesn't need a device, so it can run headless.
+TransformBenchmark benchmark_transforms(const uint32_t num_nodes, const uint32_t iterations);
+
+#endif // #ifndef TRANSFORM_HIERARCHY_HPP
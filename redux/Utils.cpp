@@ -16,3 +16,85 @@ ID3D10Buffer* create_dynamic_buffer(ID3D10DevicePtr device, const uint32_t bind_
   }
   return buffer;
 }
+
+float distance_to_point(const D3DXPLANE& plane, const D3DXVECTOR3& pt)
+{
+  return plane.a * pt.x + plane.b * pt.y + plane.c * pt.z + plane.d;
+}
+
+void planes_from_proj_matrix(D3DXPLANE* planes, const D3DXMATRIX& proj, const bool normalize)
+{
+
+  // Left clipping plane
+  planes[0].a = proj._14 + proj._11;
+  planes[0].b = proj._24 + proj._21;
+  planes[0].c = proj._34 + proj._31;
+  planes[0].d = proj._44 + proj._41;
+
+  // Right clipping plane
+  planes[1].a = proj._14 - proj._11;
+  planes[1].b = proj._24 - proj._21;
+  planes[1].c = proj._34 - proj._31;
+  planes[1].d = proj._44 - proj._41;
+
+  // Top clipping plane
+  planes[2].a = proj._14 - proj._12;
+  planes[2].b = proj._24 - proj._22;
+  planes[2].c = proj._34 - proj._32;
+  planes[2].d = proj._44 - proj._42;
+
+  // Bottom clipping plane
+  planes[3].a = proj._14 + proj._12;
+  planes[3].b = proj._24 + proj._22;
+  planes[3].c = proj._34 + proj._32;
+  planes[3].d = proj._44 + proj._42;
+
+  // Near clipping plane
+  planes[4].a = proj._13;
+  planes[4].b = proj._23;
+  planes[4].c = proj._33;
+  planes[4].d = proj._43;
+
+  // Far clipping plane
+  planes[5].a = proj._14 - proj._13;
+  planes[5].b = proj._24 - proj._23;
+  planes[5].c = proj._34 - proj._33;
+  planes[5].d = proj._44 - proj._43;
+
+  // Normalize the plane equations, if requested
+  if (normalize)
+  {
+    for (uint32_t i = 0; i < 6; ++i) {
+      D3DXPlaneNormalize(&planes[i], &planes[i]);
+    }
+  }
+}
+
+bool is_sphere_visible(const D3DXVECTOR3& center, const float radius, const D3DXMATRIX& world, const D3DXMATRIX& view, const D3DXPLANE* planes)
+{
+  D3DXVECTOR3 ws_center;
+  D3DXVec3TransformCoord(&ws_center, &center, &world);
+
+  // transform center to view space
+  D3DXVECTOR3 vs_center;
+  D3DXVec3TransformCoord(&vs_center, &ws_center, &view);
+  const float scale = D3DXVec3Length(&get_scale(world));
+  const float scaled_radius = scale * radius;
+
+  // if the signed distance is negative and greater than the bounding sphere radius,
+  // then the sphere is outside the frustum
+  for (uint32_t j = 0; j < 6; ++j) {
+    const float dist = distance_to_point(planes[j], vs_center);
+    if (dist < - scaled_radius) {
+      return false;
+    }
+  }
+  return true;
+}
+
+double elapsed_ms(const LARGE_INTEGER& start, const LARGE_INTEGER& end)
+{
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  return 1000.0 * (end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+}
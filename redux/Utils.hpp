@@ -123,4 +123,15 @@ inline D3DXVECTOR3 hermite_interpolate(const float t, const D3DXVECTOR3& p0, con
 
 ID3D10Buffer* create_dynamic_buffer(ID3D10DevicePtr device, const uint32_t bind_flag, const uint32_t buffer_size);
 
+float distance_to_point(const D3DXPLANE& plane, const D3DXVECTOR3& pt);
+
+// extracts the view space frustum planes, with the normals pointing inwards
+void planes_from_proj_matrix(D3DXPLANE* planes, const D3DXMATRIX& proj, const bool normalize);
+
+// tests the sphere, in the object's space, against view space planes
+bool is_sphere_visible(const D3DXVECTOR3& center, const float radius, const D3DXMATRIX& world, const D3DXMATRIX& view, const D3DXPLANE* planes);
+
+// milliseconds between two QueryPerformanceCounter readings
+double elapsed_ms(const LARGE_INTEGER& start, const LARGE_INTEGER& end);
+
 #endif
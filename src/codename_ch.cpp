@@ -13,6 +13,8 @@
 #include "../redux/SpringTest.hpp"
 #include "../redux/MarchingCubes.hpp"
 #include "../redux/Particles.hpp"
+#include "../redux/Benchmarks.hpp"
+#include "../redux/ThreadPool.hpp"
 #include "../system/Serializer.hpp"
 
 namespace test = boost::unit_test;
@@ -73,7 +75,7 @@ test::test_suite* init_unit_test_suite(int, char* [])
   return suite;
 }
 
-int WINAPI WinMain(HINSTANCE /*hInstance*/, HINSTANCE /*hPrevInstance*/, LPSTR /*lpCmdLine*/, int /*nCmdShow*/ )
+int WINAPI WinMain(HINSTANCE /*hInstance*/, HINSTANCE /*hPrevInstance*/, LPSTR lpCmdLine, int /*nCmdShow*/ )
 {
   redirect_io_to_console();
 
@@ -83,6 +85,13 @@ int WINAPI WinMain(HINSTANCE /*hInstance*/, HINSTANCE /*hPrevInstance*/, LPSTR /
 
   //::boost::unit_test::unit_test_main(init_unit_test_suite, 0, 0);
 
+  // the benchmarks are headless, so they run without creating the system
+  if (lpCmdLine && strstr(lpCmdLine, "-benchmark")) {
+    run_benchmarks(&ThreadPool::instance());
+    LogMgr::close();
+    return 0;
+  }
+
   boost::shared_ptr<System> system(new System());
   system->init();
 
@@ -76,9 +76,10 @@ ID3D10Effect* EffectManager::effect_from_handle(const Handle& handle)
   return effect->effect;
 }
 
-void EffectManager::add_material(Material* material)
+MaterialSPtr EffectManager::add_material(Material* material)
 {
   materials_.push_back(boost::shared_ptr<Material>(material));
+  return materials_.back();
 }
 
 MaterialSPtr EffectManager::find_material_by_name(const StringId& name)
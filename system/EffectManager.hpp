@@ -68,7 +68,7 @@ public:
   ~EffectManager();
   ID3D10Effect* effect_from_handle(const Handle& handle);
 
-  void add_material(Material* material);
+  MaterialSPtr add_material(Material* material);
 
   MaterialSPtr find_material_by_name(const StringId& name);
 